@@ -0,0 +1,327 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmarks for the code which handles every request sent to a virtual
+// printer. The benchmarks which use the shipped configuration files look for
+// them in the directory given as the first argument, or in "config" if no
+// directory is given.
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/json/json_reader.h>
+#include <base/optional.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <base/values.h>
+#include <benchmark/benchmark.h>
+
+#include "buffer_pool.h"
+#include "escl_manager.h"
+#include "http_util.h"
+#include "ipp_util.h"
+#include "smart_buffer.h"
+#include "xml_util.h"
+
+namespace {
+
+// The directory containing the configuration files used by the benchmarks.
+const char* g_config_dir = "config";
+
+// The size of each chunk in the chunked bodies generated below, which matches
+// the chunk size used by CUPS.
+constexpr size_t kChunkSize = 4000;
+
+// The header of a typical IPP request sent by CUPS.
+constexpr char kHttpRequest[] =
+    "POST /ipp/print HTTP/1.1\r\n"
+    "Content-Type: application/ipp\r\n"
+    "Date: Mon, 06 Apr 2020 17:51:48 GMT\r\n"
+    "Host: localhost:0\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "User-Agent: CUPS/2.3.1 (Linux 4.19.108; x86_64) IPP/2.0\r\n"
+    "Expect: 100-continue\r\n"
+    "\r\n";
+
+// clang-format off
+constexpr char kScanSettings[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<scan:ScanSettings xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\" "
+         "xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">"
+       "<pwg:Version>2.0</pwg:Version>"
+       "<pwg:ScanRegions>"
+           "<pwg:ScanRegion>"
+               "<pwg:ContentRegionUnits>"
+                   "escl:ThreeHundredthsOfInches"
+               "</pwg:ContentRegionUnits>"
+               "<pwg:Height>3300</pwg:Height>"
+               "<pwg:Width>2550</pwg:Width>"
+               "<pwg:XOffset>0</pwg:XOffset>"
+               "<pwg:YOffset>0</pwg:YOffset>"
+           "</pwg:ScanRegion>"
+       "</pwg:ScanRegions>"
+       "<pwg:DocumentFormat>application/pdf</pwg:DocumentFormat>"
+       "<scan:ColorMode>RGB24</scan:ColorMode>"
+       "<scan:XResolution>300</scan:XResolution>"
+       "<scan:YResolution>300</scan:YResolution>"
+       "<pwg:InputSource>Platen</pwg:InputSource>"
+   "</scan:ScanSettings>";
+// clang-format on
+
+// Returns the parsed contents of the JSON configuration file |name|, or
+// base::nullopt if it can not be read.
+base::Optional<base::Value> LoadConfig(const std::string& name) {
+  std::string contents;
+  if (!base::ReadFileToString(base::FilePath(g_config_dir).Append(name),
+                              &contents)) {
+    return base::nullopt;
+  }
+  return base::JSONReader::Read(contents);
+}
+
+// Returns the printer attributes from the shipped ipp_attributes.json, or an
+// empty vector if they can not be loaded.
+std::vector<IppAttribute> LoadPrinterAttributes() {
+  base::Optional<base::Value> config = LoadConfig("ipp_attributes.json");
+  if (!config) {
+    return {};
+  }
+  return GetAttributes(config.value(), kPrinterAttributes);
+}
+
+// Returns |size| bytes of document data encoded as an HTTP chunked body.
+SmartBuffer CreateChunkedBody(size_t size) {
+  std::vector<uint8_t> chunk(kChunkSize, 'x');
+  SmartBuffer body;
+  for (size_t sent = 0; sent < size; sent += kChunkSize) {
+    size_t length = std::min(kChunkSize, size - sent);
+    body.Add(base::StringPrintf("%zx\r\n", length));
+    body.Add(chunk.data(), length);
+    body.Add("\r\n");
+  }
+  body.Add("0\r\n\r\n");
+  return body;
+}
+
+void BM_SmartBufferAdd(benchmark::State& state) {
+  const size_t piece_size = state.range(0);
+  std::vector<uint8_t> piece(piece_size, 'x');
+  for (auto _ : state) {
+    SmartBuffer buf;
+    for (int i = 0; i < 64; i++) {
+      buf.Add(piece.data(), piece.size());
+    }
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * 64 * piece_size);
+}
+BENCHMARK(BM_SmartBufferAdd)->Arg(64)->Arg(4096)->Arg(64 * 1024);
+
+// Builds a short-lived USBIP reply with a payload of the given size, the way
+// that each bulk IN transfer does. The storage is taken from a pool if the
+// second argument is non-zero.
+void BM_SmartBufferReply(benchmark::State& state) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  ScopedBufferPool scoped_pool(state.range(1) ? pool.get() : nullptr);
+  std::vector<uint8_t> payload(state.range(0), 'x');
+  for (auto _ : state) {
+    SmartBuffer reply(48 + payload.size());
+    reply.Add(payload.data(), 48);
+    reply.Add(payload);
+    benchmark::DoNotOptimize(reply.data());
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_SmartBufferReply)
+    ->Args({512, 0})
+    ->Args({512, 1})
+    ->Args({512 * 1024, 0})
+    ->Args({512 * 1024, 1});
+
+// Consumes a buffer from the front in pieces, the way that bulk IN transfers
+// consume a queued HTTP response.
+void BM_SmartBufferErase(benchmark::State& state) {
+  const size_t piece_size = state.range(0);
+  const size_t size = 1024 * 1024;
+  std::vector<uint8_t> contents(size, 'x');
+  for (auto _ : state) {
+    state.PauseTiming();
+    SmartBuffer buf(contents);
+    state.ResumeTiming();
+    while (buf.size() > 0) {
+      buf.Erase(0, std::min(piece_size, buf.size()));
+    }
+    benchmark::DoNotOptimize(buf.size());
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_SmartBufferErase)->Arg(512)->Arg(16 * 1024);
+
+void BM_MergeDocument(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const SmartBuffer body = CreateChunkedBody(size);
+  for (auto _ : state) {
+    state.PauseTiming();
+    SmartBuffer message = body;
+    state.ResumeTiming();
+    SmartBuffer document = MergeDocument(&message);
+    benchmark::DoNotOptimize(document.data());
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_MergeDocument)->Arg(1024 * 1024)->Arg(16 * 1024 * 1024);
+
+void BM_HttpRequestDeserialize(benchmark::State& state) {
+  SmartBuffer message;
+  message.Add(kHttpRequest);
+  const SmartBufferView view(message);
+  for (auto _ : state) {
+    SmartBufferView remaining = view;
+    base::Optional<HttpRequest> request = HttpRequest::Deserialize(&remaining);
+    benchmark::DoNotOptimize(request);
+  }
+}
+BENCHMARK(BM_HttpRequestDeserialize);
+
+void BM_GetAttributesSize(benchmark::State& state) {
+  std::vector<IppAttribute> attributes = LoadPrinterAttributes();
+  if (attributes.empty()) {
+    state.SkipWithError("Could not load ipp_attributes.json");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(GetAttributesSize(attributes));
+  }
+}
+BENCHMARK(BM_GetAttributesSize);
+
+void BM_AddPrinterAttributes(benchmark::State& state) {
+  std::vector<IppAttribute> attributes = LoadPrinterAttributes();
+  if (attributes.empty()) {
+    state.SkipWithError("Could not load ipp_attributes.json");
+    return;
+  }
+  const size_t size = GetAttributesSize(attributes);
+  for (auto _ : state) {
+    SmartBuffer buf(size);
+    AddPrinterAttributes(attributes, kPrinterAttributes, &buf);
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_AddPrinterAttributes);
+
+void BM_RemoveIppAttributes(benchmark::State& state) {
+  std::vector<IppAttribute> attributes = LoadPrinterAttributes();
+  if (attributes.empty()) {
+    state.SkipWithError("Could not load ipp_attributes.json");
+    return;
+  }
+  SmartBuffer buf;
+  AddPrinterAttributes(attributes, kPrinterAttributes, &buf);
+  AddEndOfAttributes(&buf);
+  const SmartBufferView view(buf);
+  for (auto _ : state) {
+    SmartBufferView remaining = view;
+    benchmark::DoNotOptimize(RemoveIppAttributes(&remaining));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_RemoveIppAttributes);
+
+// Parses a Get-Printer-Attributes request of the kind sent by CUPS.
+void BM_ParseIppRequest(benchmark::State& state) {
+  base::Optional<base::Value> value = base::JSONReader::Read(R"({
+    "operationAttributes": [
+      { "type": "charset", "name": "attributes-charset", "value": "utf-8" },
+      { "type": "naturalLanguage", "name": "attributes-natural-language",
+        "value": "en-us" },
+      { "type": "uri", "name": "printer-uri",
+        "value": "ipp://localhost/ipp/print" },
+      { "type": "keyword", "name": "requested-attributes",
+        "value": [ "copies-default", "document-format-supported",
+                   "media-col-database", "printer-state",
+                   "printer-state-reasons", "sides-supported" ] }
+    ]
+  })");
+  IppHeader header;
+  header.major = 2;
+  header.minor = 0;
+  header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
+  header.request_id = 1;
+  SmartBuffer message;
+  header.Serialize(&message);
+  AddPrinterAttributes(GetAttributes(value.value(), kOperationAttributes),
+                       kOperationAttributes, &message);
+  AddEndOfAttributes(&message);
+  const SmartBufferView view(message);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ParseIppRequest(view));
+  }
+  state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK(BM_ParseIppRequest);
+
+void BM_ScannerCapabilitiesAsXml(benchmark::State& state) {
+  base::Optional<base::Value> config = LoadConfig("escl_capabilities.json");
+  base::Optional<ScannerCapabilities> caps;
+  if (config) {
+    caps = CreateScannerCapabilitiesFromConfig(config.value());
+  }
+  if (!caps) {
+    state.SkipWithError("Could not load escl_capabilities.json");
+    return;
+  }
+  for (auto _ : state) {
+    std::vector<uint8_t> xml = ScannerCapabilitiesAsXml(caps.value());
+    benchmark::DoNotOptimize(xml.data());
+  }
+}
+BENCHMARK(BM_ScannerCapabilitiesAsXml);
+
+// Serializes the status of a scanner with the given number of jobs.
+void BM_ScannerStatusAsXml(benchmark::State& state) {
+  ScannerStatus status;
+  status.idle = true;
+  base::TimeTicks now = base::TimeTicks::Now();
+  for (int i = 0; i < state.range(0); i++) {
+    JobInfo job;
+    job.created = now;
+    job.state = kCompleted;
+    status.jobs.emplace(base::StringPrintf("%08d-0000-4000-8000-000000000000",
+                                           i),
+                        std::move(job));
+  }
+  for (auto _ : state) {
+    std::vector<uint8_t> xml = ScannerStatusAsXml(status);
+    benchmark::DoNotOptimize(xml.data());
+  }
+}
+BENCHMARK(BM_ScannerStatusAsXml)->Arg(0)->Arg(10)->Arg(100);
+
+void BM_ScanSettingsFromXml(benchmark::State& state) {
+  const std::string settings(kScanSettings);
+  const std::vector<uint8_t> xml(settings.begin(), settings.end());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        ScanSettingsFromXml(SmartBufferView(xml.data(), xml.size())));
+  }
+}
+BENCHMARK(BM_ScanSettingsFromXml);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (argc > 1) {
+    g_config_dir = argv[1];
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
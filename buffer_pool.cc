@@ -0,0 +1,102 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "buffer_pool.h"
+
+#include <utility>
+
+#include <base/stl_util.h>
+
+namespace {
+
+// The capacity of the buffers in each size class: headers and control
+// replies, small HTTP messages, bulk transfers, and large messages.
+constexpr size_t kSizeClasses[] = {256, 4 * 1024, 64 * 1024, 1024 * 1024};
+
+// The most free buffers which are kept in each size class, so that a burst of
+// large messages does not leave the pool holding on to a lot of memory.
+constexpr size_t kMaxFreeBuffers[] = {64, 32, 8, 2};
+
+static_assert(base::size(kSizeClasses) == base::size(kMaxFreeBuffers),
+              "Each size class needs a limit");
+
+// The largest capacity of storage which is recycled. Storage which has grown
+// beyond this, such as that of a scanned page, is freed so that the largest
+// class does not hold on to buffers many times its size.
+constexpr size_t kMaxRecycledCapacity =
+    2 * kSizeClasses[base::size(kSizeClasses) - 1];
+
+// The pool used by SmartBuffers created on this thread.
+thread_local BufferPool* current_pool = nullptr;
+
+}  // namespace
+
+BufferPool::BufferPool() : free_buffers_(base::size(kSizeClasses)) {}
+
+BufferPool::~BufferPool() = default;
+
+// static
+BufferPool* BufferPool::Current() {
+  return current_pool;
+}
+
+std::vector<uint8_t> BufferPool::Acquire(size_t size) {
+  std::vector<uint8_t> storage;
+  for (size_t i = 0; i < base::size(kSizeClasses); i++) {
+    if (size > kSizeClasses[i]) {
+      continue;
+    }
+    {
+      base::AutoLock lock(lock_);
+      if (!free_buffers_[i].empty()) {
+        storage = std::move(free_buffers_[i].back());
+        free_buffers_[i].pop_back();
+        reused_count_++;
+        return storage;
+      }
+      allocated_count_++;
+    }
+    storage.reserve(kSizeClasses[i]);
+    return storage;
+  }
+  storage.reserve(size);
+  return storage;
+}
+
+void BufferPool::Recycle(std::vector<uint8_t> storage) {
+  if (storage.capacity() > kMaxRecycledCapacity) {
+    return;
+  }
+  // Use the largest class which the storage can hold, so that every buffer in
+  // a class has at least the capacity of that class.
+  for (size_t i = base::size(kSizeClasses); i > 0; i--) {
+    if (storage.capacity() < kSizeClasses[i - 1]) {
+      continue;
+    }
+    storage.clear();
+    base::AutoLock lock(lock_);
+    if (free_buffers_[i - 1].size() < kMaxFreeBuffers[i - 1]) {
+      free_buffers_[i - 1].push_back(std::move(storage));
+    }
+    return;
+  }
+}
+
+size_t BufferPool::reused_count() const {
+  base::AutoLock lock(lock_);
+  return reused_count_;
+}
+
+size_t BufferPool::allocated_count() const {
+  base::AutoLock lock(lock_);
+  return allocated_count_;
+}
+
+ScopedBufferPool::ScopedBufferPool(BufferPool* pool) : previous_(current_pool) {
+  current_pool = pool;
+}
+
+ScopedBufferPool::~ScopedBufferPool() {
+  current_pool = previous_;
+}
@@ -0,0 +1,77 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BUFFER_POOL_H__
+#define BUFFER_POOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <base/memory/ref_counted.h>
+#include <base/synchronization/lock.h>
+
+// A pool of reusable storage for SmartBuffers, so that handling a steady
+// stream of requests does not allocate and free memory for every message.
+//
+// Storage is grouped into size classes, from small buffers which hold USBIP
+// and IPP headers up to slabs which hold whole bulk transfers. Each class
+// keeps a bounded number of free buffers. Requests larger than the largest
+// class are not pooled, and storage more than twice the size of the largest
+// class is freed instead of being recycled.
+//
+// A pool may be used from any thread. Buffers keep a reference to the pool
+// which they came from, so a pool lives until the last of its buffers has been
+// destroyed.
+class BufferPool : public base::RefCountedThreadSafe<BufferPool> {
+ public:
+  BufferPool();
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Returns the pool installed on the current thread by ScopedBufferPool, or
+  // null if there is none.
+  static BufferPool* Current();
+
+  // Returns an empty vector with a capacity of at least |size|. The storage
+  // is taken from the free buffers of the smallest size class which can hold
+  // |size| bytes if there are any.
+  std::vector<uint8_t> Acquire(size_t size);
+
+  // Returns the storage of |storage| to the pool so that it can be reused. The
+  // storage is freed instead if it is too small for any size class, if it is
+  // much larger than the largest class, or if its class already holds as many
+  // free buffers as it may.
+  void Recycle(std::vector<uint8_t> storage);
+
+  // The number of Acquire calls which were served from free buffers and which
+  // needed new storage.
+  size_t reused_count() const;
+  size_t allocated_count() const;
+
+ private:
+  friend class base::RefCountedThreadSafe<BufferPool>;
+  ~BufferPool();
+
+  mutable base::Lock lock_;
+  // The free buffers of each size class.
+  std::vector<std::vector<std::vector<uint8_t>>> free_buffers_;
+  size_t reused_count_ = 0;
+  size_t allocated_count_ = 0;
+};
+
+// Installs |pool| as the pool used by the SmartBuffers created on the current
+// thread for as long as this object exists.
+class ScopedBufferPool {
+ public:
+  explicit ScopedBufferPool(BufferPool* pool);
+  ScopedBufferPool(const ScopedBufferPool&) = delete;
+  ScopedBufferPool& operator=(const ScopedBufferPool&) = delete;
+  ~ScopedBufferPool();
+
+ private:
+  BufferPool* previous_;
+};
+
+#endif  // BUFFER_POOL_H__
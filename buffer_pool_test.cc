@@ -0,0 +1,170 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "buffer_pool.h"
+
+#include <utility>
+#include <vector>
+
+#include <base/memory/ref_counted.h>
+#include <base/optional.h>
+#include <gtest/gtest.h>
+
+#include "smart_buffer.h"
+
+namespace {
+
+TEST(BufferPool, AcquireRoundsUpToSizeClass) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  std::vector<uint8_t> storage = pool->Acquire(100);
+  EXPECT_TRUE(storage.empty());
+  EXPECT_GE(storage.capacity(), 256u);
+  EXPECT_GE(pool->Acquire(5000).capacity(), 64 * 1024u);
+  EXPECT_EQ(pool->allocated_count(), 2u);
+  EXPECT_EQ(pool->reused_count(), 0u);
+}
+
+TEST(BufferPool, ReleasedStorageIsReused) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  std::vector<uint8_t> storage = pool->Acquire(1000);
+  storage.push_back(1);
+  const uint8_t* data = storage.data();
+  pool->Recycle(std::move(storage));
+
+  std::vector<uint8_t> reused = pool->Acquire(2000);
+  EXPECT_TRUE(reused.empty());
+  EXPECT_EQ(reused.data(), data);
+  EXPECT_EQ(pool->reused_count(), 1u);
+  EXPECT_EQ(pool->allocated_count(), 1u);
+}
+
+TEST(BufferPool, SmallerClassIsNotServedFromLargerOne) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  pool->Recycle(pool->Acquire(64 * 1024));
+  pool->Acquire(10);
+  EXPECT_EQ(pool->reused_count(), 0u);
+  EXPECT_EQ(pool->allocated_count(), 2u);
+}
+
+TEST(BufferPool, LargeRequestsAreNotPooled) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  std::vector<uint8_t> storage = pool->Acquire(2 * 1024 * 1024);
+  EXPECT_GE(storage.capacity(), 2 * 1024 * 1024u);
+  EXPECT_EQ(pool->allocated_count(), 0u);
+}
+
+TEST(BufferPool, LargeStorageIsNotRecycled) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  std::vector<uint8_t> storage;
+  storage.reserve(8 * 1024 * 1024);
+  pool->Recycle(std::move(storage));
+  EXPECT_LT(pool->Acquire(1024 * 1024).capacity(), 8 * 1024 * 1024u);
+  EXPECT_EQ(pool->reused_count(), 0u);
+  EXPECT_EQ(pool->allocated_count(), 1u);
+}
+
+TEST(BufferPool, FreeBuffersAreBounded) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  std::vector<std::vector<uint8_t>> buffers;
+  for (int i = 0; i < 3; i++) {
+    buffers.push_back(pool->Acquire(1024 * 1024));
+  }
+  for (std::vector<uint8_t>& storage : buffers) {
+    pool->Recycle(std::move(storage));
+  }
+  // Only two free buffers are kept in the largest class.
+  for (int i = 0; i < 3; i++) {
+    pool->Acquire(1024 * 1024);
+  }
+  EXPECT_EQ(pool->reused_count(), 2u);
+  EXPECT_EQ(pool->allocated_count(), 4u);
+}
+
+TEST(ScopedBufferPool, InstallsAndRestoresPool) {
+  auto outer = base::MakeRefCounted<BufferPool>();
+  auto inner = base::MakeRefCounted<BufferPool>();
+  EXPECT_EQ(BufferPool::Current(), nullptr);
+  {
+    ScopedBufferPool scoped_outer(outer.get());
+    EXPECT_EQ(BufferPool::Current(), outer.get());
+    {
+      ScopedBufferPool scoped_inner(inner.get());
+      EXPECT_EQ(BufferPool::Current(), inner.get());
+    }
+    EXPECT_EQ(BufferPool::Current(), outer.get());
+  }
+  EXPECT_EQ(BufferPool::Current(), nullptr);
+}
+
+TEST(ScopedBufferPool, SmartBufferStorageIsReturned) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  ScopedBufferPool scoped_pool(pool.get());
+  {
+    SmartBuffer buf(100);
+    buf.Add(std::vector<uint8_t>(100, 1));
+  }
+  SmartBuffer buf(200);
+  EXPECT_EQ(pool->allocated_count(), 1u);
+  EXPECT_EQ(pool->reused_count(), 1u);
+}
+
+TEST(ScopedBufferPool, SmartBufferGrowsFromPool) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  ScopedBufferPool scoped_pool(pool.get());
+  SmartBuffer buf;
+  std::vector<uint8_t> expected;
+  for (int i = 0; i < 1000; i++) {
+    buf.Add(static_cast<uint8_t>(i));
+    expected.push_back(static_cast<uint8_t>(i));
+  }
+  EXPECT_EQ(buf.contents(), expected);
+  // Each growth moves the contents into the next size class, and the storage
+  // left behind is returned to the pool.
+  EXPECT_EQ(pool->allocated_count(), 2u);
+  pool->Acquire(10);
+  EXPECT_EQ(pool->reused_count(), 1u);
+}
+
+TEST(ScopedBufferPool, GrowthDropsConsumedSpace) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  ScopedBufferPool scoped_pool(pool.get());
+  SmartBuffer buf(10);
+  buf.Add(std::vector<uint8_t>(200, 1));
+  buf.Erase(0, 150);
+  buf.Add(std::vector<uint8_t>(100, 2));
+  std::vector<uint8_t> expected(50, 1);
+  expected.insert(expected.end(), 100, 2);
+  EXPECT_EQ(buf.contents(), expected);
+}
+
+TEST(ScopedBufferPool, BufferKeepsPoolAlive) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  BufferPool* raw_pool = pool.get();
+  base::Optional<SmartBuffer> buf;
+  {
+    ScopedBufferPool scoped_pool(raw_pool);
+    buf.emplace(100);
+  }
+  pool = nullptr;
+  buf->Add(std::vector<uint8_t>(1000, 1));
+  EXPECT_EQ(buf->size(), 1000u);
+  buf.reset();
+}
+
+TEST(ScopedBufferPool, MovedBufferReturnsStorageOnce) {
+  auto pool = base::MakeRefCounted<BufferPool>();
+  ScopedBufferPool scoped_pool(pool.get());
+  {
+    SmartBuffer buf(100);
+    SmartBuffer moved(std::move(buf));
+    SmartBuffer assigned(100);
+    assigned = std::move(moved);
+  }
+  pool->Acquire(100);
+  pool->Acquire(100);
+  pool->Acquire(100);
+  EXPECT_EQ(pool->reused_count(), 2u);
+}
+
+}  // namespace
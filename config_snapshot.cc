@@ -0,0 +1,334 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "config_snapshot.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <base/files/memory_mapped_file.h>
+#include <base/logging.h>
+#include <base/stl_util.h>
+#include <base/time/time.h>
+
+#include "device_descriptors.h"
+#include "performance_model.h"
+#include "smart_buffer.h"
+
+namespace {
+
+// Identifies a file as a config snapshot.
+constexpr char kSnapshotMagic[4] = {'V', 'U', 'P', 'S'};
+
+// Must be increased whenever the layout of a snapshot changes.
+constexpr uint32_t kSnapshotVersion = 3;
+
+// The sizes of the descriptor structs which are stored as-is, which are
+// checked when a snapshot is loaded in case a struct changed without the
+// version being increased.
+constexpr uint32_t kDescriptorSizes[] = {
+    sizeof(UsbDeviceDescriptor),   sizeof(UsbConfigurationDescriptor),
+    sizeof(UsbDeviceQualifierDescriptor), sizeof(UsbInterfaceDescriptor),
+    sizeof(UsbEndpointDescriptor)};
+
+// Appends the values which make up a snapshot to a buffer. Lists and byte
+// strings are each preceded by their length.
+class SnapshotWriter {
+ public:
+  template <typename T>
+  void AddValue(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be stored as-is");
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(value));
+  }
+
+  void AddCount(size_t count) { AddValue(static_cast<uint32_t>(count)); }
+
+  void AddBytes(const void* bytes, size_t size) {
+    AddCount(size);
+    const uint8_t* begin = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), begin, begin + size);
+  }
+
+  void AddAttributes(
+      const std::vector<std::pair<std::string, SmartBuffer>>& attributes) {
+    AddCount(attributes.size());
+    for (const auto& attribute : attributes) {
+      AddBytes(attribute.first.data(), attribute.first.size());
+      AddBytes(attribute.second.data(), attribute.second.size());
+    }
+  }
+
+  void AddPerformanceProfile(const PerformanceProfile& profile) {
+    AddValue(profile.pages_per_minute);
+    AddValue(static_cast<uint64_t>(profile.bytes_per_page));
+    AddValue(static_cast<uint64_t>(profile.buffer_size));
+    AddValue(profile.scan_megabytes_per_second);
+    AddCount(profile.ipp_operation_latency.size());
+    for (const auto& entry : profile.ipp_operation_latency) {
+      AddBytes(entry.first.data(), entry.first.size());
+      AddValue(entry.second.InMicroseconds());
+    }
+  }
+
+  std::vector<uint8_t> Finish() { return std::move(data_); }
+
+ private:
+  std::vector<uint8_t> data_;
+};
+
+// Reads back the values written by SnapshotWriter. Each method returns false
+// if the snapshot ends before the value.
+class SnapshotReader {
+ public:
+  SnapshotReader(const uint8_t* data, size_t size)
+      : data_(data), remaining_(size) {}
+
+  template <typename T>
+  bool ReadValue(T* value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be stored as-is");
+    if (remaining_ < sizeof(*value)) {
+      return false;
+    }
+    memcpy(value, data_, sizeof(*value));
+    Skip(sizeof(*value));
+    return true;
+  }
+
+  // Reads the length of a list whose elements each take up at least
+  // |min_element_size| bytes, so that a corrupt length is rejected before any
+  // space is reserved for the list.
+  bool ReadCount(size_t min_element_size, size_t* count) {
+    uint32_t value;
+    if (!ReadValue(&value) || value * min_element_size > remaining_) {
+      return false;
+    }
+    *count = value;
+    return true;
+  }
+
+  // Sets |bytes| to point at the next byte string within the snapshot.
+  bool ReadBytes(const uint8_t** bytes, size_t* size) {
+    if (!ReadCount(1, size)) {
+      return false;
+    }
+    *bytes = data_;
+    Skip(*size);
+    return true;
+  }
+
+  template <typename T>
+  bool ReadBytes(T* container) {
+    const uint8_t* bytes;
+    size_t size;
+    if (!ReadBytes(&bytes, &size)) {
+      return false;
+    }
+    container->assign(bytes, bytes + size);
+    return true;
+  }
+
+  bool ReadBytes(SmartBuffer* buf) {
+    const uint8_t* bytes;
+    size_t size;
+    if (!ReadBytes(&bytes, &size)) {
+      return false;
+    }
+    *buf = SmartBuffer(size);
+    buf->Add(bytes, size);
+    return true;
+  }
+
+  bool ReadAttributes(
+      std::vector<std::pair<std::string, SmartBuffer>>* attributes) {
+    size_t count;
+    // Each attribute has two lengths.
+    if (!ReadCount(2 * sizeof(uint32_t), &count)) {
+      return false;
+    }
+    attributes->resize(count);
+    for (auto& attribute : *attributes) {
+      if (!ReadBytes(&attribute.first) || !ReadBytes(&attribute.second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool ReadPerformanceProfile(PerformanceProfile* profile) {
+    uint64_t bytes_per_page;
+    uint64_t buffer_size;
+    size_t count;
+    // Each latency has a length and a number of microseconds.
+    if (!ReadValue(&profile->pages_per_minute) || !ReadValue(&bytes_per_page) ||
+        !ReadValue(&buffer_size) ||
+        !ReadValue(&profile->scan_megabytes_per_second) ||
+        !ReadCount(sizeof(uint32_t) + sizeof(int64_t), &count)) {
+      return false;
+    }
+    profile->bytes_per_page = bytes_per_page;
+    profile->buffer_size = buffer_size;
+    for (size_t i = 0; i < count; i++) {
+      std::string operation;
+      int64_t microseconds;
+      if (!ReadBytes(&operation) || !ReadValue(&microseconds)) {
+        return false;
+      }
+      profile->ipp_operation_latency[operation] =
+          base::TimeDelta::FromMicroseconds(microseconds);
+    }
+    return true;
+  }
+
+  bool empty() const { return remaining_ == 0; }
+
+ private:
+  void Skip(size_t size) {
+    data_ += size;
+    remaining_ -= size;
+  }
+
+  const uint8_t* data_;
+  size_t remaining_;
+};
+
+}  // namespace
+
+std::vector<uint8_t> CreateConfigSnapshot(
+    const UsbDescriptors& descriptors,
+    const SerializedIppAttributes& ipp_attributes,
+    const PerformanceProfile& performance_profile) {
+  SnapshotWriter writer;
+  writer.AddValue(kSnapshotMagic);
+  writer.AddValue(kSnapshotVersion);
+  writer.AddValue(kDescriptorSizes);
+
+  writer.AddValue(descriptors.device_descriptor());
+  writer.AddValue(descriptors.configuration_descriptor());
+  writer.AddValue(descriptors.qualifier_descriptor());
+  const std::vector<UsbInterfaceDescriptor>& interfaces =
+      descriptors.interface_descriptors();
+  writer.AddCount(interfaces.size());
+  for (const UsbInterfaceDescriptor& interface : interfaces) {
+    writer.AddValue(interface);
+  }
+  writer.AddCount(descriptors.endpoint_descriptors().size());
+  for (const auto& entry : descriptors.endpoint_descriptors()) {
+    writer.AddValue(entry.first);
+    writer.AddCount(entry.second.size());
+    for (const UsbEndpointDescriptor& endpoint : entry.second) {
+      writer.AddValue(endpoint);
+    }
+  }
+  writer.AddCount(descriptors.string_descriptors().size());
+  for (const std::vector<char>& string : descriptors.string_descriptors()) {
+    writer.AddBytes(string.data(), string.size());
+  }
+  writer.AddBytes(descriptors.ieee_device_id().data(),
+                  descriptors.ieee_device_id().size());
+
+  writer.AddBytes(ipp_attributes.operation_attributes.data(),
+                  ipp_attributes.operation_attributes.size());
+  writer.AddAttributes(ipp_attributes.job_attributes);
+  writer.AddAttributes(ipp_attributes.printer_attributes);
+  writer.AddAttributes(ipp_attributes.unsupported_attributes);
+  writer.AddPerformanceProfile(performance_profile);
+  return writer.Finish();
+}
+
+base::Optional<PrinterSnapshot> ParseConfigSnapshot(const uint8_t* data,
+                                                    size_t size) {
+  SnapshotReader reader(data, size);
+  char magic[sizeof(kSnapshotMagic)];
+  uint32_t version;
+  uint32_t descriptor_sizes[base::size(kDescriptorSizes)];
+  if (!reader.ReadValue(&magic) ||
+      memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0) {
+    LOG(ERROR) << "File is not a config snapshot";
+    return base::nullopt;
+  }
+  if (!reader.ReadValue(&version) || version != kSnapshotVersion ||
+      !reader.ReadValue(&descriptor_sizes) ||
+      memcmp(descriptor_sizes, kDescriptorSizes, sizeof(kDescriptorSizes)) !=
+          0) {
+    LOG(ERROR) << "Config snapshot was created by a different version of "
+                  "virtual-usb-printer";
+    return base::nullopt;
+  }
+
+  UsbDeviceDescriptor device;
+  UsbConfigurationDescriptor configuration;
+  UsbDeviceQualifierDescriptor qualifier;
+  std::vector<UsbInterfaceDescriptor> interfaces;
+  std::map<uint8_t, std::vector<UsbEndpointDescriptor>> endpoints;
+  std::vector<std::vector<char>> strings;
+  std::vector<char> ieee_device_id;
+  SerializedIppAttributes ipp_attributes;
+  PerformanceProfile performance_profile;
+
+  size_t count;
+  bool valid = reader.ReadValue(&device) &&
+               reader.ReadValue(&configuration) &&
+               reader.ReadValue(&qualifier) &&
+               reader.ReadCount(sizeof(UsbInterfaceDescriptor), &count);
+  if (valid) {
+    interfaces.resize(count);
+    for (UsbInterfaceDescriptor& interface : interfaces) {
+      valid = valid && reader.ReadValue(&interface);
+    }
+  }
+  // Each entry in the endpoint map has a key and a length.
+  valid = valid && reader.ReadCount(1 + sizeof(uint32_t), &count);
+  for (size_t i = 0; valid && i < count; i++) {
+    uint8_t interface_number;
+    size_t endpoint_count;
+    valid = reader.ReadValue(&interface_number) &&
+            reader.ReadCount(sizeof(UsbEndpointDescriptor), &endpoint_count);
+    if (valid) {
+      std::vector<UsbEndpointDescriptor>& list = endpoints[interface_number];
+      list.resize(endpoint_count);
+      for (UsbEndpointDescriptor& endpoint : list) {
+        valid = valid && reader.ReadValue(&endpoint);
+      }
+    }
+  }
+  valid = valid && reader.ReadCount(sizeof(uint32_t), &count);
+  if (valid) {
+    strings.resize(count);
+    for (std::vector<char>& string : strings) {
+      valid = valid && reader.ReadBytes(&string);
+    }
+  }
+  valid = valid && reader.ReadBytes(&ieee_device_id) &&
+          reader.ReadBytes(&ipp_attributes.operation_attributes) &&
+          reader.ReadAttributes(&ipp_attributes.job_attributes) &&
+          reader.ReadAttributes(&ipp_attributes.printer_attributes) &&
+          reader.ReadAttributes(&ipp_attributes.unsupported_attributes) &&
+          reader.ReadPerformanceProfile(&performance_profile) &&
+          reader.empty();
+  if (!valid) {
+    LOG(ERROR) << "Config snapshot is malformed";
+    return base::nullopt;
+  }
+
+  return PrinterSnapshot{
+      UsbDescriptors(device, configuration, qualifier, strings, ieee_device_id,
+                     interfaces, endpoints),
+      std::move(ipp_attributes), std::move(performance_profile)};
+}
+
+base::Optional<PrinterSnapshot> LoadConfigSnapshot(
+    const base::FilePath& path) {
+  base::MemoryMappedFile file;
+  if (!file.Initialize(path)) {
+    LOG(ERROR) << "Failed to map config snapshot " << path.value();
+    return base::nullopt;
+  }
+  return ParseConfigSnapshot(file.data(), file.length());
+}
@@ -0,0 +1,52 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CONFIG_SNAPSHOT_H__
+#define CONFIG_SNAPSHOT_H__
+
+// A config snapshot holds the USB descriptors and IPP attributes of a printer
+// in the form in which the printer uses them, so that it can be started
+// without parsing its JSON configuration. Snapshots are written using the
+// --write_snapshot_path flag and loaded using --snapshot_path.
+//
+// The descriptors are stored exactly as they are laid out in memory, so a
+// snapshot can only be loaded on the same architecture as it was created on.
+// The performance profile of the printer is stored along with them.
+// Snapshots start with a version number which must be increased whenever the
+// layout of a snapshot changes.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/optional.h>
+
+#include "ipp_manager.h"
+#include "performance_model.h"
+#include "usb_printer.h"
+
+// The configuration of a printer loaded from a snapshot.
+struct PrinterSnapshot {
+  UsbDescriptors descriptors;
+  SerializedIppAttributes ipp_attributes;
+  PerformanceProfile performance_profile;
+};
+
+// Serializes |descriptors|, |ipp_attributes| and |performance_profile| into a
+// snapshot.
+std::vector<uint8_t> CreateConfigSnapshot(
+    const UsbDescriptors& descriptors,
+    const SerializedIppAttributes& ipp_attributes,
+    const PerformanceProfile& performance_profile);
+
+// Parses the |size| byte snapshot in |data|. Returns base::nullopt if |data| is
+// not a snapshot of the current version or is malformed.
+base::Optional<PrinterSnapshot> ParseConfigSnapshot(const uint8_t* data,
+                                                    size_t size);
+
+// Maps the snapshot file at |path| into memory and parses it.
+base::Optional<PrinterSnapshot> LoadConfigSnapshot(const base::FilePath& path);
+
+#endif  // CONFIG_SNAPSHOT_H__
@@ -0,0 +1,238 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "config_snapshot.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <base/optional.h>
+#include <base/time/time.h>
+#include <base/values.h>
+#include <gtest/gtest.h>
+
+#include "device_descriptors.h"
+#include "ipp_manager.h"
+#include "ipp_util.h"
+#include "performance_model.h"
+#include "smart_buffer.h"
+#include "usb_printer.h"
+#include "usbip_constants.h"
+
+namespace {
+
+UsbDescriptors CreateTestDescriptors() {
+  UsbDeviceDescriptor device(18, 1, 0x0200, 0, 0, 0, 64, 0x04a9, 0x27e8,
+                             0x0100, 1, 2, 3, 1);
+  UsbConfigurationDescriptor configuration(9, 2, 55, 2, 1, 0, 0xc0, 1);
+  UsbDeviceQualifierDescriptor qualifier(10, 6, 0x0200, 0, 0, 0, 64, 1, 0);
+  std::vector<UsbInterfaceDescriptor> interfaces = {
+      UsbInterfaceDescriptor(9, 4, 0, 0, 2, 7, 1, 4, 0),
+      UsbInterfaceDescriptor(9, 4, 1, 0, 2, 7, 1, 4, 0)};
+  std::map<uint8_t, std::vector<UsbEndpointDescriptor>> endpoints = {
+      {0,
+       {UsbEndpointDescriptor(7, 5, 0x01, 2, 512, 0),
+        UsbEndpointDescriptor(7, 5, 0x81, 2, 512, 0)}},
+      {1,
+       {UsbEndpointDescriptor(7, 5, 0x02, 2, 512, 0),
+        UsbEndpointDescriptor(7, 5, 0x82, 2, 512, 0)}}};
+  std::vector<std::vector<char>> strings = {{4, 3, 9, 4},
+                                            {8, 3, 'T', 0, 'e', 0, 's', 0}};
+  std::string id = "MFG:Test;MDL:Printer;";
+  std::vector<char> ieee_device_id(id.begin(), id.end());
+  return UsbDescriptors(device, configuration, qualifier, strings,
+                        ieee_device_id, interfaces, endpoints);
+}
+
+std::vector<uint8_t> ToVector(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  return std::vector<uint8_t>(bytes, bytes + size);
+}
+
+PerformanceProfile CreateTestProfile() {
+  PerformanceProfile profile;
+  profile.pages_per_minute = 20;
+  profile.bytes_per_page = 100000;
+  profile.buffer_size = 4096;
+  profile.scan_megabytes_per_second = 1.5;
+  profile.ipp_operation_latency["Create-Job"] =
+      base::TimeDelta::FromMilliseconds(50);
+  profile.ipp_operation_latency["Send-Document"] =
+      base::TimeDelta::FromMicroseconds(1);
+  return profile;
+}
+
+IppHeader CreateTestHeader(int operation_id) {
+  IppHeader header;
+  header.major = 2;
+  header.minor = 0;
+  header.operation_id = operation_id;
+  header.request_id = 7;
+  return header;
+}
+
+class ConfigSnapshotTest : public testing::Test {
+ protected:
+  ConfigSnapshotTest()
+      : charset_value_("utf-8"),
+        state_value_(3),
+        uri_value_("ipp://localhost/ipp/print"),
+        ipp_manager_({IppAttribute(kCharset, "attributes-charset",
+                                   &charset_value_)},
+                     {IppAttribute(kEnum, "printer-state", &state_value_),
+                      IppAttribute(kUri, "printer-uri-supported",
+                                   &uri_value_)},
+                     {IppAttribute(kUri, "job-printer-uri", &uri_value_)},
+                     {IppAttribute(kEnum, "unsupported-state",
+                                   &state_value_)}),
+        snapshot_(CreateConfigSnapshot(CreateTestDescriptors(),
+                                       ipp_manager_.serialized_attributes(),
+                                       CreateTestProfile())) {}
+
+  base::Value charset_value_;
+  base::Value state_value_;
+  base::Value uri_value_;
+  IppManager ipp_manager_;
+  std::vector<uint8_t> snapshot_;
+};
+
+TEST_F(ConfigSnapshotTest, RoundTripDescriptors) {
+  base::Optional<PrinterSnapshot> parsed =
+      ParseConfigSnapshot(snapshot_.data(), snapshot_.size());
+  ASSERT_TRUE(parsed);
+
+  const UsbDescriptors expected = CreateTestDescriptors();
+  const UsbDescriptors& actual = parsed->descriptors;
+  EXPECT_EQ(ToVector(&actual.device_descriptor(), sizeof(UsbDeviceDescriptor)),
+            ToVector(&expected.device_descriptor(),
+                     sizeof(UsbDeviceDescriptor)));
+  EXPECT_EQ(ToVector(&actual.configuration_descriptor(),
+                     sizeof(UsbConfigurationDescriptor)),
+            ToVector(&expected.configuration_descriptor(),
+                     sizeof(UsbConfigurationDescriptor)));
+  EXPECT_EQ(ToVector(&actual.qualifier_descriptor(),
+                     sizeof(UsbDeviceQualifierDescriptor)),
+            ToVector(&expected.qualifier_descriptor(),
+                     sizeof(UsbDeviceQualifierDescriptor)));
+  ASSERT_EQ(actual.interface_descriptors().size(),
+            expected.interface_descriptors().size());
+  EXPECT_EQ(ToVector(actual.interface_descriptors().data(),
+                     2 * sizeof(UsbInterfaceDescriptor)),
+            ToVector(expected.interface_descriptors().data(),
+                     2 * sizeof(UsbInterfaceDescriptor)));
+  ASSERT_EQ(actual.endpoint_descriptors().size(),
+            expected.endpoint_descriptors().size());
+  for (const auto& entry : expected.endpoint_descriptors()) {
+    auto iter = actual.endpoint_descriptors().find(entry.first);
+    ASSERT_NE(iter, actual.endpoint_descriptors().end());
+    ASSERT_EQ(iter->second.size(), entry.second.size());
+    EXPECT_EQ(ToVector(iter->second.data(),
+                       iter->second.size() * sizeof(UsbEndpointDescriptor)),
+              ToVector(entry.second.data(),
+                       entry.second.size() * sizeof(UsbEndpointDescriptor)));
+  }
+  EXPECT_EQ(actual.string_descriptors(), expected.string_descriptors());
+  EXPECT_EQ(actual.ieee_device_id(), expected.ieee_device_id());
+}
+
+// An IppManager created from a snapshot should produce the same responses as
+// the IppManager which the snapshot was created from.
+TEST_F(ConfigSnapshotTest, RoundTripIppAttributes) {
+  base::Optional<PrinterSnapshot> parsed =
+      ParseConfigSnapshot(snapshot_.data(), snapshot_.size());
+  ASSERT_TRUE(parsed);
+  IppManager loaded(std::move(parsed->ipp_attributes));
+
+  for (int operation_id : {IPP_VALIDATE_JOB, IPP_GET_PRINTER_ATTRIBUTES}) {
+    IppHeader header = CreateTestHeader(operation_id);
+    EXPECT_EQ(loaded.HandleIppRequest(header, SmartBuffer()).contents(),
+              ipp_manager_.HandleIppRequest(header, SmartBuffer()).contents())
+        << "operation " << operation_id;
+  }
+
+  // Every job has its own id, so only compare the job attributes which do not
+  // identify the job.
+  IppHeader header = CreateTestHeader(IPP_CREATE_JOB);
+  SmartBuffer loaded_response = loaded.HandleIppRequest(header, SmartBuffer());
+  SmartBuffer original_response =
+      ipp_manager_.HandleIppRequest(header, SmartBuffer());
+  base::Optional<IppRequest> loaded_job =
+      ParseIppRequest(SmartBufferView(loaded_response));
+  base::Optional<IppRequest> original_job =
+      ParseIppRequest(SmartBufferView(original_response));
+  ASSERT_TRUE(loaded_job);
+  ASSERT_TRUE(original_job);
+  for (IppRequest* job : {&loaded_job.value(), &original_job.value()}) {
+    EXPECT_EQ(job->job_attributes.erase("job-id"), 1);
+    EXPECT_EQ(job->job_attributes.erase("job-uri"), 1);
+  }
+  EXPECT_EQ(loaded_job->operation_attributes,
+            original_job->operation_attributes);
+  EXPECT_EQ(loaded_job->job_attributes, original_job->job_attributes);
+  EXPECT_EQ(loaded_job->job_attributes.count("job-printer-uri"), 1);
+}
+
+TEST_F(ConfigSnapshotTest, RoundTripPerformanceProfile) {
+  base::Optional<PrinterSnapshot> parsed =
+      ParseConfigSnapshot(snapshot_.data(), snapshot_.size());
+  ASSERT_TRUE(parsed);
+
+  const PerformanceProfile expected = CreateTestProfile();
+  const PerformanceProfile& actual = parsed->performance_profile;
+  EXPECT_EQ(actual.pages_per_minute, expected.pages_per_minute);
+  EXPECT_EQ(actual.bytes_per_page, expected.bytes_per_page);
+  EXPECT_EQ(actual.buffer_size, expected.buffer_size);
+  EXPECT_EQ(actual.scan_megabytes_per_second,
+            expected.scan_megabytes_per_second);
+  EXPECT_EQ(actual.ipp_operation_latency, expected.ipp_operation_latency);
+}
+
+TEST_F(ConfigSnapshotTest, RejectsWrongMagic) {
+  snapshot_[0] = 'X';
+  EXPECT_FALSE(ParseConfigSnapshot(snapshot_.data(), snapshot_.size()));
+}
+
+TEST_F(ConfigSnapshotTest, RejectsWrongVersion) {
+  snapshot_[4]++;
+  EXPECT_FALSE(ParseConfigSnapshot(snapshot_.data(), snapshot_.size()));
+}
+
+TEST_F(ConfigSnapshotTest, RejectsTruncatedSnapshot) {
+  for (size_t size = 0; size < snapshot_.size(); size++) {
+    EXPECT_FALSE(ParseConfigSnapshot(snapshot_.data(), size))
+        << "size " << size;
+  }
+}
+
+TEST_F(ConfigSnapshotTest, RejectsTrailingData) {
+  snapshot_.push_back(0);
+  EXPECT_FALSE(ParseConfigSnapshot(snapshot_.data(), snapshot_.size()));
+}
+
+TEST_F(ConfigSnapshotTest, LoadFromFile) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("printer.snapshot");
+  ASSERT_EQ(base::WriteFile(path, reinterpret_cast<char*>(snapshot_.data()),
+                            snapshot_.size()),
+            static_cast<int>(snapshot_.size()));
+
+  base::Optional<PrinterSnapshot> loaded = LoadConfigSnapshot(path);
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ(loaded->descriptors.ieee_device_id(),
+            CreateTestDescriptors().ieee_device_id());
+}
+
+TEST(ConfigSnapshot, LoadMissingFile) {
+  EXPECT_FALSE(LoadConfigSnapshot(base::FilePath("/nonexistent/snapshot")));
+}
+
+}  // namespace
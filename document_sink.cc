@@ -0,0 +1,157 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "document_sink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <string>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <crypto/sha2.h>
+
+namespace {
+
+// Returns a new number used to name the file of a document recorded into a
+// directory. Numbers are shared between every recorder so that printers
+// which record into the same directory never overwrite each other's
+// documents. Sinks may be created on several threads at once, so the counter
+// is atomic.
+int NextDocumentNumber() {
+  static std::atomic<int> next_document_number(1);
+  return next_document_number++;
+}
+
+}  // namespace
+
+DocumentSink::DocumentSink(base::File file, const base::FilePath& path)
+    : file_(std::move(file)), path_(path) {}
+
+DocumentSink::DocumentSink(base::File file,
+                           const base::FilePath& path,
+                           size_t keep_bytes,
+                           const base::FilePath& manifest_path)
+    : file_(std::move(file)),
+      path_(path),
+      checksum_(crypto::SecureHash::Create(crypto::SecureHash::SHA256)),
+      keep_bytes_(keep_bytes),
+      manifest_path_(manifest_path) {}
+
+DocumentSink::~DocumentSink() {
+  if (checksum_) {
+    WriteManifestEntry();
+  }
+}
+
+bool DocumentSink::Write(const uint8_t* data, size_t size) {
+  document_size_ += size;
+  if (!checksum_) {
+    return WriteToFile(data, size);
+  }
+  checksum_->Update(data, size);
+  if (bytes_written_ >= keep_bytes_) {
+    return true;
+  }
+  return WriteToFile(data, std::min(size, keep_bytes_ - bytes_written_));
+}
+
+bool DocumentSink::WriteToFile(const uint8_t* data, size_t size) {
+  // base::File writes at most INT_MAX bytes at a time.
+  while (size > 0) {
+    int to_write = static_cast<int>(std::min<size_t>(size, INT_MAX));
+    int written =
+        file_.WriteAtCurrentPos(reinterpret_cast<const char*>(data), to_write);
+    if (written <= 0) {
+      PLOG(ERROR) << "Failed to write document to file at " << path_;
+      return false;
+    }
+    data += written;
+    size -= written;
+    bytes_written_ += written;
+  }
+  return true;
+}
+
+void DocumentSink::WriteManifestEntry() {
+  uint8_t digest[crypto::kSHA256Length];
+  checksum_->Finish(digest, sizeof(digest));
+  // Each entry is a single line, which is appended in one write so that the
+  // entries of documents finished by other printers are never interleaved.
+  std::string entry = base::StringPrintf(
+      "%s %zu %s\n",
+      base::ToLowerASCII(base::HexEncode(digest, sizeof(digest))).c_str(),
+      document_size_, path_.BaseName().value().c_str());
+  base::File manifest(manifest_path_, base::File::FLAG_OPEN_ALWAYS |
+                                          base::File::FLAG_APPEND |
+                                          base::File::FLAG_WRITE);
+  if (!manifest.IsValid() ||
+      manifest.WriteAtCurrentPos(entry.data(), entry.size()) !=
+          static_cast<int>(entry.size())) {
+    LOG(ERROR) << "Failed to write checksum of " << path_ << " to manifest at "
+               << manifest_path_;
+  }
+}
+
+DocumentRecorder::DocumentRecorder(const base::FilePath& path,
+                                   const base::FilePath& directory)
+    : path_(path), directory_(directory) {}
+
+base::FilePath DocumentRecorder::GetManifestPath() const {
+  if (!path_.empty()) {
+    return path_.AddExtension("manifest");
+  }
+  return directory_.Append("manifest");
+}
+
+std::unique_ptr<DocumentSink> DocumentRecorder::CreateSink(bool append) const {
+  base::FilePath path;
+  uint32_t flags = base::File::FLAG_WRITE;
+  if (!path_.empty()) {
+    path = path_;
+    flags |= append ? base::File::FLAG_OPEN_ALWAYS | base::File::FLAG_APPEND
+                    : base::File::FLAG_CREATE_ALWAYS;
+  } else if (!directory_.empty()) {
+    path = directory_.Append(
+        base::StringPrintf("document-%d", NextDocumentNumber()));
+    flags |= base::File::FLAG_CREATE_ALWAYS;
+  } else {
+    return nullptr;
+  }
+  return OpenSink(path, flags);
+}
+
+std::unique_ptr<DocumentSink> DocumentRecorder::CreateJobSink(
+    int job_id, int document_number) const {
+  if (directory_.empty() || !path_.empty()) {
+    return CreateSink(false /* append */);
+  }
+  return OpenSink(directory_.Append(base::StringPrintf(
+                      "job-%d-document-%d", job_id, document_number)),
+                  base::File::FLAG_WRITE | base::File::FLAG_CREATE_ALWAYS);
+}
+
+std::unique_ptr<DocumentSink> DocumentRecorder::OpenSink(
+    const base::FilePath& path, uint32_t flags) const {
+  base::File file;
+  if (!checksum_mode_ || keep_bytes_ > 0) {
+    file.Initialize(path, flags);
+    if (!file.IsValid()) {
+      LOG(ERROR) << "Failed to open/create file at " << path;
+      return nullptr;
+    }
+  }
+  if (!checksum_mode_) {
+    LOG(INFO) << "Recording document to " << path;
+    return std::make_unique<DocumentSink>(std::move(file), path);
+  }
+  base::FilePath manifest_path = GetManifestPath();
+  VLOG(1) << "Recording checksum of " << path << " to " << manifest_path;
+  return std::make_unique<DocumentSink>(std::move(file), path, keep_bytes_,
+                                        manifest_path);
+}
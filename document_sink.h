@@ -0,0 +1,125 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DOCUMENT_SINK_H__
+#define DOCUMENT_SINK_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <base/files/file.h>
+#include <base/files/file_path.h>
+#include <crypto/secure_hash.h>
+
+// Writes a single received document to a file as its data arrives. The file
+// is kept open for the lifetime of the sink so that each piece of the document
+// can be written without reopening it.
+//
+// A checksum sink instead computes the SHA-256 checksum of the document as it
+// arrives and writes only the start of it to the file. When the sink is
+// destroyed, the size and checksum of the document are appended to a
+// manifest.
+class DocumentSink {
+ public:
+  DocumentSink(base::File file, const base::FilePath& path);
+
+  // Creates a checksum sink which writes the first |keep_bytes| bytes of the
+  // document to |file|, and adds an entry naming |path| to the manifest at
+  // |manifest_path|. |file| is not used if |keep_bytes| is 0.
+  DocumentSink(base::File file,
+               const base::FilePath& path,
+               size_t keep_bytes,
+               const base::FilePath& manifest_path);
+  DocumentSink(const DocumentSink&) = delete;
+  DocumentSink& operator=(const DocumentSink&) = delete;
+  ~DocumentSink();
+
+  // Appends the |size| bytes in |data| to the document. Returns false if the
+  // data could not be written.
+  bool Write(const uint8_t* data, size_t size);
+
+  const base::FilePath& path() const { return path_; }
+  // The number of bytes of the document written to the file.
+  size_t bytes_written() const { return bytes_written_; }
+  // The number of bytes of the document received by the sink.
+  size_t document_size() const { return document_size_; }
+
+ private:
+  // Writes the |size| bytes in |data| to |file_|.
+  bool WriteToFile(const uint8_t* data, size_t size);
+
+  // Appends the size and checksum of the document to |manifest_path_|.
+  void WriteManifestEntry();
+
+  base::File file_;
+  base::FilePath path_;
+  size_t bytes_written_ = 0;
+  size_t document_size_ = 0;
+  // The checksum of the document received so far, or null if this is not a
+  // checksum sink.
+  std::unique_ptr<crypto::SecureHash> checksum_;
+  // The bytes of the document which are written to |file_| by a checksum sink.
+  size_t keep_bytes_ = 0;
+  base::FilePath manifest_path_;
+};
+
+// Determines where the documents received by a printer are recorded, and
+// creates a DocumentSink for each of them.
+class DocumentRecorder {
+ public:
+  // Creates a recorder which does not record documents.
+  DocumentRecorder() = default;
+
+  // If |path| is not empty then every document is recorded to the file at
+  // |path|. Otherwise, if |directory| is not empty, then each document is
+  // recorded to a new file within |directory|.
+  DocumentRecorder(const base::FilePath& path,
+                   const base::FilePath& directory);
+
+  // Returns whether documents are recorded at all.
+  bool enabled() const { return !path_.empty() || !directory_.empty(); }
+
+  // Records only the size and SHA-256 checksum of each document, along with
+  // its first |keep_bytes| bytes. The size and checksum are written to a
+  // manifest named after the file with ".manifest" appended when recording to
+  // a single file, or to a file named "manifest" within the directory.
+  void set_checksum_mode(size_t keep_bytes) {
+    checksum_mode_ = true;
+    keep_bytes_ = keep_bytes;
+  }
+
+  bool checksum_mode() const { return checksum_mode_; }
+
+  // Returns the path of the manifest written in checksum mode.
+  base::FilePath GetManifestPath() const;
+
+  // Creates a sink for a newly received document. When recording to a single
+  // file, |append| determines whether the document is added to the end of the
+  // file or replaces its contents. Returns nullptr if documents are not
+  // recorded or the file could not be opened.
+  std::unique_ptr<DocumentSink> CreateSink(bool append) const;
+
+  // Creates a sink for the document numbered |document_number| within the IPP
+  // job |job_id|. When recording into a directory the document is recorded to
+  // a file named after the job and document, so that documents sent by
+  // concurrent jobs never overwrite each other. When recording to a single file
+  // the document replaces its contents.
+  std::unique_ptr<DocumentSink> CreateJobSink(int job_id,
+                                              int document_number) const;
+
+ private:
+  // Opens |path| with the base::File |flags| and returns a sink which writes to
+  // it, or nullptr if the file could not be opened. In checksum mode the file
+  // is only opened if some of the document is kept.
+  std::unique_ptr<DocumentSink> OpenSink(const base::FilePath& path,
+                                         uint32_t flags) const;
+
+  base::FilePath path_;
+  base::FilePath directory_;
+  bool checksum_mode_ = false;
+  size_t keep_bytes_ = 0;
+};
+
+#endif  // DOCUMENT_SINK_H__
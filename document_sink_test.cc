@@ -0,0 +1,205 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "document_sink.h"
+
+#include <memory>
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+// Writes |contents| to |sink|.
+bool WriteString(DocumentSink* sink, const std::string& contents) {
+  return sink->Write(reinterpret_cast<const uint8_t*>(contents.data()),
+                     contents.size());
+}
+
+std::string ReadFile(const base::FilePath& path) {
+  std::string contents;
+  EXPECT_TRUE(base::ReadFileToString(path, &contents));
+  return contents;
+}
+
+TEST(DocumentRecorder, Disabled) {
+  DocumentRecorder recorder;
+  EXPECT_FALSE(recorder.enabled());
+  EXPECT_EQ(recorder.CreateSink(false), nullptr);
+}
+
+TEST(DocumentRecorder, RecordToPath) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("document");
+  DocumentRecorder recorder(path, base::FilePath());
+  EXPECT_TRUE(recorder.enabled());
+
+  std::unique_ptr<DocumentSink> sink = recorder.CreateSink(false);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_EQ(sink->path(), path);
+  EXPECT_TRUE(WriteString(sink.get(), "first "));
+  EXPECT_TRUE(WriteString(sink.get(), "document"));
+  EXPECT_EQ(sink->bytes_written(), 14);
+  sink.reset();
+  EXPECT_EQ(ReadFile(path), "first document");
+
+  // A new document replaces the previous one.
+  sink = recorder.CreateSink(false);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_TRUE(WriteString(sink.get(), "second"));
+  sink.reset();
+  EXPECT_EQ(ReadFile(path), "second");
+}
+
+TEST(DocumentRecorder, AppendToPath) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("document");
+  DocumentRecorder recorder(path, base::FilePath());
+
+  std::unique_ptr<DocumentSink> sink = recorder.CreateSink(true);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_TRUE(WriteString(sink.get(), "first"));
+  sink = recorder.CreateSink(true);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_TRUE(WriteString(sink.get(), "second"));
+  sink.reset();
+  EXPECT_EQ(ReadFile(path), "firstsecond");
+}
+
+TEST(DocumentRecorder, RecordToDirectory) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  DocumentRecorder recorder(base::FilePath(), temp_dir.GetPath());
+  EXPECT_TRUE(recorder.enabled());
+
+  std::unique_ptr<DocumentSink> first = recorder.CreateSink(false);
+  std::unique_ptr<DocumentSink> second = recorder.CreateSink(false);
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_EQ(first->path().DirName(), temp_dir.GetPath());
+  EXPECT_EQ(second->path().DirName(), temp_dir.GetPath());
+  EXPECT_NE(first->path(), second->path());
+
+  base::FilePath first_path = first->path();
+  base::FilePath second_path = second->path();
+  EXPECT_TRUE(WriteString(first.get(), "first"));
+  EXPECT_TRUE(WriteString(second.get(), "second"));
+  first.reset();
+  second.reset();
+  EXPECT_EQ(ReadFile(first_path), "first");
+  EXPECT_EQ(ReadFile(second_path), "second");
+}
+
+// Documents of concurrent jobs are each recorded to a file named after their
+// job.
+TEST(DocumentRecorder, RecordJobsToDirectory) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  DocumentRecorder recorder(base::FilePath(), temp_dir.GetPath());
+
+  std::unique_ptr<DocumentSink> first = recorder.CreateJobSink(4, 1);
+  std::unique_ptr<DocumentSink> second = recorder.CreateJobSink(5, 1);
+  std::unique_ptr<DocumentSink> next = recorder.CreateJobSink(4, 2);
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  ASSERT_NE(next, nullptr);
+  EXPECT_EQ(first->path(), temp_dir.GetPath().Append("job-4-document-1"));
+  EXPECT_EQ(second->path(), temp_dir.GetPath().Append("job-5-document-1"));
+  EXPECT_EQ(next->path(), temp_dir.GetPath().Append("job-4-document-2"));
+
+  EXPECT_TRUE(WriteString(first.get(), "first"));
+  EXPECT_TRUE(WriteString(second.get(), "second"));
+  first.reset();
+  second.reset();
+  EXPECT_EQ(ReadFile(temp_dir.GetPath().Append("job-4-document-1")), "first");
+  EXPECT_EQ(ReadFile(temp_dir.GetPath().Append("job-5-document-1")),
+            "second");
+}
+
+TEST(DocumentRecorder, RecordJobToPath) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("document");
+  DocumentRecorder recorder(path, temp_dir.GetPath());
+
+  std::unique_ptr<DocumentSink> sink = recorder.CreateJobSink(4, 1);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_EQ(sink->path(), path);
+  EXPECT_EQ(DocumentRecorder().CreateJobSink(4, 1), nullptr);
+}
+
+// The SHA-256 checksum of "abc".
+constexpr char kAbcChecksum[] =
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+
+TEST(DocumentRecorder, ChecksumToPath) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("document");
+  DocumentRecorder recorder(path, base::FilePath());
+  recorder.set_checksum_mode(0);
+  EXPECT_EQ(recorder.GetManifestPath(),
+            temp_dir.GetPath().Append("document.manifest"));
+
+  std::unique_ptr<DocumentSink> sink = recorder.CreateSink(false);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_TRUE(WriteString(sink.get(), "a"));
+  EXPECT_TRUE(WriteString(sink.get(), "bc"));
+  EXPECT_EQ(sink->bytes_written(), 0);
+  EXPECT_EQ(sink->document_size(), 3);
+  sink.reset();
+
+  // Nothing of the document is kept.
+  EXPECT_FALSE(base::PathExists(path));
+  EXPECT_EQ(ReadFile(recorder.GetManifestPath()),
+            std::string(kAbcChecksum) + " 3 document\n");
+}
+
+TEST(DocumentRecorder, ChecksumKeepsStartOfDocument) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath path = temp_dir.GetPath().Append("document");
+  DocumentRecorder recorder(path, base::FilePath());
+  recorder.set_checksum_mode(4);
+
+  std::unique_ptr<DocumentSink> sink = recorder.CreateSink(false);
+  ASSERT_NE(sink, nullptr);
+  EXPECT_TRUE(WriteString(sink.get(), "abc"));
+  EXPECT_TRUE(WriteString(sink.get(), "def"));
+  EXPECT_TRUE(WriteString(sink.get(), "ghi"));
+  EXPECT_EQ(sink->bytes_written(), 4);
+  EXPECT_EQ(sink->document_size(), 9);
+  sink.reset();
+  EXPECT_EQ(ReadFile(path), "abcd");
+}
+
+// Each document recorded to a directory adds an entry to the same manifest.
+TEST(DocumentRecorder, ChecksumJobsToDirectory) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  DocumentRecorder recorder(base::FilePath(), temp_dir.GetPath());
+  recorder.set_checksum_mode(0);
+  EXPECT_EQ(recorder.GetManifestPath(), temp_dir.GetPath().Append("manifest"));
+
+  std::unique_ptr<DocumentSink> first = recorder.CreateJobSink(4, 1);
+  std::unique_ptr<DocumentSink> second = recorder.CreateJobSink(5, 1);
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_TRUE(WriteString(first.get(), "abc"));
+  second.reset();
+  first.reset();
+
+  EXPECT_FALSE(base::PathExists(temp_dir.GetPath().Append("job-4-document-1")));
+  EXPECT_EQ(ReadFile(recorder.GetManifestPath()),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 "
+            "0 job-5-document-1\n" +
+                std::string(kAbcChecksum) + " 3 job-4-document-1\n");
+}
+
+}  // namespace
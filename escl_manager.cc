@@ -4,18 +4,51 @@
 
 #include "escl_manager.h"
 
+#include <algorithm>
+#include <memory>
 #include <utility>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
+#include <base/files/memory_mapped_file.h>
 #include <base/logging.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <crypto/random.h>
 
+#include "metrics.h"
+#include "scan_generator.h"
 #include "xml_util.h"
 
 namespace {
 
+// Exposes the contents of a memory-mapped file as RefCountedMemory.
+class RefCountedMappedFile : public base::RefCountedMemory {
+ public:
+  explicit RefCountedMappedFile(std::unique_ptr<base::MemoryMappedFile> file)
+      : file_(std::move(file)) {}
+
+  const unsigned char* front() const override { return file_->data(); }
+  size_t size() const override { return file_->length(); }
+
+ private:
+  ~RefCountedMappedFile() override = default;
+
+  std::unique_ptr<base::MemoryMappedFile> file_;
+};
+
+// Maps the scan data at |path| into memory. If this fails, logs an error and
+// returns an empty page.
+scoped_refptr<base::RefCountedMemory> MapPage(const base::FilePath& path) {
+  auto file = std::make_unique<base::MemoryMappedFile>();
+  if (!file->Initialize(path)) {
+    LOG(ERROR) << "Failed to map document at " << path
+               << ", sending empty page";
+    return base::MakeRefCounted<base::RefCountedBytes>();
+  }
+  return base::MakeRefCounted<RefCountedMappedFile>(std::move(file));
+}
+
 base::Optional<std::vector<std::string>> ExtractStringList(
     const base::Value& root, const std::string& config_name) {
   const base::Value* value =
@@ -198,29 +231,43 @@ EsclManager::EsclManager(ScannerCapabilities scanner_capabilities,
     : scanner_capabilities_(std::move(scanner_capabilities)),
       document_path_(document_path) {}
 
+void EsclManager::SetScannerCapabilities(
+    ScannerCapabilities scanner_capabilities) {
+  scanner_capabilities_ = std::move(scanner_capabilities);
+  capabilities_xml_.clear();
+}
+
 HttpResponse EsclManager::HandleEsclRequest(const HttpRequest& request,
                                             const SmartBuffer& request_body) {
+  ScopedLatencyTimer timer(kEsclRequestSeconds,
+                           FormatLabels({{"operation", "Invalid"}}));
+  RemoveExpiredJobs(base::TimeTicks::Now());
   if (request.method == "GET" && request.uri == "/eSCL/ScannerCapabilities") {
+    timer.set_labels(FormatLabels({{"operation", "ScannerCapabilities"}}));
     HttpResponse response;
     response.status = "200 OK";
     response.headers["Content-Type"] = "text/xml";
-    response.body.Add(ScannerCapabilitiesAsXml(scanner_capabilities_));
+    response.body.Add(GetCapabilitiesXml());
     return response;
   } else if (request.method == "GET" && request.uri == "/eSCL/ScannerStatus") {
+    timer.set_labels(FormatLabels({{"operation", "ScannerStatus"}}));
     HttpResponse response;
     response.status = "200 OK";
     response.headers["Content-Type"] = "text/xml";
-    response.body.Add(ScannerStatusAsXml(status_));
+    response.body.Add(GetStatusXml());
     return response;
   } else if (request.method == "POST" && request.uri == "/eSCL/ScanJobs") {
+    timer.set_labels(FormatLabels({{"operation", "CreateScanJob"}}));
     return HandleCreateScanJob(request_body);
   } else if (request.method == "GET" &&
              base::StartsWith(request.uri, "/eSCL/ScanJobs/",
                               base::CompareCase::SENSITIVE)) {
+    timer.set_labels(FormatLabels({{"operation", "NextDocument"}}));
     return HandleGetNextDocument(request.uri);
   } else if (request.method == "DELETE" &&
              base::StartsWith(request.uri, "/eSCL/ScanJobs/",
                               base::CompareCase::SENSITIVE)) {
+    timer.set_labels(FormatLabels({{"operation", "DeleteScanJob"}}));
     return HandleDeleteJob(request.uri);
   } else if (request.uri == "/eSCL/ScannerCapabilities" ||
              request.uri == "/eSCL/ScannerStatus" ||
@@ -245,7 +292,7 @@ HttpResponse EsclManager::HandleCreateScanJob(const SmartBuffer& request_body) {
   HttpResponse response;
 
   base::Optional<ScanSettings> settings_opt =
-      ScanSettingsFromXml(request_body.contents());
+      ScanSettingsFromXml(SmartBufferView(request_body));
   if (!settings_opt) {
     LOG(ERROR) << "Could not parse ScanSettings from request body";
     response.status = "415 Unsupported Media Type";
@@ -287,6 +334,17 @@ HttpResponse EsclManager::HandleCreateScanJob(const SmartBuffer& request_body) {
     return response;
   }
 
+  // Without a document to return, the scan data is generated, which is only
+  // possible in some formats. Reject the job now rather than failing to
+  // produce its document later.
+  if (document_path_.empty() && settings.document_format != kPngFormat &&
+      settings.document_format != kPdfFormat) {
+    LOG(ERROR) << "Can not generate scans in format '"
+               << settings.document_format << "' without a scanner document";
+    response.status = "409 Conflict";
+    return response;
+  }
+
   if (settings.x_resolution != settings.y_resolution) {
     LOG(ERROR) << "Scanner cannot support different resolutions in X and Y: "
                << settings.x_resolution << " " << settings.y_resolution;
@@ -305,7 +363,12 @@ HttpResponse EsclManager::HandleCreateScanJob(const SmartBuffer& request_body) {
   JobInfo job;
   job.created = base::TimeTicks::Now();
   job.state = kPending;
+  job.settings = settings;
+  job.from_adf = settings.input_source == "ADF";
   status_.jobs[uuid] = job;
+  job_order_.push_back(uuid);
+  RemoveExpiredJobs(job.created);
+  InvalidateStatusXml();
 
   response.status = "201 Created";
   response.headers["Location"] = "/eSCL/ScanJobs/" + uuid;
@@ -334,24 +397,45 @@ HttpResponse EsclManager::HandleGetNextDocument(const std::string& uri) {
     return response;
   }
 
-  JobInfo info = status_.jobs[uuid];
+  JobInfo& info = status_.jobs[uuid];
   switch (info.state) {
     case kCanceled:
     case kCompleted:
-      LOG(INFO) << "Not providing NextDocument for "
-                << JobStateAsString(info.state) << " job.";
+      VLOG(1) << "Not providing NextDocument for "
+              << JobStateAsString(info.state) << " job.";
       response.status = "404 Not Found";
       break;
     case kPending: {
-      status_.jobs[uuid].state = kCompleted;
-      std::string document;
-      if (!base::ReadFileToString(document_path_, &document)) {
-        LOG(ERROR) << "Failed to read document at " << document_path_
-                   << ", sending empty response";
+      InvalidateStatusXml();
+      if (document_path_.empty()) {
+        base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>>
+            scan = GenerateScan(info.settings);
+        if (!scan) {
+          LOG(ERROR) << "Failed to generate scan for job " << uuid;
+          info.state = kCanceled;
+          response.status = "500 Internal Server Error";
+          break;
+        }
+        info.state = kCompleted;
+        response.shared_body = std::move(scan.value());
+        response.status = "200 OK";
+        response.headers["Content-Type"] = info.settings.document_format;
+        break;
+      }
+
+      const std::vector<scoped_refptr<base::RefCountedMemory>>& pages =
+          GetPages();
+      if (pages.empty()) {
+        LOG(ERROR) << "No scan data available, sending empty response";
+      } else {
+        response.shared_body.push_back(pages[info.next_page]);
+      }
+      info.next_page++;
+      if (!info.from_adf || info.next_page >= pages.size()) {
+        info.state = kCompleted;
       }
       response.status = "200 OK";
       response.headers["Content-Type"] = "image/jpeg";
-      response.body.Add(document);
       break;
     }
   }
@@ -373,9 +457,88 @@ HttpResponse EsclManager::HandleDeleteJob(const std::string& uri) {
   std::string uuid = tokens[3];
   size_t erased = status_.jobs.erase(uuid);
   if (erased == 1) {
+    job_order_.erase(std::find(job_order_.begin(), job_order_.end(), uuid));
+    InvalidateStatusXml();
     response.status = "200 OK";
   } else {
     response.status = "404 Not Found";
   }
   return response;
 }
+
+const std::vector<scoped_refptr<base::RefCountedMemory>>&
+EsclManager::GetPages() {
+  if (pages_loaded_) {
+    return pages_;
+  }
+  pages_loaded_ = true;
+  if (document_path_.empty()) {
+    return pages_;
+  }
+
+  if (!base::DirectoryExists(document_path_)) {
+    pages_.push_back(MapPage(document_path_));
+    return pages_;
+  }
+
+  std::vector<base::FilePath> page_paths;
+  base::FileEnumerator enumerator(document_path_, false /* recursive */,
+                                  base::FileEnumerator::FILES);
+  for (base::FilePath path = enumerator.Next(); !path.empty();
+       path = enumerator.Next()) {
+    page_paths.push_back(path);
+  }
+  std::sort(page_paths.begin(), page_paths.end());
+  for (const base::FilePath& path : page_paths) {
+    pages_.push_back(MapPage(path));
+  }
+  LOG(INFO) << "Loaded " << pages_.size() << " scan pages from "
+            << document_path_;
+  return pages_;
+}
+
+const std::vector<uint8_t>& EsclManager::GetCapabilitiesXml() {
+  if (capabilities_xml_.empty()) {
+    capabilities_xml_ = ScannerCapabilitiesAsXml(scanner_capabilities_);
+  }
+  return capabilities_xml_;
+}
+
+const std::vector<uint8_t>& EsclManager::GetStatusXml() {
+  base::TimeTicks now = base::TimeTicks::Now();
+  if (status_xml_ &&
+      (status_xml_expiry_.is_null() || now < status_xml_expiry_)) {
+    return status_xml_.value();
+  }
+
+  status_xml_ = ScannerStatusAsXml(status_);
+  // The age of each job is reported in whole seconds, so the XML expires when
+  // the first of them is next incremented.
+  status_xml_expiry_ = base::TimeTicks();
+  for (const auto& job : status_.jobs) {
+    base::TimeTicks created = job.second.created;
+    base::TimeTicks next_increment =
+        created +
+        base::TimeDelta::FromSeconds((now - created).InSeconds() + 1);
+    if (status_xml_expiry_.is_null() || next_increment < status_xml_expiry_) {
+      status_xml_expiry_ = next_increment;
+    }
+  }
+  return status_xml_.value();
+}
+
+void EsclManager::RemoveExpiredJobs(base::TimeTicks now) {
+  // Jobs are created in order, so the expired jobs are always the oldest.
+  while (!job_order_.empty()) {
+    auto it = status_.jobs.find(job_order_.front());
+    bool expired = now - it->second.created >= job_retention_.max_age;
+    if (!expired && status_.jobs.size() <= job_retention_.max_jobs) {
+      break;
+    }
+    VLOG(1) << "Removing " << (expired ? "expired" : "oldest") << " scan job "
+            << it->first;
+    status_.jobs.erase(it);
+    InvalidateStatusXml();
+    job_order_.pop_front();
+  }
+}
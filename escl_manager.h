@@ -5,11 +5,14 @@
 #ifndef ESCL_MANAGER_H__
 #define ESCL_MANAGER_H__
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 
-#include <base/containers/flat_map.h>
 #include <base/files/file_path.h>
+#include <base/memory/ref_counted_memory.h>
+#include <base/memory/scoped_refptr.h>
 #include <base/optional.h>
 #include <base/time/time.h>
 #include <base/values.h>
@@ -106,19 +109,41 @@ struct JobInfo {
   base::TimeTicks created;
   // The current state of the job.
   JobState state;
+  // The settings the job was created with.
+  ScanSettings settings;
+  // Whether the job scans from the ADF, in which case every page of the scan
+  // document is returned rather than just the first.
+  bool from_adf = false;
+  // The index of the page to return from the next NextDocument request.
+  size_t next_page = 0;
 };
 
 struct ScannerStatus {
   bool idle;
   // All of the scan jobs for this scanner.
   // Keys are v4 UUIDs. Scan jobs may be in any state.
-  base::flat_map<std::string, JobInfo> jobs;
+  std::map<std::string, JobInfo> jobs;
+};
+
+// Limits on the scan jobs which an EsclManager keeps track of, so that jobs
+// which clients never delete do not accumulate.
+struct JobRetention {
+  // The most jobs to keep, which must be at least 1. Once there are more, the
+  // oldest are removed.
+  size_t max_jobs = 100;
+  // Jobs are removed once they are this old, whatever their state.
+  base::TimeDelta max_age = base::TimeDelta::FromHours(1);
 };
 
 // This class is responsible for generating responses to eSCL requests sent
 // over USB.
 // The |document_path| parameter specifies the path to the scan data that
-// should be reported to clients within HandleGetNextDocument.
+// should be reported to clients within HandleGetNextDocument. If it is a
+// directory, each file within it is a page, in order of file name; ADF scans
+// return every page in turn, while other scans return only the first. The scan
+// data is memory-mapped the first time it is needed and shared by every
+// response which sends it. If there is no |document_path|, scan data is
+// generated to match the settings of each job instead.
 class EsclManager {
  public:
   EsclManager() = default;
@@ -131,14 +156,50 @@ class EsclManager {
   HttpResponse HandleEsclRequest(const HttpRequest& request,
                                  const SmartBuffer& request_body);
 
+  void set_job_retention(const JobRetention& retention) {
+    job_retention_ = retention;
+  }
+
+  // Replaces the capabilities which the scanner reports. Existing scan jobs
+  // are kept, and new jobs are checked against |scanner_capabilities|.
+  void SetScannerCapabilities(ScannerCapabilities scanner_capabilities);
+
  private:
   HttpResponse HandleCreateScanJob(const SmartBuffer& request_body);
   HttpResponse HandleGetNextDocument(const std::string& uri);
   HttpResponse HandleDeleteJob(const std::string& uri);
 
+  // Returns the pages of the scan document, loading them if needed.
+  const std::vector<scoped_refptr<base::RefCountedMemory>>& GetPages();
+
+  // Return the serialized ScannerCapabilities and ScannerStatus, generating
+  // them only if they are out of date.
+  const std::vector<uint8_t>& GetCapabilitiesXml();
+  const std::vector<uint8_t>& GetStatusXml();
+
+  // Must be called whenever |status_| is modified.
+  void InvalidateStatusXml() { status_xml_.reset(); }
+
+  // Removes the jobs which are no longer retained as of |now|.
+  void RemoveExpiredJobs(base::TimeTicks now);
+
   ScannerCapabilities scanner_capabilities_;
   ScannerStatus status_;
+  JobRetention job_retention_;
+  // The UUIDs of the jobs in |status_|, from oldest to newest.
+  std::deque<std::string> job_order_;
   base::FilePath document_path_;
+  bool pages_loaded_ = false;
+  std::vector<scoped_refptr<base::RefCountedMemory>> pages_;
+  // The serialized ScannerCapabilities, which are generated again when the
+  // capabilities are replaced.
+  std::vector<uint8_t> capabilities_xml_;
+  // Clients poll the scanner status many times during each scan, so the
+  // serialized XML is kept until |status_| changes or the age reported for one
+  // of its jobs would change at |status_xml_expiry_|. A null expiry means the
+  // XML stays valid until |status_| changes.
+  base::Optional<std::vector<uint8_t>> status_xml_;
+  base::TimeTicks status_xml_expiry_;
 };
 
 #endif  // ESCL_MANAGER_H__
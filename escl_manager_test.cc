@@ -6,7 +6,10 @@
 
 #include <utility>
 
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/logging.h>
+#include <base/strings/string_util.h>
 #include <base/values.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -80,6 +83,34 @@ inline const xmlChar* XmlCast(const char* p) {
   return reinterpret_cast<const xmlChar*>(p);
 }
 
+// Creates a scan job on |manager| from |scan_settings| and returns the URI of
+// the NextDocument endpoint for the new job.
+std::string CreateScanJob(EsclManager* manager,
+                          const std::string& scan_settings) {
+  HttpRequest request;
+  request.method = "POST";
+  request.uri = "/eSCL/ScanJobs";
+  std::vector<uint8_t> xml(scan_settings.begin(), scan_settings.end());
+  HttpResponse response = manager->HandleEsclRequest(request, SmartBuffer(xml));
+  EXPECT_EQ(response.status, "201 Created");
+  return response.headers["Location"] + "/NextDocument";
+}
+
+HttpResponse GetNextDocument(EsclManager* manager, const std::string& uri) {
+  HttpRequest request;
+  request.method = "GET";
+  request.uri = uri;
+  return manager->HandleEsclRequest(request, SmartBuffer());
+}
+
+std::string BodyAsString(const HttpResponse& response) {
+  std::string body;
+  for (const auto& piece : response.shared_body) {
+    body.append(piece->front_as<char>(), piece->size());
+  }
+  return body;
+}
+
 }  // namespace
 
 TEST(ScannerCapabilities, Initialize) {
@@ -212,7 +243,8 @@ TEST(ScannerCapabilities, AsXml) {
 // Test that we can properly parse a ScanSettings document.
 TEST(ScanSettings, Parse) {
   std::vector<uint8_t> xml(kNewScan, kNewScan + strlen(kNewScan));
-  base::Optional<ScanSettings> opt_settings = ScanSettingsFromXml(xml);
+  base::Optional<ScanSettings> opt_settings =
+      ScanSettingsFromXml(SmartBufferView(xml.data(), xml.size()));
   EXPECT_TRUE(opt_settings);
   ScanSettings settings = opt_settings.value();
   EXPECT_EQ(settings.document_format, "application/pdf");
@@ -230,6 +262,112 @@ TEST(ScanSettings, Parse) {
   EXPECT_EQ(region.y_offset, 0);
 }
 
+// Returns the result of parsing |xml| as ScanSettings.
+base::Optional<ScanSettings> ParseScanSettings(const std::string& xml) {
+  return ScanSettingsFromXml(SmartBufferView(
+      reinterpret_cast<const uint8_t*>(xml.data()), xml.size()));
+}
+
+TEST(ScannerCapabilities, AsXmlEscapesText) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  caps->make_and_model = "Make & <Model>";
+  caps->serial_number = "";
+  std::vector<uint8_t> xml = ScannerCapabilitiesAsXml(caps.value());
+  xmlDoc* doc = xmlReadMemory(reinterpret_cast<const char*>(xml.data()),
+                              xml.size(), "noname.xml", NULL, 0);
+  ASSERT_NE(doc, nullptr);
+
+  HasPathWithContents(doc, "/scan:ScannerCapabilities/pwg:MakeAndModel",
+                      {"Make & <Model>"});
+  HasPathWithContents(doc, "/scan:ScannerCapabilities/pwg:SerialNumber",
+                      {""});
+  xmlFreeDoc(doc);
+}
+
+TEST(ScannerStatus, AsXml) {
+  ScannerStatus status;
+  status.idle = false;
+  JobInfo pending;
+  pending.created = base::TimeTicks::Now();
+  pending.state = kPending;
+  status.jobs["1"] = pending;
+  JobInfo completed;
+  completed.created = base::TimeTicks::Now();
+  completed.state = kCompleted;
+  status.jobs["2"] = completed;
+  std::vector<uint8_t> xml = ScannerStatusAsXml(status);
+  xmlDoc* doc = xmlReadMemory(reinterpret_cast<const char*>(xml.data()),
+                              xml.size(), "noname.xml", NULL, 0);
+  ASSERT_NE(doc, nullptr);
+
+  HasPathWithContents(doc, "/scan:ScannerStatus/pwg:State", {"Busy"});
+  const std::string job_info = "/scan:ScannerStatus/scan:Jobs/scan:JobInfo";
+  HasPathWithContents(doc, job_info + "/pwg:JobUri",
+                      {"/eSCL/ScanJobs/1", "/eSCL/ScanJobs/2"});
+  HasPathWithContents(doc, job_info + "/pwg:JobState",
+                      {"Pending", "Completed"});
+  HasPathWithContents(doc, job_info + "/pwg:JobStateReasons/pwg:JobStateReason",
+                      {"JobScanning", "JobCompletedSuccessfully"});
+  xmlFreeDoc(doc);
+}
+
+TEST(ScanSettings, ParseMultipleRegions) {
+  base::Optional<ScanSettings> settings = ParseScanSettings(
+      "<scan:ScanSettings xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\" "
+      "xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">"
+      "<pwg:ScanRegions>"
+      "<pwg:ScanRegion><pwg:Height>10</pwg:Height></pwg:ScanRegion>"
+      "<pwg:ScanRegion><pwg:Width>20</pwg:Width></pwg:ScanRegion>"
+      "</pwg:ScanRegions>"
+      "<scan:ColorMode>Grayscale8</scan:ColorMode>"
+      "</scan:ScanSettings>");
+  ASSERT_TRUE(settings);
+  EXPECT_EQ(settings->color_mode, kGrayscale);
+  ASSERT_EQ(settings->regions.size(), 2);
+  EXPECT_EQ(settings->regions[0].height, 10);
+  EXPECT_EQ(settings->regions[0].width, 0);
+  EXPECT_EQ(settings->regions[1].width, 20);
+}
+
+// Only the children of the root element are settings.
+TEST(ScanSettings, ParseIgnoresNestedSettings) {
+  base::Optional<ScanSettings> settings =
+      ParseScanSettings("<ScanSettings>"
+                        "<XResolution>300</XResolution>"
+                        "<Other><XResolution>600</XResolution></Other>"
+                        "<Height>5</Height>"
+                        "</ScanSettings>");
+  ASSERT_TRUE(settings);
+  EXPECT_EQ(settings->x_resolution, 300);
+  EXPECT_TRUE(settings->regions.empty());
+}
+
+TEST(ScanSettings, ParseFailsWithEmptySetting) {
+  EXPECT_FALSE(ParseScanSettings(
+      "<ScanSettings><DocumentFormat></DocumentFormat></ScanSettings>"));
+  EXPECT_FALSE(
+      ParseScanSettings("<ScanSettings><DocumentFormat/></ScanSettings>"));
+}
+
+TEST(ScanSettings, ParseFailsWithInvalidSetting) {
+  EXPECT_FALSE(ParseScanSettings(
+      "<ScanSettings><XResolution>high</XResolution></ScanSettings>"));
+  EXPECT_FALSE(ParseScanSettings(
+      "<ScanSettings><ColorMode>CMYK</ColorMode></ScanSettings>"));
+  EXPECT_FALSE(ParseScanSettings("<ScanSettings><ScanRegions><ScanRegion>"
+                                 "<Width>wide</Width>"
+                                 "</ScanRegion></ScanRegions></ScanSettings>"));
+}
+
+// The whole document must be well-formed, even after the last setting.
+TEST(ScanSettings, ParseFailsWithMalformedXml) {
+  EXPECT_FALSE(ParseScanSettings(""));
+  EXPECT_FALSE(ParseScanSettings(
+      "<ScanSettings><XResolution>300</XResolution></Settings>"));
+}
+
 TEST(HandleEsclRequest, InvalidEndpoint) {
   HttpRequest request;
   request.method = "GET";
@@ -265,6 +403,26 @@ TEST(HandleEsclRequest, ScannerCapabilities) {
   xmlFreeDoc(doc);
 }
 
+// Replacing the capabilities changes the ScannerCapabilities response.
+TEST(HandleEsclRequest, SetScannerCapabilities) {
+  HttpRequest request;
+  request.method = "GET";
+  request.uri = "/eSCL/ScannerCapabilities";
+
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), base::FilePath());
+  HttpResponse before = manager.HandleEsclRequest(request, SmartBuffer());
+
+  caps->make_and_model = "Reloaded Scanner";
+  manager.SetScannerCapabilities(caps.value());
+  HttpResponse after = manager.HandleEsclRequest(request, SmartBuffer());
+  EXPECT_EQ(after.status, "200 OK");
+  EXPECT_NE(before.body.contents(), after.body.contents());
+  EXPECT_EQ(after.body.contents(), ScannerCapabilitiesAsXml(caps.value()));
+}
+
 // Tests that a GET request to /eSCL/ScannerStatus returns a valid XML
 // response.
 // TODO(b/157735732): add validation logic once we can.
@@ -360,3 +518,179 @@ TEST(HandleEsclRequest, DeleteNonexistentScanJob) {
   HttpResponse response = manager.HandleEsclRequest(request, SmartBuffer());
   EXPECT_EQ(response.status, "404 Not Found");
 }
+
+TEST(HandleEsclRequest, NextDocumentSharesScanData) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  base::FilePath document_path = temp_dir.GetPath().Append("scan.jpg");
+  const std::string document = "scan data";
+  ASSERT_EQ(base::WriteFile(document_path, document.data(), document.size()),
+            static_cast<int>(document.size()));
+
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), document_path);
+
+  std::string uri = CreateScanJob(&manager, kNewScan);
+  HttpResponse first = GetNextDocument(&manager, uri);
+  EXPECT_EQ(first.status, "200 OK");
+  EXPECT_EQ(BodyAsString(first), document);
+
+  // A platen scan has a single page.
+  EXPECT_EQ(GetNextDocument(&manager, uri).status, "404 Not Found");
+
+  // Later scans send the same scan data without loading it again.
+  uri = CreateScanJob(&manager, kNewScan);
+  HttpResponse second = GetNextDocument(&manager, uri);
+  EXPECT_EQ(second.status, "200 OK");
+  EXPECT_EQ(second.shared_body, first.shared_body);
+}
+
+TEST(HandleEsclRequest, NextDocumentReturnsEachAdfPage) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const std::vector<std::string> pages = {"page 1", "page 2", "page 3"};
+  for (size_t i = 0; i < pages.size(); i++) {
+    base::FilePath page_path =
+        temp_dir.GetPath().Append("page-" + std::to_string(i) + ".jpg");
+    ASSERT_EQ(base::WriteFile(page_path, pages[i].data(), pages[i].size()),
+              static_cast<int>(pages[i].size()));
+  }
+
+  Value json = CreateCapabilitiesJson();
+  json.SetKey("ADF", json.FindKey("Platen")->Clone());
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(std::move(json));
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), temp_dir.GetPath());
+
+  std::string adf_scan = kNewScan;
+  base::ReplaceSubstringsAfterOffset(&adf_scan, 0, "Platen", "ADF");
+  std::string uri = CreateScanJob(&manager, adf_scan);
+  for (const std::string& page : pages) {
+    HttpResponse response = GetNextDocument(&manager, uri);
+    EXPECT_EQ(response.status, "200 OK");
+    EXPECT_EQ(BodyAsString(response), page);
+  }
+  EXPECT_EQ(GetNextDocument(&manager, uri).status, "404 Not Found");
+
+  // A platen scan only returns the first page.
+  uri = CreateScanJob(&manager, kNewScan);
+  EXPECT_EQ(BodyAsString(GetNextDocument(&manager, uri)), pages[0]);
+  EXPECT_EQ(GetNextDocument(&manager, uri).status, "404 Not Found");
+}
+
+TEST(HandleEsclRequest, NextDocumentGeneratesScanWithoutDocument) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), base::FilePath());
+
+  std::string uri = CreateScanJob(&manager, kNewScan);
+  HttpResponse response = GetNextDocument(&manager, uri);
+  EXPECT_EQ(response.status, "200 OK");
+  EXPECT_EQ(response.headers["Content-Type"], "application/pdf");
+  std::string body = BodyAsString(response);
+  EXPECT_TRUE(base::StartsWith(body, "%PDF", base::CompareCase::SENSITIVE));
+  EXPECT_NE(body.find("/Width 200 /Height 600"), std::string::npos);
+  EXPECT_EQ(GetNextDocument(&manager, uri).status, "404 Not Found");
+}
+
+// Tests that a job in a format which can not be generated is rejected when
+// there is no scanner document to return instead.
+TEST(HandleEsclRequest, CreateScanJobRejectsFormatWhichCanNotBeGenerated) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  caps->platen_capabilities.formats.push_back("image/jpeg");
+  EsclManager manager(caps.value(), base::FilePath());
+
+  std::string scan_settings = kNewScan;
+  base::ReplaceFirstSubstringAfterOffset(&scan_settings, 0, "application/pdf",
+                                         "image/jpeg");
+  HttpRequest request;
+  request.method = "POST";
+  request.uri = "/eSCL/ScanJobs";
+  std::vector<uint8_t> xml(scan_settings.begin(), scan_settings.end());
+  HttpResponse response = manager.HandleEsclRequest(request, SmartBuffer(xml));
+  EXPECT_EQ(response.status, "409 Conflict");
+}
+
+TEST(HandleEsclRequest, NextDocumentFailsWhenScanCanNotBeGenerated) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), base::FilePath());
+
+  std::string scan_settings = kNewScan;
+  base::ReplaceFirstSubstringAfterOffset(&scan_settings, 0,
+                                         "escl:ThreeHundredthsOfInches",
+                                         "escl:Furlongs");
+  std::string uri = CreateScanJob(&manager, scan_settings);
+  HttpResponse response = GetNextDocument(&manager, uri);
+  EXPECT_EQ(response.status, "500 Internal Server Error");
+  EXPECT_TRUE(response.shared_body.empty());
+  EXPECT_EQ(GetNextDocument(&manager, uri).status, "404 Not Found");
+}
+
+// Tests that the cached ScannerStatus is regenerated when a job is created or
+// deleted.
+TEST(HandleEsclRequest, ScannerStatusReflectsJobChanges) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), base::FilePath());
+
+  HttpRequest status_request;
+  status_request.method = "GET";
+  status_request.uri = "/eSCL/ScannerStatus";
+  auto get_status = [&manager, &status_request]() {
+    HttpResponse response =
+        manager.HandleEsclRequest(status_request, SmartBuffer());
+    EXPECT_EQ(response.status, "200 OK");
+    return std::string(response.body.contents().begin(),
+                       response.body.contents().end());
+  };
+
+  const std::string idle_status = get_status();
+  EXPECT_EQ(idle_status.find("JobInfo"), std::string::npos);
+  EXPECT_EQ(get_status(), idle_status);
+
+  std::string uri = CreateScanJob(&manager, kNewScan);
+  // Strip "/eSCL/ScanJobs/" and "/NextDocument" to get the job UUID.
+  std::string uuid = uri.substr(15, uri.size() - 15 - 13);
+  std::string status = get_status();
+  EXPECT_NE(status.find("urn:uuid:" + uuid), std::string::npos);
+  EXPECT_NE(status.find("Pending"), std::string::npos);
+
+  GetNextDocument(&manager, uri);
+  EXPECT_NE(get_status().find("Completed"), std::string::npos);
+
+  HttpRequest delete_request;
+  delete_request.method = "DELETE";
+  delete_request.uri = "/eSCL/ScanJobs/" + uuid;
+  EXPECT_EQ(manager.HandleEsclRequest(delete_request, SmartBuffer()).status,
+            "200 OK");
+  EXPECT_EQ(get_status(), idle_status);
+}
+
+// Tests that only the most recent jobs are kept once the job limit is reached.
+TEST(HandleEsclRequest, OldestScanJobsAreRemoved) {
+  base::Optional<ScannerCapabilities> caps =
+      CreateScannerCapabilitiesFromConfig(CreateCapabilitiesJson());
+  ASSERT_TRUE(caps);
+  EsclManager manager(caps.value(), base::FilePath());
+  JobRetention retention;
+  retention.max_jobs = 2;
+  manager.set_job_retention(retention);
+
+  std::vector<std::string> uris;
+  for (int i = 0; i < 4; i++) {
+    uris.push_back(CreateScanJob(&manager, kNewScan));
+  }
+  EXPECT_EQ(GetNextDocument(&manager, uris[0]).status, "404 Not Found");
+  EXPECT_EQ(GetNextDocument(&manager, uris[1]).status, "404 Not Found");
+  EXPECT_EQ(GetNextDocument(&manager, uris[2]).status, "200 OK");
+  EXPECT_EQ(GetNextDocument(&manager, uris[3]).status, "200 OK");
+}
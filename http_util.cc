@@ -5,116 +5,131 @@
 #include "http_util.h"
 
 #include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <base/strings/string_number_conversions.h>
-#include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 
 namespace {
 
-const std::string kHttpRequestEnd = "\r\n\r\n";  // NOLINT(runtime/string)
-const std::string kHttpLineEnd = "\r\n";         // NOLINT(runtime/string)
+constexpr base::StringPiece kHttpLineEnd = "\r\n";
 
 // Determines if |message| starts with the string |target|.
 bool StartsWith(const SmartBuffer& message, const std::string& target) {
-  return message.FindFirstOccurrence(target) == 0;
+  return message.size() >= target.size() &&
+         memcmp(message.data(), target.data(), target.size()) == 0;
 }
 
-base::Optional<HttpHeaders> ParseHttpHeaders(const std::string& headers) {
-  std::vector<std::string> lines = base::SplitStringUsingSubstr(
-      headers, kHttpLineEnd, base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
-
-  const std::string header_split = ":";
-  HttpHeaders parsed_headers;
-  for (const std::string& line : lines) {
-    size_t split = line.find(header_split);
-    if (split == std::string::npos) {
-      LOG(ERROR) << "Malformed header: '" << line << "'";
-      return base::nullopt;
-    }
-
-    parsed_headers.emplace(
-        line.substr(0, split),
-        base::TrimString(line.substr(split + header_split.size()), " ",
-                         base::TRIM_LEADING));
-  }
-  return parsed_headers;
-}
-
-bool ValidateHttpVersion(const std::string& version) {
-  std::vector<std::string> tokens = base::SplitString(
-      version, "/", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-  if (tokens.size() != 2 || tokens[0] != "HTTP") {
+bool ValidateHttpVersion(base::StringPiece version) {
+  constexpr base::StringPiece kHttpPrefix = "HTTP/";
+  if (!base::StartsWith(version, kHttpPrefix, base::CompareCase::SENSITIVE) ||
+      version.find('/', kHttpPrefix.size()) != base::StringPiece::npos) {
     LOG(ERROR) << "Malformed HTTP version: '" << version << "'";
     return false;
   }
 
   // 1.0 support is prohibited by IPP spec for HTTP transport.
-  if (tokens[1] == "1.0") {
+  if (version.substr(kHttpPrefix.size()) == "1.0") {
     LOG(ERROR) << "HTTP version 1.0 is not supported";
     return false;
   }
   return true;
 }
 
+// Appends |s| at |*out| and advances |*out| past it.
+void Write(base::StringPiece s, uint8_t** out) {
+  memcpy(*out, s.data(), s.size());
+  *out += s.size();
+}
+
 }  // namespace
 
+bool CaseInsensitiveLess::operator()(base::StringPiece a,
+                                     base::StringPiece b) const {
+  return base::CompareCaseInsensitiveASCII(a, b) < 0;
+}
+
 // static
 base::Optional<HttpRequest> HttpRequest::Deserialize(SmartBuffer* message) {
-  ssize_t request_end = message->FindFirstOccurrence(kHttpRequestEnd);
-  if (request_end == -1) {
-    LOG(ERROR) << "Message does not contain end of header marker";
-    return base::nullopt;
+  SmartBufferView view(*message);
+  base::Optional<HttpRequest> request = Deserialize(&view);
+  if (request) {
+    // Erase the data we just parsed from |message|.
+    message->Erase(0, message->size() - view.size());
   }
+  return request;
+}
 
-  ssize_t request_line_end = message->FindFirstOccurrence(kHttpLineEnd);
-  if (request_line_end == -1) {
+// static
+base::Optional<HttpRequest> HttpRequest::Deserialize(SmartBufferView* message) {
+  // The request is parsed in a single pass over |message|, one line at a time,
+  // and only the parts which are kept are copied out.
+  const base::StringPiece data(reinterpret_cast<const char*>(message->data()),
+                               message->size());
+  size_t line_end = data.find(kHttpLineEnd);
+  if (line_end == base::StringPiece::npos) {
     LOG(ERROR) << "Message does not contain end of line marker";
     return base::nullopt;
   }
 
-  if (request_line_end == 0) {
+  if (line_end == 0) {
     LOG(ERROR) << "Request line is empty";
     return base::nullopt;
   }
 
   // First parse the first line of the request, which should look something like
   // "GET /ipp/print HTTP/1.1" or "POST /eSCL/ScannerCapabilities HTTP/1.1".
-  std::string request_line(message->data(), message->data() + request_line_end);
-  std::vector<std::string> request_line_tokens = base::SplitString(
-      request_line, " ", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-
-  if (request_line_tokens.size() != 3) {
+  const base::StringPiece request_line = data.substr(0, line_end);
+  const size_t method_end = request_line.find(' ');
+  const size_t uri_end = method_end == base::StringPiece::npos
+                             ? base::StringPiece::npos
+                             : request_line.find(' ', method_end + 1);
+  if (uri_end == base::StringPiece::npos ||
+      request_line.find(' ', uri_end + 1) != base::StringPiece::npos) {
     LOG(ERROR) << "Malformed request line: '" << request_line << "'";
     return base::nullopt;
   }
 
-  std::string http_version = request_line_tokens[2];
-  if (!ValidateHttpVersion(http_version))
+  if (!ValidateHttpVersion(request_line.substr(uri_end + 1)))
     return base::nullopt;
 
   HttpRequest request;
-  request.method = request_line_tokens[0];
-  request.uri = request_line_tokens[1];
-
-  // Now, parse the rest of the HTTP request after the request line as headers.
-
-  // In case that there are no headers, make sure when we skip the kHttpLineEnd
-  // we aren't actually skipping past the kHttpRequestEnd marker.
-  size_t headers_start =
-      std::min<size_t>(request_line_end + kHttpLineEnd.size(), request_end);
-  std::string request_headers(message->data() + headers_start,
-                              message->data() + request_end);
-  base::Optional<HttpHeaders> headers = ParseHttpHeaders(request_headers);
-  if (!headers) {
-    LOG(ERROR) << "Failed to parse request headers";
-    return base::nullopt;
+  request.method = std::string(request_line.substr(0, method_end));
+  request.uri =
+      std::string(request_line.substr(method_end + 1, uri_end - method_end - 1));
+
+  // Now, parse each of the header lines which follow, up to the empty line
+  // which ends the header.
+  size_t line_start = line_end + kHttpLineEnd.size();
+  while (true) {
+    line_end = data.find(kHttpLineEnd, line_start);
+    if (line_end == base::StringPiece::npos) {
+      LOG(ERROR) << "Message does not contain end of header marker";
+      return base::nullopt;
+    }
+    if (line_end == line_start) {
+      break;
+    }
+
+    const base::StringPiece line =
+        data.substr(line_start, line_end - line_start);
+    const size_t split = line.find(':');
+    if (split == base::StringPiece::npos) {
+      LOG(ERROR) << "Malformed header: '" << line << "'";
+      return base::nullopt;
+    }
+    request.headers.emplace(
+        std::string(line.substr(0, split)),
+        std::string(base::TrimString(line.substr(split + 1), " ",
+                                     base::TRIM_LEADING)));
+    line_start = line_end + kHttpLineEnd.size();
   }
-  request.headers = headers.value();
 
-  // Erase the data we just parsed from |message|.
-  message->Erase(0, request_end + kHttpRequestEnd.size());
+  // Skip the data we just parsed from |message|.
+  message->RemovePrefix(line_end + kHttpLineEnd.size());
   return request;
 }
 
@@ -138,24 +153,181 @@ bool HttpRequest::IsChunkedMessage() const {
   return encoding != headers.end() && encoding->second == "chunked";
 }
 
+size_t HttpResponse::BodySize() const {
+  if (shared_body.empty()) {
+    return body.size();
+  }
+  size_t size = 0;
+  for (const auto& piece : shared_body) {
+    size += piece->size();
+  }
+  return size;
+}
+
+void HttpResponse::SerializeHeader(SmartBuffer* buf) const {
+  // These standard headers are added to every response, replacing any headers
+  // of the same name in |headers|. They are in the same order as |headers|.
+  const std::string content_length = std::to_string(BodySize());
+  const std::pair<base::StringPiece, base::StringPiece> standard_headers[] = {
+      {"Connection", "close"},
+      {"Content-Length", content_length},
+      {"Server", "localhost:0"},
+  };
+  const CaseInsensitiveLess less;
+
+  // The headers are written in order by merging |standard_headers| into
+  // |headers|. This is done twice, first to find the size of the header and
+  // then to write it into space reserved for all of it at once.
+  auto for_each_header = [&](auto visit) {
+    auto it = headers.begin();
+    for (const auto& standard : standard_headers) {
+      for (; it != headers.end() && less(it->first, standard.first); ++it) {
+        visit(it->first, it->second);
+      }
+      if (it != headers.end() && !less(standard.first, it->first)) {
+        ++it;
+      }
+      visit(standard.first, standard.second);
+    }
+    for (; it != headers.end(); ++it) {
+      visit(it->first, it->second);
+    }
+  };
+
+  constexpr base::StringPiece kStatusPrefix = "HTTP/1.1 ";
+  constexpr base::StringPiece kHeaderSeparator = ": ";
+  size_t size = kStatusPrefix.size() + status.size() + 2 * kHttpLineEnd.size();
+  for_each_header([&size, kHeaderSeparator](base::StringPiece name,
+                                            base::StringPiece value) {
+    size += name.size() + kHeaderSeparator.size() + value.size() +
+            kHttpLineEnd.size();
+  });
+
+  uint8_t* out = buf->Extend(size);
+  Write(kStatusPrefix, &out);
+  Write(status, &out);
+  Write(kHttpLineEnd, &out);
+  for_each_header(
+      [&out, kHeaderSeparator](base::StringPiece name, base::StringPiece value) {
+        Write(name, &out);
+        Write(kHeaderSeparator, &out);
+        Write(value, &out);
+        Write(kHttpLineEnd, &out);
+      });
+  Write(kHttpLineEnd, &out);
+}
+
 void HttpResponse::Serialize(SmartBuffer* buf) const {
-  buf->Add("HTTP/1.1 ");
-  buf->Add(status);
-  buf->Add("\r\n");
-
-  HttpHeaders headers_copy = headers;
-  // Add standard headers
-  headers_copy["Server"] = "localhost:0";
-  headers_copy["Connection"] = "close";
-  headers_copy["Content-Length"] = std::to_string(body.size());
-  for (auto header : headers_copy) {
-    buf->Add(header.first);
-    buf->Add(": ");
-    buf->Add(header.second);
-    buf->Add("\r\n");
+  SerializeHeader(buf);
+  if (shared_body.empty()) {
+    buf->Add(body);
+  }
+  for (const auto& piece : shared_body) {
+    buf->Add(piece->front(), piece->size());
+  }
+}
+
+bool ChunkedDecoder::Decode(SmartBufferView* data, SmartBuffer* output) {
+  // Chunk sizes are limited so that they can not overflow |chunk_size_|.
+  constexpr size_t kMaxChunkSizeDigits = 2 * sizeof(uint32_t);
+
+  while (!data->empty() && state_ != State::kComplete) {
+    uint8_t c = (*data)[0];
+    switch (state_) {
+      case State::kChunkSize: {
+        int digit = -1;
+        if (c >= '0' && c <= '9') {
+          digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+          digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+          digit = c - 'A' + 10;
+        }
+        if (digit >= 0 && chunk_size_digits_ < kMaxChunkSizeDigits) {
+          chunk_size_ = chunk_size_ * 16 + digit;
+          ++chunk_size_digits_;
+        } else if (chunk_size_digits_ > 0 && c == ';') {
+          state_ = State::kChunkExtension;
+        } else if (chunk_size_digits_ > 0 && c == '\r') {
+          state_ = State::kChunkSizeLf;
+        } else {
+          LOG(ERROR) << "Invalid character in chunk size: "
+                     << static_cast<int>(c);
+          state_ = State::kError;
+          return false;
+        }
+        data->RemovePrefix(1);
+        break;
+      }
+      case State::kChunkExtension:
+        if (c == '\r') {
+          state_ = State::kChunkSizeLf;
+        }
+        data->RemovePrefix(1);
+        break;
+      case State::kChunkSizeLf:
+        if (c != '\n') {
+          LOG(ERROR) << "Chunk size is not followed by CRLF";
+          state_ = State::kError;
+          return false;
+        }
+        data->RemovePrefix(1);
+        chunk_size_digits_ = 0;
+        state_ = chunk_size_ == 0 ? State::kTrailerStart : State::kChunkData;
+        break;
+      case State::kChunkData: {
+        size_t len = std::min(chunk_size_, data->size());
+        output->Add(data->data(), len);
+        data->RemovePrefix(len);
+        chunk_size_ -= len;
+        if (chunk_size_ == 0) {
+          state_ = State::kChunkDataCr;
+        }
+        break;
+      }
+      case State::kChunkDataCr:
+      case State::kChunkDataLf:
+        if (c != (state_ == State::kChunkDataCr ? '\r' : '\n')) {
+          LOG(ERROR) << "Chunk data is not followed by CRLF";
+          state_ = State::kError;
+          return false;
+        }
+        data->RemovePrefix(1);
+        state_ = state_ == State::kChunkDataCr ? State::kChunkDataLf
+                                                : State::kChunkSize;
+        break;
+      case State::kTrailerStart:
+        state_ = c == '\r' ? State::kFinalLf : State::kTrailerLine;
+        data->RemovePrefix(1);
+        break;
+      case State::kTrailerLine:
+        if (c == '\n') {
+          state_ = State::kTrailerStart;
+        }
+        data->RemovePrefix(1);
+        break;
+      case State::kFinalLf:
+        if (c != '\n') {
+          LOG(ERROR) << "Chunked message does not end with CRLF";
+          state_ = State::kError;
+          return false;
+        }
+        data->RemovePrefix(1);
+        state_ = State::kComplete;
+        break;
+      case State::kComplete:
+        break;
+      case State::kError:
+        return false;
+    }
   }
-  buf->Add("\r\n");
-  buf->Add(body);
+  return state_ != State::kError;
+}
+
+void ChunkedDecoder::Reset() {
+  state_ = State::kChunkSize;
+  chunk_size_ = 0;
+  chunk_size_digits_ = 0;
 }
 
 bool IsHttpChunkedMessage(const SmartBuffer& message) {
@@ -168,11 +340,7 @@ size_t ExtractChunkSize(const SmartBuffer& message) {
   if (end == -1) {
     return 0;
   }
-  std::string hex_string;
-  const std::vector<uint8_t>& contents = message.contents();
-  for (size_t i = 0; i < end; ++i) {
-    hex_string += static_cast<char>(contents[i]);
-  }
+  std::string hex_string(message.data(), message.data() + end);
 
   uint32_t chunk_size = 0;
   if (!base::HexStringToUInt(hex_string, &chunk_size)) {
@@ -192,7 +360,7 @@ SmartBuffer ParseHttpChunkedMessage(SmartBuffer* message) {
     message->Erase(0, 2);
   }
   size_t chunk_size = ExtractChunkSize(*message);
-  LOG(INFO) << "Chunk size: " << chunk_size;
+  VLOG(2) << "Chunk size: " << chunk_size;
   ssize_t start = message->FindFirstOccurrence("\r\n");
   SmartBuffer ret(0);
   if (start == -1) {
@@ -247,10 +415,12 @@ SmartBuffer ExtractIppMessage(SmartBuffer* message) {
 
 SmartBuffer MergeDocument(SmartBuffer* message) {
   CHECK_NE(message, nullptr) << "Received null message";
-  SmartBuffer document;
-  while (message->size() > 0) {
-    SmartBuffer chunk = ParseHttpChunkedMessage(message);
-    document.Add(chunk);
+  SmartBuffer document(message->size());
+  ChunkedDecoder decoder;
+  SmartBufferView view(*message);
+  if (!decoder.Decode(&view, &document)) {
+    LOG(ERROR) << "Failed to decode chunked message";
   }
+  message->Erase(0, message->size());
   return document;
 }
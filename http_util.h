@@ -6,13 +6,26 @@
 #define __HTTP_UTIL_H__
 
 #include <string>
+#include <vector>
 
 #include <base/containers/flat_map.h>
+#include <base/memory/ref_counted_memory.h>
+#include <base/memory/scoped_refptr.h>
 #include <base/optional.h>
+#include <base/strings/string_piece.h>
 
 #include "smart_buffer.h"
 
-using HttpHeaders = base::flat_map<std::string, std::string>;
+// Orders strings ignoring ASCII case, since HTTP header names are not case
+// sensitive. This is transparent so that headers can be looked up by
+// base::StringPiece without building a std::string.
+struct CaseInsensitiveLess {
+  using is_transparent = void;
+  bool operator()(base::StringPiece a, base::StringPiece b) const;
+};
+
+using HttpHeaders =
+    base::flat_map<std::string, std::string, CaseInsensitiveLess>;
 class HttpRequest {
  public:
   // Attempts to parse an HttpRequest from the beginning of |message|.
@@ -20,6 +33,10 @@ class HttpRequest {
   // the body of the http request.
   static base::Optional<HttpRequest> Deserialize(SmartBuffer* message);
 
+  // Same as above, but advances the view |message| past the header instead of
+  // modifying the underlying buffer.
+  static base::Optional<HttpRequest> Deserialize(SmartBufferView* message);
+
   // Returns true if this header contains a request header indicating a chunked
   // transfer encoding.
   bool IsChunkedMessage() const;
@@ -39,12 +56,70 @@ class HttpResponse {
   std::string status;
   HttpHeaders headers;
   SmartBuffer body;
+  // If not empty, these pieces are sent in order as the body of the response
+  // instead of |body|. Large immutable payloads such as scan data are shared
+  // this way so that they can be sent without being copied.
+  std::vector<scoped_refptr<base::RefCountedMemory>> shared_body;
+
+  // Returns the size of the body which will be sent with this response.
+  size_t BodySize() const;
+
+  // Serializes the status line and headers of this HttpResponse and appends
+  // them to the contents of |buf|. The body should be sent immediately after.
+  void SerializeHeader(SmartBuffer* buf) const;
 
   // Serializes this HttpResponse to the textual format specified by the HTTP
   // standard and appends it to the contents of |buf|.
   void Serialize(SmartBuffer* buf) const;
 };
 
+// Incrementally decodes an HTTP message body which uses the "chunked" transfer
+// coding. The encoded body can be given to Decode in pieces of any size as it
+// is received, for example one bulk transfer at a time, and the decoded body
+// bytes are appended to an output buffer as soon as they are available. Chunk
+// sizes and delimiters which are split between pieces are handled, so the
+// encoded body never needs to be buffered.
+class ChunkedDecoder {
+ public:
+  ChunkedDecoder() = default;
+
+  // Decodes as much of |data| as possible and appends the decoded body bytes
+  // to |output|. |data| is advanced past the bytes which were consumed, which
+  // is all of |data| unless the end of the body was reached. Returns false if
+  // |data| is not a valid chunked body, after which the decoder must be Reset
+  // before it can be used again.
+  bool Decode(SmartBufferView* data, SmartBuffer* output);
+
+  // Returns whether the final zero-length chunk and the end of the trailer
+  // have been decoded.
+  bool complete() const { return state_ == State::kComplete; }
+
+  // Prepares the decoder to decode a new message body.
+  void Reset();
+
+ private:
+  enum class State {
+    kChunkSize,       // Reading the hex-encoded chunk size.
+    kChunkExtension,  // Skipping a chunk extension following the size.
+    kChunkSizeLf,     // Expecting the LF which ends the chunk size line.
+    kChunkData,       // Copying the chunk data.
+    kChunkDataCr,     // Expecting the CR which follows the chunk data.
+    kChunkDataLf,     // Expecting the LF which follows the chunk data.
+    kTrailerStart,    // At the start of a trailer line, or the final CRLF.
+    kTrailerLine,     // Skipping a trailer header line.
+    kFinalLf,         // Expecting the LF which ends the message.
+    kComplete,        // The entire body has been decoded.
+    kError,           // The body was malformed.
+  };
+
+  State state_ = State::kChunkSize;
+  // The size of the current chunk, or while in kChunkData the number of bytes
+  // of the current chunk which have not been decoded yet.
+  size_t chunk_size_ = 0;
+  // The number of hex digits read for the current chunk size.
+  size_t chunk_size_digits_ = 0;
+};
+
 bool IsHttpChunkedMessage(const SmartBuffer& message);
 
 size_t ExtractChunkSize(const SmartBuffer& message);
@@ -4,6 +4,7 @@
 
 #include "http_util.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -22,6 +23,21 @@ const std::vector<uint8_t> CreateByteVector(const std::string& str) {
   return v;
 }
 
+// Decodes |message| by passing it to a ChunkedDecoder in pieces of size
+// |piece_size|.
+SmartBuffer DecodeInPieces(const std::string& message, size_t piece_size,
+                           ChunkedDecoder* decoder) {
+  SmartBuffer buf;
+  buf.Add(message);
+  SmartBuffer output;
+  for (size_t i = 0; i < buf.size(); i += piece_size) {
+    SmartBufferView piece =
+        SmartBufferView(buf).Subview(i, std::min(piece_size, buf.size() - i));
+    EXPECT_TRUE(decoder->Decode(&piece, &output));
+  }
+  return output;
+}
+
 }  // namespace
 
 TEST(HttpRequest, DeserializeNoHeaders) {
@@ -72,6 +88,50 @@ TEST(HttpRequest, DeserializeChunked) {
   EXPECT_EQ(buf.contents(), CreateByteVector("request body"));
 }
 
+// Test that deserializing from a view advances the view past the header
+// without modifying the underlying buffer.
+TEST(HttpRequest, DeserializeView) {
+  const std::string http_request =
+      "POST /ipp/print HTTP/1.1\r\n"
+      "Content-Length: 12\r\n\r\n"
+      "request body";
+
+  SmartBuffer buf;
+  buf.Add(http_request);
+  SmartBufferView view(buf);
+
+  base::Optional<HttpRequest> opt_request = HttpRequest::Deserialize(&view);
+  EXPECT_TRUE(opt_request.has_value());
+  EXPECT_EQ(opt_request->ContentLength(), 12);
+  EXPECT_EQ(std::string(view.data(), view.data() + view.size()),
+            "request body");
+  EXPECT_EQ(buf.size(), http_request.size());
+}
+
+// Test that header names are matched without regard to case.
+TEST(HttpRequest, HeaderLookupIgnoresCase) {
+  const std::string http_request =
+      "POST /ipp/print HTTP/1.1\r\n"
+      "content-length: 12\r\n"
+      "TRANSFER-ENCODING: chunked\r\n\r\n";
+
+  SmartBuffer buf;
+  buf.Add(http_request);
+  base::Optional<HttpRequest> request = HttpRequest::Deserialize(&buf);
+  ASSERT_TRUE(request.has_value());
+  EXPECT_EQ(request->ContentLength(), 12);
+  EXPECT_TRUE(request->IsChunkedMessage());
+  EXPECT_EQ(request->headers.count("Content-Length"), 1);
+}
+
+TEST(HttpRequest, MalformedRequestLineExtraToken) {
+  const std::string http_request = "GET /ipp/print HTTP/1.1 extra\r\n\r\n";
+
+  SmartBuffer buf;
+  buf.Add(http_request);
+  EXPECT_FALSE(HttpRequest::Deserialize(&buf).has_value());
+}
+
 TEST(HttpRequest, MalformedHeader) {
   const std::string http_request =
       "POST /ipp/print HTTP/1.1\r\n"
@@ -124,6 +184,58 @@ TEST(HttpResponse, Serialize) {
   EXPECT_EQ(actual_response, expected_response);
 }
 
+// Test that the standard headers replace any given headers of the same name,
+// whatever their case, and that the headers stay in order.
+TEST(HttpResponse, SerializeReplacesStandardHeaders) {
+  HttpResponse response;
+  response.status = "404 Not Found";
+  response.headers["content-length"] = "100";
+  response.headers["Accept"] = "*/*";
+  response.headers["Zebra"] = "Stripes";
+
+  SmartBuffer serialized;
+  response.Serialize(&serialized);
+
+  const std::string expected_response =
+      "HTTP/1.1 404 Not Found\r\n"
+      "Accept: */*\r\n"
+      "Connection: close\r\n"
+      "Content-Length: 0\r\n"
+      "Server: localhost:0\r\n"
+      "Zebra: Stripes\r\n\r\n"s;
+  EXPECT_EQ(
+      std::string(serialized.contents().begin(), serialized.contents().end()),
+      expected_response);
+}
+
+TEST(HttpResponse, SerializeSharedBody) {
+  HttpResponse response;
+  response.status = "200 OK";
+  std::string first = "[shared";
+  std::string second = " body]";
+  response.shared_body.push_back(base::RefCountedString::TakeString(&first));
+  response.shared_body.push_back(base::RefCountedString::TakeString(&second));
+  // The shared body takes precedence over |body|.
+  response.body.Add("[body]");
+  EXPECT_EQ(response.BodySize(), 13);
+
+  SmartBuffer header;
+  response.SerializeHeader(&header);
+  const std::string expected_header =
+      "HTTP/1.1 200 OK\r\n"
+      "Connection: close\r\n"
+      "Content-Length: 13\r\n"
+      "Server: localhost:0\r\n\r\n"s;
+  EXPECT_EQ(std::string(header.contents().begin(), header.contents().end()),
+            expected_header);
+
+  SmartBuffer serialized;
+  response.Serialize(&serialized);
+  EXPECT_EQ(
+      std::string(serialized.contents().begin(), serialized.contents().end()),
+      expected_header + "[shared body]");
+}
+
 TEST(IsHttpChunkedHeader, ContainsChunkedEncoding) {
   const std::string http_header =
       "POST /ipp/print HTTP/1.1\x0d\x0a"
@@ -244,6 +356,93 @@ TEST(ProcessMessageChunks, MultipleChunks) {
   EXPECT_EQ(message_buffer2.size(), 0);
 }
 
+TEST(ChunkedDecoder, SinglePiece) {
+  const std::string message =
+      "4\r\n"
+      "test\r\n"
+      "5\r\n"
+      "chunk\r\n"
+      "0\r\n\r\n";
+  ChunkedDecoder decoder;
+  SmartBuffer output = DecodeInPieces(message, message.size(), &decoder);
+  EXPECT_TRUE(decoder.complete());
+  EXPECT_EQ(output.contents(), CreateByteVector("testchunk"));
+}
+
+// Test that the message is decoded correctly no matter where it is split,
+// including within chunk sizes and the final chunk.
+TEST(ChunkedDecoder, SplitPieces) {
+  const std::string message =
+      "1a\r\n"
+      "abcdefghijklmnopqrstuvwxyz\r\n"
+      "3;name=value\r\n"
+      "0\r\n\r\n"
+      "0\r\n\r\n";
+  for (size_t piece_size = 1; piece_size < message.size(); ++piece_size) {
+    ChunkedDecoder decoder;
+    SmartBuffer output = DecodeInPieces(message, piece_size, &decoder);
+    EXPECT_TRUE(decoder.complete());
+    EXPECT_EQ(output.contents(),
+              CreateByteVector("abcdefghijklmnopqrstuvwxyz0\r\n"));
+  }
+}
+
+TEST(ChunkedDecoder, Incomplete) {
+  const std::string message =
+      "4\r\n"
+      "test\r\n"
+      "0\r\n";
+  ChunkedDecoder decoder;
+  SmartBuffer output = DecodeInPieces(message, message.size(), &decoder);
+  EXPECT_FALSE(decoder.complete());
+  EXPECT_EQ(output.contents(), CreateByteVector("test"));
+}
+
+TEST(ChunkedDecoder, Trailer) {
+  const std::string message =
+      "4\r\n"
+      "test\r\n"
+      "0\r\n"
+      "Expires: never\r\n"
+      "\r\n";
+  ChunkedDecoder decoder;
+  SmartBuffer output = DecodeInPieces(message, message.size(), &decoder);
+  EXPECT_TRUE(decoder.complete());
+  EXPECT_EQ(output.contents(), CreateByteVector("test"));
+}
+
+// Test that decoding stops at the end of the message, leaving any following
+// data in the view.
+TEST(ChunkedDecoder, StopsAtEnd) {
+  SmartBuffer buf;
+  buf.Add("4\r\ntest\r\n0\r\n\r\nextra");
+  SmartBufferView view(buf);
+  SmartBuffer output;
+  ChunkedDecoder decoder;
+  EXPECT_TRUE(decoder.Decode(&view, &output));
+  EXPECT_TRUE(decoder.complete());
+  EXPECT_EQ(view.size(), 5);
+}
+
+TEST(ChunkedDecoder, InvalidChunkSize) {
+  SmartBuffer buf;
+  buf.Add("xyz\r\ntest\r\n");
+  SmartBufferView view(buf);
+  SmartBuffer output;
+  ChunkedDecoder decoder;
+  EXPECT_FALSE(decoder.Decode(&view, &output));
+  EXPECT_FALSE(decoder.complete());
+}
+
+TEST(ChunkedDecoder, MissingChunkDelimiter) {
+  SmartBuffer buf;
+  buf.Add("4\r\ntestX\r\n");
+  SmartBufferView view(buf);
+  SmartBuffer output;
+  ChunkedDecoder decoder;
+  EXPECT_FALSE(decoder.Decode(&view, &output));
+}
+
 TEST(MergeDocument, ValidMessage) {
   const std::string message =
       "6\r\n"
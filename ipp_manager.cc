@@ -4,35 +4,312 @@
 
 #include "ipp_manager.h"
 
-#include <base/files/file_util.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <utility>
+
 #include <base/logging.h>
+#include <base/strings/string_piece.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+
+#include "metrics.h"
 
 const uint16_t IppManager::kSuccessStatus = 0;
+const uint16_t IppManager::kBadRequestStatus = 0x0400;
+const uint16_t IppManager::kNotPossibleStatus = 0x0404;
+const uint16_t IppManager::kNotFoundStatus = 0x0406;
+const size_t IppManager::kMaxJobs = 1000;
+
+namespace {
+
+// The operation attribute in which a client lists the attributes it wants
+// returned.
+constexpr char kRequestedAttributes[] = "requested-attributes";
+
+// The operation attribute which gives the format of a document.
+constexpr char kDocumentFormat[] = "document-format";
+
+// The operation attributes which identify the printer and name a new job.
+constexpr char kPrinterUri[] = "printer-uri";
+constexpr char kJobName[] = "job-name";
+
+// The operation attribute of a Send-Document request which tells whether it
+// carries the last document of the job.
+constexpr char kLastDocument[] = "last-document";
+
+// The operation attributes of a Get-Jobs request which select the jobs
+// returned.
+constexpr char kWhichJobs[] = "which-jobs";
+constexpr char kLimit[] = "limit";
+
+// The job attributes which are generated for each job. The job-id attribute
+// is also the operation attribute which identifies the job of a request.
+constexpr char kJobId[] = "job-id";
+constexpr char kJobUri[] = "job-uri";
+constexpr char kJobState[] = "job-state";
+constexpr char kJobStateReasons[] = "job-state-reasons";
+
+// Used to build the job-uri of a job when the request which created it did not
+// give the printer-uri.
+constexpr char kDefaultPrinterUri[] = "ipp://localhost/ipp/print";
+
+// The job-name of a job when the request which created it did not name it.
+constexpr char kDefaultJobName[] = "Untitled";
+
+// Returns whether the job attribute |name| is generated for each job, rather
+// than taken from the configuration.
+bool IsJobSpecificAttribute(base::StringPiece name) {
+  return name == kJobId || name == kJobUri || name == kJobName ||
+         name == kJobState || name == kJobStateReasons;
+}
+
+// Returns the value of job-state-reasons reported for a job in |state|.
+const char* GetJobStateReason(IppJobState state) {
+  switch (state) {
+    case IppJobState::kPending:
+      return "none";
+    case IppJobState::kProcessing:
+      return "job-printing";
+    case IppJobState::kCompleted:
+      return "job-completed-successfully";
+  }
+  NOTREACHED();
+  return "none";
+}
+
+// Returns whether |name| is one of the values of requested-attributes which
+// names a whole group of attributes rather than a single attribute. Since
+// every printer attribute belongs to one of these groups, all printer
+// attributes are returned when one is requested.
+bool IsAttributeGroupName(base::StringPiece name) {
+  return name == "all" || name == "printer-description" ||
+         name == "job-template";
+}
+
+// Returns the first value of the attribute |name| in |attributes|, or
+// |default_value| if the attribute was not sent.
+base::StringPiece GetFirstValue(const IppRequestAttributes& attributes,
+                                base::StringPiece name,
+                                base::StringPiece default_value) {
+  auto iter = attributes.find(name);
+  if (iter == attributes.end() || iter->second.empty()) {
+    return default_value;
+  }
+  return iter->second.front();
+}
+
+// Returns the job-id operation attribute of |request|, or nullopt if it is
+// missing or malformed.
+base::Optional<int> GetJobId(const IppRequest& request) {
+  return GetIntegerValue(request.operation_attributes, kJobId);
+}
+
+// Returns a new job id. Ids are shared between every IppManager so that
+// printers which record into the same directory never overwrite each other's
+// documents.
+int NextJobId() {
+  static std::atomic<int> next_job_id(1);
+  return next_job_id++;
+}
+
+// Returns whether the Send-Document |request| carries the last document of its
+// job. A request without last-document is treated as the last document, so
+// that simple clients do not leave their jobs processing.
+bool IsLastDocument(const IppRequest& request) {
+  base::StringPiece value =
+      GetFirstValue(request.operation_attributes, kLastDocument, "\x01");
+  return value.size() == 1 && value[0] != 0;
+}
+
+// Serializes each of |attributes| separately. Attributes without a name are
+// the members of a collection, so they are kept together with the preceding
+// named attribute.
+std::vector<std::pair<std::string, SmartBuffer>> SerializeEach(
+    const std::vector<IppAttribute>& attributes) {
+  std::vector<std::vector<IppAttribute>> entries;
+  for (const IppAttribute& attribute : attributes) {
+    if (!attribute.name().empty() || entries.empty()) {
+      entries.emplace_back();
+    }
+    entries.back().push_back(attribute);
+  }
+
+  std::vector<std::pair<std::string, SmartBuffer>> serialized;
+  serialized.reserve(entries.size());
+  for (const std::vector<IppAttribute>& entry : entries) {
+    SmartBuffer buf(GetAttributesSize(entry));
+    AddAttributes(entry, &buf);
+    serialized.emplace_back(entry.front().name(), std::move(buf));
+  }
+  return serialized;
+}
+
+// Returns the serialized attributes in |attributes| joined into one group,
+// without its group tag.
+SmartBuffer JoinAttributes(
+    const std::vector<std::pair<std::string, SmartBuffer>>& attributes) {
+  size_t size = 0;
+  for (const auto& attribute : attributes) {
+    size += attribute.second.size();
+  }
+  SmartBuffer buf(size);
+  for (const auto& attribute : attributes) {
+    buf.Add(attribute.second);
+  }
+  return buf;
+}
+
+// Serializes the attribute groups in |groups|, each preceded by its group tag
+// and followed by the end of attributes tag, into a buffer which can be
+// appended to the header of a response.
+SmartBuffer SerializeResponseBody(
+    const std::vector<std::pair<IppTag, const SmartBuffer*>>& groups) {
+  // We add 1 to the size for the end of attributes tag, and 1 for each group
+  // tag.
+  size_t size = 1;
+  for (const auto& group : groups) {
+    size += 1 + group.second->size();
+  }
+  SmartBuffer buf(size);
+  for (const auto& group : groups) {
+    buf.Add(static_cast<uint8_t>(group.first));
+    buf.Add(*group.second);
+  }
+  AddEndOfAttributes(&buf);
+  return buf;
+}
+
+}  // namespace
+
+std::string GetIppOperationName(int operation_id) {
+  switch (operation_id) {
+    case IPP_VALIDATE_JOB:
+      return "Validate-Job";
+    case IPP_CREATE_JOB:
+      return "Create-Job";
+    case IPP_SEND_DOCUMENT:
+      return "Send-Document";
+    case IPP_GET_JOB_ATTRIBUTES:
+      return "Get-Job-Attributes";
+    case IPP_GET_JOBS:
+      return "Get-Jobs";
+    case IPP_GET_PRINTER_ATTRIBUTES:
+      return "Get-Printer-Attributes";
+    default:
+      return base::NumberToString(operation_id);
+  }
+}
 
-IppManager::IppManager(std::vector<IppAttribute> operation_attributes,
-                       std::vector<IppAttribute> printer_attributes,
-                       std::vector<IppAttribute> job_attributes,
-                       std::vector<IppAttribute> unsupported_attributes,
-                       const base::FilePath& document_output_path)
-    : operation_attributes_(operation_attributes),
-      printer_attributes_(printer_attributes),
-      job_attributes_(job_attributes),
-      unsupported_attributes_(unsupported_attributes),
-      document_output_path_(document_output_path) {}
+SerializedIppAttributes SerializeIppAttributes(
+    const std::vector<IppAttribute>& operation_attributes,
+    const std::vector<IppAttribute>& printer_attributes,
+    const std::vector<IppAttribute>& job_attributes,
+    const std::vector<IppAttribute>& unsupported_attributes) {
+  SerializedIppAttributes serialized;
+  serialized.operation_attributes =
+      SmartBuffer(GetAttributesSize(operation_attributes));
+  AddAttributes(operation_attributes, &serialized.operation_attributes);
+  serialized.job_attributes = SerializeEach(job_attributes);
+  serialized.printer_attributes = SerializeEach(printer_attributes);
+  serialized.unsupported_attributes = SerializeEach(unsupported_attributes);
+  return serialized;
+}
+
+IppManager::IppManager() : IppManager(SerializedIppAttributes()) {}
+
+IppManager::IppManager(
+    const std::vector<IppAttribute>& operation_attributes,
+    const std::vector<IppAttribute>& printer_attributes,
+    const std::vector<IppAttribute>& job_attributes,
+    const std::vector<IppAttribute>& unsupported_attributes)
+    : IppManager(SerializeIppAttributes(operation_attributes,
+                                        printer_attributes, job_attributes,
+                                        unsupported_attributes)) {}
+
+IppManager::IppManager(SerializedIppAttributes attributes)
+    : attributes_lock_(std::make_unique<base::Lock>()),
+      attributes_(base::MakeRefCounted<AttributeSet>(std::move(attributes))),
+      jobs_lock_(std::make_unique<base::Lock>()) {}
+
+IppManager::AttributeSet::AttributeSet(SerializedIppAttributes attributes)
+    : serialized(std::move(attributes)) {
+  for (const auto& attribute : serialized.job_attributes) {
+    if (!IsJobSpecificAttribute(attribute.first)) {
+      static_job_attributes.Add(attribute.second);
+    }
+  }
+  const SmartBuffer printer_group =
+      JoinAttributes(serialized.printer_attributes);
+  operation_response_body = SerializeResponseBody(
+      {{IppTag::OPERATION, &serialized.operation_attributes}});
+  printer_response_body = SerializeResponseBody(
+      {{IppTag::OPERATION, &serialized.operation_attributes},
+       {IppTag::PRINTER, &printer_group}});
+
+  operation_group.Add(static_cast<uint8_t>(IppTag::OPERATION));
+  operation_group.Add(serialized.operation_attributes);
+  printer_attribute_index = IndexAttributes(serialized.printer_attributes);
+  unsupported_attribute_index =
+      IndexAttributes(serialized.unsupported_attributes);
+}
+
+IppManager::AttributeSet::~AttributeSet() = default;
+
+SerializedIppAttributes IppManager::serialized_attributes() const {
+  return GetAttributeSet()->serialized;
+}
+
+void IppManager::SetAttributes(SerializedIppAttributes attributes) {
+  // The new attributes are prepared before taking the lock, and the old ones
+  // are released after it, so that requests are not held up meanwhile.
+  scoped_refptr<const AttributeSet> attribute_set =
+      base::MakeRefCounted<AttributeSet>(std::move(attributes));
+  base::AutoLock lock(*attributes_lock_);
+  std::swap(attributes_, attribute_set);
+}
+
+scoped_refptr<const IppManager::AttributeSet> IppManager::GetAttributeSet()
+    const {
+  base::AutoLock lock(*attributes_lock_);
+  return attributes_;
+}
 
 SmartBuffer IppManager::HandleIppRequest(const IppHeader& ipp_header,
-                                         const SmartBuffer& body) const {
+                                         const SmartBuffer& body) {
+  IppRequest request;
+  request.header = ipp_header;
+  return HandleIppRequest(request, body);
+}
+
+SmartBuffer IppManager::HandleIppRequest(const IppRequest& request,
+                                         const SmartBuffer& message) {
+  const IppHeader& ipp_header = request.header;
+  ScopedLatencyTimer timer(
+      kIppOperationSeconds,
+      FormatLabels(
+          {{"operation", GetIppOperationName(ipp_header.operation_id)}}));
+  // The whole response is built from the same attributes, even if they are
+  // replaced in the meantime.
+  scoped_refptr<const AttributeSet> attributes = GetAttributeSet();
   switch (ipp_header.operation_id) {
     case IPP_VALIDATE_JOB:
-      return HandleValidateJob(ipp_header);
+      return HandleValidateJob(*attributes, ipp_header);
     case IPP_CREATE_JOB:
-      return HandleCreateJob(ipp_header);
-    case IPP_SEND_DOCUMENT:
-      return HandleSendDocument(ipp_header, body);
+      return HandleCreateJob(*attributes, request);
+    case IPP_SEND_DOCUMENT: {
+      SmartBufferView document = SmartBufferView(message).Subview(
+          request.document_offset, message.size() - request.document_offset);
+      return HandleSendDocument(*attributes, request, document);
+    }
     case IPP_GET_JOB_ATTRIBUTES:
-      return HandleGetJobAttributes(ipp_header);
+      return HandleGetJobAttributes(*attributes, request);
+    case IPP_GET_JOBS:
+      return HandleGetJobs(*attributes, request);
     case IPP_GET_PRINTER_ATTRIBUTES:
-      return HandleGetPrinterAttributes(ipp_header);
+      return HandleGetPrinterAttributes(*attributes, request);
     default:
       LOG(ERROR) << "Unknown operation id in ipp request "
                  << ipp_header.operation_id;
@@ -40,99 +317,283 @@ SmartBuffer IppManager::HandleIppRequest(const IppHeader& ipp_header,
   }
 }
 
-SmartBuffer IppManager::HandleValidateJob(
-    const IppHeader& request_header) const {
-  printf("HandleValidateJob %u\n", request_header.request_id);
+base::Optional<int> IppManager::StartDocument(int job_id) {
+  base::AutoLock lock(*jobs_lock_);
+  auto iter = jobs_.find(job_id);
+  if (iter == jobs_.end() || iter->second.state == IppJobState::kCompleted) {
+    return base::nullopt;
+  }
+  iter->second.state = IppJobState::kProcessing;
+  return ++iter->second.document_count;
+}
 
-  IppHeader response_header = request_header;
-  response_header.operation_id = kSuccessStatus;
-  // We add 1 to the size for the end of attributes tag.
-  size_t response_size =
-      sizeof(response_header) + GetAttributesSize(operation_attributes_) + 1;
-  SmartBuffer buf(response_size);
-  response_header.Serialize(&buf);
-  AddPrinterAttributes(operation_attributes_, kOperationAttributes, &buf);
-  AddEndOfAttributes(&buf);
-  return buf;
+base::Optional<IppJob> IppManager::GetJob(int job_id) const {
+  base::AutoLock lock(*jobs_lock_);
+  auto iter = jobs_.find(job_id);
+  if (iter == jobs_.end()) {
+    return base::nullopt;
+  }
+  return iter->second;
 }
 
-SmartBuffer IppManager::HandleCreateJob(const IppHeader& request_header) const {
-  LOG(INFO) << "HandleCreateJob " << request_header.request_id;
+SmartBuffer IppManager::HandleValidateJob(
+    const AttributeSet& attributes, const IppHeader& request_header) const {
+  VLOG(1) << "HandleValidateJob " << request_header.request_id;
+  return CreateResponse(request_header, kSuccessStatus,
+                        attributes.operation_response_body);
+}
 
-  IppHeader response_header = request_header;
-  response_header.operation_id = kSuccessStatus;
-  // We add 1 to the size for the end of attributes tag.
-  size_t response_size = sizeof(response_header) +
-                         GetAttributesSize(operation_attributes_) +
-                         GetAttributesSize(job_attributes_) + 1;
-  SmartBuffer buf(response_size);
-  response_header.Serialize(&buf);
-  AddPrinterAttributes(operation_attributes_, kOperationAttributes, &buf);
-  AddPrinterAttributes(job_attributes_, kJobAttributes, &buf);
-  AddEndOfAttributes(&buf);
-  return buf;
+SmartBuffer IppManager::HandleCreateJob(const AttributeSet& attributes,
+                                        const IppRequest& request) {
+  VLOG(1) << "HandleCreateJob " << request.header.request_id;
+  IppJob job;
+  {
+    base::AutoLock lock(*jobs_lock_);
+    RemoveOldJob();
+    job.id = NextJobId();
+    job.state = IppJobState::kPending;
+    job.name = std::string(GetFirstValue(request.operation_attributes,
+                                         kJobName, kDefaultJobName));
+    job.uri = base::StringPrintf(
+        "%s/%d",
+        std::string(GetFirstValue(request.operation_attributes, kPrinterUri,
+                                  kDefaultPrinterUri))
+            .c_str(),
+        job.id);
+    job.document_count = 0;
+    jobs_.emplace(job.id, job);
+  }
+  VLOG(1) << "Created job " << job.id;
+  return CreateJobResponse(attributes, request.header, job);
 }
 
-SmartBuffer IppManager::HandleSendDocument(const IppHeader& request_header,
-                                           const SmartBuffer& body) const {
-  LOG(INFO) << "HandleSendDocument " << request_header.request_id;
+SmartBuffer IppManager::HandleSendDocument(const AttributeSet& attributes,
+                                           const IppRequest& request,
+                                           const SmartBufferView& document) {
+  VLOG(1) << "HandleSendDocument " << request.header.request_id << " with "
+          << document.size() << " bytes of "
+          << GetFirstValue(request.operation_attributes, kDocumentFormat,
+                           "unspecified format");
+  base::Optional<int> job_id = GetJobId(request);
+  if (!job_id) {
+    LOG(ERROR) << "Send-Document request does not give a job-id";
+    return CreateErrorResponse(attributes, request.header, kBadRequestStatus);
+  }
 
-  if (!document_output_path_.empty()) {
-    LOG(INFO) << "Recording document...";
-    int written = base::WriteFile(document_output_path_,
-                                  reinterpret_cast<const char*>(body.data()),
-                                  body.size());
-    if (written != body.size()) {
-      PLOG(ERROR) << "Failed to write document to file: "
-                  << document_output_path_;
+  IppJob job;
+  {
+    base::AutoLock lock(*jobs_lock_);
+    auto iter = jobs_.find(job_id.value());
+    if (iter == jobs_.end()) {
+      LOG(ERROR) << "Send-Document request for unknown job " << job_id.value();
+      return CreateErrorResponse(attributes, request.header, kNotFoundStatus);
     }
+    if (iter->second.state == IppJobState::kCompleted) {
+      LOG(ERROR) << "Send-Document request for completed job "
+                 << job_id.value();
+      return CreateErrorResponse(attributes, request.header,
+                                 kNotPossibleStatus);
+    }
+    iter->second.state = IsLastDocument(request) ? IppJobState::kCompleted
+                                                 : IppJobState::kProcessing;
+    job = iter->second;
   }
-
-  IppHeader response_header = request_header;
-  response_header.operation_id = kSuccessStatus;
-  // We add 1 to the size for the end of attributes tag.
-  size_t response_size = sizeof(response_header) +
-                         GetAttributesSize(operation_attributes_) +
-                         GetAttributesSize(job_attributes_) + 1;
-  SmartBuffer buf(response_size);
-  response_header.Serialize(&buf);
-  AddPrinterAttributes(operation_attributes_, kOperationAttributes, &buf);
-  AddPrinterAttributes(job_attributes_, kJobAttributes, &buf);
-  AddEndOfAttributes(&buf);
-  return buf;
+  return CreateJobResponse(attributes, request.header, job);
 }
 
 SmartBuffer IppManager::HandleGetJobAttributes(
-    const IppHeader& request_header) const {
-  LOG(INFO) << "HandleGetJobAttributes " << request_header.request_id;
-  IppHeader response_header = request_header;
-  response_header.operation_id = kSuccessStatus;
-  // We add 1 to the size for the end of attributes tag.
-  size_t response_size = sizeof(response_header) +
-                         GetAttributesSize(operation_attributes_) +
-                         GetAttributesSize(job_attributes_) + 1;
-  SmartBuffer buf(response_size);
-  response_header.Serialize(&buf);
-  AddPrinterAttributes(operation_attributes_, kOperationAttributes, &buf);
-  AddPrinterAttributes(job_attributes_, kJobAttributes, &buf);
-  AddEndOfAttributes(&buf);
-  return buf;
+    const AttributeSet& attributes, const IppRequest& request) const {
+  VLOG(1) << "HandleGetJobAttributes " << request.header.request_id;
+  base::Optional<int> job_id = GetJobId(request);
+  if (!job_id) {
+    LOG(ERROR) << "Get-Job-Attributes request does not give a job-id";
+    return CreateErrorResponse(attributes, request.header, kBadRequestStatus);
+  }
+  base::Optional<IppJob> job = GetJob(job_id.value());
+  if (!job) {
+    return CreateErrorResponse(attributes, request.header, kNotFoundStatus);
+  }
+  return CreateJobResponse(attributes, request.header, job.value());
+}
+
+SmartBuffer IppManager::HandleGetJobs(const AttributeSet& attributes,
+                                      const IppRequest& request) const {
+  VLOG(1) << "HandleGetJobs " << request.header.request_id;
+  // Only the not-completed and completed values of which-jobs are supported.
+  // Completed jobs are returned most recent first, and other jobs oldest first.
+  const bool completed = GetFirstValue(request.operation_attributes,
+                                       kWhichJobs, "") == "completed";
+  std::vector<IppJob> jobs;
+  {
+    base::AutoLock lock(*jobs_lock_);
+    for (const auto& entry : jobs_) {
+      if ((entry.second.state == IppJobState::kCompleted) == completed) {
+        jobs.push_back(entry.second);
+      }
+    }
+  }
+  if (completed) {
+    std::reverse(jobs.begin(), jobs.end());
+  }
+  base::Optional<int> limit =
+      GetIntegerValue(request.operation_attributes, kLimit);
+  if (limit && limit.value() > 0 &&
+      static_cast<size_t>(limit.value()) < jobs.size()) {
+    jobs.resize(limit.value());
+  }
+
+  SmartBuffer response = StartResponse(request.header, kSuccessStatus,
+                                       attributes.operation_group.size() + 1);
+  response.Add(attributes.operation_group);
+  for (const IppJob& job : jobs) {
+    AddJobGroup(attributes, job, &response);
+  }
+  AddEndOfAttributes(&response);
+  return response;
 }
 
 SmartBuffer IppManager::HandleGetPrinterAttributes(
-    const IppHeader& request_header) const {
-  LOG(INFO) << "HandleGetPrinterAttributes " << request_header.request_id;
+    const AttributeSet& attributes, const IppRequest& request) const {
+  const IppHeader& request_header = request.header;
+  VLOG(1) << "HandleGetPrinterAttributes " << request_header.request_id;
+
+  const IppRequestAttributes& operation_attributes =
+      request.operation_attributes;
+  auto requested = operation_attributes.find(kRequestedAttributes);
+  if (requested == operation_attributes.end()) {
+    return CreateResponse(request_header, kSuccessStatus,
+                          attributes.printer_response_body);
+  }
+
+  // Use sets so that attributes are returned once each, in the order in which
+  // they are configured.
+  std::set<size_t> printer_indices;
+  std::set<size_t> unsupported_indices;
+  for (base::StringPiece name : requested->second) {
+    if (IsAttributeGroupName(name)) {
+      return CreateResponse(request_header, kSuccessStatus,
+                            attributes.printer_response_body);
+    }
+    auto iter = attributes.printer_attribute_index.find(std::string(name));
+    if (iter != attributes.printer_attribute_index.end()) {
+      printer_indices.insert(iter->second);
+      continue;
+    }
+    iter = attributes.unsupported_attribute_index.find(std::string(name));
+    if (iter != attributes.unsupported_attribute_index.end()) {
+      unsupported_indices.insert(iter->second);
+    }
+  }
+
+  // We add 2 to the size for the printer attributes group tag and the end of
+  // attributes tag, and 1 more for the unsupported attributes group tag.
+  const SerializedIppAttributes& serialized = attributes.serialized;
+  size_t size = attributes.operation_group.size() + 2;
+  if (!unsupported_indices.empty()) {
+    size++;
+  }
+  for (size_t i : printer_indices) {
+    size += serialized.printer_attributes[i].second.size();
+  }
+  for (size_t i : unsupported_indices) {
+    size += serialized.unsupported_attributes[i].second.size();
+  }
+
+  SmartBuffer response = StartResponse(request_header, kSuccessStatus, size);
+  response.Add(attributes.operation_group);
+  if (!unsupported_indices.empty()) {
+    response.Add(static_cast<uint8_t>(IppTag::UNSUPPORTED_GROUP));
+    for (size_t i : unsupported_indices) {
+      response.Add(serialized.unsupported_attributes[i].second);
+    }
+  }
+  response.Add(static_cast<uint8_t>(IppTag::PRINTER));
+  for (size_t i : printer_indices) {
+    response.Add(serialized.printer_attributes[i].second);
+  }
+  AddEndOfAttributes(&response);
+  return response;
+}
 
+// static
+void IppManager::AddJobGroup(const AttributeSet& attributes,
+                             const IppJob& job,
+                             SmartBuffer* buf) {
+  buf->Add(static_cast<uint8_t>(IppTag::JOB));
+  AddIntegerValue(IppTag::INTEGER, kJobId, job.id, buf);
+  AddStringValue(IppTag::URI, kJobUri, job.uri, buf);
+  AddStringValue(IppTag::NAME, kJobName, job.name, buf);
+  AddIntegerValue(IppTag::ENUM, kJobState, static_cast<int>(job.state), buf);
+  AddStringValue(IppTag::KEYWORD, kJobStateReasons,
+                 GetJobStateReason(job.state), buf);
+  buf->Add(attributes.static_job_attributes);
+}
+
+// static
+SmartBuffer IppManager::CreateJobResponse(const AttributeSet& attributes,
+                                          const IppHeader& request_header,
+                                          const IppJob& job) {
+  // We add 2 to the size for the job attributes group tag and the end of
+  // attributes tag. The buffer grows to fit the generated job attributes.
+  SmartBuffer response = StartResponse(
+      request_header, kSuccessStatus,
+      attributes.operation_group.size() +
+          attributes.static_job_attributes.size() + 2);
+  response.Add(attributes.operation_group);
+  AddJobGroup(attributes, job, &response);
+  AddEndOfAttributes(&response);
+  return response;
+}
+
+// static
+SmartBuffer IppManager::CreateErrorResponse(const AttributeSet& attributes,
+                                            const IppHeader& request_header,
+                                            uint16_t status) {
+  return CreateResponse(request_header, status,
+                        attributes.operation_response_body);
+}
+
+void IppManager::RemoveOldJob() {
+  if (jobs_.size() < kMaxJobs) {
+    return;
+  }
+  for (auto iter = jobs_.begin(); iter != jobs_.end(); ++iter) {
+    if (iter->second.state == IppJobState::kCompleted) {
+      jobs_.erase(iter);
+      return;
+    }
+  }
+  // Every job is still waiting for its documents, which a client may never
+  // send, so the oldest of them is given up on. Jobs are ordered by id, which
+  // is the order in which they were created.
+  VLOG(1) << "Removing unfinished job " << jobs_.begin()->first;
+  jobs_.erase(jobs_.begin());
+}
+
+// static
+std::map<std::string, size_t> IppManager::IndexAttributes(
+    const std::vector<std::pair<std::string, SmartBuffer>>& attributes) {
+  std::map<std::string, size_t> index;
+  for (size_t i = 0; i < attributes.size(); i++) {
+    index.emplace(attributes[i].first, i);
+  }
+  return index;
+}
+
+SmartBuffer IppManager::StartResponse(const IppHeader& request_header,
+                                      uint16_t status,
+                                      size_t body_size) {
   IppHeader response_header = request_header;
-  response_header.operation_id = kSuccessStatus;
-  // We add 1 to the size for the end of attributes tag.
-  size_t response_size = sizeof(response_header) +
-                         GetAttributesSize(operation_attributes_) +
-                         GetAttributesSize(printer_attributes_) + 1;
-  SmartBuffer buf(response_size);
+  response_header.operation_id = status;
+  SmartBuffer buf(sizeof(response_header) + body_size);
   response_header.Serialize(&buf);
-  AddPrinterAttributes(operation_attributes_, kOperationAttributes, &buf);
-  AddPrinterAttributes(printer_attributes_, kPrinterAttributes, &buf);
-  AddEndOfAttributes(&buf);
+  return buf;
+}
+
+SmartBuffer IppManager::CreateResponse(const IppHeader& request_header,
+                                       uint16_t status,
+                                       const SmartBuffer& body) {
+  SmartBuffer buf = StartResponse(request_header, status, body.size());
+  buf.Add(body);
   return buf;
 }
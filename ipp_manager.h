@@ -5,52 +5,231 @@
 #ifndef IPP_MANAGER_H__
 #define IPP_MANAGER_H__
 
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
-#include <base/files/file_path.h>
+#include <base/memory/ref_counted.h>
+#include <base/optional.h>
+#include <base/synchronization/lock.h>
 
 #include "ipp_util.h"
 #include "smart_buffer.h"
 
+// The attributes returned by an IppManager, serialized ahead of time so that
+// an IppManager can be created without the JSON configuration which they were
+// loaded from. The operation attribute group is serialized without its group
+// tag. Job, printer and unsupported attributes are serialized one at a time,
+// with the members of a collection kept together with the collection, and are
+// paired with their names.
+struct SerializedIppAttributes {
+  SmartBuffer operation_attributes;
+  std::vector<std::pair<std::string, SmartBuffer>> job_attributes;
+  std::vector<std::pair<std::string, SmartBuffer>> printer_attributes;
+  std::vector<std::pair<std::string, SmartBuffer>> unsupported_attributes;
+};
+
+// Serializes the attributes given for each group.
+SerializedIppAttributes SerializeIppAttributes(
+    const std::vector<IppAttribute>& operation_attributes,
+    const std::vector<IppAttribute>& printer_attributes,
+    const std::vector<IppAttribute>& job_attributes,
+    const std::vector<IppAttribute>& unsupported_attributes);
+
+// Returns the name of the IPP operation |operation_id|, such as "Create-Job",
+// or its number if it is not an operation which the printer supports.
+std::string GetIppOperationName(int operation_id);
+
+// The states of a print job which the printer reports. The values are those
+// of the job-state attribute.
+enum class IppJobState {
+  kPending = 3,
+  kProcessing = 5,
+  kCompleted = 9,
+};
+
+// A print job created by a Create-Job request.
+struct IppJob {
+  int id;
+  IppJobState state;
+  std::string name;
+  std::string uri;
+  // The number of documents which have started to arrive for the job.
+  int document_count;
+};
+
 // This class is responsible for generating responses to IPP requests sent over
 // USB.
+//
+// Each attribute group is serialized once when the attributes are configured,
+// and every response is built by prepending a header for the request to the
+// cached bytes. Printer attributes are also serialized individually and
+// indexed by name, so that a response can contain only the attributes which
+// the client requested. The attributes may be replaced while requests are
+// being handled, in which case each request finishes with the attributes it
+// started with.
+//
+// Each Create-Job request adds a job to a table of jobs, which is shared by
+// every interface of the printer so that several clients can print at once.
+// The attributes which describe a particular job, such as job-id and
+// job-state, are generated from the table for each response and replace the
+// configured values of those attributes.
 class IppManager {
  public:
-  IppManager() = default;
-  IppManager(std::vector<IppAttribute> operation_attributes,
-             std::vector<IppAttribute> printer_attributes,
-             std::vector<IppAttribute> job_attributes,
-             std::vector<IppAttribute> unsupported_attributes,
-             const base::FilePath& document_output_path);
-
-  // Returns a standard response based on the operation specified in
-  // |ipp_header|.
+  // Creates an IppManager which returns no attributes.
+  IppManager();
+  IppManager(const std::vector<IppAttribute>& operation_attributes,
+             const std::vector<IppAttribute>& printer_attributes,
+             const std::vector<IppAttribute>& job_attributes,
+             const std::vector<IppAttribute>& unsupported_attributes);
+  explicit IppManager(SerializedIppAttributes attributes);
+
+  // Returns the attributes which this IppManager returns.
+  SerializedIppAttributes serialized_attributes() const;
+
+  // Replaces the attributes which this IppManager returns. The job table is
+  // kept, and requests which are already being handled are unaffected.
+  void SetAttributes(SerializedIppAttributes attributes);
+
+  // Returns a standard response based on the operation specified in the header
+  // of |request|, which was parsed from |message|. Requests may be handled
+  // concurrently.
+  SmartBuffer HandleIppRequest(const IppRequest& request,
+                               const SmartBuffer& message);
+
+  // Same as above, for a request which carries no attributes and is followed
+  // by the document in |body|.
   SmartBuffer HandleIppRequest(const IppHeader& ipp_header,
-                               const SmartBuffer& body) const;
+                               const SmartBuffer& body);
 
-  // Result returned in the |operation_id| field of an IppHeader when the
-  // operation was successful.
+  // Called when the document of a Send-Document request for the job |job_id|
+  // starts to arrive, before the request is handled. Marks the job as
+  // processing and returns the number of the document within the job, starting
+  // from 1. Returns nullopt if there is no such job or it has completed, in
+  // which case the document should be discarded.
+  base::Optional<int> StartDocument(int job_id);
+
+  // Returns a copy of the job |job_id|, or nullopt if there is no such job.
+  base::Optional<IppJob> GetJob(int job_id) const;
+
+  // Results returned in the |operation_id| field of an IppHeader.
+  // The operation was successful.
   static const uint16_t kSuccessStatus;
+  // The request is missing an attribute needed by the operation.
+  static const uint16_t kBadRequestStatus;
+  // The operation refers to a job which does not exist.
+  static const uint16_t kNotFoundStatus;
+  // The operation is not possible in the current state of the job.
+  static const uint16_t kNotPossibleStatus;
+
+  // The most jobs which are kept in the job table. Once it is full the oldest
+  // completed job is removed for each new job, or the oldest job if none has
+  // completed.
+  static const size_t kMaxJobs;
 
  private:
-  SmartBuffer HandleValidateJob(const IppHeader& request_header) const;
-  SmartBuffer HandleCreateJob(const IppHeader& request_header) const;
-  SmartBuffer HandleSendDocument(const IppHeader& request_header,
-                                 const SmartBuffer& body) const;
-  SmartBuffer HandleGetJobAttributes(const IppHeader& request_header) const;
-  SmartBuffer HandleGetPrinterAttributes(const IppHeader& ipp_header) const;
-
-  // Constant attributes that will be returned in response to requests from the
-  // client.
-  std::vector<IppAttribute> operation_attributes_;
-  std::vector<IppAttribute> printer_attributes_;
-  std::vector<IppAttribute> job_attributes_;
-
-  // TODO(valleau): Look into making these attributes dynamic as we should only
-  // report unsupported attributes if they were requested by the client.
-  std::vector<IppAttribute> unsupported_attributes_;
-
-  base::FilePath document_output_path_;
+  // The configured attributes along with the parts of each response which are
+  // built from them. An AttributeSet never changes once it has been built, so
+  // a request can keep using one after it has been replaced.
+  struct AttributeSet : public base::RefCountedThreadSafe<AttributeSet> {
+    explicit AttributeSet(SerializedIppAttributes attributes);
+
+    SerializedIppAttributes serialized;
+
+    // The configured job attributes, without those which are generated for
+    // each job.
+    SmartBuffer static_job_attributes;
+
+    // The operation attributes group, including its group tag.
+    SmartBuffer operation_group;
+
+    // Used to build Get-Printer-Attributes responses for a subset of the
+    // attributes, by mapping the name of each attribute to its index in
+    // |serialized|.
+    std::map<std::string, size_t> printer_attribute_index;
+    std::map<std::string, size_t> unsupported_attribute_index;
+
+    // The serialized attribute groups, followed by the end of attributes tag,
+    // returned in each type of response.
+    // |operation_response_body| holds the operation attributes.
+    // |printer_response_body| holds the operation and printer attributes.
+    SmartBuffer operation_response_body;
+    SmartBuffer printer_response_body;
+
+   private:
+    friend class base::RefCountedThreadSafe<AttributeSet>;
+    ~AttributeSet();
+  };
+
+  // Returns the current attributes.
+  scoped_refptr<const AttributeSet> GetAttributeSet() const;
+
+  // Each handler builds its response from |attributes|.
+  SmartBuffer HandleValidateJob(const AttributeSet& attributes,
+                                const IppHeader& request_header) const;
+  SmartBuffer HandleCreateJob(const AttributeSet& attributes,
+                              const IppRequest& request);
+  SmartBuffer HandleSendDocument(const AttributeSet& attributes,
+                                 const IppRequest& request,
+                                 const SmartBufferView& document);
+  SmartBuffer HandleGetJobAttributes(const AttributeSet& attributes,
+                                     const IppRequest& request) const;
+  SmartBuffer HandleGetJobs(const AttributeSet& attributes,
+                            const IppRequest& request) const;
+  SmartBuffer HandleGetPrinterAttributes(const AttributeSet& attributes,
+                                         const IppRequest& request) const;
+
+  // Adds a job attributes group describing |job| to |buf|.
+  static void AddJobGroup(const AttributeSet& attributes,
+                          const IppJob& job,
+                          SmartBuffer* buf);
+
+  // Builds a response carrying the operation attributes and a job attributes
+  // group describing |job|.
+  static SmartBuffer CreateJobResponse(const AttributeSet& attributes,
+                                       const IppHeader& request_header,
+                                       const IppJob& job);
+
+  // Builds a response with the status |status| which carries only the
+  // operation attributes.
+  static SmartBuffer CreateErrorResponse(const AttributeSet& attributes,
+                                         const IppHeader& request_header,
+                                         uint16_t status);
+
+  // Removes the oldest completed job once the job table is full, or the oldest
+  // job if none has completed. Must be called with |jobs_lock_| held.
+  void RemoveOldJob();
+
+  // Maps the name of each of |attributes| to its index.
+  static std::map<std::string, size_t> IndexAttributes(
+      const std::vector<std::pair<std::string, SmartBuffer>>& attributes);
+
+  // Starts a response to the request described by |request_header| with the
+  // status |status|, which has room for |body_size| bytes of attributes to be
+  // added straight after the header. Responses whose attributes are generated
+  // are built this way so that the attributes are not copied again.
+  static SmartBuffer StartResponse(const IppHeader& request_header,
+                                   uint16_t status,
+                                   size_t body_size);
+
+  // Builds a response to the request described by |request_header| with the
+  // status |status| which carries the serialized attributes in |body|.
+  static SmartBuffer CreateResponse(const IppHeader& request_header,
+                                    uint16_t status,
+                                    const SmartBuffer& body);
+
+  // Guards |attributes_|. It is held by a unique_ptr so that the IppManager
+  // can be moved.
+  std::unique_ptr<base::Lock> attributes_lock_;
+  scoped_refptr<const AttributeSet> attributes_;
+
+  // Guards |jobs_|. It is held by a unique_ptr so that the IppManager can be
+  // moved.
+  std::unique_ptr<base::Lock> jobs_lock_;
+  // The jobs which have been created, ordered by id.
+  std::map<int, IppJob> jobs_;
 };
 
 #endif  // IPP_MANAGER_H__
@@ -4,9 +4,17 @@
 
 #include "ipp_manager.h"
 
+#include <arpa/inet.h>
+
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <base/logging.h>
+#include <base/optional.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_piece.h>
 #include <base/values.h>
 #include <gtest/gtest.h>
 
@@ -29,13 +37,11 @@ class IppManagerTest : public testing::Test {
         ipp_manager_(operation_attributes_,
                      printer_attributes_,
                      job_attributes_,
-                     unsupported_attributes_,
-                     base::FilePath()) {
+                     unsupported_attributes_) {
     AddPrinterAttributes(operation_attributes_, kOperationAttributes,
                          &serialized_operation_);
     AddPrinterAttributes(printer_attributes_, kPrinterAttributes,
                          &serialized_printer_);
-    AddPrinterAttributes(job_attributes_, kJobAttributes, &serialized_job_);
   }
 
   static IppHeader CreateTestHeader() {
@@ -47,6 +53,58 @@ class IppManagerTest : public testing::Test {
     return header;
   }
 
+  static IppRequest CreateJobRequest(int operation_id) {
+    IppRequest request;
+    request.header = CreateTestHeader();
+    request.header.operation_id = operation_id;
+    return request;
+  }
+
+  // Returns |value| as it is sent in an integer attribute.
+  static std::string EncodeInteger(int value) {
+    uint32_t network_value = htonl(value);
+    return std::string(reinterpret_cast<const char*>(&network_value),
+                       sizeof(network_value));
+  }
+
+  // Returns the status of the IPP response |response|.
+  static uint16_t GetStatus(SmartBuffer response) {
+    base::Optional<IppHeader> header = IppHeader::Deserialize(&response);
+    CHECK(header);
+    return header->operation_id;
+  }
+
+  // Creates a job and returns its id.
+  int CreateJob() {
+    SmartBuffer response = ipp_manager_.HandleIppRequest(
+        CreateJobRequest(IPP_CREATE_JOB), SmartBuffer());
+    base::Optional<IppRequest> parsed =
+        ParseIppRequest(SmartBufferView(response));
+    CHECK(parsed);
+    base::Optional<int> job_id =
+        GetIntegerValue(parsed->job_attributes, "job-id");
+    CHECK(job_id);
+    return job_id.value();
+  }
+
+  // Returns the ids of the jobs in the response to the Get-Jobs |request|.
+  std::vector<int> GetJobIds(const IppRequest& request) {
+    SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+    base::Optional<IppRequest> parsed =
+        ParseIppRequest(SmartBufferView(response));
+    CHECK(parsed);
+    EXPECT_EQ(parsed->header.operation_id, IppManager::kSuccessStatus);
+    std::vector<int> ids;
+    auto iter = parsed->job_attributes.find("job-id");
+    if (iter != parsed->job_attributes.end()) {
+      for (base::StringPiece value : iter->second) {
+        IppRequestAttributes single = {{"job-id", {value}}};
+        ids.push_back(GetIntegerValue(single, "job-id").value());
+      }
+    }
+    return ids;
+  }
+
   // Used to setup IppAttribute vectors to be returned from commands.
   base::Value int_value_;
   base::Value bool_value_;
@@ -60,7 +118,6 @@ class IppManagerTest : public testing::Test {
   // These will be used to build up expected response SmartBuffers.
   SmartBuffer serialized_operation_;
   SmartBuffer serialized_printer_;
-  SmartBuffer serialized_job_;
 
   std::vector<IppAttribute> operation_attributes_;
   std::vector<IppAttribute> printer_attributes_;
@@ -94,24 +151,211 @@ TEST_F(IppManagerTest, HandleValidateJob) {
 }
 
 TEST_F(IppManagerTest, HandleCreateJob) {
-  IppHeader header = CreateTestHeader();
-  header.operation_id = IPP_CREATE_JOB;
+  IppRequest request = CreateJobRequest(IPP_CREATE_JOB);
+  std::string printer_uri = "ipp://localhost:60000/ipp/print";
+  request.operation_attributes = {{"printer-uri", {printer_uri}},
+                                  {"job-name", {"test job"}}};
 
-  SmartBuffer response = ipp_manager_.HandleIppRequest(header, SmartBuffer());
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  base::Optional<IppRequest> parsed =
+      ParseIppRequest(SmartBufferView(response));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(parsed->header.operation_id, IppManager::kSuccessStatus);
+
+  base::Optional<int> job_id = GetIntegerValue(parsed->job_attributes, "job-id");
+  ASSERT_TRUE(job_id);
+  EXPECT_EQ(GetIntegerValue(parsed->job_attributes, "job-state"),
+            static_cast<int>(IppJobState::kPending));
+  const IppRequestAttributes& job = parsed->job_attributes;
+  EXPECT_EQ(job.at("job-uri"),
+            std::vector<base::StringPiece>(
+                {printer_uri + "/" + base::NumberToString(job_id.value())}));
+  EXPECT_EQ(job.at("job-name"), std::vector<base::StringPiece>({"test job"}));
+  EXPECT_EQ(job.at("job-state-reasons"),
+            std::vector<base::StringPiece>({"none"}));
+  // The configured job attributes are returned as well.
+  EXPECT_EQ(job.at("uri attribute"),
+            std::vector<base::StringPiece>({"http://www.example.com"}));
+
+  base::Optional<IppJob> created = ipp_manager_.GetJob(job_id.value());
+  ASSERT_TRUE(created);
+  EXPECT_EQ(created->state, IppJobState::kPending);
+  EXPECT_EQ(created->name, "test job");
+}
+
+TEST_F(IppManagerTest, CreateJobUniqueIds) {
+  std::set<int> ids;
+  for (int i = 0; i < 10; i++) {
+    ids.insert(CreateJob());
+  }
+  EXPECT_EQ(ids.size(), 10);
+}
+
+// Jobs which are never completed are removed once the job table is full.
+TEST_F(IppManagerTest, UnfinishedJobsAreRemoved) {
+  int first = CreateJob();
+  int last = first;
+  for (size_t i = 0; i < IppManager::kMaxJobs; i++) {
+    last = CreateJob();
+  }
+  EXPECT_FALSE(ipp_manager_.GetJob(first));
+  EXPECT_TRUE(ipp_manager_.GetJob(first + 1));
+  EXPECT_TRUE(ipp_manager_.GetJob(last));
+}
+
+// Jobs created concurrently from several threads, as they are by clients on
+// different interfaces, are each given their own id.
+TEST_F(IppManagerTest, CreateJobConcurrently) {
+  constexpr int kThreads = 4;
+  constexpr int kJobsPerThread = 50;
+  std::vector<std::vector<int>> ids(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([this, &ids, i]() {
+      for (int j = 0; j < kJobsPerThread; j++) {
+        ids[i].push_back(CreateJob());
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  std::set<int> unique_ids;
+  for (const std::vector<int>& thread_ids : ids) {
+    unique_ids.insert(thread_ids.begin(), thread_ids.end());
+  }
+  EXPECT_EQ(unique_ids.size(), kThreads * kJobsPerThread);
+  for (int id : unique_ids) {
+    EXPECT_TRUE(ipp_manager_.GetJob(id));
+  }
+}
+
+TEST_F(IppManagerTest, HandleSendDocument) {
+  int job_id = CreateJob();
+  const std::string encoded_id = EncodeInteger(job_id);
+  IppRequest request = CreateJobRequest(IPP_SEND_DOCUMENT);
+  request.operation_attributes = {{"job-id", {encoded_id}},
+                                  {"last-document", {"\x01"}}};
+
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  base::Optional<IppRequest> parsed =
+      ParseIppRequest(SmartBufferView(response));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(parsed->header.operation_id, IppManager::kSuccessStatus);
+  EXPECT_EQ(GetIntegerValue(parsed->job_attributes, "job-id"), job_id);
+  EXPECT_EQ(GetIntegerValue(parsed->job_attributes, "job-state"),
+            static_cast<int>(IppJobState::kCompleted));
+  EXPECT_EQ(ipp_manager_.GetJob(job_id)->state, IppJobState::kCompleted);
+}
+
+// A job which is sent more documents is processing until its last document is
+// received.
+TEST_F(IppManagerTest, HandleSendDocumentNotLast) {
+  int job_id = CreateJob();
+  const std::string encoded_id = EncodeInteger(job_id);
+  IppRequest request = CreateJobRequest(IPP_SEND_DOCUMENT);
+  request.operation_attributes = {{"job-id", {encoded_id}},
+                                  {"last-document", {std::string(1, '\0')}}};
+
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
   base::Optional<IppHeader> response_header = IppHeader::Deserialize(&response);
-  EXPECT_TRUE(response_header);
-  EXPECT_EQ(response_header.value().operation_id, IppManager::kSuccessStatus);
+  ASSERT_TRUE(response_header);
+  EXPECT_EQ(response_header->operation_id, IppManager::kSuccessStatus);
+  EXPECT_EQ(ipp_manager_.GetJob(job_id)->state, IppJobState::kProcessing);
+}
+
+TEST_F(IppManagerTest, HandleSendDocumentErrors) {
+  int job_id = CreateJob();
+  const std::string encoded_id = EncodeInteger(job_id);
+  const std::string unknown_id = EncodeInteger(job_id + 1000);
+  IppRequest request = CreateJobRequest(IPP_SEND_DOCUMENT);
+
+  // Without a job-id.
+  EXPECT_EQ(GetStatus(ipp_manager_.HandleIppRequest(request, SmartBuffer())),
+            IppManager::kBadRequestStatus);
+
+  request.operation_attributes = {{"job-id", {unknown_id}}};
+  EXPECT_EQ(GetStatus(ipp_manager_.HandleIppRequest(request, SmartBuffer())),
+            IppManager::kNotFoundStatus);
+
+  // A completed job does not accept more documents.
+  request.operation_attributes = {{"job-id", {encoded_id}}};
+  EXPECT_EQ(GetStatus(ipp_manager_.HandleIppRequest(request, SmartBuffer())),
+            IppManager::kSuccessStatus);
+  EXPECT_EQ(GetStatus(ipp_manager_.HandleIppRequest(request, SmartBuffer())),
+            IppManager::kNotPossibleStatus);
+}
+
+TEST_F(IppManagerTest, StartDocument) {
+  int job_id = CreateJob();
+  EXPECT_EQ(ipp_manager_.StartDocument(job_id), 1);
+  EXPECT_EQ(ipp_manager_.GetJob(job_id)->state, IppJobState::kProcessing);
+  EXPECT_EQ(ipp_manager_.StartDocument(job_id), 2);
+  EXPECT_EQ(ipp_manager_.GetJob(job_id)->document_count, 2);
 
+  const std::string encoded_id = EncodeInteger(job_id);
+  IppRequest request = CreateJobRequest(IPP_SEND_DOCUMENT);
+  request.operation_attributes = {{"job-id", {encoded_id}}};
+  ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  EXPECT_FALSE(ipp_manager_.StartDocument(job_id));
+  EXPECT_FALSE(ipp_manager_.StartDocument(job_id + 1000));
+}
+
+TEST_F(IppManagerTest, HandleGetJobAttributes) {
+  int job_id = CreateJob();
+  const std::string encoded_id = EncodeInteger(job_id);
+  IppRequest request = CreateJobRequest(IPP_GET_JOB_ATTRIBUTES);
+  request.operation_attributes = {{"job-id", {encoded_id}}};
+
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  base::Optional<IppRequest> parsed =
+      ParseIppRequest(SmartBufferView(response));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(parsed->header.operation_id, IppManager::kSuccessStatus);
+  EXPECT_EQ(GetIntegerValue(parsed->job_attributes, "job-id"), job_id);
+  EXPECT_EQ(GetIntegerValue(parsed->job_attributes, "job-state"),
+            static_cast<int>(IppJobState::kPending));
+
+  const std::string unknown_id = EncodeInteger(job_id + 1000);
+  request.operation_attributes = {{"job-id", {unknown_id}}};
+  response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  EXPECT_EQ(GetStatus(response), IppManager::kNotFoundStatus);
+  // The error response carries only the operation attributes.
+  IppHeader::Deserialize(&response);
   SmartBuffer expected_response;
   expected_response.Add(serialized_operation_);
-  expected_response.Add(serialized_job_);
   AddEndOfAttributes(&expected_response);
   EXPECT_EQ(response.contents(), expected_response.contents());
 }
 
-TEST_F(IppManagerTest, HandleSendDocument) {
+TEST_F(IppManagerTest, HandleGetJobs) {
+  int first = CreateJob();
+  int second = CreateJob();
+  int third = CreateJob();
+  for (int job_id : {first, third}) {
+    const std::string encoded_id = EncodeInteger(job_id);
+    IppRequest request = CreateJobRequest(IPP_SEND_DOCUMENT);
+    request.operation_attributes = {{"job-id", {encoded_id}}};
+    ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  }
+
+  IppRequest request = CreateJobRequest(IPP_GET_JOBS);
+  EXPECT_EQ(GetJobIds(request), std::vector<int>({second}));
+
+  // Completed jobs are returned most recent first.
+  request.operation_attributes = {{"which-jobs", {"completed"}}};
+  EXPECT_EQ(GetJobIds(request), std::vector<int>({third, first}));
+
+  const std::string limit = EncodeInteger(1);
+  request.operation_attributes = {{"which-jobs", {"completed"}},
+                                  {"limit", {limit}}};
+  EXPECT_EQ(GetJobIds(request), std::vector<int>({third}));
+}
+
+TEST_F(IppManagerTest, HandleGetPrinterAttributes) {
   IppHeader header = CreateTestHeader();
-  header.operation_id = IPP_SEND_DOCUMENT;
+  header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
 
   SmartBuffer response = ipp_manager_.HandleIppRequest(header, SmartBuffer());
   base::Optional<IppHeader> response_header = IppHeader::Deserialize(&response);
@@ -120,39 +364,115 @@ TEST_F(IppManagerTest, HandleSendDocument) {
 
   SmartBuffer expected_response;
   expected_response.Add(serialized_operation_);
-  expected_response.Add(serialized_job_);
+  expected_response.Add(serialized_printer_);
   AddEndOfAttributes(&expected_response);
   EXPECT_EQ(response.contents(), expected_response.contents());
 }
 
-TEST_F(IppManagerTest, HandleGetJobAttributes) {
-  IppHeader header = CreateTestHeader();
-  header.operation_id = IPP_GET_JOB_ATTRIBUTES;
+// Replacing the attributes changes later responses but keeps the job table.
+TEST_F(IppManagerTest, SetAttributes) {
+  int job_id = CreateJob();
+  std::vector<IppAttribute> printer_attributes = {int_attribute_};
+  ipp_manager_.SetAttributes(SerializeIppAttributes(
+      operation_attributes_, printer_attributes, job_attributes_,
+      unsupported_attributes_));
 
+  IppHeader header = CreateTestHeader();
+  header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
   SmartBuffer response = ipp_manager_.HandleIppRequest(header, SmartBuffer());
+  EXPECT_TRUE(IppHeader::Deserialize(&response));
+  SmartBuffer expected_response;
+  expected_response.Add(serialized_operation_);
+  AddPrinterAttributes(printer_attributes, kPrinterAttributes,
+                       &expected_response);
+  AddEndOfAttributes(&expected_response);
+  EXPECT_EQ(response.contents(), expected_response.contents());
+
+  EXPECT_TRUE(ipp_manager_.GetJob(job_id));
+  EXPECT_EQ(ipp_manager_.serialized_attributes().printer_attributes.size(), 1);
+  EXPECT_EQ(ipp_manager_.serialized_attributes().printer_attributes[0].first,
+            "int attribute");
+}
+
+// Responses are built from cached attributes, so check that the header of each
+// response still reflects the request it answers.
+TEST_F(IppManagerTest, ResponseHeaderMatchesRequest) {
+  IppHeader first = CreateTestHeader();
+  first.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
+  IppHeader second = first;
+  second.minor = 1;
+  second.request_id = 15;
+
+  SmartBuffer first_response =
+      ipp_manager_.HandleIppRequest(first, SmartBuffer());
+  SmartBuffer second_response =
+      ipp_manager_.HandleIppRequest(second, SmartBuffer());
+  base::Optional<IppHeader> first_header =
+      IppHeader::Deserialize(&first_response);
+  base::Optional<IppHeader> second_header =
+      IppHeader::Deserialize(&second_response);
+  ASSERT_TRUE(first_header);
+  ASSERT_TRUE(second_header);
+
+  EXPECT_EQ(first_header.value().major, 2);
+  EXPECT_EQ(first_header.value().minor, 0);
+  EXPECT_EQ(first_header.value().operation_id, IppManager::kSuccessStatus);
+  EXPECT_EQ(first_header.value().request_id, 14);
+  EXPECT_EQ(second_header.value().major, 2);
+  EXPECT_EQ(second_header.value().minor, 1);
+  EXPECT_EQ(second_header.value().operation_id, IppManager::kSuccessStatus);
+  EXPECT_EQ(second_header.value().request_id, 15);
+  EXPECT_EQ(first_response.contents(), second_response.contents());
+}
+
+TEST_F(IppManagerTest, HandleGetPrinterAttributesRequested) {
+  IppHeader header = CreateTestHeader();
+  header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
+  IppRequest request;
+  request.header = header;
+  request.operation_attributes = {
+      {"requested-attributes", {"missing attribute", "bool attribute"}}};
+
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
   base::Optional<IppHeader> response_header = IppHeader::Deserialize(&response);
   EXPECT_TRUE(response_header);
   EXPECT_EQ(response_header.value().operation_id, IppManager::kSuccessStatus);
 
   SmartBuffer expected_response;
   expected_response.Add(serialized_operation_);
-  expected_response.Add(serialized_job_);
+  expected_response.Add(serialized_printer_);
   AddEndOfAttributes(&expected_response);
   EXPECT_EQ(response.contents(), expected_response.contents());
 }
 
-TEST_F(IppManagerTest, HandleGetPrinterAttributes) {
+TEST_F(IppManagerTest, HandleGetPrinterAttributesNoneMatching) {
   IppHeader header = CreateTestHeader();
   header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
+  IppRequest request;
+  request.header = header;
+  request.operation_attributes = {
+      {"requested-attributes", {"missing attribute"}}};
 
-  SmartBuffer response = ipp_manager_.HandleIppRequest(header, SmartBuffer());
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
   base::Optional<IppHeader> response_header = IppHeader::Deserialize(&response);
   EXPECT_TRUE(response_header);
-  EXPECT_EQ(response_header.value().operation_id, IppManager::kSuccessStatus);
 
+  // The printer attributes group is present but empty.
   SmartBuffer expected_response;
   expected_response.Add(serialized_operation_);
-  expected_response.Add(serialized_printer_);
+  AddPrinterAttributes({}, kPrinterAttributes, &expected_response);
   AddEndOfAttributes(&expected_response);
   EXPECT_EQ(response.contents(), expected_response.contents());
 }
+
+TEST_F(IppManagerTest, HandleGetPrinterAttributesAll) {
+  IppHeader header = CreateTestHeader();
+  header.operation_id = IPP_GET_PRINTER_ATTRIBUTES;
+  IppRequest request;
+  request.header = header;
+  request.operation_attributes = {{"requested-attributes", {"all"}}};
+
+  SmartBuffer response = ipp_manager_.HandleIppRequest(request, SmartBuffer());
+  EXPECT_EQ(response.contents(),
+            ipp_manager_.HandleIppRequest(header, SmartBuffer()).contents());
+}
@@ -6,11 +6,14 @@
 
 #include <arpa/inet.h>
 
+#include <climits>
 #include <map>
-#include <set>
 #include <string>
+#include <utility>
 
 #include <base/optional.h>
+#include <base/stl_util.h>
+#include <base/strings/string_piece.h>
 #include <base/values.h>
 
 #include "http_util.h"
@@ -19,6 +22,185 @@
 
 namespace {
 
+// Returns whether |value| is a JSON value which can be serialized as a single
+// IPP value of the JSON type |type|.
+bool IsSerializable(const base::Value& value, base::Value::Type type) {
+  if (value.type() != type) {
+    return false;
+  }
+  return !value.is_string() || value.GetString().size() <= USHRT_MAX;
+}
+
+// Returns whether |value| is a single value of the JSON type |type| or a list
+// of them.
+bool IsValueOrListOf(const base::Value& value, base::Value::Type type) {
+  if (!value.is_list()) {
+    return IsSerializable(value, type);
+  }
+  for (const base::Value& item : value.GetList()) {
+    if (!IsSerializable(item, type)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns whether |value| is a list of |size| integers.
+bool IsIntegerList(const base::Value& value, size_t size) {
+  return value.is_list() && value.GetList().size() == size &&
+         IsValueOrListOf(value, base::Value::Type::INTEGER);
+}
+
+// Returns whether |value| is a list of integers which each fit in a byte.
+bool IsByteList(const base::Value& value) {
+  if (!value.is_list()) {
+    return false;
+  }
+  for (const base::Value& item : value.GetList()) {
+    if (!item.is_int() || item.GetInt() < 0 || item.GetInt() > UCHAR_MAX) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Each of these returns whether |value| can be serialized as an attribute of
+// the corresponding value types.
+bool IsValidString(const base::Value& value) {
+  return IsValueOrListOf(value, base::Value::Type::STRING);
+}
+
+bool IsValidInteger(const base::Value& value) {
+  return IsValueOrListOf(value, base::Value::Type::INTEGER);
+}
+
+bool IsValidBoolean(const base::Value& value) {
+  return IsValueOrListOf(value, base::Value::Type::BOOLEAN);
+}
+
+bool IsValidOctetString(const base::Value& value) {
+  return IsSerializable(value, base::Value::Type::STRING) ||
+         (IsByteList(value) && value.GetList().size() <= USHRT_MAX);
+}
+
+bool IsValidDate(const base::Value& value) {
+  return IsByteList(value) && value.GetList().size() == kDateTimeSize;
+}
+
+bool IsValidResolution(const base::Value& value) {
+  return IsIntegerList(value, 3) && value.GetList()[2].GetInt() >= 0 &&
+         value.GetList()[2].GetInt() <= UCHAR_MAX;
+}
+
+bool IsValidRange(const base::Value& value) {
+  return IsIntegerList(value, 2);
+}
+
+// Describes how the attributes of one IPP value type are serialized.
+struct ValueType {
+  // The name of the type in the JSON configuration.
+  const char* name;
+  IppTag tag;
+  // Whether a list of values is serialized as a single value, rather than as
+  // one value per element with the tag and name only given once.
+  bool single_value;
+  size_t (*get_size)(const IppAttribute& attribute);
+  void (*add)(const IppAttribute& attribute, SmartBuffer* buf);
+  // Returns whether a JSON value can be serialized by |add|.
+  bool (*is_valid)(const base::Value& value);
+};
+
+constexpr ValueType kValueTypes[] = {
+    {kUnsupported, IppTag::UNSUPPORTED_VALUE, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kNoValue, IppTag::NOVALUE, false, GetStringAttributeSize, AddString,
+     IsValidString},
+    {kInteger, IppTag::INTEGER, false, GetIntAttributeSize, AddInteger,
+     IsValidInteger},
+    {kBoolean, IppTag::BOOLEAN, false, GetBooleanAttributeSize, AddBoolean,
+     IsValidBoolean},
+    {kEnum, IppTag::ENUM, false, GetIntAttributeSize, AddInteger,
+     IsValidInteger},
+    {kOctetString, IppTag::STRING, true, GetOctetStringAttributeSize,
+     AddOctetString, IsValidOctetString},
+    {kDateTime, IppTag::DATE, true, GetDateTimeAttributeSize, AddDate,
+     IsValidDate},
+    {kResolution, IppTag::RESOLUTION, true, GetResolutionAttributeSize,
+     AddResolution, IsValidResolution},
+    {kRangeOfInteger, IppTag::RANGE, true, GetRangeOfIntegerAttributeSize,
+     AddRange, IsValidRange},
+    {kBegCollection, IppTag::BEGIN_COLLECTION, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kEndCollection, IppTag::END_COLLECTION, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kTextWithoutLanguage, IppTag::TEXT, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kNameWithoutLanguage, IppTag::NAME, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kKeyword, IppTag::KEYWORD, false, GetStringAttributeSize, AddString,
+     IsValidString},
+    {kUri, IppTag::URI, false, GetStringAttributeSize, AddString,
+     IsValidString},
+    {kCharset, IppTag::CHARSET, false, GetStringAttributeSize, AddString,
+     IsValidString},
+    {kNaturalLanguage, IppTag::LANGUAGE, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kMimeMediaType, IppTag::MIMETYPE, false, GetStringAttributeSize,
+     AddString, IsValidString},
+    {kMemberAttrName, IppTag::MEMBERNAME, false, GetStringAttributeSize,
+     AddString, IsValidString}};
+
+struct GroupTag {
+  // The key of the group in the JSON configuration.
+  const char* name;
+  IppTag tag;
+};
+
+constexpr GroupTag kGroupTags[] = {
+    {kOperationAttributes, IppTag::OPERATION},
+    {kUnsupportedAttributes, IppTag::UNSUPPORTED_GROUP},
+    {kPrinterAttributes, IppTag::PRINTER},
+    {kJobAttributes, IppTag::JOB}};
+
+// Maps each tag to the index of its entry in |kValueTypes|, or to -1 if it is
+// not the tag of a value type.
+struct ValueTypeIndex {
+  int8_t entries[256];
+};
+
+constexpr ValueTypeIndex CreateValueTypeIndex() {
+  ValueTypeIndex index = {};
+  for (size_t i = 0; i < base::size(index.entries); i++) {
+    index.entries[i] = -1;
+  }
+  for (size_t i = 0; i < base::size(kValueTypes); i++) {
+    index.entries[static_cast<uint8_t>(kValueTypes[i].tag)] = i;
+  }
+  return index;
+}
+
+constexpr ValueTypeIndex kValueTypeIndex = CreateValueTypeIndex();
+
+// Returns the entry in |table| with the given |name|, or nullptr if there is
+// none.
+template <typename T, size_t N>
+const T* FindByName(const T (&table)[N], base::StringPiece name) {
+  for (const T& entry : table) {
+    if (name == entry.name) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Returns how attributes with the value type |tag| are serialized.
+const ValueType& GetValueType(IppTag tag) {
+  int8_t index = kValueTypeIndex.entries[static_cast<uint8_t>(tag)];
+  CHECK_GE(index, 0) << "Tag " << static_cast<int>(tag)
+                     << " is not a value type";
+  return kValueTypes[index];
+}
+
 std::vector<IppAttribute> GetAttributes(const base::Value& attributes) {
   std::vector<IppAttribute> ipp_attributes;
   for (std::size_t i = 0; i < attributes.GetList().size(); ++i) {
@@ -82,16 +264,16 @@ void AddIntAttribute(int value, IppTag tag, const std::string& name,
 }
 
 // Adds the IPP attribute of type string to |buf|.
-void AddStringAttribute(const std::string& value, IppTag tag,
+void AddStringAttribute(base::StringPiece value, IppTag tag,
                         const std::string& name, bool include_name,
                         SmartBuffer* buf) {
   AddTag(tag, buf);
   AddName(name, include_name, buf);
   AddValueLength(value.size(), buf);
-  buf->Add(value.c_str(), value.size());
+  buf->Add(value.data(), value.size());
 }
 
-base::Optional<uint16_t> ReadShort(const std::vector<uint8_t>& bytes,
+base::Optional<uint16_t> ReadShort(const SmartBufferView& bytes,
                                    size_t start) {
   uint16_t value;
   if (start + sizeof(value) > bytes.size()) {
@@ -99,14 +281,14 @@ base::Optional<uint16_t> ReadShort(const std::vector<uint8_t>& bytes,
     return base::nullopt;
   }
 
-  memcpy(&value, &bytes[start], sizeof(value));
+  memcpy(&value, bytes.data() + start, sizeof(value));
   value = ntohs(value);
   return value;
 }
 
 // Get the length of an IPP attribute in |bytes| starting at index |start|.
 // If |bytes| does not contain a well-formed attribute, return nullopt.
-base::Optional<size_t> GetAttributeLength(const std::vector<uint8_t>& bytes,
+base::Optional<size_t> GetAttributeLength(const SmartBufferView& bytes,
                                           size_t start) {
   size_t i = start;
   base::Optional<uint16_t> name_length = ReadShort(bytes, i);
@@ -141,7 +323,7 @@ bool IsAttributeGroupTag(uint8_t tag) {
 // Get the length of an IPP attribute group in |bytes| starting at index
 // |start|. Do this by summing the lengths of each attribute within the group.
 // If |bytes| does not contain a well-formed attribute group, return nullopt.
-base::Optional<size_t> GetGroupLength(const std::vector<uint8_t>& bytes,
+base::Optional<size_t> GetGroupLength(const SmartBufferView& bytes,
                                       size_t start) {
   if (start >= bytes.size())
     return base::nullopt;
@@ -171,7 +353,7 @@ base::Optional<size_t> GetGroupLength(const std::vector<uint8_t>& bytes,
 // Get the length of the IPP attributes section at the beginning of |bytes|.
 // Do this by summing the lengths of each attribute group.
 // If |bytes| does not contain a well-formed attributes section, return nullopt.
-base::Optional<size_t> GetAttributesLength(const std::vector<uint8_t>& bytes) {
+base::Optional<size_t> GetAttributesLength(const SmartBufferView& bytes) {
   size_t i = 0;
   while (i < bytes.size()) {
     uint8_t tag = bytes[i++];
@@ -201,41 +383,85 @@ base::Optional<size_t> GetAttributesLength(const std::vector<uint8_t>& bytes) {
 IppAttribute::IppAttribute(const std::string& type,
                            const std::string& name,
                            const base::Value* value)
-    : type_(type), name_(name), value_(value) {}
-
-bool IppAttribute::IsList() const {
-  return value_->is_list();
+    : name_(name) {
+  const ValueType* value_type = FindByName(kValueTypes, type);
+  if (!value_type) {
+    LOG(ERROR) << "Found attribute with invalid type " << type;
+    exit(1);
+  }
+  tag_ = value_type->tag;
+  is_list_ = value->is_list();
+  if (is_list_) {
+    values_.reserve(value->GetList().size());
+    for (const base::Value& item : value->GetList()) {
+      AddValue(item);
+    }
+  } else {
+    AddValue(*value);
+  }
+  values_.shrink_to_fit();
+  strings_.shrink_to_fit();
+}
+
+void IppAttribute::AddValue(const base::Value& value) {
+  Value entry = {ValueKind::kOther, 0, 0};
+  if (value.is_bool()) {
+    entry.kind = ValueKind::kBool;
+    entry.number = value.GetBool();
+  } else if (value.is_int()) {
+    entry.kind = ValueKind::kInt;
+    entry.number = value.GetInt();
+  } else if (value.is_string()) {
+    const std::string& contents = value.GetString();
+    entry.kind = ValueKind::kString;
+    entry.size = contents.size();
+    entry.number = strings_.size();
+    strings_.append(contents);
+  }
+  values_.push_back(entry);
+}
+
+const IppAttribute::Value& IppAttribute::GetValue(
+    size_t index, ValueKind kind, const char* kind_name) const {
+  CHECK_LT(index, values_.size())
+      << "Value index " << index << " is out of range for " << name_;
+  const Value& value = values_[index];
+  if (is_list_) {
+    CHECK(value.kind == kind) << "Failed to retrieve " << kind_name
+                              << " value from " << name_ << " at index "
+                              << index;
+  } else {
+    CHECK(value.kind == kind)
+        << "Failed to retrieve " << kind_name << " value from " << name_;
+  }
+  return value;
 }
 
 size_t IppAttribute::GetListSize() const {
-  CHECK(value_->is_list()) << "Failed to retrieve list value from " << name_;
-  return value_->GetList().size();
+  CHECK(is_list_) << "Failed to retrieve list value from " << name_;
+  return values_.size();
 }
 
 bool IppAttribute::GetBool() const {
-  CHECK(value_->is_bool()) << "Failed to retrieve boolean value from " << name_;
-  return value_->GetBool();
+  CHECK(!is_list_) << "Failed to retrieve boolean value from " << name_;
+  return GetBoolAt(0);
 }
 
 int IppAttribute::GetInt() const {
-  CHECK(value_->is_int()) << "Failed to retrieve integer value from " << name_;
-  return value_->GetInt();
+  CHECK(!is_list_) << "Failed to retrieve integer value from " << name_;
+  return GetIntAt(0);
 }
 
 std::string IppAttribute::GetString() const {
-  CHECK(value_->is_string())
-      << "Failed to retrieve string value from " << name_;
-  return value_->GetString();
+  CHECK(!is_list_) << "Failed to retrieve string value from " << name_;
+  return std::string(GetStringAt(0));
 }
 
 std::vector<bool> IppAttribute::GetBools() const {
   std::size_t size = GetListSize();
   std::vector<bool> booleans(size);
   for (std::size_t i = 0; i < size; ++i) {
-    const base::Value& out = value_->GetList()[i];
-    CHECK(out.is_bool()) << "Failed to retrieve boolean value from " << name_
-                         << " at index " << i;
-    booleans[i] = out.GetBool();
+    booleans[i] = GetBoolAt(i);
   }
   return booleans;
 }
@@ -244,10 +470,7 @@ std::vector<int> IppAttribute::GetInts() const {
   std::size_t size = GetListSize();
   std::vector<int> integers(size);
   for (std::size_t i = 0; i < size; ++i) {
-    const base::Value& out = value_->GetList()[i];
-    CHECK(out.is_int()) << "Failed to retrieve integer value from " << name_
-                        << " at index " << i;
-    integers[i] = out.GetInt();
+    integers[i] = GetIntAt(i);
   }
   return integers;
 }
@@ -256,10 +479,7 @@ std::vector<std::string> IppAttribute::GetStrings() const {
   std::size_t size = GetListSize();
   std::vector<std::string> strings(size);
   for (std::size_t i = 0; i < size; ++i) {
-    const base::Value& out = value_->GetList()[i];
-    CHECK(out.is_string()) << "Failed to retrieve string value from " << name_
-                           << " at index " << i;
-    strings[i] = out.GetString();
+    strings[i] = std::string(GetStringAt(i));
   }
   return strings;
 }
@@ -268,10 +488,7 @@ std::vector<uint8_t> IppAttribute::GetBytes() const {
   std::size_t size = GetListSize();
   std::vector<uint8_t> bytes(size);
   for (std::size_t i = 0; i < size; ++i) {
-    const base::Value& item = value_->GetList()[i];
-    CHECK(item.is_int()) << "Failed to retrieve byte value from " << name_
-                         << " at index " << i;
-    int out = item.GetInt();
+    int out = GetValue(i, ValueKind::kInt, "byte").number;
     CHECK_GE(out, 0) << "Retrieved byte value is negative";
     CHECK_LE(out, UCHAR_MAX) << "Retrieved byte value is too large";
     bytes[i] = static_cast<uint8_t>(out);
@@ -279,10 +496,23 @@ std::vector<uint8_t> IppAttribute::GetBytes() const {
   return bytes;
 }
 
+bool IppAttribute::GetBoolAt(size_t index) const {
+  return GetValue(index, ValueKind::kBool, "boolean").number != 0;
+}
+
+int IppAttribute::GetIntAt(size_t index) const {
+  return GetValue(index, ValueKind::kInt, "integer").number;
+}
+
+base::StringPiece IppAttribute::GetStringAt(size_t index) const {
+  const Value& value = GetValue(index, ValueKind::kString, "string");
+  return base::StringPiece(strings_.data() + value.number, value.size);
+}
+
 bool operator==(const IppAttribute& lhs, const IppAttribute& rhs) {
-  // TODO(valleau): Add comparison for |value_| members once chromelib is
-  // updated and the operator is defined.
-  return lhs.type_ == rhs.type_ && lhs.name_ == rhs.name_;
+  return lhs.tag_ == rhs.tag_ && lhs.name_ == rhs.name_ &&
+         lhs.is_list_ == rhs.is_list_ && lhs.values_ == rhs.values_ &&
+         lhs.strings_ == rhs.strings_;
 }
 
 bool operator!=(const IppAttribute& lhs, const IppAttribute& rhs) {
@@ -291,6 +521,16 @@ bool operator!=(const IppAttribute& lhs, const IppAttribute& rhs) {
 
 // static
 base::Optional<IppHeader> IppHeader::Deserialize(SmartBuffer* message) {
+  SmartBufferView view(*message);
+  base::Optional<IppHeader> header = Deserialize(&view);
+  if (header) {
+    message->Erase(0, sizeof(IppHeader));
+  }
+  return header;
+}
+
+// static
+base::Optional<IppHeader> IppHeader::Deserialize(SmartBufferView* message) {
   // Ensure that |message| has enough bytes to copy into |header|.
   if (message->size() < sizeof(IppHeader))
     return base::nullopt;
@@ -302,7 +542,7 @@ base::Optional<IppHeader> IppHeader::Deserialize(SmartBuffer* message) {
   header.operation_id = ntohs(header.operation_id);
   header.request_id = ntohl(header.request_id);
 
-  message->Erase(0, sizeof(header));
+  message->RemovePrefix(sizeof(header));
   return header;
 }
 
@@ -314,16 +554,131 @@ void IppHeader::Serialize(SmartBuffer* buf) {
 }
 
 bool RemoveIppAttributes(SmartBuffer* buf) {
-  base::Optional<size_t> length = GetAttributesLength(buf->contents());
+  SmartBufferView view(*buf);
+  if (!RemoveIppAttributes(&view)) {
+    return false;
+  }
+
+  buf->Erase(0, buf->size() - view.size());
+  return true;
+}
+
+bool RemoveIppAttributes(SmartBufferView* buf) {
+  base::Optional<size_t> length = GetAttributesLength(*buf);
   if (!length) {
     LOG(ERROR) << "Buffer does not contain well-formed IPP attributes";
     return false;
   }
 
-  buf->Erase(0, length.value());
+  buf->RemovePrefix(length.value());
   return true;
 }
 
+base::Optional<IppRequest> ParseIppRequest(const SmartBufferView& message) {
+  IppParseError error;
+  base::Optional<IppRequest> request = ParseIppRequest(message, &error);
+  if (!request && error == IppParseError::kIncomplete) {
+    LOG(ERROR) << "Buffer does not contain a complete IPP header and "
+                  "attributes";
+  }
+  return request;
+}
+
+base::Optional<IppRequest> ParseIppRequest(const SmartBufferView& message,
+                                           IppParseError* error) {
+  SmartBufferView view = message;
+  base::Optional<IppHeader> header = IppHeader::Deserialize(&view);
+  if (!header) {
+    VLOG(1) << "Buffer does not contain an IPP header yet";
+    *error = IppParseError::kIncomplete;
+    return base::nullopt;
+  }
+
+  IppRequest request;
+  request.header = header.value();
+  // The group which the current attribute belongs to, or nullptr if its
+  // attributes are not returned.
+  IppRequestAttributes* group = nullptr;
+  bool in_group = false;
+  std::vector<base::StringPiece>* values = nullptr;
+  size_t i = 0;
+  while (true) {
+    if (i >= view.size()) {
+      VLOG(1) << "Reached end of buffer without finding END tag";
+      *error = IppParseError::kIncomplete;
+      return base::nullopt;
+    }
+    uint8_t tag = view[i++];
+    if (tag == static_cast<uint8_t>(IppTag::END)) {
+      break;
+    }
+    if (IsAttributeGroupTag(tag)) {
+      in_group = true;
+      if (tag == static_cast<uint8_t>(IppTag::OPERATION)) {
+        group = &request.operation_attributes;
+      } else if (tag == static_cast<uint8_t>(IppTag::JOB)) {
+        group = &request.job_attributes;
+      } else {
+        group = nullptr;
+      }
+      values = nullptr;
+      continue;
+    }
+    if (!in_group) {
+      LOG(ERROR) << "Invalid attribute group tag '" << static_cast<int>(tag)
+                 << "'";
+      *error = IppParseError::kMalformed;
+      return base::nullopt;
+    }
+
+    base::Optional<uint16_t> name_length = ReadShort(view, i);
+    if (!name_length || i + 2 + name_length.value() > view.size()) {
+      VLOG(1) << "Buffer ends in attribute name at index " << i;
+      *error = IppParseError::kIncomplete;
+      return base::nullopt;
+    }
+    base::StringPiece name(reinterpret_cast<const char*>(view.data() + i + 2),
+                           name_length.value());
+    i += 2 + name_length.value();
+    base::Optional<uint16_t> value_length = ReadShort(view, i);
+    if (!value_length || i + 2 + value_length.value() > view.size()) {
+      VLOG(1) << "Buffer ends in attribute value at index " << i;
+      *error = IppParseError::kIncomplete;
+      return base::nullopt;
+    }
+    base::StringPiece value(reinterpret_cast<const char*>(view.data() + i + 2),
+                            value_length.value());
+    i += 2 + value_length.value();
+
+    if (!group) {
+      continue;
+    }
+    // An attribute without a name is an additional value of the previous
+    // attribute.
+    if (!name.empty()) {
+      values = &(*group)[name];
+    }
+    if (values) {
+      values->push_back(value);
+    }
+  }
+
+  request.document_offset = message.size() - view.size() + i;
+  return request;
+}
+
+base::Optional<int> GetIntegerValue(const IppRequestAttributes& attributes,
+                                    base::StringPiece name) {
+  auto iter = attributes.find(name);
+  uint32_t network_value;
+  if (iter == attributes.end() || iter->second.size() != 1 ||
+      iter->second.front().size() != sizeof(network_value)) {
+    return base::nullopt;
+  }
+  memcpy(&network_value, iter->second.front().data(), sizeof(network_value));
+  return static_cast<int>(ntohl(network_value));
+}
+
 IppAttribute GetAttribute(const base::Value& attribute) {
   CHECK(attribute.is_dict())
       << "Failed to retrieve dictionary value from attributes";
@@ -349,37 +704,58 @@ std::vector<IppAttribute> GetAttributes(const base::Value& attributes,
   return GetAttributes(*attributes_list);
 }
 
+base::Optional<std::vector<IppAttribute>> ParseAttributes(
+    const base::Value& attributes, const std::string& key) {
+  if (!attributes.is_dict()) {
+    LOG(ERROR) << "Failed to retrieve dictionary value from attributes";
+    return base::nullopt;
+  }
+  const base::Value* attributes_list = attributes.FindListKey(key);
+  if (!attributes_list) {
+    LOG(ERROR) << "Failed to extract attributes list for key " << key;
+    return base::nullopt;
+  }
+
+  std::vector<IppAttribute> ipp_attributes;
+  for (size_t i = 0; i < attributes_list->GetList().size(); ++i) {
+    const base::Value& attribute = attributes_list->GetList()[i];
+    if (!attribute.is_dict()) {
+      LOG(ERROR) << "Attribute " << i << " of " << key
+                 << " is not a dictionary";
+      return base::nullopt;
+    }
+    const std::string* type = attribute.FindStringKey(kTypeKey);
+    const std::string* name = attribute.FindStringKey(kNameKey);
+    const base::Value* value = attribute.FindKey(kValueKey);
+    if (!type || !name || !value) {
+      LOG(ERROR) << "Attribute " << i << " of " << key
+                 << " is missing its type, name or value";
+      return base::nullopt;
+    }
+    const ValueType* value_type = FindByName(kValueTypes, *type);
+    if (!value_type) {
+      LOG(ERROR) << "Found attribute with invalid type " << *type;
+      return base::nullopt;
+    }
+    if (name->size() > USHRT_MAX || !value_type->is_valid(*value)) {
+      LOG(ERROR) << "Attribute " << *name << " does not have a valid "
+                 << *type << " value";
+      return base::nullopt;
+    }
+    ipp_attributes.emplace_back(*type, *name, value);
+  }
+  return ipp_attributes;
+}
+
 IppTag GetIppTag(const std::string& name) {
-  std::map<std::string, IppTag> tags = {
-      {kOperationAttributes, IppTag::OPERATION},
-      {kUnsupportedAttributes, IppTag::UNSUPPORTED_GROUP},
-      {kPrinterAttributes, IppTag::PRINTER},
-      {kJobAttributes, IppTag::JOB},
-      {kUnsupported, IppTag::UNSUPPORTED_VALUE},
-      {kNoValue, IppTag::NOVALUE},
-      {kInteger, IppTag::INTEGER},
-      {kBoolean, IppTag::BOOLEAN},
-      {kEnum, IppTag::ENUM},
-      {kOctetString, IppTag::STRING},
-      {kDateTime, IppTag::DATE},
-      {kResolution, IppTag::RESOLUTION},
-      {kRangeOfInteger, IppTag::RANGE},
-      {kBegCollection, IppTag::BEGIN_COLLECTION},
-      {kEndCollection, IppTag::END_COLLECTION},
-      {kTextWithoutLanguage, IppTag::TEXT},
-      {kNameWithoutLanguage, IppTag::NAME},
-      {kKeyword, IppTag::KEYWORD},
-      {kUri, IppTag::URI},
-      {kCharset, IppTag::CHARSET},
-      {kNaturalLanguage, IppTag::LANGUAGE},
-      {kMimeMediaType, IppTag::MIMETYPE},
-      {kMemberAttrName, IppTag::MEMBERNAME}};
-  auto iter = tags.find(name);
-  if (iter == tags.end()) {
-    LOG(ERROR) << "Given unknown tag name " << name;
-    exit(1);
+  if (const GroupTag* group = FindByName(kGroupTags, name)) {
+    return group->tag;
   }
-  return iter->second;
+  if (const ValueType* value_type = FindByName(kValueTypes, name)) {
+    return value_type->tag;
+  }
+  LOG(ERROR) << "Given unknown tag name " << name;
+  exit(1);
 }
 
 void AddEndOfAttributes(SmartBuffer* buf) {
@@ -390,51 +766,41 @@ void AddEndOfAttributes(SmartBuffer* buf) {
 
 void AddPrinterAttributes(const std::vector<IppAttribute>& ipp_attributes,
                           const std::string& group, SmartBuffer* buf) {
-  std::map<std::string,
-           std::function<void(const IppAttribute&, SmartBuffer*)>>
-      function_map = {{kUnsupported, AddString},
-                      {kNoValue, AddString},
-                      {kInteger, AddInteger},
-                      {kBoolean, AddBoolean},
-                      {kEnum, AddInteger},
-                      {kOctetString, AddOctetString},
-                      {kDateTime, AddDate},
-                      {kResolution, AddResolution},
-                      {kRangeOfInteger, AddRange},
-                      {kBegCollection, AddString},
-                      {kEndCollection, AddString},
-                      {kTextWithoutLanguage, AddString},
-                      {kNameWithoutLanguage, AddString},
-                      {kKeyword, AddString},
-                      {kUri, AddString},
-                      {kCharset, AddString},
-                      {kNaturalLanguage, AddString},
-                      {kMimeMediaType, AddString},
-                      {kMemberAttrName, AddString}};
-
   // Add attribute group tag.
   IppTag group_tag = GetIppTag(group);
   uint8_t tag = static_cast<uint8_t>(group_tag);
   buf->Add(&tag, sizeof(tag));
 
+  AddAttributes(ipp_attributes, buf);
+}
+
+void AddAttributes(const std::vector<IppAttribute>& ipp_attributes,
+                   SmartBuffer* buf) {
   for (const IppAttribute& attribute : ipp_attributes) {
-    auto iter = function_map.find(attribute.type());
-    if (iter == function_map.end()) {
-      LOG(ERROR) << "Found attribute with invalid type " << attribute.type();
-      exit(1);
-    }
-    const auto& add_function = iter->second;
-    add_function(attribute, buf);
+    GetValueType(attribute.tag()).add(attribute, buf);
   }
 }
 
+void AddIntegerValue(IppTag tag, const std::string& name, int value,
+                     SmartBuffer* buf) {
+  AddIntAttribute(value, tag, name, true /* include_name */, buf);
+}
+
+void AddBooleanValue(const std::string& name, bool value, SmartBuffer* buf) {
+  AddBooleanAttribute(value, IppTag::BOOLEAN, name, true /* include_name */,
+                      buf);
+}
+
+void AddStringValue(IppTag tag, const std::string& name,
+                    base::StringPiece value, SmartBuffer* buf) {
+  AddStringAttribute(value, tag, name, true /* include_name */, buf);
+}
+
 size_t GetBaseAttributeSize(const IppAttribute& attribute) {
   size_t multiplier = 1;
-  // These types are special cases where although the values may be stored in a
+  // Some types are special cases where although the values may be stored in a
   // list form, the tag and name fields only appear once.
-  std::set<std::string> exempt = {kDateTime, kOctetString, kResolution,
-                                  kRangeOfInteger};
-  if (attribute.IsList() && exempt.find(attribute.type()) == exempt.end()) {
+  if (attribute.IsList() && !GetValueType(attribute.tag()).single_value) {
     multiplier = attribute.GetListSize();
   }
   // There are 3 elements which are repeated multiple times for each value in
@@ -469,14 +835,8 @@ size_t GetIntAttributeSize(const IppAttribute& attribute) {
 
 size_t GetStringAttributeSize(const IppAttribute& attribute) {
   size_t total_size = GetBaseAttributeSize(attribute);
-  if (attribute.IsList()) {
-    const std::vector<std::string> values = attribute.GetStrings();
-    for (const std::string& value : values) {
-      total_size += value.size();
-    }
-  } else {
-    const std::string value = attribute.GetString();
-    total_size += value.size();
+  for (size_t i = 0; i < attribute.GetValueCount(); ++i) {
+    total_size += attribute.GetStringAt(i).size();
   }
   return total_size;
 }
@@ -486,8 +846,7 @@ size_t GetOctetStringAttributeSize(const IppAttribute& attribute) {
   if (attribute.IsList()) {
     total_size += attribute.GetListSize();
   } else {
-    const std::string value = attribute.GetString();
-    total_size += value.size();
+    total_size += attribute.GetStringAt(0).size();
   }
   return total_size;
 }
@@ -505,90 +864,46 @@ size_t GetRangeOfIntegerAttributeSize(const IppAttribute& attribute) {
 }
 
 size_t GetAttributesSize(const std::vector<IppAttribute>& attributes) {
-  std::map<std::string, std::function<size_t(const IppAttribute&)>>
-      function_map = {{kUnsupported, GetStringAttributeSize},
-                      {kNoValue, GetStringAttributeSize},
-                      {kInteger, GetIntAttributeSize},
-                      {kBoolean, GetBooleanAttributeSize},
-                      {kEnum, GetIntAttributeSize},
-                      {kOctetString, GetOctetStringAttributeSize},
-                      {kDateTime, GetDateTimeAttributeSize},
-                      {kResolution, GetResolutionAttributeSize},
-                      {kRangeOfInteger, GetRangeOfIntegerAttributeSize},
-                      {kBegCollection, GetStringAttributeSize},
-                      {kEndCollection, GetStringAttributeSize},
-                      {kTextWithoutLanguage, GetStringAttributeSize},
-                      {kNameWithoutLanguage, GetStringAttributeSize},
-                      {kKeyword, GetStringAttributeSize},
-                      {kUri, GetStringAttributeSize},
-                      {kCharset, GetStringAttributeSize},
-                      {kNaturalLanguage, GetStringAttributeSize},
-                      {kMimeMediaType, GetStringAttributeSize},
-                      {kMemberAttrName, GetStringAttributeSize}};
   size_t total_size = 0;
   for (const IppAttribute& attribute : attributes) {
-    auto iter = function_map.find(attribute.type());
-    if (iter == function_map.end()) {
-      LOG(ERROR) << "Found attribute with invalid type " << attribute.type();
-      exit(1);
-    }
-    const auto& size_function = iter->second;
-    total_size += size_function(attribute);
+    total_size += GetValueType(attribute.tag()).get_size(attribute);
   }
   return total_size;
 }
 
 void AddBoolean(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
-  if (attribute.IsList()) {
-    std::vector<bool> values = attribute.GetBools();
-    for (size_t i = 0; i < values.size(); ++i) {
-      // We only include the name of the attribute for the first value.
-      bool include_name = (i == 0);
-      AddBooleanAttribute(values[i], tag, name, include_name, buf);
-    }
-  } else {
-    bool value = attribute.GetBool();
-    AddBooleanAttribute(value, tag, name, true, buf);
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
+  for (size_t i = 0; i < attribute.GetValueCount(); ++i) {
+    // We only include the name of the attribute for the first value.
+    bool include_name = (i == 0);
+    AddBooleanAttribute(attribute.GetBoolAt(i), tag, name, include_name, buf);
   }
 }
 
 void AddInteger(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
-  if (attribute.IsList()) {
-    std::vector<int> values = attribute.GetInts();
-    for (size_t i = 0; i < values.size(); ++i) {
-      // We only include the name of the attribute for the first value.
-      bool include_name = (i == 0);
-      AddIntAttribute(values[i], tag, name, include_name, buf);
-    }
-  } else {
-    int value = attribute.GetInt();
-    AddIntAttribute(value, tag, name, true, buf);
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
+  for (size_t i = 0; i < attribute.GetValueCount(); ++i) {
+    // We only include the name of the attribute for the first value.
+    bool include_name = (i == 0);
+    AddIntAttribute(attribute.GetIntAt(i), tag, name, include_name, buf);
   }
 }
 
 void AddString(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
-  if (attribute.IsList()) {
-    std::vector<std::string> values = attribute.GetStrings();
-    for (size_t i = 0; i < values.size(); ++i) {
-      // We only include the name of the attribute for the first value.
-      bool include_name = (i == 0);
-      AddStringAttribute(values[i], tag, name, include_name, buf);
-    }
-  } else {
-    std::string value = attribute.GetString();
-    AddStringAttribute(value, tag, name, true, buf);
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
+  for (size_t i = 0; i < attribute.GetValueCount(); ++i) {
+    // We only include the name of the attribute for the first value.
+    bool include_name = (i == 0);
+    AddStringAttribute(attribute.GetStringAt(i), tag, name, include_name, buf);
   }
 }
 
 void AddOctetString(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
   if (attribute.IsList()) {
     std::vector<uint8_t> values = attribute.GetBytes();
     AddTag(tag, buf);
@@ -596,14 +911,13 @@ void AddOctetString(const IppAttribute& attribute, SmartBuffer* buf) {
     AddValueLength(values.size(), buf);
     buf->Add(values.data(), values.size());
   } else {
-    std::string value = attribute.GetString();
-    AddStringAttribute(value, tag, name, true, buf);
+    AddStringAttribute(attribute.GetStringAt(0), tag, name, true, buf);
   }
 }
 
 void AddDate(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
   CHECK(attribute.IsList()) << "Date value is in an incorrect format";
 
   AddTag(tag, buf);
@@ -615,8 +929,8 @@ void AddDate(const IppAttribute& attribute, SmartBuffer* buf) {
 }
 
 void AddRange(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
 
   CHECK(attribute.IsList()) << "Range value is in an incorrect format";
   std::vector<int> range = attribute.GetInts();
@@ -634,8 +948,8 @@ void AddRange(const IppAttribute& attribute, SmartBuffer* buf) {
 }
 
 void AddResolution(const IppAttribute& attribute, SmartBuffer* buf) {
-  IppTag tag = GetIppTag(attribute.type());
-  const std::string name = attribute.name();
+  IppTag tag = attribute.tag();
+  const std::string& name = attribute.name();
 
   CHECK(attribute.IsList()) << "Resolution value is in an incorrect format";
   std::vector<int> resolution = attribute.GetInts();
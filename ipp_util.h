@@ -5,10 +5,14 @@
 #ifndef IPP_UTIL_H__
 #define IPP_UTIL_H__
 
+#include <cstdint>
 #include <cstring>
+#include <map>
 #include <string>
 #include <vector>
 
+#include <base/optional.h>
+#include <base/strings/string_piece.h>
 #include <base/values.h>
 
 #include "cups_constants.h"
@@ -55,21 +59,20 @@ const size_t kRangeOfIntegerSize = 8;
 const size_t kResolutionSize = 9;
 
 // Represents a single IPP attribute loaded from the JSON configuration file.
-// Serves as an accessor for the underlying base::Value object. This class does
-// not own the base::Value object and must not outlive it.
+// The attribute keeps its own copy of the values in the base::Value object it
+// was created from, so the base::Value may be destroyed once it is loaded.
+// Booleans and integers are stored inline, and the contents of every string
+// value are packed together into a single buffer.
 class IppAttribute {
  public:
   explicit IppAttribute(const std::string& type,
                         const std::string& name,
                         const base::Value* value);
 
-  std::string type() const { return type_; }
-  std::string name() const { return name_; }
-  const base::Value* value() const { return value_; }
+  IppTag tag() const { return tag_; }
+  const std::string& name() const { return name_; }
 
-  const char* name_cstr() const { return name_.c_str(); }
-
-  bool IsList() const;
+  bool IsList() const { return is_list_; }
   size_t GetListSize() const;
 
   bool GetBool() const;
@@ -81,13 +84,46 @@ class IppAttribute {
   std::vector<std::string> GetStrings() const;
   std::vector<uint8_t> GetBytes() const;
 
+  // Access the value at |index| without copying the whole list. These may be
+  // used for lists and, with an |index| of 0, for single values.
+  size_t GetValueCount() const { return values_.size(); }
+  bool GetBoolAt(size_t index) const;
+  int GetIntAt(size_t index) const;
+  base::StringPiece GetStringAt(size_t index) const;
+
   bool friend operator==(const IppAttribute& lhs, const IppAttribute& rhs);
   bool friend operator!=(const IppAttribute& lhs, const IppAttribute& rhs);
 
  private:
-  std::string type_;
+  // The type of JSON value which each value was given as.
+  enum class ValueKind : uint8_t { kBool, kInt, kString, kOther };
+
+  struct Value {
+    ValueKind kind;
+    // The length of a string value.
+    uint32_t size;
+    // The value of a boolean or integer, or the offset of a string value in
+    // |strings_|.
+    int number;
+
+    bool operator==(const Value& other) const {
+      return kind == other.kind && size == other.size && number == other.number;
+    }
+  };
+
+  // Returns the value at |index|, which must have been given as |kind|.
+  // |kind_name| names the kind in the error message used if it was not.
+  const Value& GetValue(size_t index,
+                        ValueKind kind,
+                        const char* kind_name) const;
+
+  void AddValue(const base::Value& value);
+
+  IppTag tag_;
+  bool is_list_;
   std::string name_;
-  const base::Value* value_;
+  std::vector<Value> values_;
+  std::string strings_;
 };
 
 class IppHeader {
@@ -98,6 +134,10 @@ class IppHeader {
   // If unsuccessful, does not modify |message|.
   static base::Optional<IppHeader> Deserialize(SmartBuffer* message);
 
+  // Same as above, but advances the view |message| past the header instead of
+  // modifying the underlying buffer.
+  static base::Optional<IppHeader> Deserialize(SmartBufferView* message);
+
   // Append this IppHeader to |buf|.
   void Serialize(SmartBuffer* buf);
 
@@ -117,6 +157,56 @@ class IppHeader {
 // attributes.
 bool RemoveIppAttributes(SmartBuffer* buf);
 
+// Same as above, but advances the view |buf| past the attributes instead of
+// modifying the underlying buffer.
+bool RemoveIppAttributes(SmartBufferView* buf);
+
+// The attributes sent in one group of an IPP request, mapping the name of each
+// attribute to its values. The names and values point into the buffer which the
+// request was parsed from. Each value is the raw bytes received, so keywords
+// and other string types can be used directly.
+using IppRequestAttributes =
+    std::map<base::StringPiece, std::vector<base::StringPiece>>;
+
+// An IPP request parsed in place. The attributes point into the buffer which
+// the request was parsed from, so that buffer must outlive the request.
+struct IppRequest {
+  IppHeader header;
+  IppRequestAttributes operation_attributes;
+  IppRequestAttributes job_attributes;
+  // The offset in the parsed buffer of the document data which follows the
+  // attributes.
+  size_t document_offset = 0;
+};
+
+// Parses the IPP header and attributes at the beginning of |message| in a
+// single pass, without copying them. Attributes in groups other than the
+// operation and job attributes groups are validated but not returned.
+// Returns nullopt if |message| does not start with a header followed by
+// well-formed IPP attributes.
+base::Optional<IppRequest> ParseIppRequest(const SmartBufferView& message);
+
+// Why ParseIppRequest failed for a message which may still be arriving.
+enum class IppParseError {
+  // |message| ends before the end of the attributes, but is otherwise
+  // well-formed, so the rest of the request may still arrive.
+  kIncomplete,
+  // |message| can never form a valid request however much more is received.
+  kMalformed,
+};
+
+// Same as above, but for a request which may only have been partly received.
+// On failure the reason is stored in |error|, and an incomplete request is
+// only logged at verbose level since it is expected while a request arrives.
+base::Optional<IppRequest> ParseIppRequest(const SmartBufferView& message,
+                                           IppParseError* error);
+
+// Returns the value of the integer or enum attribute |name| in |attributes|, or
+// nullopt if the attribute was not sent or does not have a single integer
+// value.
+base::Optional<int> GetIntegerValue(const IppRequestAttributes& attributes,
+                                    base::StringPiece name);
+
 // Construct an IppAttribute object for the given |attribute| which should be a
 // JSON representation of a single IPP attribute.
 IppAttribute GetAttribute(const base::Value& attribute);
@@ -125,6 +215,14 @@ IppAttribute GetAttribute(const base::Value& attribute);
 std::vector<IppAttribute> GetAttributes(const base::Value& attributes,
                                         const std::string& key);
 
+// Same as GetAttributes, but checks that every attribute has a known type, a
+// name and a value which can be serialized as that type instead of exiting if
+// one does not. Returns nullopt if |attributes| has no list for |key| or any
+// of its attributes is invalid, so that a mistake in a configuration which is
+// reloaded while the printer is running does not stop the process.
+base::Optional<std::vector<IppAttribute>> ParseAttributes(
+    const base::Value& attributes, const std::string& key);
+
 // Converts the |name| of a tag into its corresponding value from cups.
 IppTag GetIppTag(const std::string& group);
 
@@ -133,6 +231,20 @@ void AddEndOfAttributes(SmartBuffer* buf);
 void AddPrinterAttributes(const std::vector<IppAttribute>& ipp_attributes,
                           const std::string& group, SmartBuffer* buf);
 
+// Same as above, but only adds the attributes themselves without the tag
+// which starts their group.
+void AddAttributes(const std::vector<IppAttribute>& ipp_attributes,
+                   SmartBuffer* buf);
+
+// Adds an attribute |name| with the single |value| of the type |tag| to |buf|.
+// These are used for attributes which are generated for each response rather
+// than loaded from the configuration.
+void AddIntegerValue(IppTag tag, const std::string& name, int value,
+                     SmartBuffer* buf);
+void AddBooleanValue(const std::string& name, bool value, SmartBuffer* buf);
+void AddStringValue(IppTag tag, const std::string& name,
+                    base::StringPiece value, SmartBuffer* buf);
+
 // Determine the number of bytes required to write the portion of |attribute|
 // which is the same regardless of the underlying value type to a buffer.
 size_t GetBaseAttributeSize(const IppAttribute& attribute);
@@ -143,6 +255,9 @@ size_t GetBooleanAttributeSize(const IppAttribute& attribute);
 size_t GetIntAttributeSize(const IppAttribute& attribute);
 size_t GetStringAttributeSize(const IppAttribute& attribute);
 size_t GetOctetStringAttributeSize(const IppAttribute& attribute);
+size_t GetDateTimeAttributeSize(const IppAttribute& attribute);
+size_t GetResolutionAttributeSize(const IppAttribute& attribute);
+size_t GetRangeOfIntegerAttributeSize(const IppAttribute& attribute);
 size_t GetAttributesSize(const std::vector<IppAttribute>& attribute);
 
 void AddBoolean(const IppAttribute& attribute, SmartBuffer* buf);
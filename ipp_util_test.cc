@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <cstring>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <gmock/gmock.h>
@@ -51,9 +52,36 @@ TEST(IppAttributeEquality, DifferentNames) {
   EXPECT_NE(value1, value2);
 }
 
-// TODO(valleau): Add a test case for inequality when the actual value members
-// differ once chromelib is updated and the equality operator for base::Value is
-// defined.
+TEST(IppAttributeEquality, DifferentValues) {
+  base::Optional<base::Value> val1 = GetJSONValue(R"(["a", "b"])");
+  base::Optional<base::Value> val2 = GetJSONValue(R"(["ab", ""])");
+  IppAttribute value1("keyword", "test-attribute", &(val1.value()));
+  IppAttribute value2("keyword", "test-attribute", &(val2.value()));
+  EXPECT_NE(value1, value2);
+}
+
+TEST(IppAttribute, InvalidType) {
+  base::Optional<base::Value> val = GetJSONValue("123");
+  EXPECT_DEATH(IppAttribute("printerAttributes", "test-attribute", &(*val)),
+               "Found attribute with invalid type");
+}
+
+// Attributes keep their own copy of their values, so they can be used after the
+// configuration they were loaded from is destroyed.
+TEST(IppAttribute, OutlivesValue) {
+  base::Optional<base::Value> value = GetJSONValue(R"(
+    { "type": "keyword", "name": "sides-supported",
+      "value": [ "one-sided", "two-sided-long-edge" ] }
+  )");
+  IppAttribute attribute = GetAttribute(*value);
+  value.reset();
+
+  EXPECT_EQ(attribute.tag(), IppTag::KEYWORD);
+  EXPECT_EQ(attribute.name(), "sides-supported");
+  ASSERT_EQ(attribute.GetValueCount(), 2);
+  EXPECT_EQ(attribute.GetStringAt(0), "one-sided");
+  EXPECT_EQ(attribute.GetStringAt(1), "two-sided-long-edge");
+}
 
 TEST(IppHeader, DeserializeValid) {
   std::vector<uint8_t> message = {0x02, 0x00, 0x00, 0x06, 0x00, 0x00,
@@ -163,6 +191,138 @@ TEST(RemoveAttributes, MultipleEndTags) {
   EXPECT_EQ(buf.contents(), expected);
 }
 
+TEST(ParseIppRequest, RequestedAttributes) {
+  std::string message =
+      // IPP header for Get-Printer-Attributes with request id 7.
+      "\x02\x00\x00\x0b\x00\x00\x00\x07"
+      // IPP attributes.
+      "\x01\x47\x00\x12"
+      "attributes-charset"
+      "\x00\x05"
+      "utf-8"
+      "\x44\x00\x14"
+      "requested-attributes"
+      "\x00\x0d"
+      "printer-state"
+      "\x44\x00\x00"
+      "\x00\x09"
+      "media-col\x03"
+      "test message"s;
+
+  SmartBuffer buf;
+  buf.Add(message);
+  base::Optional<IppRequest> request = ParseIppRequest(SmartBufferView(buf));
+  ASSERT_TRUE(request);
+
+  EXPECT_EQ(request->header.operation_id, IPP_GET_PRINTER_ATTRIBUTES);
+  EXPECT_EQ(request->header.request_id, 7);
+  IppRequestAttributes expected = {
+      {"attributes-charset", {"utf-8"}},
+      {"requested-attributes", {"printer-state", "media-col"}}};
+  EXPECT_EQ(request->operation_attributes, expected);
+  EXPECT_TRUE(request->job_attributes.empty());
+
+  std::string body = "test message";
+  EXPECT_EQ(message.substr(request->document_offset), body);
+}
+
+// The parsed attributes point into the buffer rather than being copied.
+TEST(ParseIppRequest, ViewsIntoBuffer) {
+  std::string message =
+      "\x02\x00\x00\x06\x00\x00\x00\x01"
+      "\x01\x49\x00\x0f"
+      "document-format"
+      "\x00\x0f"
+      "application/pdf\x03"s;
+
+  SmartBuffer buf;
+  buf.Add(message);
+  base::Optional<IppRequest> request = ParseIppRequest(SmartBufferView(buf));
+  ASSERT_TRUE(request);
+  const std::vector<base::StringPiece>& values =
+      request->operation_attributes["document-format"];
+  ASSERT_EQ(values.size(), 1);
+  EXPECT_EQ(values[0], "application/pdf");
+  EXPECT_EQ(reinterpret_cast<const uint8_t*>(values[0].data()),
+            buf.data() + message.find("application/pdf"));
+  EXPECT_EQ(request->document_offset, buf.size());
+}
+
+TEST(ParseIppRequest, SeparatesGroups) {
+  std::string message =
+      "\x02\x00\x00\x05\x00\x00\x00\x02"
+      // Operation attributes.
+      "\x01\x42\x00\x08"
+      "job-name"
+      "\x00\x04"
+      "test"
+      // Job attributes.
+      "\x02\x21\x00\x06"
+      "copies"
+      "\x00\x04"
+      "\x00\x00\x00\x02"
+      // Printer attributes, which are not returned.
+      "\x04\x44\x00\x05"
+      "sides"
+      "\x00\x09"
+      "one-sided\x03"s;
+
+  SmartBuffer buf;
+  buf.Add(message);
+  base::Optional<IppRequest> request = ParseIppRequest(SmartBufferView(buf));
+  ASSERT_TRUE(request);
+  IppRequestAttributes expected_operation = {{"job-name", {"test"}}};
+  IppRequestAttributes expected_job = {{"copies", {"\x00\x00\x00\x02"s}}};
+  EXPECT_EQ(request->operation_attributes, expected_operation);
+  EXPECT_EQ(request->job_attributes, expected_job);
+}
+
+TEST(ParseIppRequest, Malformed) {
+  const std::string header = "\x02\x00\x00\x0b\x00\x00\x00\x07"s;
+  const std::vector<std::string> messages = {
+      // Too short for a header.
+      "\x02\x00\x00\x0b"s,
+      // IPP attributes without an end tag.
+      header + "\x01\x47\x00\x12attributes-charset\x00\x05utf-8"s,
+      // An attribute outside of any group.
+      header + "\x47\x00\x01x\x00\x01y\x03"s,
+      // A value which is longer than the buffer.
+      header + "\x01\x47\x00\x01x\x00\x10y\x03"s,
+      // A name which is longer than the buffer.
+      header + "\x01\x47\x00\x40x"s,
+  };
+  for (const std::string& message : messages) {
+    SmartBuffer buf;
+    buf.Add(message);
+    EXPECT_FALSE(ParseIppRequest(SmartBufferView(buf)));
+  }
+}
+
+// A truncated request is reported as incomplete, while a request which can
+// never become valid is reported as malformed.
+TEST(ParseIppRequest, IncompleteOrMalformed) {
+  const std::string header = "\x02\x00\x00\x0b\x00\x00\x00\x07"s;
+  const std::vector<std::string> incomplete = {
+      "\x02\x00\x00\x0b"s,
+      header + "\x01\x47\x00\x12attributes-charset\x00\x05utf-8"s,
+      header + "\x01\x47\x00\x01x\x00\x10y"s,
+      header + "\x01\x47\x00\x40x"s,
+  };
+  for (const std::string& message : incomplete) {
+    SmartBuffer buf;
+    buf.Add(message);
+    IppParseError error = IppParseError::kMalformed;
+    EXPECT_FALSE(ParseIppRequest(SmartBufferView(buf), &error));
+    EXPECT_EQ(error, IppParseError::kIncomplete);
+  }
+
+  SmartBuffer buf;
+  buf.Add(header + "\x47\x00\x01x\x00\x01y\x03"s);
+  IppParseError error = IppParseError::kIncomplete;
+  EXPECT_FALSE(ParseIppRequest(SmartBufferView(buf), &error));
+  EXPECT_EQ(error, IppParseError::kMalformed);
+}
+
 TEST(RemoveAttributes, MultipleGroups) {
   std::string message =
       // IPP attributes.
@@ -220,6 +380,13 @@ TEST(GetIppTag, ValidTagName) {
   EXPECT_EQ(GetIppTag(kDateTime), IppTag::DATE);
 }
 
+TEST(GetIppTag, GroupNames) {
+  EXPECT_EQ(GetIppTag(kOperationAttributes), IppTag::OPERATION);
+  EXPECT_EQ(GetIppTag(kUnsupportedAttributes), IppTag::UNSUPPORTED_GROUP);
+  EXPECT_EQ(GetIppTag(kPrinterAttributes), IppTag::PRINTER);
+  EXPECT_EQ(GetIppTag(kJobAttributes), IppTag::JOB);
+}
+
 TEST(GetIppTag, InvalidTagName) {
   EXPECT_DEATH(GetIppTag("InvalidName"), "Given unknown tag name");
 }
@@ -323,6 +490,107 @@ TEST(GetAttributes, InvalidAttributes) {
                "Failed to extract attributes list for key");
 }
 
+TEST(ParseAttributes, ValidAttributes) {
+  const std::string json_contents = R"(
+    {
+      "printer_attributes": [{
+        "type": "charset",
+        "name": "charset-configured",
+        "value": "utf-8"
+      }, {
+        "type": "resolution",
+        "name": "printer-resolution-default",
+        "value": [ 300, 300, 3 ]
+      }]
+    }
+  )";
+  base::Optional<base::Value> value = GetJSONValue(json_contents);
+
+  base::Optional<std::vector<IppAttribute>> actual =
+      ParseAttributes(*value, "printer_attributes");
+
+  ASSERT_TRUE(actual);
+  EXPECT_EQ(*actual, GetAttributes(*value, "printer_attributes"));
+}
+
+TEST(ParseAttributes, InvalidAttributes) {
+  // Unlike GetAttributes, each of these cases returns nullopt rather than
+  // exiting.
+  base::Optional<base::Value> value1 = GetJSONValue("123");
+  EXPECT_FALSE(ParseAttributes(*value1, ""));
+
+  const std::string json_contents2 = R"(
+    {
+      "printer_attributes": [
+        { "type": "charset", "name": "charset-configured", "value": "utf-8" }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value2 = GetJSONValue(json_contents2);
+  EXPECT_FALSE(ParseAttributes(*value2, "operation_attributes"));
+
+  const std::string json_contents3 = R"(
+    {
+      "printer_attributes": [
+        { "type": "notAType", "name": "charset-configured", "value": "utf-8" }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value3 = GetJSONValue(json_contents3);
+  EXPECT_FALSE(ParseAttributes(*value3, "printer_attributes"));
+
+  const std::string json_contents4 = R"(
+    {
+      "printer_attributes": [
+        { "type": "charset", "value": "utf-8" }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value4 = GetJSONValue(json_contents4);
+  EXPECT_FALSE(ParseAttributes(*value4, "printer_attributes"));
+
+  // The value of each of these attributes can't be serialized as its type.
+  const std::string json_contents5 = R"(
+    {
+      "printer_attributes": [
+        { "type": "resolution", "name": "resolution", "value": 300 }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value5 = GetJSONValue(json_contents5);
+  EXPECT_FALSE(ParseAttributes(*value5, "printer_attributes"));
+
+  const std::string json_contents6 = R"(
+    {
+      "printer_attributes": [
+        { "type": "rangeOfInteger", "name": "range", "value": [ 1, 2, 3 ] }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value6 = GetJSONValue(json_contents6);
+  EXPECT_FALSE(ParseAttributes(*value6, "printer_attributes"));
+
+  const std::string json_contents7 = R"(
+    {
+      "printer_attributes": [
+        { "type": "keyword", "name": "keywords", "value": [ "a", 1 ] }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value7 = GetJSONValue(json_contents7);
+  EXPECT_FALSE(ParseAttributes(*value7, "printer_attributes"));
+
+  const std::string json_contents8 = R"(
+    {
+      "printer_attributes": [
+        { "type": "dateTime", "name": "date", "value": [ 7, 255, 256 ] }
+      ]
+    }
+  )";
+  base::Optional<base::Value> value8 = GetJSONValue(json_contents8);
+  EXPECT_FALSE(ParseAttributes(*value8, "printer_attributes"));
+}
+
 TEST(IppAttributeGetBool, ValidAttributes) {
   const std::string json_contents1 = R"(
     { "type": "boolean", "name": "color-supported", "value": false }
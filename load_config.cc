@@ -17,6 +17,7 @@
 #include <brillo/syslog_logging.h>
 
 #include "device_descriptors.h"
+#include "performance_model.h"
 #include "usbip_constants.h"
 
 namespace {
@@ -24,6 +25,22 @@ namespace {
 // Represents the maximum number of characters in a USB string descriptor.
 const size_t kMaxStringDescriptorSize = 126;
 
+// Extracts the non-negative number associated with |key| in
+// |performance|, or returns |default_value| if there is none.
+double GetRate(const base::Value& performance,
+               const std::string& key,
+               double default_value) {
+  const base::Value* value = performance.FindKey(key);
+  if (!value) {
+    return default_value;
+  }
+  CHECK(value->is_int() || value->is_double())
+      << "Performance value " << key << " is not a number";
+  CHECK_GE(value->GetDouble(), 0)
+      << "Performance value " << key << " is negative";
+  return value->GetDouble();
+}
+
 }  // namespace
 
 uint8_t GetByteValue(const base::Value& dict, const std::string& path) {
@@ -252,3 +269,37 @@ std::vector<char> GetIEEEDeviceId(const base::Value& printer) {
   ieee_device_id.insert(ieee_device_id.end(), message->begin(), message->end());
   return ieee_device_id;
 }
+
+PerformanceProfile GetPerformanceProfile(const base::Value& printer) {
+  PerformanceProfile profile;
+  const base::Value* performance = printer.FindKey("performance");
+  if (!performance) {
+    return profile;
+  }
+  CHECK(performance->is_dict())
+      << "Failed to extract performance object from printer config";
+  profile.pages_per_minute =
+      GetRate(*performance, "pages_per_minute", profile.pages_per_minute);
+  profile.bytes_per_page = static_cast<size_t>(
+      GetRate(*performance, "bytes_per_page", profile.bytes_per_page));
+  CHECK_GT(profile.bytes_per_page, 0) << "bytes_per_page must be positive";
+  profile.buffer_size = static_cast<size_t>(
+      GetRate(*performance, "buffer_size", profile.buffer_size));
+  profile.scan_megabytes_per_second =
+      GetRate(*performance, "scan_megabytes_per_second",
+              profile.scan_megabytes_per_second);
+
+  const base::Value* latencies =
+      performance->FindKey("ipp_operation_latency_ms");
+  if (latencies) {
+    CHECK(latencies->is_dict())
+        << "Failed to extract ipp_operation_latency_ms object from printer "
+           "config";
+    for (const auto& entry : latencies->DictItems()) {
+      profile.ipp_operation_latency[entry.first] =
+          base::TimeDelta::FromMillisecondsD(
+              GetRate(*latencies, entry.first, 0));
+    }
+  }
+  return profile;
+}
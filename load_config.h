@@ -12,6 +12,7 @@
 #include <base/values.h>
 
 #include "device_descriptors.h"
+#include "performance_model.h"
 #include "usbip_constants.h"
 
 // Extract the uint8_t value associated with the key |path| from |dict|.
@@ -64,4 +65,9 @@ std::vector<std::vector<char>> GetStringDescriptors(const base::Value& printer);
 // Extracts the IEEE Device ID from the given |printer| config JSON.
 std::vector<char> GetIEEEDeviceId(const base::Value& printer);
 
+// Extracts the performance profile from the optional "performance" object in
+// the given |printer| config JSON. If there is no such object then the default
+// profile, which does not simulate any limits, is returned.
+PerformanceProfile GetPerformanceProfile(const base::Value& printer);
+
 #endif  // LOAD_CONFIG_H__
@@ -7,12 +7,15 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <string>
 
+#include <base/time/time.h>
 #include <base/values.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 #include "device_descriptors.h"
+#include "performance_model.h"
 #include "usbip_constants.h"
 #include "value_util.h"
 
@@ -465,4 +468,66 @@ TEST(GetIEEEDeviceId, ValidDeviceId) {
   EXPECT_EQ(GetIEEEDeviceId(*value), expected);
 }
 
+TEST(GetPerformanceProfile, MissingProfile) {
+  base::Optional<base::Value> value = GetJSONValue("{}");
+  ASSERT_TRUE(value->is_dict()) << "Failed to extract value of type "
+                                << value->type() << " as dictionary";
+  PerformanceProfile profile = GetPerformanceProfile(*value);
+  EXPECT_EQ(profile.pages_per_minute, 0);
+  EXPECT_EQ(profile.bytes_per_page, kDefaultBytesPerPage);
+  EXPECT_EQ(profile.buffer_size, 0);
+  EXPECT_EQ(profile.scan_megabytes_per_second, 0);
+  EXPECT_TRUE(profile.ipp_operation_latency.empty());
+}
+
+TEST(GetPerformanceProfile, ValidProfile) {
+  const std::string json_contents = R"(
+    {
+      "performance": {
+        "pages_per_minute": 20,
+        "bytes_per_page": 100000,
+        "buffer_size": 262144,
+        "scan_megabytes_per_second": 2.5,
+        "ipp_operation_latency_ms": {
+          "Create-Job": 50,
+          "Get-Printer-Attributes": 12.5
+        }
+      }
+    }
+  )";
+  base::Optional<base::Value> value = GetJSONValue(json_contents);
+  ASSERT_TRUE(value->is_dict()) << "Failed to extract value of type "
+                                << value->type() << " as dictionary";
+  PerformanceProfile profile = GetPerformanceProfile(*value);
+  EXPECT_EQ(profile.pages_per_minute, 20);
+  EXPECT_EQ(profile.bytes_per_page, 100000);
+  EXPECT_EQ(profile.buffer_size, 262144);
+  EXPECT_EQ(profile.scan_megabytes_per_second, 2.5);
+  std::map<std::string, base::TimeDelta> expected_latency = {
+      {"Create-Job", base::TimeDelta::FromMilliseconds(50)},
+      {"Get-Printer-Attributes", base::TimeDelta::FromMicroseconds(12500)}};
+  EXPECT_EQ(profile.ipp_operation_latency, expected_latency);
+}
+
+TEST(GetPerformanceProfile, NegativeValue) {
+  const std::string json_contents = R"(
+    { "performance": { "pages_per_minute": -1 } }
+  )";
+  base::Optional<base::Value> value = GetJSONValue(json_contents);
+  ASSERT_TRUE(value->is_dict()) << "Failed to extract value of type "
+                                << value->type() << " as dictionary";
+  EXPECT_DEATH(GetPerformanceProfile(*value),
+               "pages_per_minute is negative");
+}
+
+TEST(GetPerformanceProfile, InvalidLatency) {
+  const std::string json_contents = R"(
+    { "performance": { "ipp_operation_latency_ms": { "Create-Job": "50" } } }
+  )";
+  base::Optional<base::Value> value = GetJSONValue(json_contents);
+  ASSERT_TRUE(value->is_dict()) << "Failed to extract value of type "
+                                << value->type() << " as dictionary";
+  EXPECT_DEATH(GetPerformanceProfile(*value), "Create-Job is not a number");
+}
+
 }  // namespace
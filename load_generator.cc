@@ -0,0 +1,869 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A load generator for virtual-usb-printer. It connects to the server as a
+// USBIP client, imports IPP over USB devices, and runs concurrent streams of
+// print jobs and scan jobs against them. Each stream uses its own IPP over USB
+// interface, since the HTTP messages sent on an interface can not be
+// interleaved. A device can only be imported by one client at a time, so the
+// streams on the interfaces of a device share a single connection, as the
+// interfaces of a real device share its USB bus. When every stream has
+// finished, the job rate, URB latency and throughput of the whole run are
+// reported.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/files/scoped_file.h>
+#include <base/location.h>
+#include <base/logging.h>
+#include <base/optional.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
+
+#include "cups_constants.h"
+#include "http_util.h"
+#include "ipp_util.h"
+#include "op_commands.h"
+#include "server.h"
+#include "smart_buffer.h"
+#include "usbip.h"
+#include "usbip_constants.h"
+
+namespace {
+
+// The size of each chunk of an IPP request, which matches the chunk size used
+// by CUPS.
+constexpr size_t kChunkSize = 4000;
+
+// The largest HTTP response header which is accepted from the printer.
+constexpr size_t kMaxResponseHeaderSize = 64 * 1024;
+
+// The most bytes of a response body which are kept, which is enough for the
+// IPP responses read by print jobs.
+constexpr size_t kMaxKeptBodySize = 64 * 1024;
+
+// The kinds of job which a stream can submit.
+enum class JobType { kPrint, kScan };
+
+class UsbipConnection;
+
+// An IPP over USB interface of an imported device, on which a stream runs.
+struct StreamTarget {
+  std::string bus_id;
+  int interface;
+  // The connection on which the device was imported, shared by every stream
+  // on the device.
+  UsbipConnection* connection;
+};
+
+// The settings shared by every stream.
+struct LoadSettings {
+  std::string host;
+  int port;
+  // If not empty, the Unix domain socket to connect to instead of |host|.
+  std::string unix_socket_path;
+  int jobs_per_stream;
+  size_t document_size;
+  size_t transfer_size;
+  std::string scan_format;
+  int scan_resolution;
+};
+
+// The results of a single stream.
+struct StreamStats {
+  int jobs = 0;
+  int failed_jobs = 0;
+  // The number of bytes of URB data sent and received.
+  uint64_t bytes = 0;
+  // The time taken by each URB, from sending its CMD_SUBMIT until its
+  // RET_SUBMIT and data were received.
+  std::vector<base::TimeDelta> urb_latencies;
+};
+
+// The parts of an HTTP response which are used to run a job.
+struct ReceivedResponse {
+  // The status code and reason, for example "201 Created".
+  std::string status;
+  HttpHeaders headers;
+  // The start of the body, up to kMaxKeptBodySize bytes.
+  SmartBuffer body;
+};
+
+// Sends all of |buf| on the blocking socket |fd|. SendBuffer is not used here
+// since it treats a failed write as fatal, while a connection closed by the
+// server should only fail the jobs of the streams which use it.
+bool SendAll(int fd, const SmartBuffer& buf) {
+  size_t sent = 0;
+  while (sent < buf.size()) {
+    ssize_t result =
+        send(fd, buf.data() + sent, buf.size() - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      PLOG(ERROR) << "Failed to send to server";
+      return false;
+    }
+    sent += result;
+  }
+  return true;
+}
+
+// Receives exactly |size| bytes from |fd| into |buf|.
+bool ReceiveAll(int fd, size_t size, SmartBuffer* buf) {
+  *buf = ReceiveBuffer(fd, size);
+  if (buf->size() != size) {
+    LOG(ERROR) << "Connection closed by server";
+    return false;
+  }
+  return true;
+}
+
+// Connects to the USBIP server listening on the Unix domain socket |path|.
+base::ScopedFD ConnectUnix(const std::string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "Unix socket path is too long: " << path;
+    return base::ScopedFD();
+  }
+  path.copy(address.sun_path, path.size());
+
+  base::ScopedFD fd(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Failed to create socket";
+    return base::ScopedFD();
+  }
+  if (connect(fd.get(), reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) < 0) {
+    PLOG(ERROR) << "Failed to connect to " << path;
+    return base::ScopedFD();
+  }
+  return fd;
+}
+
+// Connects to the USBIP server listening on |host|:|port|.
+base::ScopedFD Connect(const std::string& host, int port) {
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+    LOG(ERROR) << "Invalid IPv4 address " << host;
+    return base::ScopedFD();
+  }
+
+  base::ScopedFD fd(socket(AF_INET, SOCK_STREAM, 0));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Failed to create socket";
+    return base::ScopedFD();
+  }
+  if (connect(fd.get(), reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) < 0) {
+    PLOG(ERROR) << "Failed to connect to " << host << ":" << port;
+    return base::ScopedFD();
+  }
+  // Each URB waits for the reply to the one before it, so small commands must
+  // not be held back waiting to be coalesced.
+  int enable = 1;
+  setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  return fd;
+}
+
+// Connects to the server and imports the device exported as |bus_id|. Returns
+// the connection, and sets |device| to the description of the device, if
+// successful.
+base::ScopedFD ImportDevice(const LoadSettings& settings,
+                            const std::string& bus_id,
+                            OpRepDevice* device) {
+  base::ScopedFD fd = settings.unix_socket_path.empty()
+                          ? Connect(settings.host, settings.port)
+                          : ConnectUnix(settings.unix_socket_path);
+  if (!fd.is_valid()) {
+    return fd;
+  }
+
+  OpReqImport request;
+  CreateOpReqImport(bus_id, &request);
+  if (!SendAll(fd.get(), PackOpReqImport(request))) {
+    return base::ScopedFD();
+  }
+
+  // A failed import is reported using only the header.
+  SmartBuffer reply;
+  OpHeader header;
+  if (!ReceiveAll(fd.get(), sizeof(header), &reply)) {
+    return base::ScopedFD();
+  }
+  memcpy(&header, reply.data(), sizeof(header));
+  UnpackOpHeader(&header);
+  if (header.command != OP_REP_IMPORT_CMD || header.status != 0) {
+    LOG(ERROR) << "Failed to import device " << bus_id;
+    return base::ScopedFD();
+  }
+
+  if (!ReceiveAll(fd.get(), sizeof(*device), &reply)) {
+    return base::ScopedFD();
+  }
+  memcpy(device, reply.data(), sizeof(*device));
+  UnpackOpRepDevice(device);
+  return fd;
+}
+
+// A connection to the server on which a device has been imported. The streams
+// on the interfaces of the device submit URBs on it concurrently, so each
+// reply is matched to the URB it completes by its seqnum. Whichever waiting
+// stream is not already reading receives the next reply, and hands it over if
+// it belongs to another stream.
+class UsbipConnection {
+ public:
+  explicit UsbipConnection(base::ScopedFD fd)
+      : fd_(std::move(fd)), reply_received_(&lock_) {}
+  UsbipConnection(const UsbipConnection&) = delete;
+  UsbipConnection& operator=(const UsbipConnection&) = delete;
+
+  // Sends a CMD_SUBMIT for a bulk transfer and waits for its reply. |data| is
+  // sent for an OUT transfer, and for an IN transfer up to |in_length| bytes
+  // are received into |reply_data|.
+  bool Submit(int endpoint,
+              int direction,
+              const SmartBuffer& data,
+              UsbipRetSubmit* reply,
+              SmartBuffer* reply_data,
+              size_t in_length) {
+    UsbipCmdSubmit command;
+    memset(&command, 0, sizeof(command));
+    command.header.command = COMMAND_USBIP_CMD_SUBMIT;
+    command.header.direction = direction;
+    command.header.ep = endpoint;
+    command.transfer_buffer_length = direction == 0 ? data.size() : in_length;
+
+    {
+      // The seqnum is assigned while holding the send lock so that URBs are
+      // sent in the order of their seqnums.
+      base::AutoLock send_lock(send_lock_);
+      {
+        base::AutoLock lock(lock_);
+        command.header.seqnum = ++seqnum_;
+        urbs_[command.header.seqnum].direction = direction;
+      }
+      SmartBuffer message = PackUsbipCmdSubmit(command);
+      message.Add(data);
+      if (!SendAll(fd_.get(), message)) {
+        Fail();
+        return false;
+      }
+    }
+    return WaitForReply(command.header.seqnum, reply, reply_data);
+  }
+
+ private:
+  // A URB which has been submitted, and its reply once it has been received.
+  struct Urb {
+    int direction = 0;
+    bool completed = false;
+    UsbipRetSubmit reply;
+    SmartBuffer data;
+  };
+
+  // Waits until the reply to the URB |seqnum| has been received, reading
+  // replies from the connection whenever no other stream is. Must be called
+  // without |lock_| held.
+  bool WaitForReply(int seqnum, UsbipRetSubmit* reply, SmartBuffer* data) {
+    base::AutoLock lock(lock_);
+    while (true) {
+      auto urb = urbs_.find(seqnum);
+      if (urb != urbs_.end() && urb->second.completed) {
+        *reply = urb->second.reply;
+        *data = std::move(urb->second.data);
+        urbs_.erase(urb);
+        return true;
+      }
+      if (failed_) {
+        return false;
+      }
+      if (reading_) {
+        reply_received_.Wait();
+        continue;
+      }
+
+      reading_ = true;
+      bool received;
+      UsbipRetSubmit next;
+      SmartBuffer next_data;
+      {
+        base::AutoUnlock unlock(lock_);
+        received = ReadReply(&next, &next_data);
+      }
+      reading_ = false;
+      if (received) {
+        Urb& completed = urbs_[next.header.seqnum];
+        completed.completed = true;
+        completed.reply = next;
+        completed.data = std::move(next_data);
+      } else {
+        failed_ = true;
+      }
+      reply_received_.Broadcast();
+    }
+  }
+
+  // Receives the next RET_SUBMIT and the data which follows it. Must be called
+  // without |lock_| held, by one stream at a time.
+  bool ReadReply(UsbipRetSubmit* reply, SmartBuffer* data) {
+    SmartBuffer header;
+    if (!ReceiveAll(fd_.get(), sizeof(*reply), &header)) {
+      return false;
+    }
+    *reply = UnpackUsbipRetSubmit(&header);
+    int direction;
+    {
+      base::AutoLock lock(lock_);
+      auto urb = urbs_.find(reply->header.seqnum);
+      if (reply->header.command != COMMAND_USBIP_RET_SUBMIT ||
+          urb == urbs_.end() || urb->second.completed) {
+        LOG(ERROR) << "Unexpected reply to seqnum " << reply->header.seqnum;
+        return false;
+      }
+      direction = urb->second.direction;
+    }
+    if (direction == 1 && reply->status == 0 && reply->actual_length > 0 &&
+        !ReceiveAll(fd_.get(), reply->actual_length, data)) {
+      return false;
+    }
+    return true;
+  }
+
+  // Marks the connection as failed and wakes every waiting stream.
+  void Fail() {
+    base::AutoLock lock(lock_);
+    failed_ = true;
+    reply_received_.Broadcast();
+  }
+
+  base::ScopedFD fd_;
+  // Held while sending a URB, so that URBs are not interleaved on |fd_|.
+  base::Lock send_lock_;
+  // Guards the members below.
+  base::Lock lock_;
+  // Signalled whenever a reply has been received or the connection fails.
+  base::ConditionVariable reply_received_;
+  int seqnum_ = 0;
+  // The URBs which have been sent and whose replies have not been taken yet,
+  // by seqnum.
+  std::map<int, Urb> urbs_;
+  // Whether a stream is currently reading a reply from |fd_|.
+  bool reading_ = false;
+  // Whether sending or receiving on |fd_| has failed.
+  bool failed_ = false;
+};
+
+// The client used by a single stream, which submits URBs on the connection of
+// its device and records them in the stats of the stream.
+class UsbipClient {
+ public:
+  UsbipClient(UsbipConnection* connection, StreamStats* stats)
+      : connection_(connection), stats_(stats) {}
+
+  // Sends |data| to the bulk OUT endpoint |endpoint|. Returns whether all of
+  // |data| was accepted.
+  bool SendOut(int endpoint, const SmartBuffer& data) {
+    SmartBuffer reply_data;
+    UsbipRetSubmit reply;
+    if (!Submit(endpoint, 0, data, &reply, &reply_data)) {
+      return false;
+    }
+    return reply.actual_length == static_cast<int>(data.size());
+  }
+
+  // Receives up to |length| bytes from the bulk IN endpoint |endpoint| and
+  // appends them to |data|.
+  bool ReceiveIn(int endpoint, size_t length, SmartBuffer* data) {
+    SmartBuffer request(0);
+    UsbipRetSubmit reply;
+    SmartBuffer reply_data;
+    if (!Submit(endpoint, 1, request, &reply, &reply_data, length)) {
+      return false;
+    }
+    data->Add(reply_data);
+    return true;
+  }
+
+ private:
+  // Submits a bulk transfer on |connection_| and records its latency and size.
+  bool Submit(int endpoint,
+              int direction,
+              const SmartBuffer& data,
+              UsbipRetSubmit* reply,
+              SmartBuffer* reply_data,
+              size_t in_length = 0) {
+    base::TimeTicks start = base::TimeTicks::Now();
+    if (!connection_->Submit(endpoint, direction, data, reply, reply_data,
+                             in_length)) {
+      return false;
+    }
+    if (reply->status != 0) {
+      LOG(ERROR) << "URB failed with status " << reply->status;
+      return false;
+    }
+    stats_->urb_latencies.push_back(base::TimeTicks::Now() - start);
+    stats_->bytes += direction == 0 ? data.size() : reply_data->size();
+    return true;
+  }
+
+  UsbipConnection* connection_;
+  StreamStats* stats_;
+};
+
+// Parses the status line and headers of an HTTP response from |header|, which
+// does not include the blank line which ends it.
+base::Optional<ReceivedResponse> ParseResponseHeader(base::StringPiece header) {
+  std::vector<base::StringPiece> lines = base::SplitStringPieceUsingSubstr(
+      header, "\r\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+  base::StringPiece status_line = lines[0];
+  size_t status_start = status_line.find(' ');
+  if (!base::StartsWith(status_line, "HTTP/1.", base::CompareCase::SENSITIVE) ||
+      status_start == base::StringPiece::npos) {
+    LOG(ERROR) << "Malformed response status line " << status_line;
+    return base::nullopt;
+  }
+
+  ReceivedResponse response;
+  response.status = std::string(status_line.substr(status_start + 1));
+  for (size_t i = 1; i < lines.size(); i++) {
+    size_t colon = lines[i].find(':');
+    if (colon == base::StringPiece::npos) {
+      LOG(ERROR) << "Malformed response header " << lines[i];
+      return base::nullopt;
+    }
+    response.headers.emplace(
+        std::string(lines[i].substr(0, colon)),
+        std::string(base::TrimWhitespaceASCII(lines[i].substr(colon + 1),
+                                              base::TRIM_ALL)));
+  }
+  return response;
+}
+
+// Appends as much of |data| to |body| as fits within kMaxKeptBodySize.
+void KeepBody(const SmartBufferView& data, SmartBuffer* body) {
+  size_t size =
+      std::min(data.size(), kMaxKeptBodySize - std::min(kMaxKeptBodySize,
+                                                        body->size()));
+  body->Add(data.data(), size);
+}
+
+// Sends the HTTP request |request| on |interface| and receives the response.
+// Only the start of the body of the response is kept, so that large scans can
+// be received.
+base::Optional<ReceivedResponse> Exchange(UsbipClient* client,
+                                          int interface,
+                                          const SmartBuffer& request,
+                                          size_t transfer_size) {
+  // Interface n uses OUT endpoint 2n + 1 and IN endpoint 2n + 2.
+  const int out_endpoint = 2 * interface + 1;
+  const int in_endpoint = 2 * interface + 2;
+  for (size_t sent = 0; sent < request.size(); sent += transfer_size) {
+    SmartBuffer piece(transfer_size);
+    piece.Add(request, sent, std::min(transfer_size, request.size() - sent));
+    if (!client->SendOut(out_endpoint, piece)) {
+      return base::nullopt;
+    }
+  }
+
+  SmartBuffer received;
+  ResumableSearch header_end("\r\n\r\n");
+  base::Optional<ReceivedResponse> response;
+  size_t body_remaining = 0;
+  while (!response || body_remaining > 0) {
+    size_t previous_size = received.size();
+    if (!client->ReceiveIn(in_endpoint, transfer_size, &received)) {
+      return base::nullopt;
+    }
+    if (response) {
+      KeepBody(SmartBufferView(received), &response->body);
+      body_remaining -= std::min(body_remaining, received.size());
+      received = SmartBuffer();
+      continue;
+    }
+    if (received.size() == previous_size) {
+      continue;
+    }
+
+    ssize_t end = header_end.Find(SmartBufferView(received));
+    if (end < 0) {
+      if (received.size() > kMaxResponseHeaderSize) {
+        LOG(ERROR) << "Response header is too large";
+        return base::nullopt;
+      }
+      continue;
+    }
+    response = ParseResponseHeader(base::StringPiece(
+        reinterpret_cast<const char*>(received.data()), end));
+    if (!response) {
+      return base::nullopt;
+    }
+    auto content_length = response->headers.find("Content-Length");
+    size_t body_size = 0;
+    if (content_length != response->headers.end() &&
+        !base::StringToSizeT(content_length->second, &body_size)) {
+      LOG(ERROR) << "Invalid Content-Length " << content_length->second;
+      return base::nullopt;
+    }
+    size_t body_received = received.size() - (end + 4);
+    KeepBody(SmartBufferView(received).Subview(end + 4, body_received),
+             &response->body);
+    body_remaining = body_size - std::min(body_size, body_received);
+    received = SmartBuffer();
+  }
+  return response;
+}
+
+// Returns |data| split into the chunks of a chunked HTTP message, without the
+// final empty chunk.
+SmartBuffer EncodeChunks(const SmartBuffer& data) {
+  SmartBuffer chunks;
+  for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+    size_t length = std::min(kChunkSize, data.size() - offset);
+    chunks.Add(base::StringPrintf("%zx\r\n", length));
+    chunks.Add(data, offset, length);
+    chunks.Add("\r\n");
+  }
+  return chunks;
+}
+
+// Returns a chunked HTTP POST of an IPP request for |operation_id| with the
+// serialized operation attributes in |attributes|, followed by the document
+// already split into chunks in |document_chunks|.
+SmartBuffer CreateIppRequest(uint16_t operation_id,
+                             int request_id,
+                             const SmartBuffer& attributes,
+                             const SmartBuffer& document_chunks) {
+  SmartBuffer ipp;
+  IppHeader header;
+  header.major = 2;
+  header.minor = 0;
+  header.operation_id = operation_id;
+  header.request_id = request_id;
+  header.Serialize(&ipp);
+  ipp.Add(static_cast<uint8_t>(IppTag::OPERATION));
+  AddStringValue(IppTag::CHARSET, "attributes-charset", "utf-8", &ipp);
+  AddStringValue(IppTag::LANGUAGE, "attributes-natural-language", "en", &ipp);
+  ipp.Add(attributes);
+  AddEndOfAttributes(&ipp);
+
+  SmartBuffer request;
+  request.Add(
+      "POST /ipp/print HTTP/1.1\r\n"
+      "Content-Type: application/ipp\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n");
+  request.Add(EncodeChunks(ipp));
+  request.Add(document_chunks);
+  request.Add("0\r\n\r\n");
+  return request;
+}
+
+// Returns the IPP response carried by |response|, or nullopt if the request
+// failed. The attributes of the result point into |response|.
+base::Optional<IppRequest> GetIppResponse(
+    const base::Optional<ReceivedResponse>& response) {
+  if (!response || response->status != "200 OK") {
+    return base::nullopt;
+  }
+  base::Optional<IppRequest> ipp =
+      ParseIppRequest(SmartBufferView(response->body));
+  if (!ipp || ipp->header.operation_id != 0) {
+    LOG(ERROR) << "IPP request failed";
+    return base::nullopt;
+  }
+  return ipp;
+}
+
+// Returns a POST which creates a scan job of a US letter page.
+SmartBuffer CreateScanJobRequest(const LoadSettings& settings) {
+  // clang-format off
+  std::string scan_settings = base::StringPrintf(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+      "<scan:ScanSettings xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\" "
+           "xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">"
+         "<pwg:Version>2.0</pwg:Version>"
+         "<pwg:ScanRegions>"
+             "<pwg:ScanRegion>"
+                 "<pwg:ContentRegionUnits>"
+                     "escl:ThreeHundredthsOfInches"
+                 "</pwg:ContentRegionUnits>"
+                 "<pwg:Height>3300</pwg:Height>"
+                 "<pwg:Width>2550</pwg:Width>"
+                 "<pwg:XOffset>0</pwg:XOffset>"
+                 "<pwg:YOffset>0</pwg:YOffset>"
+             "</pwg:ScanRegion>"
+         "</pwg:ScanRegions>"
+         "<pwg:DocumentFormat>%s</pwg:DocumentFormat>"
+         "<scan:ColorMode>RGB24</scan:ColorMode>"
+         "<scan:XResolution>%d</scan:XResolution>"
+         "<scan:YResolution>%d</scan:YResolution>"
+         "<pwg:InputSource>Platen</pwg:InputSource>"
+     "</scan:ScanSettings>",
+      settings.scan_format.c_str(), settings.scan_resolution,
+      settings.scan_resolution);
+  // clang-format on
+  SmartBuffer request;
+  request.Add(base::StringPrintf(
+      "POST /eSCL/ScanJobs HTTP/1.1\r\n"
+      "Content-Type: text/xml\r\n"
+      "Content-Length: %zu\r\n"
+      "\r\n",
+      scan_settings.size()));
+  request.Add(scan_settings);
+  return request;
+}
+
+// Returns a request with no body for |uri|.
+SmartBuffer CreateRequest(const std::string& method, const std::string& uri) {
+  SmartBuffer request;
+  request.Add(method + " " + uri + " HTTP/1.1\r\n\r\n");
+  return request;
+}
+
+// Prints a document: creates a job, then sends the document in
+// |document_chunks| as the only document of the job.
+bool RunPrintJob(UsbipClient* client,
+                 int interface,
+                 const SmartBuffer& create_job,
+                 const SmartBuffer& document_chunks,
+                 size_t transfer_size) {
+  base::Optional<ReceivedResponse> created =
+      Exchange(client, interface, create_job, transfer_size);
+  base::Optional<IppRequest> created_ipp = GetIppResponse(created);
+  if (!created_ipp) {
+    return false;
+  }
+  base::Optional<int> job_id =
+      GetIntegerValue(created_ipp->job_attributes, "job-id");
+  if (!job_id) {
+    LOG(ERROR) << "Create-Job response does not give a job-id";
+    return false;
+  }
+
+  SmartBuffer attributes;
+  AddIntegerValue(IppTag::INTEGER, "job-id", job_id.value(), &attributes);
+  AddBooleanValue("last-document", true, &attributes);
+  base::Optional<ReceivedResponse> sent = Exchange(
+      client, interface,
+      CreateIppRequest(IPP_SEND_DOCUMENT, 2, attributes, document_chunks),
+      transfer_size);
+  return GetIppResponse(sent).has_value();
+}
+
+// Scans a page: creates a scan job, retrieves the scanned document and then
+// deletes the job.
+bool RunScanJob(UsbipClient* client,
+                int interface,
+                const SmartBuffer& create_scan_job,
+                size_t transfer_size) {
+  base::Optional<ReceivedResponse> response =
+      Exchange(client, interface, create_scan_job, transfer_size);
+  if (!response || response->status != "201 Created") {
+    return false;
+  }
+  auto location = response->headers.find("Location");
+  if (location == response->headers.end()) {
+    LOG(ERROR) << "Created scan job has no Location";
+    return false;
+  }
+  const std::string job_uri = location->second;
+
+  response = Exchange(client, interface,
+                      CreateRequest("GET", job_uri + "/NextDocument"),
+                      transfer_size);
+  if (!response || response->status != "200 OK") {
+    return false;
+  }
+  response = Exchange(client, interface, CreateRequest("DELETE", job_uri),
+                      transfer_size);
+  return response && response->status == "200 OK";
+}
+
+// Runs |settings.jobs_per_stream| jobs of |type| one after another on
+// |target|, recording the results in |stats|.
+void RunStream(const LoadSettings& settings,
+               JobType type,
+               const StreamTarget& target,
+               StreamStats* stats) {
+  UsbipClient client(target.connection, stats);
+
+  // The same requests and document are sent for every job, so that creating
+  // them is not included in the time taken by the stream. Only the attributes
+  // of a Send-Document request, which name its job, are serialized per job.
+  SmartBuffer document(settings.document_size);
+  for (size_t i = 0; i < settings.document_size; i++) {
+    document.Add(static_cast<uint8_t>(i));
+  }
+  SmartBuffer create_job =
+      CreateIppRequest(IPP_CREATE_JOB, 1, SmartBuffer(), SmartBuffer());
+  SmartBuffer document_chunks = EncodeChunks(document);
+  SmartBuffer create_scan_job = CreateScanJobRequest(settings);
+
+  for (int i = 0; i < settings.jobs_per_stream; i++) {
+    bool succeeded =
+        type == JobType::kPrint
+            ? RunPrintJob(&client, target.interface, create_job,
+                          document_chunks, settings.transfer_size)
+            : RunScanJob(&client, target.interface, create_scan_job,
+                         settings.transfer_size);
+    if (!succeeded) {
+      LOG(ERROR) << "Job failed on " << target.bus_id << " interface "
+                 << target.interface << "; stopping stream";
+      stats->failed_jobs += settings.jobs_per_stream - i;
+      return;
+    }
+    stats->jobs++;
+  }
+}
+
+// Returns the latency below which |percentile| percent of |sorted| fall.
+base::TimeDelta GetPercentile(const std::vector<base::TimeDelta>& sorted,
+                              int percentile) {
+  if (sorted.empty()) {
+    return base::TimeDelta();
+  }
+  size_t index = std::min(sorted.size() - 1, sorted.size() * percentile / 100);
+  return sorted[index];
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  DEFINE_string(host, "127.0.0.1", "IPv4 address of the USBIP server");
+  DEFINE_int32(port, TCP_SERV_PORT, "Port of the USBIP server");
+  DEFINE_string(unix_socket_path, "",
+                "Unix domain socket of the USBIP server, used instead of "
+                "--host and --port if given");
+  DEFINE_string(bus_ids, "1-1",
+                "Comma-separated bus IDs of the IPP over USB devices to use");
+  DEFINE_int32(print_streams, 1, "Number of concurrent print job streams");
+  DEFINE_int32(scan_streams, 0, "Number of concurrent scan job streams");
+  DEFINE_int32(jobs_per_stream, 10, "Number of jobs run by each stream");
+  DEFINE_int32(document_size, 1024 * 1024,
+               "Size in bytes of the document sent by each print job");
+  DEFINE_int32(transfer_size, 16 * 1024,
+               "Size in bytes of each bulk transfer");
+  DEFINE_string(scan_format, "application/pdf",
+                "Document format requested by each scan job");
+  DEFINE_int32(scan_resolution, 100, "Resolution requested by each scan job");
+  brillo::FlagHelper::Init(argc, argv, "virtual-usb-printer load generator");
+
+  if (FLAGS_print_streams < 0 || FLAGS_scan_streams < 0 ||
+      FLAGS_print_streams + FLAGS_scan_streams == 0 ||
+      FLAGS_jobs_per_stream < 1 || FLAGS_document_size < 0 ||
+      FLAGS_transfer_size < 1) {
+    LOG(ERROR) << "At least one stream, one job per stream and a positive "
+                  "transfer size are required";
+    return 1;
+  }
+
+  LoadSettings settings;
+  settings.host = FLAGS_host;
+  settings.port = FLAGS_port;
+  settings.unix_socket_path = FLAGS_unix_socket_path;
+  settings.jobs_per_stream = FLAGS_jobs_per_stream;
+  settings.document_size = FLAGS_document_size;
+  settings.transfer_size = FLAGS_transfer_size;
+  settings.scan_format = FLAGS_scan_format;
+  settings.scan_resolution = FLAGS_scan_resolution;
+
+  // Import each device and find the interfaces which are available for
+  // streams to run on. The connection which imported a device stays open for
+  // its streams to share.
+  std::vector<std::unique_ptr<UsbipConnection>> connections;
+  std::vector<StreamTarget> targets;
+  for (const std::string& bus_id :
+       base::SplitString(FLAGS_bus_ids, ",", base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    OpRepDevice device;
+    base::ScopedFD fd = ImportDevice(settings, bus_id, &device);
+    if (!fd.is_valid()) {
+      return 1;
+    }
+    connections.push_back(std::make_unique<UsbipConnection>(std::move(fd)));
+    for (int i = 0; i < device.bNumInterfaces; i++) {
+      targets.push_back({bus_id, i, connections.back().get()});
+    }
+  }
+  const size_t stream_count = FLAGS_print_streams + FLAGS_scan_streams;
+  if (stream_count > targets.size()) {
+    LOG(ERROR) << stream_count << " streams were requested, but only "
+               << targets.size() << " interfaces are available";
+    return 1;
+  }
+
+  std::vector<StreamStats> stats(stream_count);
+  std::vector<std::unique_ptr<base::Thread>> threads;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (size_t i = 0; i < stream_count; i++) {
+    JobType type = static_cast<int>(i) < FLAGS_print_streams ? JobType::kPrint
+                                                             : JobType::kScan;
+    auto thread = std::make_unique<base::Thread>(
+        base::StringPrintf("stream-%zu", i));
+    CHECK(thread->Start());
+    thread->task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&RunStream, settings, type, targets[i],
+                                  base::Unretained(&stats[i])));
+    threads.push_back(std::move(thread));
+  }
+  // Stopping each thread waits for its stream to finish.
+  for (auto& thread : threads) {
+    thread->Stop();
+  }
+  base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+
+  int jobs = 0;
+  int failed_jobs = 0;
+  uint64_t bytes = 0;
+  std::vector<base::TimeDelta> latencies;
+  for (const StreamStats& stream : stats) {
+    jobs += stream.jobs;
+    failed_jobs += stream.failed_jobs;
+    bytes += stream.bytes;
+    latencies.insert(latencies.end(), stream.urb_latencies.begin(),
+                     stream.urb_latencies.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  double seconds = std::max(elapsed.InSecondsF(), 1e-6);
+  printf("streams: %d print, %d scan\n", FLAGS_print_streams,
+         FLAGS_scan_streams);
+  printf("jobs: %d completed, %d failed in %.3f s (%.2f jobs/sec)\n", jobs,
+         failed_jobs, seconds, jobs / seconds);
+  printf("URB latency: p50 %.3f ms, p99 %.3f ms over %zu URBs\n",
+         GetPercentile(latencies, 50).InMillisecondsF(),
+         GetPercentile(latencies, 99).InMillisecondsF(), latencies.size());
+  printf("throughput: %.2f MB/s\n", bytes / seconds / (1024 * 1024));
+  return failed_jobs == 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "metrics.h"
+
+#include <base/strings/stringprintf.h>
+
+const char kUsbipCommandSeconds[] = "virtual_usb_printer_usbip_command_seconds";
+const char kEndpointBytesTotal[] = "virtual_usb_printer_endpoint_bytes_total";
+const char kHttpRequestSeconds[] = "virtual_usb_printer_http_request_seconds";
+const char kIppOperationSeconds[] = "virtual_usb_printer_ipp_operation_seconds";
+const char kEsclRequestSeconds[] = "virtual_usb_printer_escl_request_seconds";
+
+// Requests are handled in anywhere from microseconds for a USB control
+// request to seconds for a large scan, so the buckets grow exponentially.
+const std::vector<double> kLatencyBuckets = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05,   0.1,     0.25,   0.5,   1,      2.5,   5,    10};
+
+namespace {
+
+// Label values may contain any characters, so backslashes, double quotes and
+// newlines must be escaped.
+std::string EscapeLabelValue(const std::string& value) {
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped.push_back('\\');
+      escaped.push_back(c);
+    } else if (c == '\n') {
+      escaped.append("\\n");
+    } else {
+      escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+// Returns |labels| with the label |name|="|value|" added at the end.
+std::string AddLabel(const std::string& labels,
+                     const char* name,
+                     const std::string& value) {
+  std::string label = base::StringPrintf("%s=\"%s\"", name, value.c_str());
+  if (labels.empty()) {
+    return "{" + label + "}";
+  }
+  return labels.substr(0, labels.size() - 1) + "," + label + "}";
+}
+
+// Formats |value| the way Prometheus expects floating point sample values.
+std::string FormatDouble(double value) {
+  return base::StringPrintf("%.9g", value);
+}
+
+}  // namespace
+
+std::string FormatLabels(
+    const std::vector<std::pair<std::string, std::string>>& labels) {
+  if (labels.empty()) {
+    return "";
+  }
+  std::string result = "{";
+  for (const auto& label : labels) {
+    if (result.size() > 1) {
+      result.push_back(',');
+    }
+    result += label.first + "=\"" + EscapeLabelValue(label.second) + "\"";
+  }
+  result.push_back('}');
+  return result;
+}
+
+// static
+Metrics* Metrics::Get() {
+  static Metrics* metrics = new Metrics();
+  return metrics;
+}
+
+void Metrics::IncrementCounter(const std::string& name,
+                               const std::string& labels,
+                               uint64_t amount) {
+  base::AutoLock lock(lock_);
+  counters_[name][labels] += amount;
+}
+
+void Metrics::RecordLatency(const std::string& name,
+                            const std::string& labels,
+                            base::TimeDelta latency) {
+  double seconds = latency.InSecondsF();
+  size_t bucket = 0;
+  while (bucket < kLatencyBuckets.size() && seconds > kLatencyBuckets[bucket]) {
+    bucket++;
+  }
+
+  base::AutoLock lock(lock_);
+  Histogram& histogram = histograms_[name][labels];
+  if (histogram.bucket_counts.empty()) {
+    histogram.bucket_counts.resize(kLatencyBuckets.size() + 1);
+  }
+  histogram.bucket_counts[bucket]++;
+  histogram.count++;
+  histogram.sum += seconds;
+}
+
+std::string Metrics::Serialize() const {
+  base::AutoLock lock(lock_);
+  std::string result;
+  for (const auto& counter : counters_) {
+    result += "# TYPE " + counter.first + " counter\n";
+    for (const auto& series : counter.second) {
+      result += base::StringPrintf("%s%s %llu\n", counter.first.c_str(),
+                                   series.first.c_str(),
+                                   static_cast<unsigned long long>(
+                                       series.second));
+    }
+  }
+  for (const auto& histogram : histograms_) {
+    const std::string& name = histogram.first;
+    result += "# TYPE " + name + " histogram\n";
+    for (const auto& series : histogram.second) {
+      const std::string& labels = series.first;
+      const Histogram& values = series.second;
+      // Prometheus buckets are cumulative, so each one also counts every
+      // latency in the buckets before it.
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < values.bucket_counts.size(); i++) {
+        cumulative += values.bucket_counts[i];
+        std::string bound = i < kLatencyBuckets.size()
+                                ? FormatDouble(kLatencyBuckets[i])
+                                : "+Inf";
+        result += base::StringPrintf(
+            "%s_bucket%s %llu\n", name.c_str(),
+            AddLabel(labels, "le", bound).c_str(),
+            static_cast<unsigned long long>(cumulative));
+      }
+      result += name + "_sum" + labels + " " + FormatDouble(values.sum) + "\n";
+      result += base::StringPrintf("%s_count%s %llu\n", name.c_str(),
+                                   labels.c_str(),
+                                   static_cast<unsigned long long>(
+                                       values.count));
+    }
+  }
+  return result;
+}
+
+ScopedLatencyTimer::ScopedLatencyTimer(const char* name, std::string labels)
+    : name_(name),
+      labels_(std::move(labels)),
+      start_(base::TimeTicks::Now()) {}
+
+ScopedLatencyTimer::~ScopedLatencyTimer() {
+  Metrics::Get()->RecordLatency(name_, labels_,
+                                base::TimeTicks::Now() - start_);
+}
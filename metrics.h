@@ -0,0 +1,93 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+// The names of the metrics recorded by the virtual printer.
+extern const char kUsbipCommandSeconds[];
+extern const char kEndpointBytesTotal[];
+extern const char kHttpRequestSeconds[];
+extern const char kIppOperationSeconds[];
+extern const char kEsclRequestSeconds[];
+
+// The upper bounds, in seconds, of the buckets used by every latency
+// histogram. A final bucket with no upper bound holds any larger latencies.
+extern const std::vector<double> kLatencyBuckets;
+
+// Formats |labels| as a Prometheus label set, for example
+// {endpoint="1",direction="in"}. Returns an empty string if |labels| is empty.
+std::string FormatLabels(
+    const std::vector<std::pair<std::string, std::string>>& labels);
+
+// Collects counters and latency histograms for the requests handled by the
+// virtual printer, and serializes them in the Prometheus text exposition
+// format. Every method may be called from any thread.
+class Metrics {
+ public:
+  // Returns the metrics shared by every printer in this process.
+  static Metrics* Get();
+
+  Metrics() = default;
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // Adds |amount| to the counter |name| with the label set |labels|, which
+  // should be created with FormatLabels.
+  void IncrementCounter(const std::string& name,
+                        const std::string& labels,
+                        uint64_t amount = 1);
+
+  // Records |latency| in the histogram |name| with the label set |labels|.
+  void RecordLatency(const std::string& name,
+                     const std::string& labels,
+                     base::TimeDelta latency);
+
+  // Returns every metric recorded so far, sorted by name and then by labels.
+  std::string Serialize() const;
+
+ private:
+  struct Histogram {
+    // The number of latencies in each bucket of kLatencyBuckets, followed by
+    // the number which were larger than every bucket.
+    std::vector<uint64_t> bucket_counts;
+    uint64_t count = 0;
+    double sum = 0;
+  };
+
+  mutable base::Lock lock_;
+  // Each metric name maps to the value for each of its label sets.
+  std::map<std::string, std::map<std::string, uint64_t>> counters_;
+  std::map<std::string, std::map<std::string, Histogram>> histograms_;
+};
+
+// Records the time between its construction and destruction in the latency
+// histogram |name| of Metrics::Get().
+class ScopedLatencyTimer {
+ public:
+  ScopedLatencyTimer(const char* name, std::string labels);
+  ScopedLatencyTimer(const ScopedLatencyTimer&) = delete;
+  ScopedLatencyTimer& operator=(const ScopedLatencyTimer&) = delete;
+  ~ScopedLatencyTimer();
+
+  // Replaces the label set which is recorded, for requests whose labels are
+  // not known until they have been handled.
+  void set_labels(std::string labels) { labels_ = std::move(labels); }
+
+ private:
+  const char* name_;
+  std::string labels_;
+  base::TimeTicks start_;
+};
+
+#endif  // METRICS_H__
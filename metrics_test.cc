@@ -0,0 +1,86 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "metrics.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(FormatLabels, Empty) {
+  EXPECT_EQ(FormatLabels({}), "");
+}
+
+TEST(FormatLabels, EscapesValues) {
+  EXPECT_EQ(FormatLabels({{"endpoint", "1"}, {"path", "a\"b\\c\nd"}}),
+            "{endpoint=\"1\",path=\"a\\\"b\\\\c\\nd\"}");
+}
+
+TEST(Metrics, SerializeCounter) {
+  Metrics metrics;
+  std::string labels = FormatLabels({{"endpoint", "1"}});
+  metrics.IncrementCounter("bytes_total", labels, 512);
+  metrics.IncrementCounter("bytes_total", labels, 100);
+  metrics.IncrementCounter("bytes_total", FormatLabels({{"endpoint", "2"}}));
+  EXPECT_EQ(metrics.Serialize(),
+            "# TYPE bytes_total counter\n"
+            "bytes_total{endpoint=\"1\"} 612\n"
+            "bytes_total{endpoint=\"2\"} 1\n");
+}
+
+TEST(Metrics, SerializeHistogram) {
+  Metrics metrics;
+  metrics.RecordLatency("latency", "", base::TimeDelta::FromMicroseconds(50));
+  metrics.RecordLatency("latency", "", base::TimeDelta::FromMilliseconds(1));
+  metrics.RecordLatency("latency", "", base::TimeDelta::FromSeconds(20));
+  std::string serialized = metrics.Serialize();
+
+  EXPECT_EQ(serialized.find("# TYPE latency histogram\n"), 0u);
+  // Buckets are cumulative, and include latencies equal to their bound.
+  EXPECT_NE(serialized.find("latency_bucket{le=\"0.0001\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_bucket{le=\"0.0005\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_bucket{le=\"0.001\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_bucket{le=\"10\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_bucket{le=\"+Inf\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_sum 20.00105\n"), std::string::npos);
+  EXPECT_NE(serialized.find("latency_count 3\n"), std::string::npos);
+}
+
+TEST(Metrics, HistogramLabelsIncludeBucketBound) {
+  Metrics metrics;
+  metrics.RecordLatency("latency", FormatLabels({{"command", "submit"}}),
+                        base::TimeDelta::FromMilliseconds(3));
+  std::string serialized = metrics.Serialize();
+  EXPECT_NE(serialized.find("latency_bucket{command=\"submit\",le=\"0.0025\"} "
+                            "0\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_bucket{command=\"submit\",le=\"0.005\"} "
+                            "1\n"),
+            std::string::npos);
+  EXPECT_NE(serialized.find("latency_count{command=\"submit\"} 1\n"),
+            std::string::npos);
+}
+
+TEST(ScopedLatencyTimer, RecordsOnDestruction) {
+  const char kName[] = "scoped_timer_test_seconds";
+  {
+    ScopedLatencyTimer timer(kName, FormatLabels({{"operation", "Invalid"}}));
+    timer.set_labels(FormatLabels({{"operation", "ScannerStatus"}}));
+  }
+  std::string serialized = Metrics::Get()->Serialize();
+  EXPECT_NE(serialized.find(
+                "scoped_timer_test_seconds_count{operation=\"ScannerStatus\"} "
+                "1\n"),
+            std::string::npos);
+  EXPECT_EQ(serialized.find("operation=\"Invalid\""), std::string::npos);
+}
+
+}  // namespace
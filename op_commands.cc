@@ -9,16 +9,18 @@
 #include <cstring>
 
 #include <base/logging.h>
+#include <base/strings/stringprintf.h>
 
 #include "device_descriptors.h"
 #include "smart_buffer.h"
+#include "usb_printer.h"
 #include "usbip_constants.h"
 
-// These are constants used to describe the exported device. They are used to
+// These are constants used to describe the exported devices. They are used to
 // populate the OpRepDevice message used when responding to OpReqDevlist and
-// OpReqImport requests.
-const char kUsbPath[] = "/sys/devices/pci0000:00/0000:00:01.2/usb1/1-1";
-const char kBusId[] = "1-1";
+// OpReqImport requests. Every device is exported on the same bus, with the
+// device number and port in the bus ID and path offset by its index.
+const char kUsbPathPrefix[] = "/sys/devices/pci0000:00/0000:00:01.2/usb1/";
 constexpr int kBusnum = 1;
 constexpr int kDevnum = 2;
 constexpr int kSpeed = 3;  // Represents a high-speed USB device.
@@ -36,17 +38,24 @@ void SetOpRepDevlistHeader(uint16_t command, int status, int numExportedDevices,
   devlist_header->numExportedDevices = numExportedDevices;
 }
 
+std::string GetBusId(size_t index) {
+  return base::StringPrintf("%d-%zu", kBusnum, index + 1);
+}
+
 void SetOpRepDevice(const UsbDeviceDescriptor& dev_dsc,
                     const UsbConfigurationDescriptor& config,
+                    size_t index,
                     OpRepDevice* device) {
   // Set constants.
+  const std::string bus_id = GetBusId(index);
   memset(device->usbPath, 0, sizeof(device->usbPath));
-  snprintf(device->usbPath, sizeof(device->usbPath), "%s", kUsbPath);
+  snprintf(device->usbPath, sizeof(device->usbPath), "%s%s", kUsbPathPrefix,
+           bus_id.c_str());
   memset(device->busID, 0, sizeof(device->busID));
-  snprintf(device->busID, sizeof(device->busID), "%s", kBusId);
+  snprintf(device->busID, sizeof(device->busID), "%s", bus_id.c_str());
 
   device->busnum = kBusnum;
-  device->devnum = kDevnum;
+  device->devnum = kDevnum + index;
   device->speed = kSpeed;
 
   // Set values using |dev_dsc|.
@@ -65,10 +74,8 @@ void SetOpRepDevice(const UsbDeviceDescriptor& dev_dsc,
 
 void SetOpRepDevlistInterfaces(
     const std::vector<UsbInterfaceDescriptor>& interfaces,
-    OpRepDevlistInterface** rep_interfaces) {
-  // TODO(daviev): Change this to use a smart pointer at some point.
-  *rep_interfaces = reinterpret_cast<OpRepDevlistInterface*>(
-      malloc(interfaces.size() * sizeof(OpRepDevlistInterface)));
+    std::vector<OpRepDevlistInterface>* rep_interfaces) {
+  rep_interfaces->resize(interfaces.size());
   for (size_t i = 0; i < interfaces.size(); ++i) {
     const auto& interface = interfaces[i];
     (*rep_interfaces)[i].bInterfaceClass = interface.bInterfaceClass;
@@ -80,20 +87,33 @@ void SetOpRepDevlistInterfaces(
 
 // Creates the OpRepDevlist message used to respond to a request to list the
 // host's exported USB devices.
-void CreateOpRepDevlist(const UsbDeviceDescriptor& device,
-                        const UsbConfigurationDescriptor& config,
-                        const std::vector<UsbInterfaceDescriptor>& interfaces,
+void CreateOpRepDevlist(const std::vector<UsbPrinter>& printers,
                         OpRepDevlist* list) {
-  SetOpRepDevlistHeader(OP_REP_DEVLIST_CMD, 0, 1, &list->header);
-  SetOpRepDevice(device, config, &list->device);
-  SetOpRepDevlistInterfaces(interfaces, &list->interfaces);
+  SetOpRepDevlistHeader(OP_REP_DEVLIST_CMD, 0, printers.size(),
+                        &list->header);
+  list->devices.resize(printers.size());
+  for (size_t i = 0; i < printers.size(); ++i) {
+    const UsbPrinter& printer = printers[i];
+    OpRepDevlistDevice* entry = &list->devices[i];
+    SetOpRepDevice(printer.device_descriptor(),
+                   printer.configuration_descriptor(), i, &entry->device);
+    SetOpRepDevlistInterfaces(printer.interface_descriptors(),
+                              &entry->interfaces);
+  }
 }
 
 void CreateOpRepImport(const UsbDeviceDescriptor& dev_dsc,
                        const UsbConfigurationDescriptor& config,
+                       size_t index,
                        OpRepImport* rep) {
   SetOpHeader(OP_REP_IMPORT_CMD, 0, &rep->header);
-  SetOpRepDevice(dev_dsc, config, &rep->device);
+  SetOpRepDevice(dev_dsc, config, index, &rep->device);
+}
+
+void CreateOpReqImport(const std::string& bus_id, OpReqImport* req) {
+  SetOpHeader(OP_REQ_IMPORT_CMD, 0, &req->header);
+  memset(req->busID, 0, sizeof(req->busID));
+  snprintf(req->busID, sizeof(req->busID), "%s", bus_id.c_str());
 }
 
 SmartBuffer PackOpHeader(OpHeader header) {
@@ -127,17 +147,21 @@ SmartBuffer PackOpRepDevlistHeader(OpRepDevlistHeader devlist_header) {
   return packed_header;
 }
 
-SmartBuffer PackOpRepDevlist(OpRepDevlist devlist) {
+SmartBuffer PackOpRepDevlist(const OpRepDevlist& devlist) {
   SmartBuffer packed_header = PackOpRepDevlistHeader(devlist.header);
-  SmartBuffer packed_device = PackOpRepDevice(devlist.device);
-  size_t interfaces_size =
-      sizeof(*devlist.interfaces) * devlist.device.bNumInterfaces;
-  size_t buffer_size =
-      sizeof(devlist.header) + sizeof(devlist.device) + interfaces_size;
+  size_t buffer_size = sizeof(devlist.header);
+  for (const auto& entry : devlist.devices) {
+    buffer_size += sizeof(entry.device) +
+                   sizeof(OpRepDevlistInterface) * entry.interfaces.size();
+  }
   SmartBuffer packed_devlist(buffer_size);
   packed_devlist.Add(packed_header);
-  packed_devlist.Add(packed_device);
-  packed_devlist.Add(devlist.interfaces, interfaces_size);
+  for (const auto& entry : devlist.devices) {
+    SmartBuffer packed_device = PackOpRepDevice(entry.device);
+    packed_devlist.Add(packed_device);
+    packed_devlist.Add(entry.interfaces.data(),
+                       sizeof(OpRepDevlistInterface) * entry.interfaces.size());
+  }
   return packed_devlist;
 }
 
@@ -150,8 +174,25 @@ SmartBuffer PackOpRepImport(OpRepImport import) {
   return packed_import;
 }
 
+SmartBuffer PackOpReqImport(OpReqImport import) {
+  SmartBuffer packed_header = PackOpHeader(import.header);
+  SmartBuffer packed_import(sizeof(import));
+  packed_import.Add(packed_header);
+  packed_import.Add(import.busID, sizeof(import.busID));
+  return packed_import;
+}
+
 void UnpackOpHeader(OpHeader* header) {
   header->version = ntohs(header->version);
   header->command = ntohs(header->command);
   header->status = ntohl(header->status);
 }
+
+void UnpackOpRepDevice(OpRepDevice* device) {
+  device->busnum = ntohl(device->busnum);
+  device->devnum = ntohl(device->devnum);
+  device->speed = ntohl(device->speed);
+  device->idVendor = ntohs(device->idVendor);
+  device->idProduct = ntohs(device->idProduct);
+  device->bcdDevice = ntohs(device->bcdDevice);
+}
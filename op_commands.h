@@ -20,6 +20,7 @@
  */
 
 #include <cstdlib>
+#include <string>
 #include <vector>
 
 #include "device_descriptors.h"
@@ -73,13 +74,18 @@ struct OpRepDevlistInterface {
   uint8_t padding;
 };
 
+// A single exported device listed in an OpRepDevlist message, along with the
+// interfaces that it provides.
+struct OpRepDevlistDevice {
+  OpRepDevice device;
+  std::vector<OpRepDevlistInterface> interfaces;
+};
+
 // Defines the OpRepDevlist used to respond to a OpReqDevlist message.
 struct OpRepDevlist {
   OpRepDevlistHeader header;
-  // Since our program is used to provide a virtual USB device, we only include
-  // a single OpRepDevice in our response.
-  OpRepDevice device;
-  OpRepDevlistInterface* interfaces;
+  // Contains one entry for each of the exported virtual USB devices.
+  std::vector<OpRepDevlistDevice> devices;
 };
 
 // Defines the OpReqImport request used to request a device for import.
@@ -102,40 +108,57 @@ void SetOpHeader(uint16_t command, int status, OpHeader* header);
 void SetOpRepDevlistHeader(uint16_t command, int status, int numExportedDevices,
                            OpRepDevlistHeader* header);
 
+// Returns the bus ID used to export the device at position |index| in the list
+// of exported devices. The first device is exported as "1-1", the second as
+// "1-2", and so on.
+std::string GetBusId(size_t index);
+
 // Sets the members of |device| using the corresponding values in
-// |dev_dsc| and |config|.
+// |dev_dsc| and |config|. |index| is the position of the device in the list of
+// exported devices and is used to assign its bus ID and device number.
 void SetOpRepDevice(const UsbDeviceDescriptor& dev_dsc,
                     const UsbConfigurationDescriptor& configuration,
+                    size_t index,
                     OpRepDevice* device);
 
 // Assigns the values from |interfaces| into |rep_interfaces|.
 void SetOpRepDevlistInterfaces(
     const std::vector<UsbInterfaceDescriptor>& interfaces,
-    OpRepDevlistInterface** rep_interfaces);
+    std::vector<OpRepDevlistInterface>* rep_interfaces);
 
 // Creates the OpRepDevlist message used to respond to requests to list the
-// host's exported USB devices.
-void CreateOpRepDevlist(const UsbDeviceDescriptor& device,
-                        const UsbConfigurationDescriptor& config,
-                        const std::vector<UsbInterfaceDescriptor>& interfaces,
+// host's exported USB devices. Each printer in |printers| is listed using the
+// bus ID for its position in the vector.
+void CreateOpRepDevlist(const std::vector<UsbPrinter>& printers,
                         OpRepDevlist* list);
 
 // Creates the OpRepImport message used to respond to a request to attach a
-// host USB device.
+// host USB device. |index| is the position of the device in the list of
+// exported devices.
 void CreateOpRepImport(const UsbDeviceDescriptor& device,
                        const UsbConfigurationDescriptor& config,
+                       size_t index,
                        OpRepImport* rep);
 
-// Convert the various elements of an "OpRep" message into network
+// Creates the OpReqImport message sent by a client to attach the device
+// exported as |bus_id|.
+void CreateOpReqImport(const std::string& bus_id, OpReqImport* req);
+
+// Convert the various elements of an "OpRep" or "OpReq" message into network
 // byte order and pack them into a SmartBuffer to be used for transferring along
 // a socket.
 SmartBuffer PackOpHeader(OpHeader header);
 SmartBuffer PackOpRepDevice(OpRepDevice device);
 SmartBuffer PackOpRepDevlistHeader(OpRepDevlistHeader devlist_header);
-SmartBuffer PackOpRepDevlist(OpRepDevlist devlist);
+SmartBuffer PackOpRepDevlist(const OpRepDevlist& devlist);
 SmartBuffer PackOpRepImport(OpRepImport import);
+SmartBuffer PackOpReqImport(OpReqImport import);
 
 // Convert |header| into host uint8_t order.
 void UnpackOpHeader(OpHeader* header);
 
+// Convert |device|, as received in an OpRepImport message, into host byte
+// order.
+void UnpackOpRepDevice(OpRepDevice* device);
+
 #endif  // OP_COMMANDS_H__
@@ -0,0 +1,90 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "performance_model.h"
+
+#include <algorithm>
+
+namespace {
+
+// Returns the rate in bytes per second at which |profile| prints.
+double GetPrintRate(const PerformanceProfile& profile) {
+  return profile.pages_per_minute / 60 * profile.bytes_per_page;
+}
+
+}  // namespace
+
+TokenBucket::TokenBucket(double rate, double capacity)
+    : rate_(rate), capacity_(capacity), tokens_(capacity) {}
+
+base::TimeDelta TokenBucket::Take(double tokens, base::TimeTicks now) {
+  if (rate_ <= 0) {
+    return base::TimeDelta();
+  }
+  Refill(now);
+  tokens_ -= tokens;
+  if (tokens_ >= 0) {
+    return base::TimeDelta();
+  }
+  return base::TimeDelta::FromSecondsD(-tokens_ / rate_);
+}
+
+base::TimeDelta TokenBucket::GetTimeUntilFull(base::TimeTicks now) {
+  if (rate_ <= 0) {
+    return base::TimeDelta();
+  }
+  Refill(now);
+  return base::TimeDelta::FromSecondsD((capacity_ - tokens_) / rate_);
+}
+
+void TokenBucket::Refill(base::TimeTicks now) {
+  if (!last_update_.is_null() && now > last_update_) {
+    tokens_ = std::min(capacity_,
+                       tokens_ + (now - last_update_).InSecondsF() * rate_);
+  }
+  last_update_ = std::max(last_update_, now);
+}
+
+PerformanceModel::PerformanceModel() : PerformanceModel(PerformanceProfile()) {}
+
+PerformanceModel::PerformanceModel(const PerformanceProfile& profile)
+    : profile_(profile),
+      enabled_(profile.pages_per_minute > 0 ||
+               profile.scan_megabytes_per_second > 0 ||
+               !profile.ipp_operation_latency.empty()),
+      lock_(std::make_unique<base::Lock>()),
+      print_bucket_(GetPrintRate(profile), profile.buffer_size),
+      scan_bucket_(profile.scan_megabytes_per_second * 1000 * 1000, 0) {}
+
+base::TimeDelta PerformanceModel::ReceivePrintData(size_t size,
+                                                   base::TimeTicks now) {
+  base::AutoLock lock(*lock_);
+  base::TimeDelta wait = print_bucket_.Take(size, now);
+  // An unbounded buffer never fills up, so only the time taken to print is
+  // tracked.
+  if (profile_.buffer_size == 0) {
+    return base::TimeDelta();
+  }
+  return wait;
+}
+
+base::TimeDelta PerformanceModel::GetPrintTime(base::TimeTicks now) {
+  base::AutoLock lock(*lock_);
+  return print_bucket_.GetTimeUntilFull(now);
+}
+
+base::TimeDelta PerformanceModel::SendScanData(size_t size,
+                                               base::TimeTicks now) {
+  base::AutoLock lock(*lock_);
+  return scan_bucket_.Take(size, now);
+}
+
+base::TimeDelta PerformanceModel::GetOperationLatency(
+    const std::string& operation) const {
+  auto iter = profile_.ipp_operation_latency.find(operation);
+  if (iter == profile_.ipp_operation_latency.end()) {
+    return base::TimeDelta();
+  }
+  return iter->second;
+}
@@ -0,0 +1,113 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERFORMANCE_MODEL_H__
+#define PERFORMANCE_MODEL_H__
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+// The default number of bytes of print data which are treated as one page.
+constexpr size_t kDefaultBytesPerPage = 256 * 1024;
+
+// Describes how fast a simulated printer prints and scans. A value of 0 means
+// that the corresponding limit is not simulated, so a default profile makes
+// the printer answer as fast as it can.
+struct PerformanceProfile {
+  // The rate at which received print data is consumed, where |bytes_per_page|
+  // bytes of print data make up a page.
+  double pages_per_minute = 0;
+  size_t bytes_per_page = kDefaultBytesPerPage;
+  // The number of bytes of print data which the printer can hold before it
+  // stops accepting more. Once the buffer is full, BULK OUT transfers are not
+  // acknowledged until enough of it has been printed. If 0 the buffer is
+  // unbounded.
+  size_t buffer_size = 0;
+  // The rate at which scanned documents are sent, where a megabyte is 10^6
+  // bytes.
+  double scan_megabytes_per_second = 0;
+  // The time taken to process each IPP operation, keyed by operation name such
+  // as "Create-Job".
+  std::map<std::string, base::TimeDelta> ipp_operation_latency;
+};
+
+// A token bucket holding up to |capacity| tokens which are refilled at |rate|
+// tokens per second. Tokens may be taken even when the bucket does not hold
+// enough of them, leaving it in debt until it has been refilled.
+class TokenBucket {
+ public:
+  // A |rate| of 0 means tokens are unlimited.
+  TokenBucket(double rate, double capacity);
+
+  // Takes |tokens| at |now|. Returns how long it will take for the bucket to
+  // be out of debt, which is zero if it held enough tokens.
+  base::TimeDelta Take(double tokens, base::TimeTicks now);
+
+  // Returns how long it will take from |now| for the bucket to be full.
+  base::TimeDelta GetTimeUntilFull(base::TimeTicks now);
+
+ private:
+  // Adds the tokens refilled between the last update and |now|.
+  void Refill(base::TimeTicks now);
+
+  double rate_;
+  double capacity_;
+  double tokens_;
+  base::TimeTicks last_update_;
+};
+
+// Applies a PerformanceProfile to the requests handled by a printer. The model
+// only computes how long each step should take, and leaves delaying the
+// corresponding replies to the caller. Every method may be called from any
+// thread.
+class PerformanceModel {
+ public:
+  PerformanceModel();
+  explicit PerformanceModel(const PerformanceProfile& profile);
+
+  PerformanceModel(PerformanceModel&&) = default;
+  PerformanceModel& operator=(PerformanceModel&&) = default;
+
+  // Returns whether any part of the profile is simulated.
+  bool enabled() const { return enabled_; }
+
+  const PerformanceProfile& profile() const { return profile_; }
+
+  // Records that |size| bytes of print data were received at |now|. Returns
+  // how long the transfer which carried them must wait to be acknowledged,
+  // which is non-zero once the print buffer is full.
+  base::TimeDelta ReceivePrintData(size_t size, base::TimeTicks now);
+
+  // Returns how long it will take from |now| to print all of the print data
+  // received so far.
+  base::TimeDelta GetPrintTime(base::TimeTicks now);
+
+  // Records that |size| bytes of a scanned document are sent at |now|. Returns
+  // how long it takes the scanner to produce them, before which no further
+  // data should be sent.
+  base::TimeDelta SendScanData(size_t size, base::TimeTicks now);
+
+  // Returns the time taken to process the IPP operation named |operation|.
+  base::TimeDelta GetOperationLatency(const std::string& operation) const;
+
+ private:
+  PerformanceProfile profile_;
+  bool enabled_;
+  // Held by pointer so that a PerformanceModel can be moved.
+  std::unique_ptr<base::Lock> lock_;
+  // Holds a token for each byte of free space in the print buffer. With an
+  // unbounded buffer it has no capacity, and its debt is the print data
+  // waiting to be printed.
+  TokenBucket print_bucket_;
+  // Has no capacity, so that scan data is never sent faster than the scanner
+  // produces it.
+  TokenBucket scan_bucket_;
+};
+
+#endif  // PERFORMANCE_MODEL_H__
@@ -0,0 +1,113 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "performance_model.h"
+
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+// An arbitrary non-null time at which each test starts.
+base::TimeTicks StartTime() {
+  return base::TimeTicks() + base::TimeDelta::FromSeconds(100);
+}
+
+base::TimeDelta Seconds(double seconds) {
+  return base::TimeDelta::FromSecondsD(seconds);
+}
+
+TEST(TokenBucket, UnlimitedRate) {
+  TokenBucket bucket(0, 0);
+  EXPECT_EQ(bucket.Take(1000000, StartTime()), base::TimeDelta());
+  EXPECT_EQ(bucket.GetTimeUntilFull(StartTime()), base::TimeDelta());
+}
+
+TEST(TokenBucket, TakeWithinCapacity) {
+  TokenBucket bucket(10, 100);
+  EXPECT_EQ(bucket.Take(60, StartTime()), base::TimeDelta());
+  EXPECT_EQ(bucket.Take(40, StartTime()), base::TimeDelta());
+  EXPECT_EQ(bucket.GetTimeUntilFull(StartTime()), Seconds(10));
+}
+
+TEST(TokenBucket, DebtIsRepaidAtRate) {
+  TokenBucket bucket(10, 100);
+  EXPECT_EQ(bucket.Take(150, StartTime()), Seconds(5));
+  EXPECT_EQ(bucket.Take(10, StartTime() + Seconds(2)), Seconds(4));
+  EXPECT_EQ(bucket.GetTimeUntilFull(StartTime() + Seconds(6)), Seconds(10));
+}
+
+TEST(TokenBucket, RefillStopsAtCapacity) {
+  TokenBucket bucket(10, 100);
+  bucket.Take(100, StartTime());
+  EXPECT_EQ(bucket.GetTimeUntilFull(StartTime() + Seconds(60)),
+            base::TimeDelta());
+  EXPECT_EQ(bucket.Take(110, StartTime() + Seconds(60)), Seconds(1));
+}
+
+TEST(TokenBucket, IgnoresEarlierTimes) {
+  TokenBucket bucket(10, 0);
+  EXPECT_EQ(bucket.Take(10, StartTime() + Seconds(1)), Seconds(1));
+  EXPECT_EQ(bucket.Take(10, StartTime()), Seconds(2));
+}
+
+TEST(PerformanceModel, DefaultProfileIsDisabled) {
+  PerformanceModel model;
+  EXPECT_FALSE(model.enabled());
+  EXPECT_EQ(model.ReceivePrintData(1 << 20, StartTime()), base::TimeDelta());
+  EXPECT_EQ(model.GetPrintTime(StartTime()), base::TimeDelta());
+  EXPECT_EQ(model.SendScanData(1 << 20, StartTime()), base::TimeDelta());
+  EXPECT_EQ(model.GetOperationLatency("Create-Job"), base::TimeDelta());
+}
+
+TEST(PerformanceModel, UnboundedBufferNeverWaits) {
+  PerformanceProfile profile;
+  profile.pages_per_minute = 60;
+  profile.bytes_per_page = 1000;
+  PerformanceModel model(profile);
+  EXPECT_TRUE(model.enabled());
+  EXPECT_EQ(model.ReceivePrintData(5000, StartTime()), base::TimeDelta());
+  EXPECT_EQ(model.GetPrintTime(StartTime()), Seconds(5));
+  EXPECT_EQ(model.GetPrintTime(StartTime() + Seconds(3)), Seconds(2));
+  EXPECT_EQ(model.GetPrintTime(StartTime() + Seconds(10)), base::TimeDelta());
+}
+
+TEST(PerformanceModel, FullBufferDelaysAcknowledgement) {
+  PerformanceProfile profile;
+  profile.pages_per_minute = 60;
+  profile.bytes_per_page = 1000;
+  profile.buffer_size = 2000;
+  PerformanceModel model(profile);
+  EXPECT_EQ(model.ReceivePrintData(2000, StartTime()), base::TimeDelta());
+  EXPECT_EQ(model.ReceivePrintData(500, StartTime()), Seconds(0.5));
+  EXPECT_EQ(model.GetPrintTime(StartTime()), Seconds(2.5));
+  // Once a page has been printed there is room for the rest.
+  EXPECT_EQ(model.ReceivePrintData(500, StartTime() + Seconds(1)),
+            base::TimeDelta());
+}
+
+TEST(PerformanceModel, ScanDataIsPaced) {
+  PerformanceProfile profile;
+  profile.scan_megabytes_per_second = 2;
+  PerformanceModel model(profile);
+  EXPECT_TRUE(model.enabled());
+  EXPECT_EQ(model.SendScanData(1000 * 1000, StartTime()), Seconds(0.5));
+  EXPECT_EQ(model.SendScanData(1000 * 1000, StartTime() + Seconds(0.5)),
+            Seconds(0.5));
+  EXPECT_EQ(model.SendScanData(1000 * 1000, StartTime() + Seconds(0.5)),
+            Seconds(1));
+}
+
+TEST(PerformanceModel, OperationLatency) {
+  PerformanceProfile profile;
+  profile.ipp_operation_latency["Create-Job"] =
+      base::TimeDelta::FromMilliseconds(50);
+  PerformanceModel model(profile);
+  EXPECT_TRUE(model.enabled());
+  EXPECT_EQ(model.GetOperationLatency("Create-Job"),
+            base::TimeDelta::FromMilliseconds(50));
+  EXPECT_EQ(model.GetOperationLatency("Send-Document"), base::TimeDelta());
+}
+
+}  // namespace
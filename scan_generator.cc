@@ -0,0 +1,358 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "scan_generator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/strings/string_piece.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+const char kPngFormat[] = "image/png";
+const char kPdfFormat[] = "application/pdf";
+
+namespace {
+
+using Pieces = std::vector<scoped_refptr<base::RefCountedMemory>>;
+
+// The largest width or height of a generated scan, in pixels.
+constexpr int kMaxScanDimension = 1 << 16;
+
+// The approximate size of each strip of image data.
+constexpr size_t kStripSize = 1 << 20;
+
+// The largest amount of data in a deflate stored block.
+constexpr size_t kMaxStoredBlockSize = 0xffff;
+
+scoped_refptr<base::RefCountedMemory> ToPiece(std::vector<uint8_t> data) {
+  return base::RefCountedBytes::TakeVector(&data);
+}
+
+scoped_refptr<base::RefCountedMemory> ToPiece(const std::string& data) {
+  return ToPiece(std::vector<uint8_t>(data.begin(), data.end()));
+}
+
+void AppendUint16Le(std::vector<uint8_t>* out, uint16_t value) {
+  out->push_back(value & 0xff);
+  out->push_back(value >> 8);
+}
+
+void AppendUint32Be(std::vector<uint8_t>* out, uint32_t value) {
+  out->push_back(value >> 24);
+  out->push_back((value >> 16) & 0xff);
+  out->push_back((value >> 8) & 0xff);
+  out->push_back(value & 0xff);
+}
+
+uint32_t Crc32(const uint8_t* data, size_t size) {
+  static const std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+// Incrementally computes an Adler-32 checksum, as used by zlib streams.
+class Adler32 {
+ public:
+  void Update(const std::vector<uint8_t>& data) {
+    constexpr uint32_t kModulus = 65521;
+    // The largest number of bytes which can be summed before |b_| could
+    // overflow, so the modulus only needs to be taken once per run.
+    constexpr size_t kMaxRun = 5552;
+    for (size_t start = 0; start < data.size(); start += kMaxRun) {
+      size_t end = std::min(data.size(), start + kMaxRun);
+      for (size_t i = start; i < end; i++) {
+        a_ += data[i];
+        b_ += a_;
+      }
+      a_ %= kModulus;
+      b_ %= kModulus;
+    }
+  }
+
+  uint32_t value() const { return (b_ << 16) | a_; }
+
+ private:
+  uint32_t a_ = 1;
+  uint32_t b_ = 0;
+};
+
+// Returns the number of bytes in a row of |width| pixels in |color_mode|.
+size_t RowSize(int width, ColorMode color_mode) {
+  switch (color_mode) {
+    case kBlackAndWhite:
+      return (width + 7) / 8;
+    case kGrayscale:
+      return width;
+    case kRGB:
+      return 3 * static_cast<size_t>(width);
+  }
+  NOTREACHED();
+  return 0;
+}
+
+// Generates a row of |width| pixels in |color_mode|. Black and white images
+// have alternating 16 pixel wide bars, and other images have a horizontal
+// gradient. 1 bit pixels are packed most significant bit first, with 0 for
+// black, as both PNG and PDF expect.
+std::vector<uint8_t> GenerateRow(int width, ColorMode color_mode) {
+  std::vector<uint8_t> row(RowSize(width, color_mode));
+  for (int x = 0; x < width; x++) {
+    uint8_t level = width > 1 ? x * 255 / (width - 1) : 0;
+    switch (color_mode) {
+      case kBlackAndWhite:
+        if ((x / 16) % 2 == 1) {
+          row[x / 8] |= 0x80 >> (x % 8);
+        }
+        break;
+      case kGrayscale:
+        row[x] = level;
+        break;
+      case kRGB:
+        row[3 * x] = level;
+        row[3 * x + 1] = 255 - level;
+        row[3 * x + 2] = 128;
+        break;
+    }
+  }
+  return row;
+}
+
+// Returns the number of rows of |row_size| bytes to put in each strip.
+int RowsPerStrip(size_t row_size, int height) {
+  size_t rows = std::max<size_t>(1, kStripSize / row_size);
+  return std::min<size_t>(rows, height);
+}
+
+// Appends the strips making up |height| rows to |pieces|, where
+// |make_strip(rows)| returns the piece for a strip of |rows| rows.
+template <typename MakeStrip>
+void AppendStrips(int height, int rows_per_strip, MakeStrip make_strip,
+                  Pieces* pieces) {
+  const int full_strips = height / rows_per_strip;
+  const int remaining_rows = height % rows_per_strip;
+  if (full_strips > 0) {
+    scoped_refptr<base::RefCountedMemory> strip = make_strip(rows_per_strip);
+    pieces->insert(pieces->end(), full_strips, strip);
+  }
+  if (remaining_rows > 0) {
+    pieces->push_back(make_strip(remaining_rows));
+  }
+}
+
+scoped_refptr<base::RefCountedMemory> MakePngChunk(
+    const char* type, const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> chunk;
+  chunk.reserve(data.size() + 12);
+  AppendUint32Be(&chunk, data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  // The CRC covers the chunk type and data, but not the length.
+  AppendUint32Be(&chunk, Crc32(chunk.data() + 4, chunk.size() - 4));
+  return ToPiece(std::move(chunk));
+}
+
+// Encodes the image as a PNG. The image data is stored uncompressed, using
+// deflate stored blocks, with each strip in an IDAT chunk of its own.
+Pieces GeneratePng(const ScanDimensions& dimensions, ColorMode color_mode) {
+  Pieces pieces;
+  const std::vector<uint8_t> signature = {0x89, 'P',  'N',  'G',
+                                          '\r', '\n', 0x1a, '\n'};
+  pieces.push_back(ToPiece(signature));
+
+  std::vector<uint8_t> header;
+  AppendUint32Be(&header, dimensions.width);
+  AppendUint32Be(&header, dimensions.height);
+  header.push_back(color_mode == kBlackAndWhite ? 1 : 8);  // Bit depth.
+  header.push_back(color_mode == kRGB ? 2 : 0);  // Color type.
+  header.push_back(0);  // Compression method.
+  header.push_back(0);  // Filter method.
+  header.push_back(0);  // Interlace method.
+  pieces.push_back(MakePngChunk("IHDR", header));
+
+  // The zlib header, for deflate with a 32K window and no preset dictionary.
+  pieces.push_back(MakePngChunk("IDAT", {0x78, 0x01}));
+
+  // Each row is preceded by its filter type, which is always None.
+  std::vector<uint8_t> row = GenerateRow(dimensions.width, color_mode);
+  row.insert(row.begin(), 0);
+  const int rows_per_strip = RowsPerStrip(row.size(), dimensions.height);
+  auto make_strip = [&row](int rows) {
+    std::vector<uint8_t> raw;
+    raw.reserve(row.size() * rows);
+    for (int i = 0; i < rows; i++) {
+      raw.insert(raw.end(), row.begin(), row.end());
+    }
+    std::vector<uint8_t> blocks;
+    for (size_t offset = 0; offset < raw.size();
+         offset += kMaxStoredBlockSize) {
+      uint16_t size = std::min(kMaxStoredBlockSize, raw.size() - offset);
+      blocks.push_back(0);  // Not the final block, stored.
+      AppendUint16Le(&blocks, size);
+      AppendUint16Le(&blocks, ~size);
+      blocks.insert(blocks.end(), raw.begin() + offset,
+                    raw.begin() + offset + size);
+    }
+    return MakePngChunk("IDAT", blocks);
+  };
+  AppendStrips(dimensions.height, rows_per_strip, make_strip, &pieces);
+
+  // The checksum covers every row, including those in repeated strips.
+  Adler32 adler;
+  for (int y = 0; y < dimensions.height; y++) {
+    adler.Update(row);
+  }
+  // An empty final stored block ends the deflate stream.
+  std::vector<uint8_t> trailer = {0x01, 0x00, 0x00, 0xff, 0xff};
+  AppendUint32Be(&trailer, adler.value());
+  pieces.push_back(MakePngChunk("IDAT", trailer));
+  pieces.push_back(MakePngChunk("IEND", {}));
+  return pieces;
+}
+
+// Encodes the image as a single page PDF, with the image data uncompressed.
+Pieces GeneratePdf(const ScanDimensions& dimensions,
+                   ColorMode color_mode,
+                   int resolution) {
+  const std::vector<uint8_t> row = GenerateRow(dimensions.width, color_mode);
+  const size_t image_size = row.size() * dimensions.height;
+  // The page is the physical size of the scanned region, in points.
+  const double page_width = dimensions.width * 72.0 / resolution;
+  const double page_height = dimensions.height * 72.0 / resolution;
+
+  std::vector<size_t> offsets;
+  std::string header = "%PDF-1.4\n";
+  offsets.push_back(header.size());
+  header += "1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n";
+  offsets.push_back(header.size());
+  header += "2 0 obj\n<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n";
+  offsets.push_back(header.size());
+  header += base::StringPrintf(
+      "3 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %.2f %.2f] "
+      "/Resources << /XObject << /Im0 5 0 R >> >> /Contents 4 0 R >>\n"
+      "endobj\n",
+      page_width, page_height);
+  const std::string contents =
+      base::StringPrintf("q %.2f 0 0 %.2f 0 0 cm /Im0 Do Q", page_width,
+                         page_height);
+  offsets.push_back(header.size());
+  header += base::StringPrintf(
+      "4 0 obj\n<< /Length %zu >>\nstream\n%s\nendstream\nendobj\n",
+      contents.size(), contents.c_str());
+  offsets.push_back(header.size());
+  header += base::StringPrintf(
+      "5 0 obj\n<< /Type /XObject /Subtype /Image /Width %d /Height %d "
+      "/ColorSpace /%s /BitsPerComponent %d /Length %zu >>\nstream\n",
+      dimensions.width, dimensions.height,
+      color_mode == kRGB ? "DeviceRGB" : "DeviceGray",
+      color_mode == kBlackAndWhite ? 1 : 8, image_size);
+
+  Pieces pieces;
+  pieces.push_back(ToPiece(header));
+
+  const int rows_per_strip = RowsPerStrip(row.size(), dimensions.height);
+  auto make_strip = [&row](int rows) {
+    std::vector<uint8_t> strip;
+    strip.reserve(row.size() * rows);
+    for (int i = 0; i < rows; i++) {
+      strip.insert(strip.end(), row.begin(), row.end());
+    }
+    return ToPiece(std::move(strip));
+  };
+  AppendStrips(dimensions.height, rows_per_strip, make_strip, &pieces);
+
+  std::string trailer = "\nendstream\nendobj\n";
+  const size_t xref_offset = header.size() + image_size + trailer.size();
+  trailer += base::StringPrintf("xref\n0 %zu\n0000000000 65535 f \n",
+                                offsets.size() + 1);
+  for (size_t offset : offsets) {
+    trailer += base::StringPrintf("%010zu 00000 n \n", offset);
+  }
+  trailer += base::StringPrintf(
+      "trailer\n<< /Size %zu /Root 1 0 R >>\nstartxref\n%zu\n%%%%EOF\n",
+      offsets.size() + 1, xref_offset);
+  pieces.push_back(ToPiece(trailer));
+  return pieces;
+}
+
+}  // namespace
+
+base::Optional<ScanDimensions> GetScanDimensions(const ScanRegion& region,
+                                                 int resolution) {
+  base::StringPiece units = region.units;
+  if (base::StartsWith(units, "escl:", base::CompareCase::SENSITIVE)) {
+    units.remove_prefix(strlen("escl:"));
+  }
+
+  // The number of units in an inch, or 0 if the units are pixels.
+  int64_t units_per_inch;
+  if (units == "ThreeHundredthsOfInches") {
+    units_per_inch = 300;
+  } else if (units == "TenThousandthsOfInches") {
+    units_per_inch = 10000;
+  } else if (units == "Micrometers") {
+    units_per_inch = 25400;
+  } else if (units == "Pixels") {
+    units_per_inch = 0;
+  } else {
+    LOG(ERROR) << "Unsupported scan region units " << region.units;
+    return base::nullopt;
+  }
+
+  auto to_pixels = [units_per_inch, resolution](int64_t length) {
+    return units_per_inch ? length * resolution / units_per_inch : length;
+  };
+  int64_t width = to_pixels(region.width);
+  int64_t height = to_pixels(region.height);
+  if (width <= 0 || height <= 0 || width > kMaxScanDimension ||
+      height > kMaxScanDimension) {
+    LOG(ERROR) << "Invalid scan size " << width << "x" << height;
+    return base::nullopt;
+  }
+  return ScanDimensions{static_cast<int>(width), static_cast<int>(height)};
+}
+
+base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>>
+GenerateScan(const ScanSettings& settings) {
+  if (settings.regions.empty()) {
+    LOG(ERROR) << "Scan settings have no scan regions";
+    return base::nullopt;
+  }
+  if (settings.x_resolution <= 0) {
+    LOG(ERROR) << "Invalid scan resolution " << settings.x_resolution;
+    return base::nullopt;
+  }
+  base::Optional<ScanDimensions> dimensions =
+      GetScanDimensions(settings.regions[0], settings.x_resolution);
+  if (!dimensions) {
+    return base::nullopt;
+  }
+
+  if (settings.document_format == kPngFormat) {
+    return GeneratePng(dimensions.value(), settings.color_mode);
+  } else if (settings.document_format == kPdfFormat) {
+    return GeneratePdf(dimensions.value(), settings.color_mode,
+                       settings.x_resolution);
+  }
+  LOG(ERROR) << "Can not generate scans in format "
+             << settings.document_format;
+  return base::nullopt;
+}
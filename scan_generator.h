@@ -0,0 +1,45 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCAN_GENERATOR_H__
+#define SCAN_GENERATOR_H__
+
+#include <string>
+#include <vector>
+
+#include <base/memory/ref_counted_memory.h>
+#include <base/memory/scoped_refptr.h>
+#include <base/optional.h>
+
+#include "escl_manager.h"
+
+// The document formats which GenerateScan can produce.
+extern const char kPngFormat[];
+extern const char kPdfFormat[];
+
+// The size in pixels of a scanned image.
+struct ScanDimensions {
+  int width;
+  int height;
+};
+
+// Returns the size in pixels of |region| when scanned at |resolution| dots per
+// inch, or base::nullopt if the units of |region| are not supported or the
+// region is empty.
+base::Optional<ScanDimensions> GetScanDimensions(const ScanRegion& region,
+                                                 int resolution);
+
+// Generates a synthetic scan of the first region in |settings|, sized for the
+// requested resolution and encoded in the requested color mode and document
+// format. Returns base::nullopt if the document format is not one of the
+// formats above, or the region can not be sized.
+//
+// The document is returned as a sequence of pieces which should be sent in
+// order. The image data is split into strips of rows, and since every strip is
+// identical they share the same memory, so that scans of any size can be
+// produced without holding the whole image in memory.
+base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>>
+GenerateScan(const ScanSettings& settings);
+
+#endif  // SCAN_GENERATOR_H__
@@ -0,0 +1,234 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "scan_generator.h"
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+ScanSettings CreateScanSettings(const std::string& document_format,
+                                ColorMode color_mode) {
+  ScanSettings settings;
+  settings.document_format = document_format;
+  settings.color_mode = color_mode;
+  settings.input_source = "Platen";
+  settings.x_resolution = 300;
+  settings.y_resolution = 300;
+  ScanRegion region;
+  region.units = "escl:ThreeHundredthsOfInches";
+  region.width = 2550;
+  region.height = 3300;
+  region.x_offset = 0;
+  region.y_offset = 0;
+  settings.regions.push_back(region);
+  return settings;
+}
+
+std::string Concatenate(
+    const std::vector<scoped_refptr<base::RefCountedMemory>>& pieces) {
+  std::string result;
+  for (const auto& piece : pieces) {
+    result.append(piece->front_as<char>(), piece->size());
+  }
+  return result;
+}
+
+uint32_t ReadUint32Be(const std::string& data, size_t offset) {
+  return (static_cast<uint8_t>(data[offset]) << 24) |
+         (static_cast<uint8_t>(data[offset + 1]) << 16) |
+         (static_cast<uint8_t>(data[offset + 2]) << 8) |
+         static_cast<uint8_t>(data[offset + 3]);
+}
+
+// Decodes the image data of the PNG |png|, which must only use deflate stored
+// blocks. Returns the decoded data, or an empty string if |png| is malformed.
+std::string DecodeStoredPng(const std::string& png, uint32_t* width,
+                            uint32_t* height) {
+  if (png.compare(0, 8, "\x89PNG\r\n\x1a\n") != 0) {
+    return "";
+  }
+  std::string zlib;
+  size_t offset = 8;
+  while (offset + 12 <= png.size()) {
+    uint32_t length = ReadUint32Be(png, offset);
+    std::string type = png.substr(offset + 4, 4);
+    std::string data = png.substr(offset + 8, length);
+    if (type == "IHDR") {
+      *width = ReadUint32Be(data, 0);
+      *height = ReadUint32Be(data, 4);
+    } else if (type == "IDAT") {
+      zlib += data;
+    }
+    offset += length + 12;
+  }
+  if (offset != png.size() || zlib.size() < 6) {
+    return "";
+  }
+
+  std::string decoded;
+  size_t pos = 2;
+  bool final_block = false;
+  while (!final_block && pos + 5 <= zlib.size()) {
+    final_block = zlib[pos] & 1;
+    size_t size = static_cast<uint8_t>(zlib[pos + 1]) |
+                  (static_cast<uint8_t>(zlib[pos + 2]) << 8);
+    decoded += zlib.substr(pos + 5, size);
+    pos += 5 + size;
+  }
+  // Only the Adler-32 checksum should follow the final block.
+  if (!final_block || pos + 4 != zlib.size()) {
+    return "";
+  }
+
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (char c : decoded) {
+    a = (a + static_cast<uint8_t>(c)) % 65521;
+    b = (b + a) % 65521;
+  }
+  if (ReadUint32Be(zlib, pos) != ((b << 16) | a)) {
+    return "";
+  }
+  return decoded;
+}
+
+TEST(GetScanDimensions, ThreeHundredthsOfInches) {
+  ScanRegion region;
+  region.units = "escl:ThreeHundredthsOfInches";
+  region.width = 2550;
+  region.height = 3300;
+  base::Optional<ScanDimensions> dimensions = GetScanDimensions(region, 100);
+  ASSERT_TRUE(dimensions);
+  EXPECT_EQ(dimensions->width, 850);
+  EXPECT_EQ(dimensions->height, 1100);
+}
+
+TEST(GetScanDimensions, Pixels) {
+  ScanRegion region;
+  region.units = "Pixels";
+  region.width = 640;
+  region.height = 480;
+  base::Optional<ScanDimensions> dimensions = GetScanDimensions(region, 600);
+  ASSERT_TRUE(dimensions);
+  EXPECT_EQ(dimensions->width, 640);
+  EXPECT_EQ(dimensions->height, 480);
+}
+
+TEST(GetScanDimensions, UnsupportedUnits) {
+  ScanRegion region;
+  region.units = "Percent";
+  region.width = 100;
+  region.height = 100;
+  EXPECT_FALSE(GetScanDimensions(region, 300));
+}
+
+TEST(GetScanDimensions, EmptyRegion) {
+  ScanRegion region;
+  region.units = "Pixels";
+  region.width = 0;
+  region.height = 100;
+  EXPECT_FALSE(GetScanDimensions(region, 300));
+}
+
+TEST(GenerateScan, UnsupportedFormat) {
+  EXPECT_FALSE(GenerateScan(CreateScanSettings("image/jpeg", kRGB)));
+}
+
+TEST(GenerateScan, PngRgb) {
+  ScanSettings settings = CreateScanSettings(kPngFormat, kRGB);
+  settings.x_resolution = 100;
+  base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>> scan =
+      GenerateScan(settings);
+  ASSERT_TRUE(scan);
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::string decoded = DecodeStoredPng(Concatenate(scan.value()), &width,
+                                        &height);
+  EXPECT_EQ(width, 850);
+  EXPECT_EQ(height, 1100);
+  // Each row has a filter type byte followed by 3 bytes per pixel.
+  EXPECT_EQ(decoded.size(), height * (1 + 3 * width));
+}
+
+TEST(GenerateScan, PngBlackAndWhite) {
+  ScanSettings settings = CreateScanSettings(kPngFormat, kBlackAndWhite);
+  settings.regions[0].units = "Pixels";
+  settings.regions[0].width = 33;
+  settings.regions[0].height = 10;
+  base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>> scan =
+      GenerateScan(settings);
+  ASSERT_TRUE(scan);
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::string decoded = DecodeStoredPng(Concatenate(scan.value()), &width,
+                                        &height);
+  EXPECT_EQ(width, 33);
+  EXPECT_EQ(height, 10);
+  // Rows of 33 1 bit pixels are padded to 5 bytes.
+  ASSERT_EQ(decoded.size(), 10 * (1 + 5));
+  // Pixels 0-15 are black, and 16-31 are white.
+  EXPECT_EQ(decoded.substr(0, 6), std::string("\x00\x00\x00\xff\xff\x00", 6));
+}
+
+TEST(GenerateScan, Pdf) {
+  base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>> scan =
+      GenerateScan(CreateScanSettings(kPdfFormat, kGrayscale));
+  ASSERT_TRUE(scan);
+  std::string pdf = Concatenate(scan.value());
+  EXPECT_EQ(pdf.compare(0, 9, "%PDF-1.4\n"), 0);
+  EXPECT_EQ(pdf.compare(pdf.size() - 6, 6, "%%EOF\n"), 0);
+  EXPECT_NE(pdf.find("/Width 2550 /Height 3300 /ColorSpace /DeviceGray "
+                     "/BitsPerComponent 8 /Length 8415000"),
+            std::string::npos);
+  // A US letter page scanned at 300 DPI.
+  EXPECT_NE(pdf.find("/MediaBox [0 0 612.00 792.00]"), std::string::npos);
+
+  // The cross-reference table must point at each object.
+  size_t startxref = pdf.rfind("startxref\n");
+  ASSERT_NE(startxref, std::string::npos);
+  size_t xref_offset = 0;
+  ASSERT_TRUE(base::StringToSizeT(
+      pdf.substr(startxref + 10, pdf.find('\n', startxref + 10) -
+                                     (startxref + 10)),
+      &xref_offset));
+  ASSERT_EQ(pdf.compare(xref_offset, 5, "xref\n"), 0);
+  for (int object = 1; object <= 5; object++) {
+    // Skip "xref\n0 6\n" and the entry for object 0, 20 bytes each.
+    size_t entry = xref_offset + 9 + 20 * object;
+    size_t object_offset = 0;
+    ASSERT_TRUE(
+        base::StringToSizeT(pdf.substr(entry, 10), &object_offset));
+    EXPECT_EQ(pdf.compare(object_offset, 8,
+                          base::StringPrintf("%d 0 obj\n", object)),
+              0);
+  }
+}
+
+TEST(GenerateScan, StripsShareMemory) {
+  base::Optional<std::vector<scoped_refptr<base::RefCountedMemory>>> scan =
+      GenerateScan(CreateScanSettings(kPdfFormat, kRGB));
+  ASSERT_TRUE(scan);
+  size_t size = 0;
+  std::set<const unsigned char*> distinct;
+  for (const auto& piece : scan.value()) {
+    size += piece->size();
+    distinct.insert(piece->front());
+  }
+  EXPECT_GT(size, 2550u * 3300 * 3);
+  // The header, a full strip, a shorter final strip, and the trailer.
+  EXPECT_LE(distinct.size(), 4u);
+  EXPECT_GT(scan->size(), distinct.size());
+}
+
+}  // namespace
@@ -5,7 +5,15 @@
 #include "server.h"
 
 #include <arpa/inet.h>
+#include <linux/vm_sockets.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -16,229 +24,661 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <memory>
+#include <string>
 #include <utility>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+#include <base/synchronization/lock.h>
 
 #include "device_descriptors.h"
+#include "metrics.h"
 #include "op_commands.h"
 #include "usbip.h"
 #include "usbip_constants.h"
 
 namespace {
 
-// Attempts to create the socket used for accepting connections on the server,
-// and if successful returns the file descriptor of the socket.
+// The smallest number of bytes requested from a connection in a single read.
+// This is large enough to hold several USBIP commands, or a typical bulk OUT
+// transfer of an IPP request, at once.
+constexpr size_t kMinimumReadSize = 16 * 1024;
+
+// The largest number of bytes requested from a connection in a single read.
+// The space for each read is zeroed before it is filled, so reads are bounded
+// to keep that cost in proportion to the data which actually arrives.
+constexpr size_t kMaximumReadSize = 128 * 1024;
+
+// The largest bulk OUT transfer which is accepted, which matches the default
+// limit on the memory used for URBs by usbfs. A client which sends a larger
+// one is disconnected instead of having the whole transfer buffered.
+constexpr size_t kMaxTransferBufferLength = 16 * 1024 * 1024;
+
+// Attempts to create a socket of |domain| used for accepting connections on
+// the server, and if successful returns the file descriptor of the socket.
 //
-// Opens a socket with the option SO_REUSEADDR;
-base::ScopedFD SetupServerSocket() {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
+// Opens a non-blocking socket. TCP sockets are given the option SO_REUSEADDR,
+// and send and receive buffers of |options.socket_buffer_size| if it is set,
+// which are inherited by each accepted connection.
+base::ScopedFD SetupServerSocket(int domain, const ListenOptions& options) {
+  int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (fd < 0) {
     LOG(ERROR) << "Socket error: " << strerror(errno);
     exit(1);
   }
+  if (domain != AF_INET) {
+    return base::ScopedFD(fd);
+  }
 
   int reuse = 1;
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
     LOG(ERROR) << "setsockopt(SO_REUSEADDR) failed";
   }
+  // Setting the buffer sizes turns off the kernel's automatic tuning of them,
+  // so they are only set when asked for.
+  int buffer_size = options.socket_buffer_size;
+  if (buffer_size > 0 &&
+      (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size,
+                  sizeof(buffer_size)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+                  sizeof(buffer_size)) < 0)) {
+    LOG(ERROR) << "setsockopt(SO_SNDBUF/SO_RCVBUF) failed";
+  }
 
   return base::ScopedFD(fd);
 }
 
-// Binds the server socket described by |fd| to an address and returns the
-// resulting sockaddr_in struct which contains the address.
-sockaddr_in BindServerSocket(const base::ScopedFD& sockfd) {
+// Binds the server socket described by |fd| to |address| of |length| bytes,
+// which is described in logs as |name|.
+void BindServerSocket(const base::ScopedFD& sockfd,
+                      const sockaddr* address,
+                      socklen_t length,
+                      const std::string& name) {
+  if (bind(sockfd.get(), address, length) < 0) {
+    LOG(ERROR) << "Bind error on " << name << ": " << strerror(errno);
+    exit(1);
+  }
+  LOG(INFO) << "Bound server to address " << name;
+}
+
+// Creates a TCP socket bound to TCP_SERV_PORT on every IPv4 address.
+base::ScopedFD CreateTcpListener(const ListenOptions& options) {
+  base::ScopedFD fd = SetupServerSocket(AF_INET, options);
   sockaddr_in server;
   memset(&server, 0, sizeof(server));
   server.sin_family = AF_INET;
   server.sin_addr.s_addr = htonl(INADDR_ANY);
   server.sin_port = htons(TCP_SERV_PORT);
+  BindServerSocket(fd, reinterpret_cast<sockaddr*>(&server), sizeof(server),
+                   base::StringPrintf("0.0.0.0:%d", TCP_SERV_PORT));
+  return fd;
+}
+
+// Creates a Unix domain socket bound to |path|, replacing any socket left
+// behind at |path| by an earlier server. Exits if something other than a
+// socket is at |path|.
+base::ScopedFD CreateUnixListener(const std::string& path,
+                                  const ListenOptions& options) {
+  sockaddr_un server;
+  memset(&server, 0, sizeof(server));
+  server.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(server.sun_path)) {
+    LOG(ERROR) << "Unix socket path is too long: " << path;
+    exit(1);
+  }
+  path.copy(server.sun_path, path.size());
 
-  sockaddr* server_socket = reinterpret_cast<sockaddr*>(&server);
-  if (bind(sockfd.get(), server_socket, sizeof(server)) < 0) {
-    LOG(ERROR) << "Bind error: " << strerror(errno);
+  base::ScopedFD fd = SetupServerSocket(AF_UNIX, options);
+  // Only a socket is replaced, so that a mistyped path cannot remove some
+  // other file.
+  struct stat info;
+  if (lstat(path.c_str(), &info) == 0) {
+    if (!S_ISSOCK(info.st_mode)) {
+      LOG(ERROR) << path << " exists and is not a socket";
+      exit(1);
+    }
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+      LOG(ERROR) << "Failed to remove " << path << ": " << strerror(errno);
+      exit(1);
+    }
+  } else if (errno != ENOENT) {
+    LOG(ERROR) << "Failed to stat " << path << ": " << strerror(errno);
     exit(1);
   }
+  BindServerSocket(fd, reinterpret_cast<sockaddr*>(&server), sizeof(server),
+                   path);
+  return fd;
+}
 
-  return server;
+// Creates a vsock socket bound to |port| which accepts connections from any
+// context, such as a guest VM.
+base::ScopedFD CreateVsockListener(uint32_t port,
+                                   const ListenOptions& options) {
+  base::ScopedFD fd = SetupServerSocket(AF_VSOCK, options);
+  sockaddr_vm server;
+  memset(&server, 0, sizeof(server));
+  server.svm_family = AF_VSOCK;
+  server.svm_cid = VMADDR_CID_ANY;
+  server.svm_port = port;
+  BindServerSocket(fd, reinterpret_cast<sockaddr*>(&server), sizeof(server),
+                   base::StringPrintf("vsock:%u", port));
+  return fd;
+}
+
+// Returns a description of the client address |address| for logging.
+std::string FormatClientAddress(const sockaddr_storage& address) {
+  switch (address.ss_family) {
+    case AF_INET: {
+      const sockaddr_in* client =
+          reinterpret_cast<const sockaddr_in*>(&address);
+      return base::StringPrintf("%s:%d", inet_ntoa(client->sin_addr),
+                                ntohs(client->sin_port));
+    }
+    case AF_VSOCK: {
+      const sockaddr_vm* client =
+          reinterpret_cast<const sockaddr_vm*>(&address);
+      return base::StringPrintf("vsock:%u:%u", client->svm_cid,
+                                client->svm_port);
+    }
+    default:
+      return "local";
+  }
 }
 
 // Accepts a new connection to the server described by |fd| and returns the file
-// descriptor of the connection.
+// descriptor of the connection, which is set to be non-blocking. Returns an
+// invalid ScopedFD if there are no more connections waiting to be accepted.
+//
+// TCP connections are given the option TCP_NODELAY, since each USBIP reply is
+// waited on by the client and must not be held back to be coalesced.
 base::ScopedFD AcceptConnection(const base::ScopedFD& fd) {
-  sockaddr_in client;
+  sockaddr_storage client;
   socklen_t client_length = sizeof(client);
   int connection =
-      accept(fd.get(), reinterpret_cast<sockaddr*>(&client), &client_length);
+      accept4(fd.get(), reinterpret_cast<sockaddr*>(&client), &client_length,
+              SOCK_NONBLOCK | SOCK_CLOEXEC);
   if (connection < 0) {
-    LOG(ERROR) << "Accept error: " << strerror(errno);
-    exit(1);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      LOG(ERROR) << "Accept error: " << strerror(errno);
+    }
+    return base::ScopedFD();
   }
-  LOG(INFO) << "Connection address: " << inet_ntoa(client.sin_addr) << ":"
-            << client.sin_port;
+  if (client.ss_family == AF_INET) {
+    int enable = 1;
+    if (setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &enable,
+                   sizeof(enable)) < 0) {
+      LOG(ERROR) << "setsockopt(TCP_NODELAY) failed";
+    }
+  }
+  LOG(INFO) << "Connection address: " << FormatClientAddress(client);
   return base::ScopedFD(connection);
 }
 
-// Converts the bound address in |server| and reports it in a human-readable
-// format.
-void ReportBoundAddress(sockaddr_in* server) {
-  char address[INET_ADDRSTRLEN];
-  if (inet_ntop(AF_INET, &server->sin_addr, address, INET_ADDRSTRLEN)) {
-    LOG(INFO) << "Bound server to address " << address << ":"
-              << server->sin_port;
-  } else {
-    LOG(ERROR) << "inet_ntop: " << strerror(errno);
-    exit(1);
+// Blocks until |sockfd| is ready for the I/O described by |events|.
+void WaitForSocket(int sockfd, int16_t events) {
+  pollfd pfd;
+  pfd.fd = sockfd;
+  pfd.events = events;
+  pfd.revents = 0;
+  int result = HANDLE_EINTR(poll(&pfd, 1, -1));
+  CHECK_GE(result, 0) << "Failed to poll socket: " << strerror(errno);
+}
+
+// Returns the lock which serializes the messages sent on |sockfd|. A lock is
+// created the first time each file descriptor is used and is never destroyed,
+// so it stays valid for a later connection which reuses the descriptor. The
+// number of locks is bounded by the number of open file descriptors.
+base::Lock* GetSendLock(int sockfd) {
+  static base::Lock* locks_lock = new base::Lock();
+  static auto* locks = new std::map<int, std::unique_ptr<base::Lock>>();
+  base::AutoLock lock(*locks_lock);
+  std::unique_ptr<base::Lock>& send_lock = (*locks)[sockfd];
+  if (!send_lock) {
+    send_lock = std::make_unique<base::Lock>();
   }
+  return send_lock.get();
 }
 
-// Reads the requested bus ID for an OpReqImport message. Since we are only
-// exporting a single device we should only ever expect to receive the value for
-// the exported device, so this function is meant to simply clear the data from
-// the socket.
-void ReadBusId(const base::ScopedFD& sockfd) {
-  char busid[32];
-  LOG(INFO) << "Attaching device...";
-  ssize_t received = recv(sockfd.get(), busid, 32, 0);
-  if (received != 32) {
-    LOG(ERROR) << "Receive error: " << strerror(errno);
+// Registers |fd| with |epoll_fd| for notifications of incoming data.
+void WatchSocket(const base::ScopedFD& epoll_fd, int fd) {
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, fd, &event) < 0) {
+    LOG(ERROR) << "epoll_ctl error: " << strerror(errno);
     exit(1);
   }
 }
 
+// Reads every pending signal from the signalfd |fd|. Returns whether any
+// signals were pending.
+bool ReadSignals(int fd) {
+  bool received = false;
+  signalfd_siginfo info;
+  while (HANDLE_EINTR(read(fd, &info, sizeof(info))) ==
+         static_cast<ssize_t>(sizeof(info))) {
+    received = true;
+  }
+  return received;
+}
+
 }  // namespace
 
 void SendBuffer(int sockfd, const SmartBuffer& smart_buffer) {
-  size_t remaining = smart_buffer.size();
-  size_t total = 0;
-  while (remaining > 0) {
-    size_t to_send = std::min<size_t>(remaining, 512UL);
-    ssize_t sent =
-        send(sockfd, smart_buffer.data() + total, to_send, MSG_NOSIGNAL);
+  iovec iov;
+  // iovec is also used for writes, so its base pointer is not const.
+  iov.iov_base = const_cast<uint8_t*>(smart_buffer.data());
+  iov.iov_len = smart_buffer.size();
+  SendIovecs(sockfd, &iov, 1);
+}
+
+void SendIovecs(int sockfd, iovec* iov, size_t iov_count) {
+  // Replies may be sent by the worker threads of a printer as well as by the
+  // thread running the server, so each message is written while holding the
+  // lock of its socket to keep messages from being interleaved on it. Writers
+  // to other sockets are not held up while this one waits to be writable.
+  base::AutoLock lock(*GetSendLock(sockfd));
+
+  // Skip over any empty buffers so that a zero-length payload does not need to
+  // be special-cased by the caller.
+  while (iov_count > 0 && iov->iov_len == 0) {
+    ++iov;
+    --iov_count;
+  }
+  while (iov_count > 0) {
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iov_count;
+    ssize_t sent = sendmsg(sockfd, &message, MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      WaitForSocket(sockfd, POLLOUT);
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
     CHECK_GE(sent, 0) << "Failed to write data to socket";
-    CHECK_GE(remaining, sent) << "Sent more data than expected";
+
+    // Advance past the buffers which were sent completely, and then past the
+    // portion of the first remaining buffer which was sent.
     size_t sent_unsigned = static_cast<size_t>(sent);
-    total += sent_unsigned;
-    remaining -= sent_unsigned;
+    while (iov_count > 0 && sent_unsigned >= iov->iov_len) {
+      sent_unsigned -= iov->iov_len;
+      ++iov;
+      --iov_count;
+    }
+    CHECK(iov_count > 0 || sent_unsigned == 0)
+        << "Sent more data than expected";
+    if (iov_count > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + sent_unsigned;
+      iov->iov_len -= sent_unsigned;
+    }
   }
 }
 
 SmartBuffer ReceiveBuffer(int sockfd, size_t size) {
-  SmartBuffer smart_buffer(size);
-  auto buf = std::make_unique<uint8_t[]>(size);
-  size_t remaining = size;
+  SmartBuffer smart_buffer;
+  uint8_t* buf = smart_buffer.Extend(size);
   size_t total = 0;
   while (total < size) {
-    size_t to_receive = std::min<size_t>(remaining, 512UL);
-    ssize_t received = recv(sockfd, buf.get() + total, to_receive, 0);
-    if (received == 0 && size != 0) {
+    ssize_t received = recv(sockfd, buf + total, size - total, MSG_WAITALL);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      WaitForSocket(sockfd, POLLIN);
+      continue;
+    }
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received == 0) {
       LOG(ERROR) << "Client has closed connection";
+      smart_buffer.Shrink(total);
       return smart_buffer;
     }
     CHECK_GE(received, 0) << "Failed to receive data from socket";
-    CHECK_GE(remaining, received) << "Received more data than expected";
-    size_t received_unsigned = static_cast<size_t>(received);
-    total += received_unsigned;
-    remaining -= received_unsigned;
+    total += static_cast<size_t>(received);
   }
-  smart_buffer.Add(buf.get(), size);
   return smart_buffer;
 }
 
-Server::Server(UsbPrinter printer) : printer_(std::move(printer)) {}
+Server::Connection::Connection(base::ScopedFD fd)
+    : fd(std::move(fd)), pool(base::MakeRefCounted<BufferPool>()) {}
+
+Server::Server(std::vector<UsbPrinter> printers, const ListenOptions& options)
+    : options_(options), printers_(std::move(printers)) {}
+
+void Server::HandleSighup(base::RepeatingClosure handler) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+    LOG(ERROR) << "Failed to block SIGHUP";
+    exit(1);
+  }
+  sighup_fd_.reset(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+  if (!sighup_fd_.is_valid()) {
+    LOG(ERROR) << "signalfd error: " << strerror(errno);
+    exit(1);
+  }
+  sighup_handler_ = std::move(handler);
+}
 
 void Server::Run() {
-  base::ScopedFD fd = SetupServerSocket();
-  sockaddr_in server = BindServerSocket(fd);
-  ReportBoundAddress(&server);
+  std::vector<base::ScopedFD> listeners;
+  if (options_.tcp) {
+    listeners.push_back(CreateTcpListener(options_));
+  }
+  if (!options_.unix_socket_path.empty()) {
+    listeners.push_back(
+        CreateUnixListener(options_.unix_socket_path, options_));
+  }
+  if (options_.vsock_port) {
+    listeners.push_back(
+        CreateVsockListener(options_.vsock_port.value(), options_));
+  }
+  CHECK(!listeners.empty()) << "The server has nowhere to listen";
 
-  if (listen(fd.get(), SOMAXCONN) < 0) {
-    LOG(ERROR) << "Listen error: " << strerror(errno);
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (!epoll_fd_.is_valid()) {
+    LOG(ERROR) << "epoll_create1 error: " << strerror(errno);
     exit(1);
   }
+  for (const base::ScopedFD& fd : listeners) {
+    if (listen(fd.get(), SOMAXCONN) < 0) {
+      LOG(ERROR) << "Listen error: " << strerror(errno);
+      exit(1);
+    }
+    WatchSocket(epoll_fd_, fd.get());
+  }
+  if (sighup_fd_.is_valid()) {
+    WatchSocket(epoll_fd_, sighup_fd_.get());
+  }
 
   // Print notification that the server is ready to begin accepting connections.
   printf("virtual-usb-printer: ready to accept connections\n");
+  fflush(stdout);
 
+  constexpr int kMaxEvents = 64;
+  epoll_event events[kMaxEvents];
+  while (true) {
+    // Will block until either a new connection is waiting to be accepted or an
+    // existing connection has data available.
+    int ready = epoll_wait(epoll_fd_.get(), events, kMaxEvents, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "epoll_wait error: " << strerror(errno);
+      exit(1);
+    }
+
+    for (int i = 0; i < ready; ++i) {
+      int event_fd = events[i].data.fd;
+      if (sighup_fd_.is_valid() && event_fd == sighup_fd_.get()) {
+        // Several signals received in quick succession are handled once.
+        if (ReadSignals(event_fd)) {
+          LOG(INFO) << "Received SIGHUP";
+          sighup_handler_.Run();
+        }
+        continue;
+      }
+      auto listener =
+          std::find_if(listeners.begin(), listeners.end(),
+                       [event_fd](const base::ScopedFD& fd) {
+                         return fd.get() == event_fd;
+                       });
+      if (listener != listeners.end()) {
+        AcceptConnections(*listener);
+        continue;
+      }
+
+      auto iter = connections_.find(event_fd);
+      if (iter == connections_.end()) {
+        continue;
+      }
+      bool open;
+      {
+        ScopedBufferPool scoped_pool(iter->second.pool.get());
+        open = HandleReadable(&iter->second);
+      }
+      if (!open) {
+        LOG(INFO) << "Closing connection " << event_fd;
+        // The printer must not try to complete requests on the connection
+        // once it is closed, and the next client to attach it must not see
+        // anything left over from this one.
+        if (iter->second.printer) {
+          iter->second.printer->Detach(event_fd);
+        }
+        // Closing the file descriptor also removes it from |epoll_fd_|.
+        connections_.erase(iter);
+      }
+    }
+  }
+}
+
+void Server::AcceptConnections(const base::ScopedFD& fd) {
   while (true) {
-    // Will block until a new connection has been accepted.
     base::ScopedFD connection = AcceptConnection(fd);
-    HandleConnection(std::move(connection));
+    if (!connection.is_valid()) {
+      return;
+    }
+    int connection_fd = connection.get();
+    WatchSocket(epoll_fd_, connection_fd);
+    connections_.emplace(connection_fd, Connection(std::move(connection)));
+  }
+}
+
+bool Server::HandleReadable(Connection* connection) {
+  SmartBuffer* pending = &connection->pending;
+  while (true) {
+    // Read as much of the rest of the current message as possible when its
+    // size is known, which for a bulk OUT transfer is the entire URB payload.
+    // Otherwise read enough to cover the next few small messages.
+    size_t read_size = std::min(
+        std::max(connection->bytes_needed, kMinimumReadSize), kMaximumReadSize);
+    size_t offset = pending->size();
+    uint8_t* buf = pending->Extend(read_size);
+    ssize_t received = recv(connection->fd.get(), buf, read_size, 0);
+    size_t received_unsigned = received > 0 ? received : 0;
+    if (received_unsigned < read_size) {
+      pending->Shrink(offset + received_unsigned);
+    }
+
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      LOG(ERROR) << "Receive error: " << strerror(errno);
+      return false;
+    }
+    if (received == 0) {
+      LOG(INFO) << "Client has closed connection";
+      return false;
+    }
+    if (!HandlePending(connection)) {
+      return false;
+    }
+  }
+}
+
+bool Server::HandlePending(Connection* connection) {
+  while (true) {
+    RequestStatus status = connection->printer
+                               ? HandleUsbRequest(connection)
+                               : HandleOpRequest(connection);
+    switch (status) {
+      case RequestStatus::kIncomplete:
+        return true;
+      case RequestStatus::kHandled:
+        break;
+      case RequestStatus::kClose:
+        return false;
+    }
   }
 }
 
-void Server::HandleDeviceList(const base::ScopedFD& connection) const {
+void Server::HandleDeviceList(int sockfd) const {
   OpRepDevlist list;
   LOG(INFO) << "Listing devices...";
-  CreateOpRepDevlist(printer_.device_descriptor(),
-                     printer_.configuration_descriptor(),
-                     printer_.interface_descriptors(), &list);
+  CreateOpRepDevlist(printers_, &list);
   SmartBuffer packed_devlist = PackOpRepDevlist(list);
-  free(list.interfaces);
-  SendBuffer(connection.get(), packed_devlist);
+  SendBuffer(sockfd, packed_devlist);
 }
 
-void Server::HandleAttach(const base::ScopedFD& connection) const {
+void Server::HandleAttach(int sockfd, size_t index) const {
+  const UsbPrinter& printer = printers_[index];
   OpRepImport rep;
-  CreateOpRepImport(printer_.device_descriptor(),
-                    printer_.configuration_descriptor(), &rep);
+  CreateOpRepImport(printer.device_descriptor(),
+                    printer.configuration_descriptor(), index, &rep);
   SmartBuffer packed_import = PackOpRepImport(rep);
-  SendBuffer(connection.get(), packed_import);
+  SendBuffer(sockfd, packed_import);
 }
 
-bool Server::HandleOpRequest(const base::ScopedFD& connection,
-                             bool* attached) const {
+bool Server::IsAttached(const UsbPrinter* printer) const {
+  return std::any_of(connections_.begin(), connections_.end(),
+                     [printer](const std::pair<const int, Connection>& entry) {
+                       return entry.second.printer == printer;
+                     });
+}
+
+Server::RequestStatus Server::HandleOpRequest(Connection* connection) {
   // Read in the header first in order to determine whether the request is an
   // OpReqDevlist or an OpReqImport.
+  SmartBuffer* pending = &connection->pending;
+  connection->bytes_needed = 0;
   OpHeader request;
-  ssize_t received = recv(connection.get(), &request, sizeof(request), 0);
-  if (received != sizeof(request)) {
-    LOG(ERROR) << "Receive error: " << strerror(errno);
-    exit(1);
+  if (pending->size() < sizeof(request)) {
+    return RequestStatus::kIncomplete;
   }
-
+  memcpy(&request, pending->data(), sizeof(request));
   UnpackOpHeader(&request);
+
   if (request.command == OP_REQ_DEVLIST_CMD) {
-    HandleDeviceList(connection);
-    return false;
+    pending->Erase(0, sizeof(request));
+    HandleDeviceList(connection->fd.get());
+    return RequestStatus::kClose;
   } else if (request.command == OP_REQ_IMPORT_CMD) {
-    ReadBusId(connection);
-    HandleAttach(connection);
-    *attached = true;
-    return true;
+    OpReqImport import;
+    if (pending->size() < sizeof(import)) {
+      return RequestStatus::kIncomplete;
+    }
+    memcpy(&import, pending->data(), sizeof(import));
+    pending->Erase(0, sizeof(import));
+    // The bus ID is not guaranteed to be null-terminated if it uses all 32
+    // bytes.
+    std::string bus_id(import.busID,
+                       strnlen(import.busID, sizeof(import.busID)));
+
+    bool known = false;
+    for (size_t i = 0; i < printers_.size(); ++i) {
+      if (GetBusId(i) != bus_id) {
+        continue;
+      }
+      known = true;
+      // The state of a printer's interfaces belongs to the client which
+      // attached it, so it may only be attached by one connection at a time.
+      if (IsAttached(&printers_[i])) {
+        LOG(ERROR) << "Device " << bus_id << " is already attached";
+        break;
+      }
+      LOG(INFO) << "Attaching device " << bus_id << "...";
+      HandleAttach(connection->fd.get(), i);
+      connection->printer = &printers_[i];
+      return RequestStatus::kHandled;
+    }
+
+    // A failed import is reported using only the header with a non-zero
+    // status.
+    if (!known) {
+      LOG(ERROR) << "Requested unknown bus ID: " << bus_id;
+    }
+    OpHeader reply;
+    SetOpHeader(OP_REP_IMPORT_CMD, 1, &reply);
+    SendBuffer(connection->fd.get(), PackOpHeader(reply));
+    return RequestStatus::kClose;
   } else {
     LOG(ERROR) << "Unknown command: " << request.command;
-    return false;
+    return RequestStatus::kClose;
   }
 }
 
-bool Server::HandleUsbRequest(const base::ScopedFD& connection) {
-  SmartBuffer received =
-      ReceiveBuffer(connection.get(), sizeof(UsbipCmdSubmit));
-  UsbipCmdSubmit command = UnpackUsbipCmdSubmit(&received);
+Server::RequestStatus Server::HandleUsbRequest(Connection* connection) {
+  SmartBuffer* pending = &connection->pending;
+  connection->bytes_needed = 0;
+  if (pending->size() < sizeof(UsbipCmdSubmit)) {
+    return RequestStatus::kIncomplete;
+  }
+
+  // Unpack a copy of the command so that nothing is consumed from |pending|
+  // until the data for an OUT transfer has also been received.
+  SmartBuffer header(sizeof(UsbipCmdSubmit));
+  header.Add(*pending, 0, sizeof(UsbipCmdSubmit));
+  UsbipCmdSubmit command = UnpackUsbipCmdSubmit(&header);
+
   if (command.header.command == COMMAND_USBIP_CMD_SUBMIT) {
-    printer_.HandleUsbRequest(connection.get(), command);
-    return true;
+    size_t data_length = 0;
+    if (command.header.direction == 0 && command.transfer_buffer_length > 0) {
+      data_length = command.transfer_buffer_length;
+    }
+    if (data_length > kMaxTransferBufferLength) {
+      LOG(ERROR) << "Bulk OUT transfer of " << data_length
+                 << " bytes is too large";
+      return RequestStatus::kClose;
+    }
+    size_t message_length = sizeof(UsbipCmdSubmit) + data_length;
+    if (pending->size() < message_length) {
+      // Make room for the whole transfer up front, so that its storage is only
+      // allocated once however many reads it arrives in.
+      connection->bytes_needed = message_length - pending->size();
+      pending->Reserve(connection->bytes_needed);
+      return RequestStatus::kIncomplete;
+    }
+    std::string endpoint = base::NumberToString(command.header.ep);
+    ScopedLatencyTimer timer(
+        kUsbipCommandSeconds,
+        FormatLabels({{"command", "submit"}, {"endpoint", endpoint}}));
+    if (data_length > 0) {
+      Metrics::Get()->IncrementCounter(
+          kEndpointBytesTotal,
+          FormatLabels({{"endpoint", endpoint}, {"direction", "out"}}),
+          data_length);
+    }
+    // The payload is handed to the printer in the storage it was received
+    // into. Only the start of any message which follows it is copied.
+    pending->Erase(0, sizeof(UsbipCmdSubmit));
+    SmartBuffer data = pending->Split(data_length);
+    connection->printer->HandleUsbRequest(connection->fd.get(), command,
+                                          &data);
+    return RequestStatus::kHandled;
   } else if (command.header.command == COMMAND_USBIP_CMD_UNLINK) {
-    LOG(INFO) << "Received unlink URB...ignoring";
-    LOG(INFO) << "Unlinked seqnum : " << command.transfer_flags;
-    return true;
+    ScopedLatencyTimer timer(kUsbipCommandSeconds,
+                             FormatLabels({{"command", "unlink"}}));
+    UsbipCmdUnlink unlink = UnpackUsbipCmdUnlink(pending);
+    HandleUnlink(connection, unlink);
+    return RequestStatus::kHandled;
   } else {
     LOG(ERROR) << "Unknown USBIP command " << command.header.command;
-    return false;
+    return RequestStatus::kClose;
   }
 }
 
-void Server::HandleConnection(base::ScopedFD connection) {
-  bool connection_open = true;
-  bool attached = false;
-  while (connection_open) {
-    if (!attached) {
-      connection_open = HandleOpRequest(connection, &attached);
-    } else {
-      connection_open = HandleUsbRequest(connection);
-    }
+void Server::HandleUnlink(Connection* connection,
+                          const UsbipCmdUnlink& unlink) {
+  VLOG(1) << "Unlinking seqnum " << unlink.unlink_seqnum;
+  // The request may already have been completed, in which case the reply
+  // reports a status of 0 as there was nothing to cancel.
+  int status = 0;
+  if (connection->printer->UnlinkRequest(connection->fd.get(),
+                                         unlink.unlink_seqnum)) {
+    status = -ECONNRESET;
   }
+  SendUsbipRetUnlink(connection->fd.get(), unlink, status);
 }
@@ -6,48 +6,170 @@
 #define SERVER_H__
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/callback.h>
 #include <base/files/scoped_file.h>
+#include <base/memory/ref_counted.h>
+#include <base/optional.h>
 
+#include "buffer_pool.h"
 #include "usb_printer.h"
+#include "usbip.h"
 #include "smart_buffer.h"
 
+// Sends the contents of |smart_buffer| on |sockfd|. If |sockfd| is
+// non-blocking this waits for the socket to become writable whenever its send
+// buffer is full, so the entire buffer is always sent before returning.
 void SendBuffer(int sockfd, const SmartBuffer& smart_buffer);
+
+// Receives exactly |size| bytes from |sockfd|, reading directly into the
+// returned buffer. MSG_WAITALL is used so that a blocking socket fills the
+// whole buffer with a single call. If the client closes the connection first
+// then the returned buffer contains only the bytes which were received.
 SmartBuffer ReceiveBuffer(int sockfd, size_t size);
 
+// Sends the |iov_count| buffers described by |iov| on |sockfd| in order using
+// scatter/gather I/O, so that the buffers are sent straight from the memory
+// which owns them without first being concatenated. Like SendBuffer, waits for
+// the socket to become writable whenever its send buffer is full. Messages
+// sent on the same socket from different threads are never interleaved, and
+// only writers to the same socket wait for each other.
+//
+// The contents of |iov| are modified to track partial writes.
+void SendIovecs(int sockfd, iovec* iov, size_t iov_count);
+
+// The endpoints on which a Server accepts connections. At least one of them
+// must be enabled.
+struct ListenOptions {
+  // Whether to listen for TCP connections on TCP_SERV_PORT on every IPv4
+  // address.
+  bool tcp = true;
+  // The send and receive buffer size of each TCP connection, or 0 to let the
+  // kernel size them.
+  int socket_buffer_size = 0;
+  // If not empty, the path of a Unix domain socket to listen on. Any socket
+  // already at the path is replaced, but no other kind of file is.
+  std::string unix_socket_path;
+  // If set, the port on which to listen for vsock connections from any
+  // context.
+  base::Optional<uint32_t> vsock_port;
+};
+
 class Server {
  public:
-  // Create a simple server which processes USBIP requests.
-  explicit Server(UsbPrinter printer);
+  // Create a simple server which processes USBIP requests for each of the
+  // virtual printers in |printers|, accepting connections on the endpoints
+  // in |options|. The printer at index i is exported with the bus ID returned
+  // by GetBusId(i).
+  explicit Server(std::vector<UsbPrinter> printers,
+                  const ListenOptions& options = ListenOptions());
+
+  // Calls |handler| on the thread running the server each time the process
+  // receives SIGHUP. SIGHUP is blocked on the calling thread so that it is only
+  // received by the event loop, so this must be called before any other thread
+  // is started.
+  void HandleSighup(base::RepeatingClosure handler);
+
+  // The number of exported printers, and the printer at |index|.
+  size_t printer_count() const { return printers_.size(); }
+  UsbPrinter* printer(size_t index) { return &printers_[index]; }
 
   // Run the server to process USBIP requests.
+  // Connections on every endpoint are serviced from a single epoll event loop,
+  // so any number of clients may list or attach to |printers_| at the same
+  // time, although each printer may only be attached by one client at a time.
   // This function does not return.
   void Run();
 
  private:
-  // Handles an OpReqDevlist request using |printer_| to create an OpRepDevlist
-  // message.
-  void HandleDeviceList(const base::ScopedFD& connection) const;
+  // The state kept for each open client connection.
+  struct Connection {
+    explicit Connection(base::ScopedFD fd);
+
+    base::ScopedFD fd;
+    // The printer which has been attached by an OpReqImport request on this
+    // connection, or null if no printer has been attached yet. Once attached,
+    // all further messages are USBIP commands for this printer.
+    UsbPrinter* printer = nullptr;
+    // Data which has been received on |fd| but does not yet make up a complete
+    // message.
+    SmartBuffer pending;
+    // The number of bytes still missing from the message at the front of
+    // |pending|, if it is known. Used to size the next reads, and to reserve
+    // room for a large bulk transfer once rather than growing |pending| as
+    // each part of it arrives.
+    size_t bytes_needed = 0;
+    // The pool which the buffers created while handling messages on this
+    // connection are taken from, including the replies which are sent
+    // straight away.
+    scoped_refptr<BufferPool> pool;
+  };
+
+  // The result of attempting to handle a single message from the data
+  // buffered in a Connection.
+  enum class RequestStatus {
+    // Not enough data has been received to form a complete message.
+    kIncomplete,
+    // A message was handled and the connection should remain open.
+    kHandled,
+    // The connection should be closed.
+    kClose,
+  };
+
+  // Accepts every pending connection on the listening socket |fd| and
+  // registers each of them with |epoll_fd_|.
+  void AcceptConnections(const base::ScopedFD& fd);
+
+  // Reads all of the data currently available on |connection| and handles any
+  // complete messages. Returns whether or not |connection| should remain open.
+  bool HandleReadable(Connection* connection);
+
+  // Handles complete messages buffered in |connection| until more data is
+  // required. Returns whether or not |connection| should remain open.
+  bool HandlePending(Connection* connection);
+
+  // Handles an OpReqDevlist request using |printers_| to create an
+  // OpRepDevlist message.
+  void HandleDeviceList(int sockfd) const;
+
+  // Handles an OpReqImport request for the printer at |index| in |printers_|
+  // by creating an OpRepImport message.
+  void HandleAttach(int sockfd, size_t index) const;
 
-  // Handles an OpReqImport request using |printer_| to create an OpRepImport
-  // message.
-  void HandleAttach(const base::ScopedFD& connection) const;
+  // Returns whether |printer| is attached by any open connection.
+  bool IsAttached(const UsbPrinter* printer) const;
 
-  // Handles either an OpReqDevlist or OpReqImport request received from
-  // |connection|. Returns whether or not |connection| should remain open. If
-  // |printer_| is successfully attached from the OpReqImport request then set
-  // |attached| to true.
-  bool HandleOpRequest(const base::ScopedFD& connection, bool* attached) const;
+  // Handles either an OpReqDevlist or OpReqImport request buffered in
+  // |connection|. If the requested printer is successfully attached from the
+  // OpReqImport request then |connection->printer| is set to it. A printer
+  // which is already attached by another connection is not attached again.
+  RequestStatus HandleOpRequest(Connection* connection);
 
-  // Handles a USB request received from |connection|. Returns whether or not
-  // |connection| should remain open.
-  bool HandleUsbRequest(const base::ScopedFD& connection);
+  // Handles a USB request buffered in |connection|, including the data for
+  // an OUT transfer.
+  RequestStatus HandleUsbRequest(Connection* connection);
 
-  // Loops continuously while |connection| remains open and handles any requests
-  // received on |connection|.
-  void HandleConnection(base::ScopedFD connection);
+  // Handles an unlink command for the request |unlink.unlink_seqnum|. If the
+  // request is still parked by the printer then it is cancelled.
+  void HandleUnlink(Connection* connection, const UsbipCmdUnlink& unlink);
 
-  UsbPrinter printer_;
+  const ListenOptions options_;
+  base::ScopedFD epoll_fd_;
+  // A signalfd which becomes readable when SIGHUP is received, and the handler
+  // which is then called, if one has been set.
+  base::ScopedFD sighup_fd_;
+  base::RepeatingClosure sighup_handler_;
+  // Maps the file descriptor of each open connection to its state.
+  std::map<int, Connection> connections_;
+  // The set of exported printers. This is never resized after construction so
+  // that each Connection may safely point at its attached printer.
+  std::vector<UsbPrinter> printers_;
 };
 
 #endif  // SERVER_H__
@@ -4,18 +4,72 @@
 
 #include "smart_buffer.h"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/logging.h>
 
-SmartBuffer::SmartBuffer(size_t size) {
+SmartBuffer::SmartBuffer() : pool_(BufferPool::Current()) {}
+
+SmartBuffer::SmartBuffer(size_t size) : pool_(BufferPool::Current()) {
   // Set the capacity of |buffer_| to |size|.
-  buffer_.reserve(size);
+  if (pool_) {
+    buffer_ = pool_->Acquire(size);
+  } else {
+    buffer_.reserve(size);
+  }
+}
+
+SmartBuffer::SmartBuffer(const std::vector<uint8_t>& v)
+    : SmartBuffer(v.size()) {
+  buffer_.assign(v.begin(), v.end());
+}
+
+SmartBuffer::SmartBuffer(std::vector<uint8_t>&& v)
+    : buffer_(std::move(v)), pool_(BufferPool::Current()) {}
+
+SmartBuffer::SmartBuffer(const SmartBuffer& other)
+    : SmartBuffer(other.size()) {
+  buffer_.assign(other.data(), other.data() + other.size());
+}
+
+SmartBuffer& SmartBuffer::operator=(const SmartBuffer& other) {
+  if (this != &other) {
+    // Reuse the existing storage if it is large enough.
+    buffer_.clear();
+    start_ = 0;
+    Add(other.data(), other.size());
+  }
+  return *this;
+}
+
+SmartBuffer::SmartBuffer(SmartBuffer&& other) noexcept
+    : buffer_(std::move(other.buffer_)),
+      start_(other.start_),
+      pool_(other.pool_) {
+  other.buffer_.clear();
+  other.start_ = 0;
 }
 
-SmartBuffer::SmartBuffer(const std::vector<uint8_t>& v) : buffer_(v) {}
+SmartBuffer& SmartBuffer::operator=(SmartBuffer&& other) noexcept {
+  if (this != &other) {
+    ReleaseStorage();
+    buffer_ = std::move(other.buffer_);
+    start_ = other.start_;
+    pool_ = other.pool_;
+    other.buffer_.clear();
+    other.start_ = 0;
+  }
+  return *this;
+}
+
+SmartBuffer::~SmartBuffer() {
+  ReleaseStorage();
+}
 
 void SmartBuffer::Add(const std::string& s) {
   Add(s.c_str(), s.size());
@@ -27,46 +81,208 @@ void SmartBuffer::Add(const char* s) {
 
 // Adds the contents from |buf|.
 void SmartBuffer::Add(const SmartBuffer& buf) {
-  const std::vector<uint8_t> contents = buf.contents();
-  buffer_.insert(buffer_.end(), contents.begin(), contents.end());
+  if (&buf == this) {
+    // Inserting a range of |buffer_| into itself is not allowed, so the
+    // contents are copied first.
+    const std::vector<uint8_t> contents(data(), data() + size());
+    Add(contents.data(), contents.size());
+    return;
+  }
+  Add(buf.data(), buf.size());
+}
+
+void SmartBuffer::Add(SmartBuffer&& buf) {
+  if (&buf == this) {
+    Add(static_cast<const SmartBuffer&>(buf));
+    return;
+  }
+  if (size() == 0) {
+    *this = std::move(buf);
+    return;
+  }
+  Add(buf.data(), buf.size());
+  buf.Erase(0, buf.size());
 }
 
 // Add the contents from |buf|, starting from |start|.
 void SmartBuffer::Add(const SmartBuffer& buf, size_t start) {
-  const std::vector<uint8_t>& contents = buf.contents();
-  buffer_.insert(buffer_.end(), contents.begin() + start, contents.end());
+  CHECK_LE(start, buf.size()) << "Given start out of bounds";
+  Add(buf.data() + start, buf.size() - start);
 }
 
 void SmartBuffer::Add(const SmartBuffer& buf, size_t start, size_t len) {
   CHECK_LE(start + len, buf.size()) << "Given range out of bounds";
-  const std::vector<uint8_t>& contents = buf.contents();
-  buffer_.insert(buffer_.end(), contents.begin() + start,
-                 contents.begin() + start + len);
+  Add(buf.data() + start, len);
 }
 
 void SmartBuffer::Erase(size_t index) {
-  buffer_.erase(buffer_.begin() + index);
+  Erase(index, 1);
 }
 
 void SmartBuffer::Erase(size_t start, size_t len) {
-  buffer_.erase(buffer_.begin() + start, buffer_.begin() + start + len);
+  CHECK_LE(start + len, size()) << "Given range out of bounds";
+  if (start == 0) {
+    start_ += len;
+    if (start_ == buffer_.size()) {
+      // The buffer is now empty, so the cursor can be reset for free.
+      buffer_.clear();
+      start_ = 0;
+    }
+    return;
+  }
+  auto begin = buffer_.begin() + start_ + start;
+  buffer_.erase(begin, begin + len);
 }
 
 void SmartBuffer::Shrink(size_t size) {
-  if (size >= buffer_.size()) {
+  if (size >= this->size()) {
     LOG(INFO) << "Can't shrink to a size larger than current buffer";
     return;
   }
-  buffer_.resize(size);
+  buffer_.resize(start_ + size);
+}
+
+uint8_t* SmartBuffer::Extend(size_t len) {
+  Reserve(len);
+  size_t offset = buffer_.size();
+  buffer_.resize(offset + len);
+  return buffer_.data() + offset;
 }
 
 ssize_t SmartBuffer::FindFirstOccurrence(const std::string& target,
                                          size_t start) const {
-  const std::vector<uint8_t>& contents = this->contents();
-  auto iter = std::search(contents.begin() + start, contents.end(),
-                          target.begin(), target.end());
-  if (iter == contents.end()) {
+  return SmartBufferView(*this).FindFirstOccurrence(target, start);
+}
+
+const std::vector<uint8_t>& SmartBuffer::contents() {
+  Compact(true);
+  return buffer_;
+}
+
+SmartBuffer SmartBuffer::Split(size_t len) {
+  CHECK_LE(len, size()) << "Given length out of bounds";
+  SmartBuffer front;
+  front.pool_ = pool_;
+  if (len <= size() - len) {
+    front.Add(data(), len);
+    Erase(0, len);
+    return front;
+  }
+  // The front is larger, so it takes over the storage and the rest of the
+  // contents are copied back into this buffer.
+  std::swap(front.buffer_, buffer_);
+  std::swap(front.start_, start_);
+  Add(front.data() + len, front.size() - len);
+  front.buffer_.resize(front.start_ + len);
+  return front;
+}
+
+std::vector<uint8_t> SmartBuffer::TakeContents() {
+  Compact(true);
+  std::vector<uint8_t> contents;
+  contents.swap(buffer_);
+  return contents;
+}
+
+void SmartBuffer::Compact(bool force) {
+  // Only reclaim the consumed space once it is at least as large as the
+  // remaining contents, so that the cost of moving the contents is amortized
+  // over the bytes which were consumed.
+  if (start_ == 0 || (!force && start_ < buffer_.size() - start_)) {
+    return;
+  }
+  buffer_.erase(buffer_.begin(), buffer_.begin() + start_);
+  start_ = 0;
+}
+
+SmartBufferView::SmartBufferView(const uint8_t* data, size_t size)
+    : data_(data), size_(size) {}
+
+// explicit
+SmartBufferView::SmartBufferView(const SmartBuffer& buf)
+    : data_(buf.data()), size_(buf.size()) {}
+
+void SmartBufferView::RemovePrefix(size_t len) {
+  CHECK_LE(len, size_) << "Given length out of bounds";
+  data_ += len;
+  size_ -= len;
+}
+
+SmartBufferView SmartBufferView::Subview(size_t start, size_t len) const {
+  CHECK_LE(start + len, size_) << "Given range out of bounds";
+  return SmartBufferView(data_ + start, len);
+}
+
+ssize_t SmartBufferView::FindFirstOccurrence(const std::string& target,
+                                             size_t start) const {
+  if (start > size_) {
     return -1;
   }
-  return std::distance(contents.begin(), iter);
+  if (target.empty()) {
+    return start < size_ ? start : -1;
+  }
+
+  // Use memchr, which is vectorized by the C library, to skip to each
+  // occurrence of the first byte of |target| and only then compare the rest.
+  const uint8_t first = target[0];
+  const uint8_t* iter = data_ + start;
+  const uint8_t* end = data_ + size_;
+  while (static_cast<size_t>(end - iter) >= target.size()) {
+    iter = static_cast<const uint8_t*>(
+        memchr(iter, first, end - iter - target.size() + 1));
+    if (!iter) {
+      return -1;
+    }
+    if (memcmp(iter + 1, target.data() + 1, target.size() - 1) == 0) {
+      return iter - data_;
+    }
+    ++iter;
+  }
+  return -1;
+}
+
+ResumableSearch::ResumableSearch(const std::string& target)
+    : target_(target) {}
+
+ssize_t ResumableSearch::Find(const SmartBufferView& view) {
+  ssize_t index = view.FindFirstOccurrence(target_, next_start_);
+  if (index != -1) {
+    next_start_ = index;
+    return index;
+  }
+  // An occurrence may begin in the last few bytes and end in data which has
+  // not arrived yet, so those bytes are searched again next time.
+  if (view.size() >= target_.size()) {
+    next_start_ = std::max(next_start_, view.size() - target_.size() + 1);
+  }
+  return -1;
+}
+
+void SmartBuffer::Reserve(size_t len) {
+  Compact(false);
+  size_t needed = buffer_.size() + len;
+  if (needed <= buffer_.capacity()) {
+    return;
+  }
+  if (!pool_) {
+    buffer_.reserve(std::max(needed, 2 * buffer_.capacity()));
+    return;
+  }
+  // Take the new storage from the pool and return the old storage to it. Grow
+  // geometrically as std::vector would, and drop the consumed space at the
+  // front while moving the contents.
+  std::vector<uint8_t> storage =
+      pool_->Acquire(std::max(needed - start_, 2 * buffer_.capacity()));
+  storage.assign(buffer_.begin() + start_, buffer_.end());
+  start_ = 0;
+  std::swap(storage, buffer_);
+  pool_->Recycle(std::move(storage));
+}
+
+void SmartBuffer::ReleaseStorage() {
+  if (pool_ && buffer_.capacity() > 0) {
+    pool_->Recycle(std::move(buffer_));
+  }
+  buffer_ = std::vector<uint8_t>();
+  start_ = 0;
 }
@@ -10,11 +10,80 @@
 #include <vector>
 
 #include <base/logging.h>
+#include <base/memory/ref_counted.h>
+
+#include "buffer_pool.h"
+
+class SmartBuffer;
+
+// A non-owning, read-only view of a sequence of bytes, used by parsers to walk
+// through a message without copying or modifying it. A view must not outlive
+// the buffer which it refers to, and is invalidated by any modification of
+// that buffer.
+class SmartBufferView {
+ public:
+  SmartBufferView() = default;
+  SmartBufferView(const uint8_t* data, size_t size);
+
+  // Creates a view of the entire contents of |buf|.
+  explicit SmartBufferView(const SmartBuffer& buf);
+
+  // Removes the first |len| bytes from the view.
+  void RemovePrefix(size_t len);
+
+  // Returns a view of the |len| bytes starting at |start|.
+  SmartBufferView Subview(size_t start, size_t len) const;
+
+  // Find first occurrence of |target| in the view and return the index to
+  // where it begins. If |target| does not appear in the view then returns -1.
+  ssize_t FindFirstOccurrence(const std::string& target,
+                              size_t start = 0) const;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const uint8_t* data() const { return data_; }
+  uint8_t operator[](size_t index) const { return data_[index]; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Finds a target sequence in a buffer which grows between searches, such as a
+// message which arrives in pieces. Each search resumes where the previous one
+// stopped instead of scanning the whole buffer again.
+class ResumableSearch {
+ public:
+  explicit ResumableSearch(const std::string& target);
+
+  // Returns the index at which the target first occurs in |view|, or -1 if it
+  // does not occur. |view| must begin with the bytes which were given to the
+  // previous calls since the last Reset.
+  ssize_t Find(const SmartBufferView& view);
+
+  // Forgets the previous searches so that a new buffer can be searched.
+  void Reset() { next_start_ = 0; }
+
+ private:
+  std::string target_;
+  // The index from which the next search begins. Everything before it is
+  // known not to start an occurrence of |target_|.
+  size_t next_start_ = 0;
+};
 
 // Wrapper class used for packing bytes to be transferred on a network socket.
+//
+// Consuming bytes from the front of the buffer with Erase(0, len) only moves a
+// read cursor, so parsers can strip each part of a message as it is processed
+// without moving the rest of the message. The space in front of the cursor is
+// reclaimed once it makes up most of the underlying storage.
+//
+// A buffer created while a ScopedBufferPool is installed on the current thread
+// takes its storage from that pool, including whenever it grows, and returns
+// the storage to the pool when it is destroyed. Other buffers use the heap.
 class SmartBuffer {
  public:
-  SmartBuffer() = default;
+  SmartBuffer();
 
   // Initialize the buffer with an initial size of |size|.
   explicit SmartBuffer(size_t size);
@@ -22,6 +91,16 @@ class SmartBuffer {
   // Initialize the buffer with the same contents as |v|.
   explicit SmartBuffer(const std::vector<uint8_t>& v);
 
+  // Initialize the buffer with the contents of |v|, taking over its storage
+  // instead of copying it.
+  explicit SmartBuffer(std::vector<uint8_t>&& v);
+
+  SmartBuffer(const SmartBuffer& other);
+  SmartBuffer& operator=(const SmartBuffer& other);
+  SmartBuffer(SmartBuffer&& other) noexcept;
+  SmartBuffer& operator=(SmartBuffer&& other) noexcept;
+  ~SmartBuffer();
+
   // Convert |data| into uint8_t* and add |data_size| bytes to the internal
   // buffer.
   template <typename T>
@@ -46,6 +125,10 @@ class SmartBuffer {
   // Adds the contents from |buf|.
   void Add(const SmartBuffer& buf);
 
+  // Adds the contents from |buf|, leaving it empty. When this buffer is empty
+  // it takes over the storage of |buf| instead of copying its contents.
+  void Add(SmartBuffer&& buf);
+
   // Add the contents from |buf|, starting from |start|.
   void Add(const SmartBuffer& buf, size_t start);
 
@@ -56,26 +139,71 @@ class SmartBuffer {
   void Erase(size_t index);
 
   // Erases the subsequence of length |len| starting at |start| from |buffer|.
+  // When |start| is 0 this takes constant time.
   void Erase(size_t start, size_t len);
 
   // Shrink the underlying vector to |size|.
   void Shrink(size_t size);
 
+  // Makes room for |len| more bytes without changing the contents, so that
+  // adding up to that many bytes does not move the buffer again. The new space
+  // is not initialized until it is added to the buffer.
+  void Reserve(size_t len);
+
+  // Grows the buffer by |len| bytes and returns a pointer to the start of the
+  // new space, so that it can be filled directly (e.g. by recv()) rather than
+  // through a temporary buffer. Any part of the space which is not filled
+  // should then be removed using Shrink.
+  //
+  // The returned pointer is invalidated by any other modification of the
+  // buffer.
+  uint8_t* Extend(size_t len);
+
   // Find first occurrence of |target| in the buffer and return the index to
   // where it begins. If |target| does not appear in |message| then returns -1.
   ssize_t FindFirstOccurrence(const std::string& target,
                               size_t start = 0) const;
 
-  size_t size() const { return buffer_.size(); }
-  const std::vector<uint8_t>& contents() const { return buffer_; }
-  const uint8_t* data() const { return buffer_.data(); }
+  size_t size() const { return buffer_.size() - start_; }
+
+  // Returns the contents of the buffer. This may need to move the contents to
+  // the front of the underlying storage, invalidating any pointer returned by
+  // data(), so prefer data() and size() or a SmartBufferView in performance
+  // sensitive code.
+  const std::vector<uint8_t>& contents();
+
+  const uint8_t* data() const { return buffer_.data() + start_; }
+
+  // Removes the first |len| bytes of the buffer and returns them in a new
+  // buffer. Only the smaller of the two parts is copied. The larger part keeps
+  // the existing storage, so a large message at the front of a buffer can be
+  // split from the start of the next one without copying the message.
+  SmartBuffer Split(size_t len);
+
+  // Moves the contents of the buffer out without copying them, leaving the
+  // buffer empty. The storage is no longer returned to the buffer's pool.
+  std::vector<uint8_t> TakeContents();
 
  private:
+  // Returns the storage of the buffer to its pool, leaving the buffer empty.
+  void ReleaseStorage();
+
+  // Moves the contents of |buffer_| to the front of the storage when enough
+  // space has been consumed from the front to make it worthwhile, or always
+  // if |force| is true.
+  void Compact(bool force);
+
+  // The contents of the buffer are the bytes of |buffer_| from index |start_|
+  // onwards.
   std::vector<uint8_t> buffer_;
+  size_t start_ = 0;
+  // The pool which |buffer_| is taken from and returned to, or null.
+  scoped_refptr<BufferPool> pool_;
 };
 
 template <typename T>
 void SmartBuffer::Add(const T* data, size_t data_size) {
+  Reserve(data_size);
   const uint8_t* packed_data = reinterpret_cast<const uint8_t*>(data);
   buffer_.insert(buffer_.end(), packed_data, packed_data + data_size);
 }
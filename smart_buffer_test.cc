@@ -4,6 +4,7 @@
 
 #include "smart_buffer.h"
 
+#include <utility>
 #include <vector>
 
 #include <gmock/gmock.h>
@@ -71,6 +72,56 @@ TEST(Add, AddSmartBuffer) {
   EXPECT_EQ(buf1.contents(), buf2.contents());
 }
 
+TEST(Add, AddSmartBufferToItself) {
+  SmartBuffer buf(std::vector<uint8_t>{1, 2, 3});
+  buf.Add(buf);
+  const std::vector<uint8_t> expected = {1, 2, 3, 1, 2, 3};
+  EXPECT_EQ(buf.contents(), expected);
+}
+
+// Test that moving a SmartBuffer into an empty one takes over its storage.
+TEST(Add, MoveSmartBufferIntoEmpty) {
+  SmartBuffer from(std::vector<uint8_t>{1, 2, 3, 4, 5});
+  from.Erase(0, 1);
+  const uint8_t* data = from.data();
+  SmartBuffer to;
+  to.Add(std::move(from));
+  const std::vector<uint8_t> expected = {2, 3, 4, 5};
+  EXPECT_EQ(to.data(), data);
+  EXPECT_EQ(to.contents(), expected);
+  EXPECT_EQ(from.size(), 0);
+}
+
+TEST(Add, MoveSmartBufferIntoNonEmpty) {
+  SmartBuffer from(std::vector<uint8_t>{3, 4});
+  SmartBuffer to(std::vector<uint8_t>{1, 2});
+  to.Add(std::move(from));
+  const std::vector<uint8_t> expected = {1, 2, 3, 4};
+  EXPECT_EQ(to.contents(), expected);
+  EXPECT_EQ(from.size(), 0);
+}
+
+// Test that a moved-from SmartBuffer is empty even if its front had been
+// erased.
+TEST(Move, MovedFromBufferIsEmpty) {
+  SmartBuffer from(std::vector<uint8_t>{1, 2, 3});
+  from.Erase(0, 2);
+  SmartBuffer to(std::move(from));
+  const std::vector<uint8_t> expected = {3};
+  EXPECT_EQ(to.contents(), expected);
+  EXPECT_EQ(from.size(), 0);
+  from.Add(static_cast<uint8_t>(7));
+  EXPECT_EQ(from.contents(), std::vector<uint8_t>{7});
+}
+
+TEST(Move, ConstructFromVectorTakesStorage) {
+  std::vector<uint8_t> contents = {1, 2, 3};
+  const uint8_t* data = contents.data();
+  SmartBuffer buf(std::move(contents));
+  EXPECT_EQ(buf.data(), data);
+  EXPECT_EQ(buf.size(), 3);
+}
+
 // Test that the proper suffix from the provided SmartBuffer is added.
 TEST(Add, AddSmartBufferSuffix) {
   SmartBuffer buf1(5);
@@ -128,4 +179,170 @@ TEST(Resize, Shrink) {
   EXPECT_EQ(expected, buf.contents());
 }
 
+TEST(Resize, Extend) {
+  SmartBuffer buf({1, 2});
+  uint8_t* tail = buf.Extend(3);
+  tail[0] = 3;
+  tail[1] = 4;
+  tail[2] = 5;
+  std::vector<uint8_t> expected = {1, 2, 3, 4, 5};
+  EXPECT_EQ(expected, buf.contents());
+}
+
+// Test that the unfilled part of an extension can be discarded.
+TEST(Resize, ExtendThenShrink) {
+  SmartBuffer buf({1, 2});
+  uint8_t* tail = buf.Extend(4);
+  tail[0] = 3;
+  buf.Shrink(3);
+  std::vector<uint8_t> expected = {1, 2, 3};
+  EXPECT_EQ(expected, buf.contents());
+}
+
+// Test that reserved space is not part of the contents, and that extending
+// into it does not move the buffer.
+TEST(Resize, ReserveThenExtend) {
+  SmartBuffer buf({1, 2});
+  buf.Reserve(1000);
+  EXPECT_EQ(buf.size(), 2);
+  const uint8_t* data = buf.data();
+  uint8_t* tail = buf.Extend(1000);
+  tail[0] = 3;
+  buf.Shrink(3);
+  EXPECT_EQ(buf.data(), data);
+  std::vector<uint8_t> expected = {1, 2, 3};
+  EXPECT_EQ(expected, buf.contents());
+}
+
+// Test that splitting off a large front keeps the existing storage.
+TEST(Split, LargeFront) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  buf.Erase(0, 1);
+  const uint8_t* data = buf.data();
+  SmartBuffer front = buf.Split(3);
+  EXPECT_EQ(front.data(), data);
+  std::vector<uint8_t> expected_front = {2, 3, 4};
+  std::vector<uint8_t> expected_rest = {5};
+  EXPECT_EQ(expected_front, front.contents());
+  EXPECT_EQ(expected_rest, buf.contents());
+}
+
+TEST(Split, SmallFront) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  SmartBuffer front = buf.Split(1);
+  std::vector<uint8_t> expected_front = {1};
+  std::vector<uint8_t> expected_rest = {2, 3, 4, 5};
+  EXPECT_EQ(expected_front, front.contents());
+  EXPECT_EQ(expected_rest, buf.contents());
+}
+
+TEST(Split, Everything) {
+  SmartBuffer buf({1, 2, 3});
+  SmartBuffer front = buf.Split(3);
+  std::vector<uint8_t> expected = {1, 2, 3};
+  EXPECT_EQ(expected, front.contents());
+  EXPECT_EQ(buf.size(), 0);
+}
+
+TEST(TakeContents, AfterErasePrefix) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  buf.Erase(0, 2);
+  std::vector<uint8_t> expected = {3, 4, 5};
+  EXPECT_EQ(expected, buf.TakeContents());
+  EXPECT_EQ(buf.size(), 0);
+}
+
+// Test that erasing from the front of the buffer and then adding more data
+// preserves the order of the contents.
+TEST(Erase, ErasePrefixThenAdd) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  buf.Erase(0, 3);
+  EXPECT_EQ(buf.size(), 2);
+  EXPECT_EQ(buf.data()[0], 4);
+  buf.Add(static_cast<uint8_t>(6));
+  const std::vector<uint8_t> expected = {4, 5, 6};
+  EXPECT_EQ(buf.contents(), expected);
+}
+
+TEST(Erase, EraseAfterErasePrefix) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  buf.Erase(0, 1);
+  buf.Erase(1, 2);
+  const std::vector<uint8_t> expected = {2, 5};
+  EXPECT_EQ(buf.contents(), expected);
+}
+
+TEST(Erase, EraseEntireBuffer) {
+  SmartBuffer buf({1, 2, 3});
+  buf.Erase(0, 3);
+  EXPECT_EQ(buf.size(), 0);
+  buf.Add(static_cast<uint8_t>(4));
+  const std::vector<uint8_t> expected = {4};
+  EXPECT_EQ(buf.contents(), expected);
+}
+
+TEST(FindFirstOccurrence, AfterErasePrefix) {
+  SmartBuffer buf;
+  buf.Add("abc\r\ndef\r\n");
+  buf.Erase(0, 5);
+  EXPECT_EQ(buf.FindFirstOccurrence("\r\n"), 3);
+  EXPECT_EQ(buf.FindFirstOccurrence("abc"), -1);
+}
+
+TEST(SmartBufferView, RemovePrefix) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  SmartBufferView view(buf);
+  view.RemovePrefix(2);
+  EXPECT_EQ(view.size(), 3);
+  EXPECT_EQ(view[0], 3);
+  // The underlying buffer is not modified.
+  EXPECT_EQ(buf.size(), 5);
+}
+
+TEST(SmartBufferView, Subview) {
+  SmartBuffer buf({1, 2, 3, 4, 5});
+  SmartBufferView view = SmartBufferView(buf).Subview(1, 3);
+  EXPECT_EQ(view.size(), 3);
+  EXPECT_EQ(view[0], 2);
+  EXPECT_EQ(view[2], 4);
+}
+
+TEST(SmartBufferView, FindFirstOccurrence) {
+  SmartBuffer buf;
+  buf.Add("0\r\n\r\n");
+  SmartBufferView view(buf);
+  EXPECT_EQ(view.FindFirstOccurrence("\r\n\r\n"), 1);
+  EXPECT_EQ(view.FindFirstOccurrence("\r\n", 2), 3);
+  EXPECT_EQ(view.FindFirstOccurrence("1"), -1);
+}
+
+TEST(SmartBufferView, FindFirstOccurrencePartialMatches) {
+  SmartBuffer buf;
+  buf.Add("\r\r\n\r\r\n\r\n");
+  SmartBufferView view(buf);
+  EXPECT_EQ(view.FindFirstOccurrence("\r\n\r\n"), 4);
+  EXPECT_EQ(view.FindFirstOccurrence("\r\n\r\n", 5), -1);
+  // The target may not extend past the end of the view.
+  EXPECT_EQ(view.Subview(0, 7).FindFirstOccurrence("\r\n\r\n"), -1);
+}
+
+// Tests that a target split between the pieces of a growing buffer is found.
+TEST(ResumableSearch, TargetSplitBetweenPieces) {
+  ResumableSearch search("\r\n\r\n");
+  SmartBuffer buf;
+  buf.Add("GET / HTTP/1.1\r\nHost: x\r");
+  EXPECT_EQ(search.Find(SmartBufferView(buf)), -1);
+  buf.Add("\n\r");
+  EXPECT_EQ(search.Find(SmartBufferView(buf)), -1);
+  buf.Add("\nbody");
+  EXPECT_EQ(search.Find(SmartBufferView(buf)), 23);
+  // Searching again finds the same occurrence.
+  EXPECT_EQ(search.Find(SmartBufferView(buf)), 23);
+
+  search.Reset();
+  SmartBuffer other;
+  other.Add("\r\n\r\n");
+  EXPECT_EQ(search.Find(SmartBufferView(other)), 0);
+}
+
 }  // namespace
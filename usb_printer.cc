@@ -10,15 +10,19 @@
 
 #include <algorithm>
 #include <cstdint>
-#include <cstdio>
 #include <cstring>
 #include <memory>
 #include <utility>
 
+#include <base/bind.h>
+#include <base/location.h>
 #include <base/logging.h>
 #include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 
 #include "ipp_util.h"
+#include "metrics.h"
 #include "server.h"
 #include "usbip_constants.h"
 
@@ -58,38 +62,195 @@ UsbControlRequest CreateUsbControlRequest(int64_t setup) {
   return request;
 }
 
-// Appends |buf| to the file at |path|. If no file exists at |path|, it is
-// created.
-void AppendToFile(base::FilePath path, SmartBuffer buf) {
-  base::File file(path, base::File::FLAG_OPEN_ALWAYS | base::File::FLAG_WRITE |
-                            base::File::FLAG_APPEND);
-  if (!file.IsValid()) {
-    LOG(ERROR) << "Failed to open/create file at " << path;
-    return;
-  }
+// The largest IPP header and attributes section which is parsed in order to
+// find the start of a document. If this much of a request has been received
+// without finding the end of its attributes, the request is assumed to be
+// malformed and no further attempts are made.
+constexpr size_t kMaxIppAttributesSize = 64 * 1024;
+
+// The largest HTTP header which is buffered while waiting for the rest of it
+// to arrive.
+constexpr size_t kMaxHttpHeaderSize = 64 * 1024;
+
+// The largest response body which is copied in behind its header so that the
+// whole response can be sent in a single transfer. Larger bodies are queued
+// as a message of their own, which takes over their storage.
+constexpr size_t kMaxCopiedBodySize = 16 * 1024;
+
+// A queued message which holds on to the SmartBuffer it was built in, so that
+// its storage is returned to the buffer's pool once the message has been sent.
+class RefCountedSmartBuffer : public base::RefCountedMemory {
+ public:
+  explicit RefCountedSmartBuffer(SmartBuffer buffer)
+      : buffer_(std::move(buffer)) {}
+  RefCountedSmartBuffer(const RefCountedSmartBuffer&) = delete;
+  RefCountedSmartBuffer& operator=(const RefCountedSmartBuffer&) = delete;
+
+  const unsigned char* front() const override { return buffer_.data(); }
+  size_t size() const override { return buffer_.size(); }
+
+ private:
+  ~RefCountedSmartBuffer() override = default;
+
+  SmartBuffer buffer_;
+};
+
+// Formats the wValue field of |control_request| for logging.
+std::string FormatValue(const UsbControlRequest& control_request) {
+  return base::StringPrintf("%u[%u]", control_request.wValue1,
+                            control_request.wValue0);
+}
+
+// Returns the index of the interface which contains |endpoint|.
+size_t GetInterfaceIndex(int endpoint) {
+  // Since each interface contains a pair of in/out endpoints, we perform this
+  // conversion in order to retrieve the corresponding interface number.
+  // Examples:
+  //   endpoints 1 and 2 both map to interface 0.
+  //   endpoints 3 and 4 both map to interface 1.
+  return (endpoint - 1) / 2;
+}
 
-  int written = file.WriteAtCurrentPos(
-      reinterpret_cast<const char*>(buf.data()), buf.size());
-  if (written != buf.size()) {
-    PLOG(ERROR) << "Failed to write buf to file at " << path;
+// Returns the path of |uri| which is used to label the metrics of requests
+// for it. The URIs of individual scan jobs are grouped together, and any other
+// unknown URI is labelled "other", so that the number of label sets recorded
+// stays bounded.
+std::string GetMetricsPath(const std::string& uri) {
+  if (uri == "/ipp/print" || uri == "/metrics" ||
+      uri == "/eSCL/ScannerCapabilities" || uri == "/eSCL/ScannerStatus" ||
+      uri == "/eSCL/ScanJobs") {
+    return uri;
+  }
+  if (base::StartsWith(uri, "/eSCL/ScanJobs/", base::CompareCase::SENSITIVE)) {
+    return "/eSCL/ScanJobs/{id}";
   }
+  return "other";
+}
+
+// Sends the descriptor of |size| bytes in |data| in response to
+// |control_request|. If fewer bytes were requested than the size of the
+// descriptor then only the start of the descriptor is sent.
+void SendDescriptor(int sockfd, const UsbipCmdSubmit& usb_request,
+                    const UsbControlRequest& control_request,
+                    const uint8_t* data, size_t size) {
+  size = std::min<size_t>(control_request.wLength, size);
+  SendUsbControlResponse(sockfd, usb_request, data, size);
 }
 
 }  // namespace
 
-void InterfaceManager::QueueMessage(const SmartBuffer& message) {
-  queue_.push(message);
+void InterfaceManager::QueueMessage(
+    scoped_refptr<base::RefCountedMemory> message,
+    base::TimeTicks ready_time,
+    bool is_scan_data) {
+  queue_.push_back({std::move(message), 0, ready_time, is_scan_data});
 }
 
 bool InterfaceManager::QueueEmpty() const {
   return queue_.empty();
 }
 
-SmartBuffer InterfaceManager::PopMessage() {
-  CHECK(!QueueEmpty()) << "Can't pop message from empty queue.";
-  auto message = queue_.front();
-  queue_.pop();
-  return message;
+base::TimeTicks InterfaceManager::FrontMessageReadyTime() const {
+  CHECK(!QueueEmpty()) << "Can't check message from empty queue.";
+  return std::max(queue_.front().ready_time, next_send_time_);
+}
+
+bool InterfaceManager::FrontMessageIsScanData() const {
+  CHECK(!QueueEmpty()) << "Can't check message from empty queue.";
+  return queue_.front().is_scan_data;
+}
+
+SmartBufferView InterfaceManager::FrontMessage() const {
+  CHECK(!QueueEmpty()) << "Can't view message from empty queue.";
+  const QueuedMessage& message = queue_.front();
+  return SmartBufferView(message.data->front() + message.offset,
+                         message.data->size() - message.offset);
+}
+
+scoped_refptr<base::RefCountedMemory> InterfaceManager::FrontMessageStorage()
+    const {
+  CHECK(!QueueEmpty()) << "Can't view message from empty queue.";
+  return queue_.front().data;
+}
+
+void InterfaceManager::ConsumeMessage(size_t size) {
+  CHECK(!QueueEmpty()) << "Can't consume message from empty queue.";
+  QueuedMessage& message = queue_.front();
+  CHECK_LE(size, message.data->size() - message.offset)
+      << "Can't consume more than the remainder of the message.";
+  message.offset += size;
+  if (message.offset == message.data->size()) {
+    queue_.pop_front();
+  }
+}
+
+void InterfaceManager::ParkRequest(int sockfd,
+                                   const UsbipCmdSubmit& usb_request) {
+  parked_requests_.push_back({sockfd, usb_request});
+}
+
+InterfaceManager::ParkedRequest InterfaceManager::PopParkedRequest() {
+  CHECK(HasParkedRequest()) << "Can't pop request when none are parked.";
+  ParkedRequest request = parked_requests_.front();
+  parked_requests_.pop_front();
+  return request;
+}
+
+void InterfaceManager::DelayAck(const DelayedAck& ack) {
+  delayed_acks_.push_back(ack);
+  if (delayed_acks_.size() > 1) {
+    DelayedAck& previous = delayed_acks_[delayed_acks_.size() - 2];
+    delayed_acks_.back().send_time =
+        std::max(ack.send_time, previous.send_time);
+  }
+}
+
+base::TimeTicks InterfaceManager::NextAckTime() const {
+  CHECK(HasDelayedAck()) << "Can't check acknowledgement when none are held.";
+  return delayed_acks_.front().send_time;
+}
+
+InterfaceManager::DelayedAck InterfaceManager::PopDelayedAck() {
+  CHECK(HasDelayedAck()) << "Can't pop acknowledgement when none are held.";
+  DelayedAck ack = delayed_acks_.front();
+  delayed_acks_.pop_front();
+  return ack;
+}
+
+bool InterfaceManager::UnparkRequest(int sockfd, int seqnum) {
+  for (auto iter = parked_requests_.begin(); iter != parked_requests_.end();
+       ++iter) {
+    if (iter->sockfd == sockfd && iter->usb_request.header.seqnum == seqnum) {
+      parked_requests_.erase(iter);
+      return true;
+    }
+  }
+  for (auto iter = delayed_acks_.begin(); iter != delayed_acks_.end();
+       ++iter) {
+    if (iter->sockfd == sockfd && iter->usb_request.header.seqnum == seqnum) {
+      delayed_acks_.erase(iter);
+      return true;
+    }
+  }
+  return false;
+}
+
+void InterfaceManager::Reset() {
+  queue_.clear();
+  parked_requests_.clear();
+  delayed_acks_.clear();
+  next_send_time_ = base::TimeTicks();
+  receiving_message_ = false;
+  receiving_chunked_ = false;
+  request_header_ = HttpRequest();
+  chunked_decoder_.Reset();
+  partial_header_.Erase(0, partial_header_.size());
+  header_end_search_.Reset();
+  message_.Erase(0, message_.size());
+  document_checked_ = false;
+  document_offset_ = base::nullopt;
+  document_size_ = 0;
+  document_sink_.reset();
 }
 
 // explicit
@@ -108,17 +269,53 @@ UsbDescriptors::UsbDescriptors(
       string_descriptors_(string_descriptors),
       ieee_device_id_(ieee_device_id),
       interface_descriptors_(interface_descriptors),
-      endpoint_descriptors_(endpoint_descriptors) {}
+      endpoint_descriptors_(endpoint_descriptors) {
+  const auto* config =
+      reinterpret_cast<const uint8_t*>(&configuration_descriptor_);
+  configuration_blob_.assign(config, config + sizeof(configuration_descriptor_));
+
+  // Place each interface and their corresponding endpoint descriptors after
+  // the configuration descriptor.
+  for (int i = 0; i < configuration_descriptor_.bNumInterfaces; ++i) {
+    const auto& interface = interface_descriptors_[i];
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&interface);
+    configuration_blob_.insert(configuration_blob_.end(), bytes,
+                               bytes + sizeof(interface));
+    auto iter = endpoint_descriptors_.find(interface.bInterfaceNumber);
+    if (iter == endpoint_descriptors_.end()) {
+      LOG(ERROR) << "Unable to find endpoints for interface "
+                 << interface.bInterfaceNumber;
+      exit(1);
+    }
+    for (const auto& endpoint : iter->second) {
+      bytes = reinterpret_cast<const uint8_t*>(&endpoint);
+      configuration_blob_.insert(configuration_blob_.end(), bytes,
+                                 bytes + sizeof(endpoint));
+    }
+  }
+}
 
 UsbPrinter::UsbPrinter(const UsbDescriptors& usb_descriptors,
-                       const base::FilePath& document_output_path,
+                       DocumentRecorder document_recorder,
                        IppManager ipp_manager,
-                       EsclManager escl_manager)
+                       EsclManager escl_manager,
+                       const PerformanceProfile& performance_profile)
     : usb_descriptors_(usb_descriptors),
-      document_output_path_(document_output_path),
+      document_recorder_(std::move(document_recorder)),
       ipp_manager_(std::move(ipp_manager)),
       escl_manager_(std::move(escl_manager)),
-      interface_managers_(usb_descriptors.interface_descriptors().size()) {}
+      performance_model_(performance_profile),
+      interface_managers_(usb_descriptors.interface_descriptors().size()),
+      busy_until_(interface_managers_.size()),
+      queue_lock_(std::make_unique<base::Lock>()),
+      replies_sent_(
+          std::make_unique<base::ConditionVariable>(queue_lock_.get())),
+      escl_lock_(std::make_unique<base::Lock>()),
+      workers_(interface_managers_.size()) {
+  for (size_t i = 0; i < interface_managers_.size(); i++) {
+    buffer_pools_.push_back(base::MakeRefCounted<BufferPool>());
+  }
+}
 
 bool UsbPrinter::IsIppUsb() const {
   int count = 0;
@@ -134,8 +331,53 @@ bool UsbPrinter::IsIppUsb() const {
   return count >= 2;
 }
 
+bool UsbPrinter::UnlinkRequest(int sockfd, int seqnum) {
+  base::AutoLock lock(*queue_lock_);
+  for (InterfaceManager& im : interface_managers_) {
+    if (im.UnparkRequest(sockfd, seqnum)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void UsbPrinter::Detach(int sockfd) {
+  base::AutoLock lock(*queue_lock_);
+  // A printer is only attached by one connection at a time, so everything
+  // held by its interfaces belongs to |sockfd|.
+  for (InterfaceManager& im : interface_managers_) {
+    im.Reset();
+  }
+  session_++;
+  // Replies which have not been written yet are dropped, and any being written
+  // are finished before the server closes the socket, so that none can reach
+  // a later connection which reuses the descriptor.
+  replies_.clear();
+  while (sending_replies_) {
+    replies_sent_->Wait();
+  }
+  // The checksum of the data received without IPP is only written once its
+  // sink is closed, so each connection is recorded as a separate document.
+  if (document_recorder_.checksum_mode()) {
+    usb_document_sink_.reset();
+  }
+}
+
+void UsbPrinter::SetIppAttributes(SerializedIppAttributes attributes) {
+  ipp_manager_.SetAttributes(std::move(attributes));
+}
+
+void UsbPrinter::SetScannerCapabilities(
+    ScannerCapabilities scanner_capabilities) {
+  // eSCL requests hold |escl_lock_| while they are handled, so a request which
+  // has already started finishes before the capabilities are replaced.
+  base::AutoLock lock(*escl_lock_);
+  escl_manager_.SetScannerCapabilities(std::move(scanner_capabilities));
+}
+
 void UsbPrinter::HandleUsbRequest(int sockfd,
-                                  const UsbipCmdSubmit& usb_request) {
+                                  const UsbipCmdSubmit& usb_request,
+                                  SmartBuffer* data) {
   // Endpoint 0 is used for USB control requests.
   if (usb_request.header.ep == 0) {
     HandleUsbControl(sockfd, usb_request);
@@ -144,9 +386,9 @@ void UsbPrinter::HandleUsbRequest(int sockfd,
       HandleBulkInRequest(sockfd, usb_request);
     } else {
       if (IsIppUsb()) {
-        HandleIppUsbData(sockfd, usb_request);
+        HandleIppUsbData(sockfd, usb_request, data);
       } else {
-        HandleUsbData(sockfd, usb_request);
+        HandleUsbData(sockfd, usb_request, *data);
       }
     }
   }
@@ -172,29 +414,72 @@ void UsbPrinter::HandleUsbControl(int sockfd,
   }
 }
 
-void UsbPrinter::HandleUsbData(int sockfd,
-                               const UsbipCmdSubmit& usb_request) const {
-  SmartBuffer data = ReceiveBuffer(sockfd, usb_request.transfer_buffer_length);
+void UsbPrinter::HandleUsbData(int sockfd, const UsbipCmdSubmit& usb_request,
+                               const SmartBuffer& data) {
   size_t received = data.size();
-  LOG(INFO) << "Received " << received << " bytes";
-  // Acknowledge receipt of BULK transfer.
-  SendUsbDataResponse(sockfd, usb_request, received);
-  if (!document_output_path_.empty()) {
-    LOG(INFO) << "Recording document...";
-    AppendToFile(document_output_path_, data);
+  VLOG(2) << "Received " << received << " bytes";
+  // Acknowledge receipt of BULK transfer. Without IPP everything received is
+  // print data.
+  AcknowledgeBulkOut(sockfd, usb_request, received, received);
+  if (document_recorder_.enabled()) {
+    if (!usb_document_sink_) {
+      usb_document_sink_ = document_recorder_.CreateSink(true /* append */);
+    }
+    if (usb_document_sink_) {
+      usb_document_sink_->Write(data.data(), data.size());
+    }
   }
 }
 
 void UsbPrinter::HandleIppUsbData(int sockfd,
-                                  const UsbipCmdSubmit& usb_request) {
-  SmartBuffer message =
-      ReceiveBuffer(sockfd, usb_request.transfer_buffer_length);
-  size_t received = message.size();
-  LOG(INFO) << "Received " << received << " bytes";
-  // Acknowledge receipt of BULK transfer.
-  SendUsbDataResponse(sockfd, usb_request, received);
+                                  const UsbipCmdSubmit& usb_request,
+                                  SmartBuffer* message) {
+  size_t received = message->size();
+  VLOG(2) << "Received " << received << " bytes";
+  if (!performance_model_.enabled()) {
+    // Acknowledge receipt of BULK transfer.
+    SendUsbDataResponse(sockfd, usb_request, received);
+    HandleHttpData(usb_request, message);
+    return;
+  }
 
-  HandleHttpData(usb_request, &message);
+  // Only the document data carried by the transfer fills the print buffer, so
+  // the transfer is acknowledged once it has been handled and the amount of
+  // document data in it is known.
+  InterfaceManager* im = GetInterfaceManager(usb_request.header.ep);
+  size_t document_size = im->receiving_message() ? im->document_size() : 0;
+  HandleHttpData(usb_request, message);
+  size_t print_data_size = im->document_size() >= document_size
+                               ? im->document_size() - document_size
+                               : im->document_size();
+  AcknowledgeBulkOut(sockfd, usb_request, received, print_data_size);
+}
+
+void UsbPrinter::AcknowledgeBulkOut(int sockfd,
+                                    const UsbipCmdSubmit& usb_request,
+                                    size_t received,
+                                    size_t print_data_size) {
+  if (!performance_model_.enabled()) {
+    SendUsbDataResponse(sockfd, usb_request, received);
+    return;
+  }
+
+  base::TimeTicks now = base::TimeTicks::Now();
+  base::TimeDelta wait =
+      performance_model_.ReceivePrintData(print_data_size, now);
+  base::AutoLock lock(*queue_lock_);
+  InterfaceManager* im = GetInterfaceManager(usb_request.header.ep);
+  // An acknowledgement which is not held back may still have to wait for the
+  // ones ahead of it, so that transfers are acknowledged in order.
+  if (wait.is_zero() && !im->HasDelayedAck()) {
+    QueueDataResponse(sockfd, usb_request, received);
+    SendReplies();
+    return;
+  }
+  VLOG(2) << "Print buffer is full, holding back acknowledgement of "
+          << usb_request.header.seqnum << " for " << wait;
+  im->DelayAck({now + wait, sockfd, usb_request, received});
+  ScheduleWakeup(GetInterfaceIndex(usb_request.header.ep), im->NextAckTime());
 }
 
 void UsbPrinter::HandleHttpData(const UsbipCmdSubmit& usb_request,
@@ -203,42 +488,161 @@ void UsbPrinter::HandleHttpData(const UsbipCmdSubmit& usb_request,
 
   if (!im->receiving_message()) {
     // If we're not currently receiving, |message| must be the start of a new
-    // HTTP message. Parse the header and setup some fields to track state.
+    // HTTP message, or continue a header which did not fit in the previous
+    // transfers.
+    SmartBuffer* partial_header = im->partial_header();
+    if (partial_header->size() > 0) {
+      partial_header->Add(*message);
+      std::swap(*partial_header, *message);
+      partial_header->Erase(0, partial_header->size());
+    }
+    if (im->header_end_search()->Find(SmartBufferView(*message)) == -1) {
+      if (message->size() >= kMaxHttpHeaderSize) {
+        LOG(ERROR) << "Incoming HTTP header is too large; ignoring";
+        im->header_end_search()->Reset();
+        return;
+      }
+      // Wait for the rest of the header.
+      std::swap(*partial_header, *message);
+      return;
+    }
+    im->header_end_search()->Reset();
+
+    // Parse the header and setup some fields to track state.
     base::Optional<HttpRequest> opt_request = HttpRequest::Deserialize(message);
     if (!opt_request.has_value()) {
       LOG(ERROR) << "Incoming message is not valid HTTP; ignoring";
       return;
     }
-    HttpRequest request = opt_request.value();
+    HttpRequest& request = opt_request.value();
     im->set_receiving_message(true);
-    im->set_request_header(request);
     im->set_receiving_chunked(request.IsChunkedMessage());
+    im->chunked_decoder()->Reset();
+    // Only IPP requests can carry a document.
+    im->set_document_checked(
+        !(request.method == "POST" && request.uri == "/ipp/print"));
+    im->set_document_offset(base::nullopt);
+    im->reset_document_size();
+    im->set_document_sink(nullptr);
+    im->set_request_header(std::move(request));
   }
 
-  im->message()->Add(*message);
   bool complete = false;
   if (im->receiving_chunked()) {
-    complete = ContainsFinalChunk(*message);
+    // Decode the chunks as they arrive so that the message body is assembled
+    // without holding on to the encoded chunks.
+    SmartBufferView view(*message);
+    if (!im->chunked_decoder()->Decode(&view, im->message())) {
+      LOG(ERROR) << "Incoming message is not valid chunked HTTP; ignoring";
+      im->set_receiving_message(false);
+      im->message()->Erase(0, im->message()->size());
+      return;
+    }
+    complete = im->chunked_decoder()->complete();
   } else {
-    complete = im->message()->size() == im->request_header().ContentLength();
+    // The transfer is not needed once it has been added, so the first one of
+    // the body is moved into place rather than copied.
+    im->message()->Add(std::move(*message));
+    // Any document data streamed out of the message still counts towards its
+    // length.
+    complete = im->message()->size() + im->document_size() >=
+               im->request_header().ContentLength();
   }
 
+  StreamDocumentData(im);
+
   if (complete) {
-    SmartBuffer* complete_message = im->message();
+    if (im->document_sink()) {
+      LOG(INFO) << "Recorded " << im->document_sink()->document_size()
+                << " byte document to " << im->document_sink()->path();
+      im->set_document_sink(nullptr);
+    }
 
     SmartBuffer payload;
-    if (im->receiving_chunked()) {
-      // Assemble the chunks into the HTTP request body
-      payload = MergeDocument(complete_message);
-    } else {
-      payload = *complete_message;
-      complete_message->Erase(0, complete_message->size());
-    }
+    std::swap(payload, *im->message());
 
     im->set_receiving_message(false);
-    HttpResponse response =
-        GenerateHttpResponse(im->request_header(), &payload);
-    QueueHttpResponse(usb_request, response);
+    // Requests on the same interface are processed in order by the same
+    // worker, so their responses are queued in order as well.
+    GetWorker(usb_request.header.ep)
+        ->task_runner()
+        ->PostTask(FROM_HERE,
+                   base::BindOnce(&UsbPrinter::ProcessHttpRequest,
+                                  base::Unretained(this), usb_request,
+                                  im->request_header(), std::move(payload),
+                                  session_));
+  }
+}
+
+void UsbPrinter::ProcessHttpRequest(const UsbipCmdSubmit& usb_request,
+                                    const HttpRequest& request,
+                                    SmartBuffer body,
+                                    uint64_t session) {
+  // The response is built and queued in storage from the interface's pool.
+  ScopedBufferPool scoped_pool(
+      buffer_pools_[GetInterfaceIndex(usb_request.header.ep)].get());
+  base::TimeDelta processing_time;
+  HttpResponse response =
+      GenerateHttpResponse(request, &body, &processing_time);
+  base::TimeTicks ready_time;
+  if (!processing_time.is_zero()) {
+    // The simulated device processes the requests on an interface one at a
+    // time, so each one starts once the previous one has finished.
+    base::TimeTicks& busy_until =
+        busy_until_[GetInterfaceIndex(usb_request.header.ep)];
+    ready_time =
+        std::max(base::TimeTicks::Now(), busy_until) + processing_time;
+    busy_until = ready_time;
+  }
+  QueueHttpResponse(usb_request, std::move(response), ready_time, session);
+}
+
+void UsbPrinter::StreamDocumentData(InterfaceManager* im) {
+  SmartBuffer* message = im->message();
+  if (!im->document_checked()) {
+    IppParseError error;
+    base::Optional<IppRequest> request =
+        ParseIppRequest(SmartBufferView(*message), &error);
+    if (!request) {
+      // Wait until the rest of the attributes have been received, unless the
+      // request is malformed.
+      if (error == IppParseError::kMalformed ||
+          message->size() >= kMaxIppAttributesSize) {
+        im->set_document_checked(true);
+      }
+      return;
+    }
+    im->set_document_checked(true);
+    if (request->header.operation_id != IPP_SEND_DOCUMENT) {
+      return;
+    }
+    im->set_document_offset(request->document_offset);
+    // The document is only recorded if it belongs to a job which is still
+    // accepting documents. Otherwise it is discarded as it arrives, and the
+    // request is rejected once it has been received.
+    base::Optional<int> job_id =
+        GetIntegerValue(request->operation_attributes, "job-id");
+    base::Optional<int> document_number;
+    if (job_id) {
+      document_number = ipp_manager_.StartDocument(job_id.value());
+    }
+    if (document_number) {
+      im->set_document_sink(document_recorder_.CreateJobSink(
+          job_id.value(), document_number.value()));
+    }
+  }
+
+  if (!im->document_offset()) {
+    return;
+  }
+  size_t offset = im->document_offset().value();
+  if (message->size() > offset) {
+    if (im->document_sink()) {
+      im->document_sink()->Write(message->data() + offset,
+                                 message->size() - offset);
+    }
+    im->add_document_size(message->size() - offset);
+    message->Shrink(offset);
   }
 }
 
@@ -290,38 +694,65 @@ void UsbPrinter::HandlePrinterControl(
 
 InterfaceManager* UsbPrinter::GetInterfaceManager(int endpoint) {
   CHECK_GT(endpoint, 0) << "Received request on an invalid endpoint";
-  // Since each interface contains a pair of in/out endpoints, we perform this
-  // conversion in order to retrieve the corresponding interface number.
-  // Examples:
-  //   endpoints 1 and 2 both map to interface 0.
-  //   endpoints 3 and 4 both map to interface 1.
-  int index = (endpoint - 1) / 2;
+  size_t index = GetInterfaceIndex(endpoint);
   CHECK_LT(index, interface_managers_.size())
       << "Received request on an invalid endpoint";
   return &interface_managers_[index];
 }
 
-HttpResponse UsbPrinter::GenerateHttpResponse(const HttpRequest& request,
-                                              SmartBuffer* body) {
+base::Thread* UsbPrinter::GetWorker(int endpoint) {
+  size_t index = GetInterfaceIndex(endpoint);
+  CHECK_LT(index, workers_.size()) << "Received request on an invalid endpoint";
+  if (!workers_[index]) {
+    auto worker = std::make_unique<base::Thread>(
+        base::StringPrintf("interface-%zu", index));
+    CHECK(worker->Start()) << "Failed to start worker for interface " << index;
+    workers_[index] = std::move(worker);
+  }
+  return workers_[index].get();
+}
+
+HttpResponse UsbPrinter::GenerateHttpResponse(
+    const HttpRequest& request,
+    SmartBuffer* body,
+    base::TimeDelta* processing_time) {
+  *processing_time = base::TimeDelta();
+  ScopedLatencyTimer timer(
+      kHttpRequestSeconds,
+      FormatLabels(
+          {{"method", request.method}, {"path", GetMetricsPath(request.uri)}}));
   HttpResponse response;
   if (request.method == "POST" && request.uri == "/ipp/print") {
-    base::Optional<IppHeader> ipp_header = IppHeader::Deserialize(body);
-    if (!ipp_header) {
-      LOG(ERROR) << "Request does not contain a valid IPP header.";
-      response.status = "415 Unsupported Media Type";
-      return response;
-    }
-    if (!RemoveIppAttributes(body)) {
-      LOG(ERROR) << "IPP request has malformed attributes section.";
+    base::Optional<IppRequest> ipp_request =
+        ParseIppRequest(SmartBufferView(*body));
+    if (!ipp_request) {
+      LOG(ERROR) << "Request does not contain a valid IPP header and "
+                    "attributes.";
       response.status = "415 Unsupported Media Type";
       return response;
     }
     response.status = "200 OK";
     response.headers["Content-Type"] = "application/ipp";
-    response.body = ipp_manager_.HandleIppRequest(ipp_header.value(), *body);
+    response.body = ipp_manager_.HandleIppRequest(ipp_request.value(), *body);
+    if (performance_model_.enabled()) {
+      int operation_id = ipp_request->header.operation_id;
+      *processing_time = performance_model_.GetOperationLatency(
+          GetIppOperationName(operation_id));
+      // A document has been received in full once its request completes, and
+      // the response is sent once the document has been printed.
+      if (operation_id == IPP_SEND_DOCUMENT) {
+        *processing_time +=
+            performance_model_.GetPrintTime(base::TimeTicks::Now());
+      }
+    }
   } else if (base::StartsWith(request.uri, "/eSCL",
                               base::CompareCase::SENSITIVE)) {
+    base::AutoLock lock(*escl_lock_);
     response = escl_manager_.HandleEsclRequest(request, *body);
+  } else if (request.method == "GET" && request.uri == "/metrics") {
+    response.status = "200 OK";
+    response.headers["Content-Type"] = "text/plain; version=0.0.4";
+    response.body.Add(Metrics::Get()->Serialize());
   } else {
     LOG(ERROR) << "Invalid method '" << request.method << "' and/or endpoint '"
                << request.uri << "'";
@@ -333,19 +764,17 @@ HttpResponse UsbPrinter::GenerateHttpResponse(const HttpRequest& request,
 void UsbPrinter::HandleGetStatus(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetStatus %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetStatus " << FormatValue(control_request);
   uint16_t status = 0;
-  SmartBuffer response(sizeof(status));
-  response.Add(&status, sizeof(status));
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  SendUsbControlResponse(sockfd, usb_request,
+                         reinterpret_cast<const uint8_t*>(&status),
+                         sizeof(status));
 }
 
 void UsbPrinter::HandleGetDescriptor(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetDescriptor %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetDescriptor " << FormatValue(control_request);
 
   switch (control_request.wValue1) {
     case USB_DESCRIPTOR_DEVICE:
@@ -373,160 +802,267 @@ void UsbPrinter::HandleGetDescriptor(
 void UsbPrinter::HandleGetDeviceDescriptor(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetDeviceDescriptor %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetDeviceDescriptor " << FormatValue(control_request);
 
-  SmartBuffer response(sizeof(device_descriptor()));
   const UsbDeviceDescriptor& dev = device_descriptor();
-
-  // If the requested number of bytes is smaller than the size of the device
-  // descriptor then only send a portion of the descriptor.
-  if (control_request.wLength < sizeof(dev)) {
-    response.Add(&dev, control_request.wLength);
-  } else {
-    response.Add(dev);
-  }
-
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  SendDescriptor(sockfd, usb_request, control_request,
+                 reinterpret_cast<const uint8_t*>(&dev), sizeof(dev));
 }
 
 void UsbPrinter::HandleGetConfigurationDescriptor(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetConfigurationDescriptor %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
-
-  SmartBuffer response(control_request.wLength);
-  response.Add(configuration_descriptor());
-
-  if (control_request.wLength == sizeof(configuration_descriptor())) {
-    // Only the configuration descriptor itself has been requested.
-    printf("Only configuration descriptor requested\n");
-    SendUsbControlResponse(sockfd, usb_request, response.data(),
-                           response.size());
-    return;
-  }
-
-  const auto& interfaces = interface_descriptors();
-  const auto& endpoints = endpoint_descriptors();
-
-  // Place each interface and their corresponding endnpoint descriptors into the
-  // response buffer.
-  for (int i = 0; i < configuration_descriptor().bNumInterfaces; ++i) {
-    const auto& interface = interfaces[i];
-    response.Add(&interface, sizeof(interface));
-    auto iter = endpoints.find(interface.bInterfaceNumber);
-    if (iter == endpoints.end()) {
-      LOG(ERROR) << "Unable to find endpoints for interface "
-                 << interface.bInterfaceNumber;
-      exit(1);
-    }
-    for (const auto& endpoint : iter->second) {
-      response.Add(&endpoint, sizeof(endpoint));
-    }
-  }
+  VLOG(2) << "HandleGetConfigurationDescriptor "
+          << FormatValue(control_request);
 
-  CHECK_EQ(control_request.wLength, response.size())
-      << "Response length does not match requested number of bytes";
-  // After filling the buffer with all of the necessary descriptors we can send
-  // a response.
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  // The host first requests only the configuration descriptor itself in
+  // order to learn the total length, so the response is a prefix of the
+  // complete configuration.
+  const std::vector<uint8_t>& configuration = configuration_blob();
+  SendDescriptor(sockfd, usb_request, control_request, configuration.data(),
+                 configuration.size());
 }
 
 void UsbPrinter::HandleGetDeviceQualifierDescriptor(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetDeviceQualifierDescriptor %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetDeviceQualifierDescriptor "
+          << FormatValue(control_request);
 
-  SmartBuffer response(sizeof(qualifier_descriptor()));
-  response.Add(qualifier_descriptor());
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  const UsbDeviceQualifierDescriptor& qualifier = qualifier_descriptor();
+  SendDescriptor(sockfd, usb_request, control_request,
+                 reinterpret_cast<const uint8_t*>(&qualifier),
+                 sizeof(qualifier));
 }
 
 void UsbPrinter::HandleGetStringDescriptor(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetStringDescriptor %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetStringDescriptor " << FormatValue(control_request);
 
-  int index = control_request.wValue0;
+  size_t index = control_request.wValue0;
   const auto& strings = string_descriptors();
-  SmartBuffer response(strings[index][0]);
-  response.Add(strings[index].data(), strings[index][0]);
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  // An empty descriptor has no length byte, so it is treated as unknown.
+  if (index >= strings.size() || strings[index].empty()) {
+    LOG(ERROR) << "Unknown string descriptor index " << index;
+    SendUsbControlResponse(sockfd, usb_request, 0, 0);
+    return;
+  }
+  // The first byte of each string descriptor holds its length.
+  const std::vector<char>& string = strings[index];
+  SendDescriptor(sockfd, usb_request, control_request,
+                 reinterpret_cast<const uint8_t*>(string.data()),
+                 std::min<size_t>(static_cast<uint8_t>(string[0]),
+                                  string.size()));
 }
 
 void UsbPrinter::HandleGetConfiguration(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetConfiguration %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetConfiguration " << FormatValue(control_request);
 
   // Note: For now we only have one configuration set, so we just respond with
   // with |configuration_descriptor_.bConfigurationValue|.
   const auto& configuration = configuration_descriptor();
-  SmartBuffer response(sizeof(configuration.bConfigurationValue));
-  response.Add(&configuration.bConfigurationValue,
-               sizeof(configuration.bConfigurationValue));
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  SendUsbControlResponse(sockfd, usb_request,
+                         &configuration.bConfigurationValue,
+                         sizeof(configuration.bConfigurationValue));
 }
 
 void UsbPrinter::HandleUnsupportedRequest(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleUnsupportedRequest %u: %u[%u]\n", control_request.bRequest,
-         control_request.wValue1, control_request.wValue0);
+  VLOG(2) << "HandleUnsupportedRequest "
+          << static_cast<int>(control_request.bRequest) << ": "
+          << FormatValue(control_request);
   SendUsbControlResponse(sockfd, usb_request, 0, 0);
 }
 
 void UsbPrinter::HandleGetDeviceId(
     int sockfd, const UsbipCmdSubmit& usb_request,
     const UsbControlRequest& control_request) const {
-  printf("HandleGetDeviceId %u[%u]\n", control_request.wValue1,
-         control_request.wValue0);
+  VLOG(2) << "HandleGetDeviceId " << FormatValue(control_request);
 
-  SmartBuffer response(ieee_device_id().size());
-  response.Add(ieee_device_id());
-  SendUsbControlResponse(sockfd, usb_request, response.data(), response.size());
+  const std::vector<char>& device_id = ieee_device_id();
+  SendDescriptor(sockfd, usb_request, control_request,
+                 reinterpret_cast<const uint8_t*>(device_id.data()),
+                 device_id.size());
 }
 
 void UsbPrinter::QueueHttpResponse(const UsbipCmdSubmit& usb_request,
-                                   const HttpResponse& response) {
+                                   HttpResponse response,
+                                   base::TimeTicks ready_time,
+                                   uint64_t session) {
+  // Each piece of a shared body is queued as a message of its own following the
+  // header, so that it is sent straight from the memory which holds it. A large
+  // body is queued the same way once it has been moved out of |response|.
   SmartBuffer http_message;
-  response.Serialize(&http_message);
+  scoped_refptr<base::RefCountedMemory> body;
+  if (!response.shared_body.empty()) {
+    response.SerializeHeader(&http_message);
+  } else if (response.body.size() > kMaxCopiedBodySize) {
+    response.SerializeHeader(&http_message);
+    body =
+        base::MakeRefCounted<RefCountedSmartBuffer>(std::move(response.body));
+  } else {
+    response.Serialize(&http_message);
+  }
 
-  LOG(INFO) << "Queueing ipp response...";
+  VLOG(2) << "Queueing ipp response...";
+  base::AutoLock lock(*queue_lock_);
+  if (session != session_) {
+    VLOG(1) << "Dropping response for a client which has detached";
+    return;
+  }
   InterfaceManager* im = GetInterfaceManager(usb_request.header.ep);
-  im->QueueMessage(http_message);
+  im->QueueMessage(
+      base::MakeRefCounted<RefCountedSmartBuffer>(std::move(http_message)),
+      ready_time, false /* is_scan_data */);
+  if (body) {
+    im->QueueMessage(std::move(body), ready_time, false /* is_scan_data */);
+  }
+  // Only the shared body of an eSCL response carries a scanned document.
+  for (const auto& piece : response.shared_body) {
+    if (piece->size() > 0) {
+      im->QueueMessage(piece, ready_time, true /* is_scan_data */);
+    }
+  }
+
+  CompleteParkedRequests(GetInterfaceIndex(usb_request.header.ep));
+  SendReplies();
 }
 
 void UsbPrinter::HandleBulkInRequest(int sockfd,
                                      const UsbipCmdSubmit& usb_request) {
+  base::AutoLock lock(*queue_lock_);
   InterfaceManager* im = GetInterfaceManager(usb_request.header.ep);
   if (im->QueueEmpty()) {
-    LOG(ERROR) << "No queued messages, sending empty response.";
-    SendUsbControlResponse(sockfd, usb_request, 0, 0);
+    VLOG(2) << "No queued messages, parking request "
+            << usb_request.header.seqnum;
+    im->ParkRequest(sockfd, usb_request);
+    return;
+  }
+  // Requests which are already waiting for the queued message to be ready are
+  // completed first.
+  if (im->HasParkedRequest() ||
+      im->FrontMessageReadyTime() > base::TimeTicks::Now()) {
+    VLOG(2) << "Queued message is not ready, parking request "
+            << usb_request.header.seqnum;
+    im->ParkRequest(sockfd, usb_request);
+    CompleteParkedRequests(GetInterfaceIndex(usb_request.header.ep));
+    SendReplies();
     return;
   }
+  SendQueuedMessage(im, sockfd, usb_request);
+  SendReplies();
+}
 
-  SmartBuffer http_message = im->PopMessage();
+void UsbPrinter::CompleteParkedRequests(size_t index) {
+  InterfaceManager* im = &interface_managers_[index];
+  // Complete the requests which have been waiting for a response, until
+  // either the response has been sent in full or no requests remain.
+  while (!im->QueueEmpty() && im->HasParkedRequest()) {
+    base::TimeTicks ready_time = im->FrontMessageReadyTime();
+    if (!ready_time.is_null() && ready_time > base::TimeTicks::Now()) {
+      ScheduleWakeup(index, ready_time);
+      return;
+    }
+    InterfaceManager::ParkedRequest parked = im->PopParkedRequest();
+    SendQueuedMessage(im, parked.sockfd, parked.usb_request);
+  }
+}
+
+void UsbPrinter::ScheduleWakeup(size_t index, base::TimeTicks time) {
+  InterfaceManager* im = &interface_managers_[index];
+  // A wakeup which is already due sooner will schedule any later one itself.
+  if (!im->wakeup_time().is_null() && im->wakeup_time() <= time) {
+    return;
+  }
+  im->set_wakeup_time(time);
+  if (!scheduler_) {
+    auto scheduler = std::make_unique<base::Thread>("scheduler");
+    CHECK(scheduler->Start()) << "Failed to start scheduler";
+    scheduler_ = std::move(scheduler);
+  }
+  scheduler_->task_runner()->PostDelayedTask(
+      FROM_HERE,
+      base::BindOnce(&UsbPrinter::Wakeup, base::Unretained(this), index),
+      std::max(base::TimeDelta(), time - base::TimeTicks::Now()));
+}
+
+void UsbPrinter::Wakeup(size_t index) {
+  base::AutoLock lock(*queue_lock_);
+  InterfaceManager* im = &interface_managers_[index];
+  base::TimeTicks now = base::TimeTicks::Now();
+  if (im->wakeup_time() <= now) {
+    im->set_wakeup_time(base::TimeTicks());
+  }
+  while (im->HasDelayedAck() && im->NextAckTime() <= now) {
+    InterfaceManager::DelayedAck ack = im->PopDelayedAck();
+    QueueDataResponse(ack.sockfd, ack.usb_request, ack.received);
+  }
+  if (im->HasDelayedAck()) {
+    ScheduleWakeup(index, im->NextAckTime());
+  }
+  CompleteParkedRequests(index);
+  SendReplies();
+}
+
+void UsbPrinter::SendQueuedMessage(InterfaceManager* im, int sockfd,
+                                   const UsbipCmdSubmit& usb_request) {
+  SmartBufferView http_message = im->FrontMessage();
 
   size_t max_size = usb_request.transfer_buffer_length;
 
   UsbipRetSubmit response = CreateUsbipRetSubmit(usb_request);
   response.header.direction = 1;
   response.actual_length = std::min(max_size, http_message.size());
-  LOG(INFO) << "Sending " << response.actual_length << " byte response.";
-
-  SmartBuffer response_buffer = PackUsbipRetSubmit(response);
-  if (http_message.size() > max_size) {
-    size_t leftover_size = http_message.size() - max_size;
-    SmartBuffer leftover(leftover_size);
-    leftover.Add(http_message, max_size);
-    http_message.Shrink(max_size);
-    im->QueueMessage(leftover);
-  }
-  response_buffer.Add(http_message);
-  SendBuffer(sockfd, response_buffer);
+  VLOG(2) << "Sending " << response.actual_length << " byte response.";
+
+  // Only the first |actual_length| bytes of |http_message| are sent, straight
+  // from the queued message. The reply holds a reference to the storage of
+  // the message, since consuming all of it removes it from the queue.
+  replies_.push_back({sockfd, response, im->FrontMessageStorage(),
+                      http_message.data(), response.actual_length});
+  // The next transfer waits until the simulated scanner has produced this one.
+  if (im->FrontMessageIsScanData() && performance_model_.enabled()) {
+    base::TimeTicks now = base::TimeTicks::Now();
+    base::TimeDelta scan_time =
+        performance_model_.SendScanData(response.actual_length, now);
+    if (!scan_time.is_zero()) {
+      im->set_next_send_time(now + scan_time);
+    }
+  }
+  im->ConsumeMessage(response.actual_length);
+}
+
+void UsbPrinter::QueueDataResponse(int sockfd,
+                                   const UsbipCmdSubmit& usb_request,
+                                   size_t received) {
+  UsbipRetSubmit response = CreateUsbipRetSubmit(usb_request);
+  response.actual_length = received;
+  if (VLOG_IS_ON(3)) {
+    PrintUsbipRetSubmit(response);
+  }
+  replies_.push_back({sockfd, response, nullptr, nullptr, 0});
+}
+
+void UsbPrinter::SendReplies() {
+  queue_lock_->AssertAcquired();
+  // The thread which is already sending will pick up the new replies once it
+  // has sent its current ones, which keeps them in order.
+  if (sending_replies_) {
+    return;
+  }
+  sending_replies_ = true;
+  while (!replies_.empty()) {
+    std::deque<Reply> replies;
+    replies.swap(replies_);
+    base::AutoUnlock unlock(*queue_lock_);
+    for (const Reply& reply : replies) {
+      SendUsbipRetSubmit(reply.sockfd, reply.response, reply.data, reply.size);
+    }
+  }
+  sending_replies_ = false;
+  replies_sent_->Broadcast();
 }
@@ -5,38 +5,144 @@
 #ifndef USB_PRINTER_H__
 #define USB_PRINTER_H__
 
+#include <deque>
 #include <map>
-#include <queue>
+#include <memory>
 #include <vector>
 #include <string>
+#include <utility>
 
 #include <base/files/file.h>
 #include <base/files/file_path.h>
-
+#include <base/memory/ref_counted_memory.h>
+#include <base/optional.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+
+#include "buffer_pool.h"
 #include "device_descriptors.h"
+#include "document_sink.h"
 #include "escl_manager.h"
 #include "http_util.h"
 #include "ipp_manager.h"
+#include "performance_model.h"
 #include "smart_buffer.h"
 #include "usbip.h"
 
 // This class is responsible for managing an ippusb interface of a printer. It
 // keeps track of whether or not the interface is currently in the process of
 // receiving a chunked IPP message, and queues up responses to IPP requests so
-// that they can be sent when a BULK IN request is received.
+// that they can be sent when a BULK IN request is received. BULK IN requests
+// which arrive before there is a response to send are parked until one is
+// queued.
+//
+// When the printer simulates a slow device, a queued response may not be sent
+// until its processing time has passed, and acknowledgements of BULK OUT
+// transfers may be held back while the print buffer is full.
 class InterfaceManager {
  public:
   InterfaceManager() = default;
 
-  // Place the IPP response |message| on the end of |queue_|.
-  void QueueMessage(const SmartBuffer& message);
+  // Place the IPP response |message| on the end of |queue_|. It is not sent
+  // before |ready_time|, which is null if it can be sent straight away.
+  // |is_scan_data| marks a piece of a scanned document, which is sent no
+  // faster than the scanner produces it.
+  void QueueMessage(scoped_refptr<base::RefCountedMemory> message,
+                    base::TimeTicks ready_time,
+                    bool is_scan_data);
 
   // Returns whether or not |queue_| is empty.
   bool QueueEmpty() const;
 
-  // Returns the message at the front of |queue_| and removes it. If PopMessage
-  // is called when |queue_| is empty then the program will exit.
-  SmartBuffer PopMessage();
+  // Returns the time from which the message at the front of |queue_| may be
+  // sent, which is null if it may be sent straight away. If
+  // FrontMessageReadyTime is called when |queue_| is empty then the program
+  // will exit.
+  base::TimeTicks FrontMessageReadyTime() const;
+
+  // Returns whether the message at the front of |queue_| is scan data. If
+  // FrontMessageIsScanData is called when |queue_| is empty then the program
+  // will exit.
+  bool FrontMessageIsScanData() const;
+
+  // Prevents any message from being sent before |time|, which is used to
+  // limit the rate at which scan data is sent.
+  void set_next_send_time(base::TimeTicks time) { next_send_time_ = time; }
+
+  // Returns a view of the part of the message at the front of |queue_| which
+  // has not been sent yet. The view remains valid until the message has been
+  // consumed. If FrontMessage is called when |queue_| is empty then the
+  // program will exit.
+  SmartBufferView FrontMessage() const;
+
+  // Returns the storage of the message at the front of |queue_|, which keeps
+  // the data viewed by FrontMessage alive after the message has been consumed.
+  // If FrontMessageStorage is called when |queue_| is empty then the program
+  // will exit.
+  scoped_refptr<base::RefCountedMemory> FrontMessageStorage() const;
+
+  // Marks the next |size| bytes of the message at the front of |queue_| as
+  // sent, and removes the message once all of it has been sent.
+  void ConsumeMessage(size_t size);
+
+  // A BULK IN request which is waiting for a message to be queued, along with
+  // the socket it was received on.
+  struct ParkedRequest {
+    int sockfd;
+    UsbipCmdSubmit usb_request;
+  };
+
+  // Place |usb_request|, received on |sockfd|, on the end of
+  // |parked_requests_|.
+  void ParkRequest(int sockfd, const UsbipCmdSubmit& usb_request);
+
+  // Returns whether or not any requests are parked.
+  bool HasParkedRequest() const { return !parked_requests_.empty(); }
+
+  // Returns the oldest parked request and removes it. If PopParkedRequest is
+  // called when no requests are parked then the program will exit.
+  ParkedRequest PopParkedRequest();
+
+  // A BULK OUT transfer of |received| bytes whose acknowledgement is held back
+  // until |send_time| because the print buffer is full.
+  struct DelayedAck {
+    base::TimeTicks send_time;
+    int sockfd;
+    UsbipCmdSubmit usb_request;
+    size_t received;
+  };
+
+  // Place |ack| on the end of |delayed_acks_|. Acknowledgements are sent in
+  // order, so |ack| is not sent before any acknowledgement ahead of it.
+  void DelayAck(const DelayedAck& ack);
+
+  // Returns whether or not any acknowledgements are held back.
+  bool HasDelayedAck() const { return !delayed_acks_.empty(); }
+
+  // Returns the time at which the oldest held back acknowledgement is due. If
+  // NextAckTime is called when none are held back then the program will exit.
+  base::TimeTicks NextAckTime() const;
+
+  // Returns the oldest held back acknowledgement and removes it. If
+  // PopDelayedAck is called when none are held back then the program will
+  // exit.
+  DelayedAck PopDelayedAck();
+
+  // Removes the parked request or held back acknowledgement with |seqnum|
+  // received on |sockfd|. Returns false if there is no such request.
+  bool UnparkRequest(int sockfd, int seqnum);
+
+  // Discards every queued response, parked request and held back
+  // acknowledgement, along with any partially received message, so that the
+  // interface starts afresh for the next client.
+  void Reset();
+
+  // The time at which the printer's scheduler will next complete the waiting
+  // requests of this interface, or null if it is not scheduled to.
+  base::TimeTicks wakeup_time() const { return wakeup_time_; }
+  void set_wakeup_time(base::TimeTicks time) { wakeup_time_ = time; }
 
   bool receiving_message() const { return receiving_message_; }
   void set_receiving_message(bool b) { receiving_message_ = b; }
@@ -44,20 +150,78 @@ class InterfaceManager {
   bool receiving_chunked() const { return receiving_chunked_; }
   void set_receiving_chunked(bool b) { receiving_chunked_ = b; }
 
-  HttpRequest request_header() const { return request_header_; }
-  void set_request_header(const HttpRequest& r) { request_header_ = r; }
+  const HttpRequest& request_header() const { return request_header_; }
+  void set_request_header(HttpRequest r) { request_header_ = std::move(r); }
+
+  // The decoder used for the body of the current message if it is chunked.
+  ChunkedDecoder* chunked_decoder() { return &chunked_decoder_; }
+
+  // The start of the next message, held while its header is incomplete, and
+  // the search for the end of that header.
+  SmartBuffer* partial_header() { return &partial_header_; }
+  ResumableSearch* header_end_search() { return &header_end_search_; }
 
+  // The body of the message received so far. For a chunked message this holds
+  // the decoded body.
   SmartBuffer* message() { return &message_; }
 
+  // Whether the IPP header and attributes at the start of |message_| have
+  // been parsed to check whether the message contains a document.
+  bool document_checked() const { return document_checked_; }
+  void set_document_checked(bool b) { document_checked_ = b; }
+
+  // The offset in |message_| at which the document data carried by the
+  // current IPP request begins, or nullopt if it does not carry a document.
+  // Document data is streamed to |document_sink_| as it arrives instead of
+  // being kept in |message_|.
+  base::Optional<size_t> document_offset() const { return document_offset_; }
+  void set_document_offset(base::Optional<size_t> offset) {
+    document_offset_ = offset;
+  }
+
+  // The number of bytes of document data which have been removed from
+  // |message_|.
+  size_t document_size() const { return document_size_; }
+  void add_document_size(size_t size) { document_size_ += size; }
+  void reset_document_size() { document_size_ = 0; }
+
+  // The sink which the document in the current message is recorded to, or
+  // null if it is not being recorded.
+  DocumentSink* document_sink() { return document_sink_.get(); }
+  void set_document_sink(std::unique_ptr<DocumentSink> sink) {
+    document_sink_ = std::move(sink);
+  }
+
  private:
-  std::queue<SmartBuffer> queue_;
+  // A response waiting to be sent, along with the number of bytes of it which
+  // have already been sent. Responses larger than a single BULK IN transfer
+  // are sent in pieces by advancing |offset|, without copying the remainder.
+  struct QueuedMessage {
+    scoped_refptr<base::RefCountedMemory> data;
+    size_t offset;
+    base::TimeTicks ready_time;
+    bool is_scan_data;
+  };
+
+  std::deque<QueuedMessage> queue_;
+  std::deque<ParkedRequest> parked_requests_;
+  std::deque<DelayedAck> delayed_acks_;
+  base::TimeTicks next_send_time_;
+  base::TimeTicks wakeup_time_;
   // Represents whether the interface is currently receiving an HTTP message.
   bool receiving_message_;
   // Represents whether the interface is currently receiving an HTTP "chunked"
   // message.
   bool receiving_chunked_;
   HttpRequest request_header_;
+  ChunkedDecoder chunked_decoder_;
+  SmartBuffer partial_header_;
+  ResumableSearch header_end_search_{"\r\n\r\n"};
   SmartBuffer message_;
+  bool document_checked_ = false;
+  base::Optional<size_t> document_offset_;
+  size_t document_size_ = 0;
+  std::unique_ptr<DocumentSink> document_sink_;
 };
 
 // A grouping of the descriptors for a USB device.
@@ -99,6 +263,13 @@ class UsbDescriptors {
     return endpoint_descriptors_;
   }
 
+  // The configuration descriptor followed by each of its interface
+  // descriptors and their endpoint descriptors, laid out as returned in
+  // response to a GET_DESCRIPTOR request for the configuration.
+  const std::vector<uint8_t>& configuration_blob() const {
+    return configuration_blob_;
+  }
+
  private:
   UsbDeviceDescriptor device_descriptor_;
   UsbConfigurationDescriptor configuration_descriptor_;
@@ -122,16 +293,30 @@ class UsbDescriptors {
   // Maps interface numbers to their respective collection of endpoint
   // descriptors.
   std::map<uint8_t, std::vector<UsbEndpointDescriptor>> endpoint_descriptors_;
+
+  // Built once on construction since the descriptors never change.
+  std::vector<uint8_t> configuration_blob_;
 };
 
 // Represents a single USB printer and can respond to basic USB control requests
 // and printer-specific USB requests.
+//
+// For an ipp-over-usb printer, each HTTP request is processed on a worker
+// thread belonging to the interface which received it once the whole request
+// has arrived, so that a slow request on one interface does not hold up the
+// others. A UsbPrinter must not be moved once it has started handling
+// requests, since its workers refer to it.
+//
+// The printer can simulate a slow device using a PerformanceProfile. Replies
+// which must wait are never sent by blocking a thread. Instead a scheduler
+// thread is woken when the next of them is due.
 class UsbPrinter {
  public:
   UsbPrinter(const UsbDescriptors& usb_descriptors,
-             const base::FilePath& document_output_path,
+             DocumentRecorder document_recorder,
              IppManager ipp_manager,
-             EsclManager escl_manager);
+             EsclManager escl_manager,
+             const PerformanceProfile& performance_profile);
 
   const UsbDeviceDescriptor& device_descriptor() const {
     return usb_descriptors_.device_descriptor();
@@ -162,9 +347,36 @@ class UsbPrinter {
     return usb_descriptors_.endpoint_descriptors();
   }
 
+  const std::vector<uint8_t>& configuration_blob() const {
+    return usb_descriptors_.configuration_blob();
+  }
+
+  // Cancels the parked bulk IN request or unacknowledged bulk OUT transfer with
+  // |seqnum| which was received on |sockfd|. Returns false if there is no such
+  // request, which means that it has already been completed.
+  bool UnlinkRequest(int sockfd, int seqnum);
+
+  // Detaches the client connected on |sockfd|, which is about to be closed.
+  // Every parked request, unacknowledged transfer, queued response and
+  // partially received message is discarded, as is any response still being
+  // generated, so that nothing is left over for the next client.
+  void Detach(int sockfd);
+
+  // Replace the IPP attributes and the scanner capabilities of the printer
+  // while it is attached. These may be called from any thread, and requests
+  // which are already being handled finish with the previous configuration.
+  void SetIppAttributes(SerializedIppAttributes attributes);
+  void SetScannerCapabilities(ScannerCapabilities scanner_capabilities);
+
   // Determines whether |usb_request| is either a control or data request and
-  // defers to the corresponding function.
-  void HandleUsbRequest(int sockfd, const UsbipCmdSubmit& usb_request);
+  // defers to the corresponding function. |data| contains the payload which
+  // accompanied |usb_request| if it is an OUT transfer, and is empty otherwise.
+  //
+  // A bulk IN request which cannot be completed yet because no response is
+  // waiting to be sent is parked, and completed as soon as a response is
+  // queued.
+  void HandleUsbRequest(int sockfd, const UsbipCmdSubmit& usb_request,
+                        SmartBuffer* data);
 
  private:
   // Returns true if this printer supports ipp-over-usb. An ippusb printer must
@@ -178,12 +390,25 @@ class UsbPrinter {
   // control request and defers to the corresponding function.
   void HandleUsbControl(int sockfd, const UsbipCmdSubmit& usb_request) const;
 
-  void HandleUsbData(int sockfd, const UsbipCmdSubmit& usb_request) const;
+  void HandleUsbData(int sockfd, const UsbipCmdSubmit& usb_request,
+                     const SmartBuffer& data);
 
-  void HandleIppUsbData(int sockfd, const UsbipCmdSubmit& usb_request);
+  void HandleIppUsbData(int sockfd, const UsbipCmdSubmit& usb_request,
+                        SmartBuffer* message);
 
   void HandleHttpData(const UsbipCmdSubmit& usb_request, SmartBuffer* message);
 
+  // Acknowledges the BULK OUT transfer |usb_request| of |received| bytes, of
+  // which |print_data_size| are print data. The acknowledgement is held back
+  // while the simulated print buffer is full.
+  void AcknowledgeBulkOut(int sockfd, const UsbipCmdSubmit& usb_request,
+                          size_t received, size_t print_data_size);
+
+  // If the IPP request being received by |im| carries a document, moves the
+  // document data received so far out of |im->message()| and records it, so
+  // that the document is never held in memory as a whole.
+  void StreamDocumentData(InterfaceManager* im);
+
   // Handles the standard USB requests.
   void HandleStandardControl(int sockfd, const UsbipCmdSubmit& usb_request,
                              const UsbControlRequest& control_request) const;
@@ -195,8 +420,24 @@ class UsbPrinter {
   // Get a pointer to the InterfaceManager that manages |endpoint|.
   InterfaceManager* GetInterfaceManager(int endpoint);
 
+  // Generates the response to |request|, which carries |body|. The time which
+  // the simulated device takes to process the request is stored in
+  // |processing_time|.
   HttpResponse GenerateHttpResponse(const HttpRequest& request,
-                                    SmartBuffer* body);
+                                    SmartBuffer* body,
+                                    base::TimeDelta* processing_time);
+
+  // Generates the response to |request|, which carries |body|, and queues it
+  // on the interface which received |usb_request| during |session|. Runs on
+  // the worker thread of that interface.
+  void ProcessHttpRequest(const UsbipCmdSubmit& usb_request,
+                          const HttpRequest& request,
+                          SmartBuffer body,
+                          uint64_t session);
+
+  // Returns the worker thread which processes the HTTP requests received on
+  // |endpoint|, starting it if this is the first request.
+  base::Thread* GetWorker(int endpoint);
 
   void HandleGetStatus(int sockfd, const UsbipCmdSubmit& usb_request,
                        const UsbControlRequest& control_request) const;
@@ -230,19 +471,112 @@ class UsbPrinter {
   void HandleGetDeviceId(int sockfd, const UsbipCmdSubmit& usb_request,
                          const UsbControlRequest& control_request) const;
 
+  // Queues |response| to be sent on the interface which received
+  // |usb_request| once |ready_time| has passed, and uses it to complete a
+  // parked BULK IN request if there is one. A large body is moved into the
+  // queue rather than copied. The response is discarded if the client which
+  // sent the request during |session| has since detached.
   void QueueHttpResponse(const UsbipCmdSubmit& usb_request,
-                         const HttpResponse& response);
+                         HttpResponse response,
+                         base::TimeTicks ready_time,
+                         uint64_t session);
 
   // Responds to a BULK_IN request by replying with the message at the front of
-  // |message_queue_|.
+  // |message_queue_|. If there is no message ready to be sent, or other
+  // requests are already waiting for one, then the request is parked.
   void HandleBulkInRequest(int sockfd, const UsbipCmdSubmit& usb_request);
 
+  // Completes the parked requests of the interface at |index| with its queued
+  // messages for as long as the message at the front of its queue is ready to
+  // be sent. Must be called with |queue_lock_| held.
+  void CompleteParkedRequests(size_t index);
+
+  // Arranges for the scheduler to send the replies of the interface at
+  // |index| which are due at |time|, starting the scheduler if this is the
+  // first time it is needed. Must be called with |queue_lock_| held.
+  void ScheduleWakeup(size_t index, base::TimeTicks time);
+
+  // Runs on the scheduler thread to send the replies of the interface at
+  // |index| which have become due.
+  void Wakeup(size_t index);
+
+  // Replies to |usb_request| with as much of the message at the front of the
+  // queue of |im| as it can hold. The rest of the message is left at the front
+  // of the queue, so that it is sent before any later message. The reply is
+  // added to |replies_| and sent by SendReplies. Must be called with
+  // |queue_lock_| held.
+  void SendQueuedMessage(InterfaceManager* im, int sockfd,
+                         const UsbipCmdSubmit& usb_request);
+
+  // Adds an acknowledgement that |received| bytes of |usb_request| were
+  // received to |replies_|. Must be called with |queue_lock_| held.
+  void QueueDataResponse(int sockfd,
+                         const UsbipCmdSubmit& usb_request,
+                         size_t received);
+
+  // Sends the replies in |replies_| in order, releasing |queue_lock_| while
+  // they are written so that a slow client does not hold up the workers. If
+  // another thread is already sending replies then it sends these as well.
+  // Must be called with |queue_lock_| held.
+  void SendReplies();
+
+  // A reply which has been taken from the queues of an interface and is
+  // waiting to be sent.
+  struct Reply {
+    int sockfd;
+    UsbipRetSubmit response;
+    // Keeps the |size| bytes of URB data at |data| alive until they are sent.
+    scoped_refptr<base::RefCountedMemory> storage;
+    const uint8_t* data;
+    size_t size;
+  };
+
   UsbDescriptors usb_descriptors_;
-  base::FilePath document_output_path_;
+  DocumentRecorder document_recorder_;
+  // The sink used to record the data received by a printer which does not
+  // support ipp-over-usb. Since such data has no job boundaries, all of it is
+  // appended to a single document which is kept open. In checksum mode the
+  // document is closed when the connection which sent it is closed.
+  std::unique_ptr<DocumentSink> usb_document_sink_;
 
   IppManager ipp_manager_;
   EsclManager escl_manager_;
+  PerformanceModel performance_model_;
   std::vector<InterfaceManager> interface_managers_;
+  // The time until which the simulated device is busy processing the requests
+  // already received on each interface. Each entry is only used by the worker
+  // of its interface.
+  std::vector<base::TimeTicks> busy_until_;
+
+  // These are held by pointer so that a UsbPrinter can be moved into place
+  // before it starts handling requests.
+  //
+  // Guards the response queues and parked requests of |interface_managers_|,
+  // which are used both by the thread reading requests and by the workers.
+  std::unique_ptr<base::Lock> queue_lock_;
+  // Signalled when a thread has finished sending |replies_|.
+  std::unique_ptr<base::ConditionVariable> replies_sent_;
+  // Guards |escl_manager_|, which keeps track of scan jobs across requests
+  // which may be processed by different workers.
+  std::unique_ptr<base::Lock> escl_lock_;
+  // Sends the replies which are held back to simulate a slow device, or null
+  // if none have been needed yet. Guarded by |queue_lock_|.
+  std::unique_ptr<base::Thread> scheduler_;
+  // Counts the clients which have detached, so that a response generated for
+  // a client which has gone is not sent to the next one. Only changed by the
+  // thread reading requests, and guarded by |queue_lock_|.
+  uint64_t session_ = 0;
+  // The replies which are waiting to be sent, in the order they must be sent
+  // in, and whether a thread is sending them. Guarded by |queue_lock_|.
+  std::deque<Reply> replies_;
+  bool sending_replies_ = false;
+  // The pool which the buffers of the responses generated on each interface
+  // are taken from.
+  std::vector<scoped_refptr<BufferPool>> buffer_pools_;
+  // The worker thread for each interface, or null if it has not been started.
+  // Declared last so that the workers are stopped before anything they use is
+  // destroyed.
+  std::vector<std::unique_ptr<base::Thread>> workers_;
 };
 
 #endif  // USB_PRINTER_H__
@@ -4,31 +4,42 @@
 
 #include "usbip.h"
 
+#include <sys/uio.h>
+
 #include <cinttypes>
 
 #include "device_descriptors.h"
+#include "metrics.h"
 #include "server.h"
 #include "smart_buffer.h"
 #include "usb_printer.h"
 #include "usbip_constants.h"
 
 #include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+UsbipRetSubmit ConvertUsbipRetSubmitToNetworkOrder(
+    const UsbipRetSubmit& reply) {
+  UsbipRetSubmit converted;
+  converted.header.command = htonl(reply.header.command);
+  converted.header.seqnum = htonl(reply.header.seqnum);
+  converted.header.devid = htonl(reply.header.devid);
+  converted.header.direction = htonl(reply.header.direction);
+  converted.header.ep = htonl(reply.header.ep);
+
+  converted.status = htonl(reply.status);
+  converted.actual_length = htonl(reply.actual_length);
+  converted.start_frame = htonl(reply.start_frame);
+  converted.number_of_packets = htonl(reply.number_of_packets);
+  converted.error_count = htonl(reply.error_count);
+
+  converted.setup = htobe64(reply.setup);
+  return converted;
+}
 
 SmartBuffer PackUsbipRetSubmit(const UsbipRetSubmit& reply) {
-  SmartBuffer serialized;
-  serialized.Add(htonl(reply.header.command));
-  serialized.Add(htonl(reply.header.seqnum));
-  serialized.Add(htonl(reply.header.devid));
-  serialized.Add(htonl(reply.header.direction));
-  serialized.Add(htonl(reply.header.ep));
-
-  serialized.Add(htonl(reply.status));
-  serialized.Add(htonl(reply.actual_length));
-  serialized.Add(htonl(reply.start_frame));
-  serialized.Add(htonl(reply.number_of_packets));
-  serialized.Add(htonl(reply.error_count));
-
-  serialized.Add(htobe64(reply.setup));
+  SmartBuffer serialized(sizeof(reply));
+  serialized.Add(ConvertUsbipRetSubmitToNetworkOrder(reply));
   return serialized;
 }
 
@@ -53,6 +64,66 @@ UsbipCmdSubmit UnpackUsbipCmdSubmit(SmartBuffer* buf) {
   return result;
 }
 
+SmartBuffer PackUsbipCmdSubmit(const UsbipCmdSubmit& command) {
+  UsbipCmdSubmit converted;
+  converted.header.command = htonl(command.header.command);
+  converted.header.seqnum = htonl(command.header.seqnum);
+  converted.header.devid = htonl(command.header.devid);
+  converted.header.direction = htonl(command.header.direction);
+  converted.header.ep = htonl(command.header.ep);
+
+  converted.transfer_flags = htonl(command.transfer_flags);
+  converted.transfer_buffer_length = htonl(command.transfer_buffer_length);
+  converted.start_frame = htonl(command.start_frame);
+  converted.number_of_packets = htonl(command.number_of_packets);
+  converted.interval = htonl(command.interval);
+  converted.setup = htobe64(command.setup);
+
+  SmartBuffer serialized(sizeof(converted));
+  serialized.Add(converted);
+  return serialized;
+}
+
+UsbipRetSubmit UnpackUsbipRetSubmit(SmartBuffer* buf) {
+  UsbipRetSubmit result;
+  CHECK(buf->size() >= sizeof(result));
+  memcpy(&result, buf->data(), sizeof(result));
+  buf->Erase(0, sizeof(result));
+  // Converting to network byte order swaps each member, which also converts
+  // them back to host byte order.
+  return ConvertUsbipRetSubmitToNetworkOrder(result);
+}
+
+UsbipCmdUnlink UnpackUsbipCmdUnlink(SmartBuffer* buf) {
+  UsbipCmdUnlink result;
+  CHECK(buf->size() >= sizeof(result));
+  memcpy(&result, buf->data(), sizeof(result));
+  buf->Erase(0, sizeof(result));
+
+  result.header.command = ntohl(result.header.command);
+  result.header.seqnum = ntohl(result.header.seqnum);
+  result.header.devid = ntohl(result.header.devid);
+  result.header.direction = ntohl(result.header.direction);
+  result.header.ep = ntohl(result.header.ep);
+
+  result.unlink_seqnum = ntohl(result.unlink_seqnum);
+  return result;
+}
+
+void SendUsbipRetUnlink(int sockfd, const UsbipCmdUnlink& unlink, int status) {
+  UsbipRetUnlink reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.header.command = htonl(COMMAND_USBIP_RET_UNLINK);
+  reply.header.seqnum = htonl(unlink.header.seqnum);
+  reply.header.devid = htonl(unlink.header.devid);
+  reply.status = htonl(status);
+
+  iovec iov;
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  SendIovecs(sockfd, &iov, 1);
+}
+
 void PrintUsbipHeaderBasic(const UsbipHeaderBasic& header) {
   printf("usbip cmd %u\n", header.command);
   printf("usbip seqnum %u\n", header.seqnum);
@@ -103,8 +174,10 @@ void SendUsbDataResponse(int sockfd, const UsbipCmdSubmit& usb_request,
   UsbipRetSubmit response = CreateUsbipRetSubmit(usb_request);
   response.actual_length = received;
 
-  PrintUsbipRetSubmit(response);
-  SendBuffer(sockfd, PackUsbipRetSubmit(response));
+  if (VLOG_IS_ON(3)) {
+    PrintUsbipRetSubmit(response);
+  }
+  SendUsbipRetSubmit(sockfd, response, nullptr, 0);
 }
 
 void SendUsbControlResponse(int sockfd, const UsbipCmdSubmit& usb_request,
@@ -112,10 +185,27 @@ void SendUsbControlResponse(int sockfd, const UsbipCmdSubmit& usb_request,
   UsbipRetSubmit response = CreateUsbipRetSubmit(usb_request);
   response.actual_length = data_size;
 
-  PrintUsbipRetSubmit(response);
-  SmartBuffer smart_buffer = PackUsbipRetSubmit(response);
-  if (data_size > 0) {
-    smart_buffer.Add(data, data_size);
+  if (VLOG_IS_ON(3)) {
+    PrintUsbipRetSubmit(response);
+  }
+  SendUsbipRetSubmit(sockfd, response, data, data_size);
+}
+
+void SendUsbipRetSubmit(int sockfd, const UsbipRetSubmit& response,
+                        const uint8_t* data, size_t size) {
+  if (size > 0) {
+    Metrics::Get()->IncrementCounter(
+        kEndpointBytesTotal,
+        FormatLabels({{"endpoint", base::NumberToString(response.header.ep)},
+                      {"direction", "in"}}),
+        size);
   }
-  SendBuffer(sockfd, smart_buffer);
+  UsbipRetSubmit header = ConvertUsbipRetSubmitToNetworkOrder(response);
+  iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  // iovec is also used for writes, so its base pointer is not const.
+  iov[1].iov_base = const_cast<uint8_t*>(data);
+  iov[1].iov_len = size;
+  SendIovecs(sockfd, iov, size > 0 ? 2 : 1);
 }
@@ -57,6 +57,31 @@ struct UsbipRetSubmit {
   uint64_t setup;         // Contains a USB SETUP packet.
 };
 
+// UsbipRetSubmit is sent directly on the socket once converted to network byte
+// order, so its layout must match the 48 byte message defined by the protocol.
+static_assert(sizeof(UsbipRetSubmit) == 48,
+              "UsbipRetSubmit does not match the USBIP message size");
+
+// Used to cancel a previously submitted USB request.
+struct UsbipCmdUnlink {
+  UsbipHeaderBasic header;
+  int unlink_seqnum;    // The seqnum of the request to cancel.
+  uint8_t padding[24];  // Unused, pads the message to the size of a submit.
+};
+
+// Used to reply to a request to cancel a USB request.
+struct UsbipRetUnlink {
+  UsbipHeaderBasic header;
+  int status;  // -ECONNRESET if the request was cancelled, 0 if it had
+               // already completed.
+  uint8_t padding[24];  // Unused, pads the message to the size of a submit.
+};
+
+static_assert(sizeof(UsbipCmdUnlink) == 48,
+              "UsbipCmdUnlink does not match the USBIP message size");
+static_assert(sizeof(UsbipRetUnlink) == 48,
+              "UsbipRetUnlink does not match the USBIP message size");
+
 // Represents a USB SETUP packet.
 struct UsbControlRequest {
   uint8_t bmRequestType;
@@ -79,6 +104,10 @@ void PrintUsbControlRequest(const UsbControlRequest& request);
 // from |request|.
 UsbipRetSubmit CreateUsbipRetSubmit(const UsbipCmdSubmit& usb_request);
 
+// Returns a copy of |reply| with each of its members converted to network byte
+// order, so that it can be sent on a socket as-is.
+UsbipRetSubmit ConvertUsbipRetSubmitToNetworkOrder(const UsbipRetSubmit& reply);
+
 // Serializes |reply| into a buffer and converts the contents to network byte
 // order.
 SmartBuffer PackUsbipRetSubmit(const UsbipRetSubmit& reply);
@@ -89,6 +118,26 @@ SmartBuffer PackUsbipRetSubmit(const UsbipRetSubmit& reply);
 // Erases the deserialized bytes from |buf|.
 UsbipCmdSubmit UnpackUsbipCmdSubmit(SmartBuffer* buf);
 
+// Serializes |command| into a buffer and converts the contents to network
+// byte order. This is used by clients of the server.
+SmartBuffer PackUsbipCmdSubmit(const UsbipCmdSubmit& command);
+
+// Reads a UsbipRetSubmit struct from |buf| and converts the contents of the
+// message into host byte order.
+//
+// Erases the deserialized bytes from |buf|.
+UsbipRetSubmit UnpackUsbipRetSubmit(SmartBuffer* buf);
+
+// Reads a UsbipCmdUnlink struct from |buf| and converts the contents of the
+// message into host byte order.
+//
+// Erases the deserialized bytes from |buf|.
+UsbipCmdUnlink UnpackUsbipCmdUnlink(SmartBuffer* buf);
+
+// Responds to |unlink| by sending a UsbipRetUnlink message which reports
+// |status| to the socket described by |sockfd|.
+void SendUsbipRetUnlink(int sockfd, const UsbipCmdUnlink& unlink, int status);
+
 // Responds to the USB data request |usb_request| by sending a UsbRetSubmit
 // message that uses |received| to indicate how many uint8_ts that it
 // successfully received.
@@ -101,4 +150,10 @@ void SendUsbDataResponse(int sockfd, const UsbipCmdSubmit& usb_request,
 void SendUsbControlResponse(int sockfd, const UsbipCmdSubmit& usb_request,
                             const uint8_t* data, size_t size);
 
+// Sends |response| followed by the |size| bytes of URB data in |data| to the
+// socket described by |sockfd|. The header and the data are sent with a single
+// scatter/gather write straight from their existing storage.
+void SendUsbipRetSubmit(int sockfd, const UsbipRetSubmit& response,
+                        const uint8_t* data, size_t size);
+
 #endif  // USBIP_H__
@@ -55,6 +55,7 @@
 #define IPP_CREATE_JOB 0x0005
 #define IPP_SEND_DOCUMENT 0x0006
 #define IPP_GET_JOB_ATTRIBUTES 0x0009
+#define IPP_GET_JOBS 0x000A
 #define IPP_GET_PRINTER_ATTRIBUTES 0x000B
 
 // Port that the server is bound to.
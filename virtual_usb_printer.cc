@@ -8,19 +8,27 @@
 #include <utility>
 #include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/files/file_util.h>
 #include <base/json/json_reader.h>
+#include <base/location.h>
 #include <base/logging.h>
 #include <base/optional.h>
+#include <base/strings/string_split.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/thread.h>
 #include <base/values.h>
 #include <brillo/flag_helper.h>
 #include <brillo/syslog_logging.h>
 
+#include "config_snapshot.h"
 #include "device_descriptors.h"
+#include "document_sink.h"
 #include "ipp_manager.h"
 #include "load_config.h"
+#include "op_commands.h"
+#include "performance_model.h"
 #include "server.h"
 #include "usb_printer.h"
 #include "usbip.h"
@@ -31,11 +39,54 @@ namespace {
 
 constexpr char kUsage[] =
     "virtual_usb_printer\n"
-    "    --descriptors_path=<path>\n"
-    "    [--record_doc_path=<path>]\n"
-    "    [--attributes_path=<path>]\n"
-    "    [--scanner_capabilities_path=<path>]"
-    "    [--scanner_doc_path=<path>]";
+    "    (--descriptors_path=<path>[,<path>...]\n"
+    "     [--attributes_path=<path>[,<path>...]]\n"
+    "     [--write_snapshot_path=<path>[,<path>...]] |\n"
+    "     --snapshot_path=<path>[,<path>...])\n"
+    "    [--record_doc_path=<path>[,<path>...]]\n"
+    "    [--record_doc_dir=<path>[,<path>...]]\n"
+    "    [--record_doc_checksum] [--record_doc_keep_kb=<kilobytes>]\n"
+    "    [--scanner_capabilities_path=<path>[,<path>...]]\n"
+    "    [--scanner_doc_path=<path>[,<path>...]]\n"
+    "    [--scan_job_limit=<count>] [--scan_job_max_age=<seconds>]\n"
+    "    [--[no]listen_tcp] [--socket_buffer_size=<bytes>]\n"
+    "    [--unix_socket_path=<path>] [--vsock_port=<port>]\n"
+    "    [--verbosity=<level>]\n"
+    "Each path flag other than --descriptors_path, --write_snapshot_path and\n"
+    "--snapshot_path takes either a single path which is shared by every\n"
+    "printer, or one path per descriptors or snapshot file.\n"
+    "--write_snapshot_path takes one path per descriptors file, and writes\n"
+    "the configuration of each printer to a snapshot which can be loaded\n"
+    "using --snapshot_path instead of exporting the printers.\n"
+    "The printers are exported on at least one of TCP, a Unix domain socket\n"
+    "and vsock.\n"
+    "On SIGHUP the IPP attributes and scanner capabilities of each printer\n"
+    "are loaded again, without detaching the printers.";
+
+// Splits the comma-separated list of paths given in |flag|.
+std::vector<std::string> SplitPaths(const std::string& flag) {
+  return base::SplitString(flag, ",", base::TRIM_WHITESPACE,
+                           base::SPLIT_WANT_NONEMPTY);
+}
+
+// Returns whether |paths| can be used to configure |printer_count| printers.
+bool IsValidPathList(const std::vector<std::string>& paths,
+                     size_t printer_count) {
+  return paths.size() <= 1 || paths.size() == printer_count;
+}
+
+// Returns the path from |paths| which should be used for the printer at
+// |index|, or an empty string if no path is given.
+std::string GetPathForPrinter(const std::vector<std::string>& paths,
+                              size_t index) {
+  if (paths.empty()) {
+    return std::string();
+  }
+  if (paths.size() == 1) {
+    return paths[0];
+  }
+  return paths[index];
+}
 
 // Create a new UsbDescriptors object using the USB descriptors defined in
 // |printer_config|.
@@ -56,15 +107,10 @@ UsbDescriptors CreateUsbDescriptors(const base::Value& printer_config) {
                         ieee_device_id, interfaces, endpoint_map);
 }
 
-// Attempts to initialize an EsclManager.
-// Parses |capabilities_path| into a JSON object in order to do so, returning
-// nullopt if that parsing fails.
-base::Optional<EsclManager> InitializeEsclManager(
-    const std::string& capabilities_path, const std::string& scanner_doc_path) {
-  if (capabilities_path.empty()) {
-    return EsclManager();
-  }
-
+// Attempts to load the ScannerCapabilities defined in the JSON file at
+// |capabilities_path|, returning nullopt on failure.
+base::Optional<ScannerCapabilities> LoadScannerCapabilities(
+    const std::string& capabilities_path) {
   std::string capabilities_string;
   if (!base::ReadFileToString(base::FilePath(capabilities_path),
                               &capabilities_string)) {
@@ -83,6 +129,22 @@ base::Optional<EsclManager> InitializeEsclManager(
       CreateScannerCapabilitiesFromConfig(*capabilities_json);
   if (!capabilities) {
     LOG(ERROR) << "Failed to initialize ScannerCapabilities";
+  }
+  return capabilities;
+}
+
+// Attempts to initialize an EsclManager.
+// Parses |capabilities_path| into a JSON object in order to do so, returning
+// nullopt if that parsing fails.
+base::Optional<EsclManager> InitializeEsclManager(
+    const std::string& capabilities_path, const std::string& scanner_doc_path) {
+  if (capabilities_path.empty()) {
+    return EsclManager();
+  }
+
+  base::Optional<ScannerCapabilities> capabilities =
+      LoadScannerCapabilities(capabilities_path);
+  if (!capabilities) {
     return base::nullopt;
   }
 
@@ -90,87 +152,359 @@ base::Optional<EsclManager> InitializeEsclManager(
   return EsclManager(std::move(capabilities.value()), document_path);
 }
 
+// Attempts to load and parse the printer configuration at |descriptors_path|
+// into a UsbDescriptors object, returning nullopt on failure. The performance
+// profile given in the configuration is stored in |performance_profile|.
+base::Optional<UsbDescriptors> LoadUsbDescriptors(
+    const std::string& descriptors_path,
+    PerformanceProfile* performance_profile) {
+  base::Optional<std::string> descriptors_contents =
+      GetJSONContents(descriptors_path);
+  if (!descriptors_contents.has_value()) {
+    LOG(ERROR) << "Failed to load file contents for " << descriptors_path;
+    return base::nullopt;
+  }
+
+  base::Optional<base::Value> descriptors =
+      base::JSONReader::Read(*descriptors_contents);
+  if (!descriptors) {
+    LOG(ERROR) << "Failed to parse " << descriptors_path;
+    return base::nullopt;
+  }
+
+  if (!descriptors->is_dict()) {
+    LOG(ERROR) << "Failed to extract printer configuration as dictionary";
+    return base::nullopt;
+  }
+
+  *performance_profile = GetPerformanceProfile(*descriptors);
+  return CreateUsbDescriptors(*descriptors);
+}
+
+// Attempts to load and serialize the IPP attributes defined in the JSON file
+// at |attributes_path|, returning nullopt on failure. If there is no
+// |attributes_path| then there are no attributes.
+//
+// The parsed JSON is stored in |attribute_configs| so that if the same path is
+// used by several printers then it is only parsed once.
+base::Optional<SerializedIppAttributes> LoadIppAttributes(
+    const std::string& attributes_path,
+    std::map<std::string, base::Value>* attribute_configs) {
+  if (attributes_path.empty()) {
+    return SerializedIppAttributes();
+  }
+
+  auto iter = attribute_configs->find(attributes_path);
+  if (iter == attribute_configs->end()) {
+    base::Optional<std::string> attributes_contents =
+        GetJSONContents(attributes_path);
+    if (!attributes_contents.has_value()) {
+      LOG(ERROR) << "Failed to load file contents for " << attributes_path;
+      return base::nullopt;
+    }
+    base::Optional<base::Value> result =
+        base::JSONReader::Read(*attributes_contents);
+    if (!result) {
+      LOG(ERROR) << "Failed to parse " << attributes_path;
+      return base::nullopt;
+    }
+    iter = attribute_configs->emplace(attributes_path, std::move(*result))
+               .first;
+  }
+
+  // The attributes are validated rather than loaded with GetAttributes, which
+  // exits on an invalid attribute, since they may be reloaded on SIGHUP.
+  const base::Value& attributes = iter->second;
+  base::Optional<std::vector<IppAttribute>> operation_attributes =
+      ParseAttributes(attributes, kOperationAttributes);
+  base::Optional<std::vector<IppAttribute>> printer_attributes =
+      ParseAttributes(attributes, kPrinterAttributes);
+  base::Optional<std::vector<IppAttribute>> job_attributes =
+      ParseAttributes(attributes, kJobAttributes);
+  base::Optional<std::vector<IppAttribute>> unsupported_attributes =
+      ParseAttributes(attributes, kUnsupportedAttributes);
+  if (!operation_attributes || !printer_attributes || !job_attributes ||
+      !unsupported_attributes) {
+    LOG(ERROR) << "Invalid IPP attributes in " << attributes_path;
+    return base::nullopt;
+  }
+
+  return SerializeIppAttributes(*operation_attributes, *printer_attributes,
+                                *job_attributes, *unsupported_attributes);
+}
+
+// The configuration files which are loaded again when the process receives
+// SIGHUP, given as lists of paths in the same way as the flags.
+struct ReloadPaths {
+  std::vector<std::string> snapshot_paths;
+  std::vector<std::string> attributes_paths;
+  std::vector<std::string> scanner_capabilities_paths;
+};
+
+// Loads the IPP attributes and scanner capabilities of each printer exported
+// by |server| again from |paths|, and swaps them into the printer without
+// detaching it. A printer whose configuration can not be loaded keeps its
+// current configuration.
+void ReloadConfig(Server* server, const ReloadPaths& paths) {
+  std::map<std::string, base::Value> attribute_configs;
+  for (size_t i = 0; i < server->printer_count(); ++i) {
+    base::Optional<SerializedIppAttributes> attributes;
+    if (!paths.snapshot_paths.empty()) {
+      // Only the attributes are taken from the snapshot, since the descriptors
+      // of an attached device can not change.
+      base::Optional<PrinterSnapshot> snapshot =
+          LoadConfigSnapshot(base::FilePath(paths.snapshot_paths[i]));
+      if (snapshot.has_value()) {
+        attributes = std::move(snapshot->ipp_attributes);
+      }
+    } else {
+      attributes = LoadIppAttributes(
+          GetPathForPrinter(paths.attributes_paths, i), &attribute_configs);
+    }
+    std::string capabilities_path =
+        GetPathForPrinter(paths.scanner_capabilities_paths, i);
+    base::Optional<ScannerCapabilities> capabilities;
+    if (!capabilities_path.empty()) {
+      capabilities = LoadScannerCapabilities(capabilities_path);
+    }
+    if (!attributes.has_value() ||
+        (!capabilities_path.empty() && !capabilities.has_value())) {
+      LOG(ERROR) << "Keeping the current configuration of bus ID "
+                 << GetBusId(i);
+      continue;
+    }
+
+    UsbPrinter* printer = server->printer(i);
+    printer->SetIppAttributes(std::move(attributes.value()));
+    if (capabilities.has_value()) {
+      printer->SetScannerCapabilities(std::move(capabilities.value()));
+    }
+    LOG(INFO) << "Reloaded the configuration of bus ID " << GetBusId(i);
+  }
+}
+
+// Runs on the server's thread when SIGHUP is received, and reloads the
+// configuration on |reload_thread| so that requests are not held up while the
+// files are parsed.
+void ScheduleReload(base::Thread* reload_thread,
+                    Server* server,
+                    const ReloadPaths& paths) {
+  reload_thread->task_runner()->PostTask(
+      FROM_HERE,
+      base::BindOnce(&ReloadConfig, base::Unretained(server), paths));
+}
+
+// Writes a snapshot of the configuration given by |usb_descriptors|,
+// |ipp_manager| and |performance_profile| to |path|. Returns false on failure.
+bool WriteConfigSnapshot(const std::string& path,
+                         const UsbDescriptors& usb_descriptors,
+                         const IppManager& ipp_manager,
+                         const PerformanceProfile& performance_profile) {
+  std::vector<uint8_t> snapshot =
+      CreateConfigSnapshot(usb_descriptors, ipp_manager.serialized_attributes(),
+                           performance_profile);
+  if (base::WriteFile(base::FilePath(path),
+                      reinterpret_cast<const char*>(snapshot.data()),
+                      snapshot.size()) != static_cast<int>(snapshot.size())) {
+    LOG(ERROR) << "Failed to write config snapshot to " << path;
+    return false;
+  }
+  return true;
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
   DEFINE_string(descriptors_path, "", "Path to descriptors JSON file");
   DEFINE_string(record_doc_path, "", "Path to file to record document to");
+  DEFINE_string(record_doc_dir, "",
+                "Path to directory to record each document to a new file in");
+  DEFINE_bool(record_doc_checksum, false,
+              "Record only the size and SHA-256 checksum of each document to "
+              "a manifest");
+  DEFINE_int32(record_doc_keep_kb, 0,
+               "With --record_doc_checksum, the kilobytes at the start of "
+               "each document which are also recorded");
   DEFINE_string(attributes_path, "", "Path to IPP attributes JSON file");
+  DEFINE_string(write_snapshot_path, "",
+                "Path to write a snapshot of the printer configuration to, "
+                "instead of exporting the printer");
+  DEFINE_string(snapshot_path, "",
+                "Path to a config snapshot to load instead of the descriptors "
+                "and IPP attributes JSON files");
   DEFINE_string(scanner_capabilities_path, "",
                 "Path to eSCL ScannerCapabilities JSON file");
   DEFINE_string(scanner_doc_path, "",
-                "Path to file containing data to return from scan jobs");
+                "Path to file containing data to return from scan jobs, or to "
+                "a directory containing one file per page for ADF scans. If "
+                "not given, PNG and PDF scans are generated to match each "
+                "scan job's settings");
+  DEFINE_int32(scan_job_limit, JobRetention().max_jobs,
+               "Most scan jobs to keep track of for each scanner");
+  DEFINE_int32(scan_job_max_age, JobRetention().max_age.InSeconds(),
+               "Seconds after which a scan job is forgotten");
+  DEFINE_bool(listen_tcp, true,
+              "Accept USBIP connections on TCP port 3240");
+  DEFINE_int32(socket_buffer_size, 0,
+               "Send and receive buffer size in bytes of each TCP connection. "
+               "If 0, the kernel sizes the buffers");
+  DEFINE_string(unix_socket_path, "",
+                "Path of a Unix domain socket to accept USBIP connections on");
+  DEFINE_int32(vsock_port, -1,
+               "Port to accept USBIP connections on over vsock, or -1 to not "
+               "listen on vsock");
+  DEFINE_int32(verbosity, 0,
+               "Verbose logging level: 1 logs each IPP and eSCL request, 2 "
+               "each USB transfer and control request, and 3 dumps each "
+               "USBIP reply");
 
   brillo::FlagHelper::Init(argc, argv, "Virtual USB Printer");
   brillo::InitLog(brillo::kLogToSyslog | brillo::kLogToStderrIfTty);
+  // VLOG(n) is enabled when the minimum log level is -n or lower.
+  if (FLAGS_verbosity > 0) {
+    logging::SetMinLogLevel(-FLAGS_verbosity);
+  }
+
+  std::vector<std::string> descriptors_paths =
+      SplitPaths(FLAGS_descriptors_path);
+  std::vector<std::string> record_doc_paths = SplitPaths(FLAGS_record_doc_path);
+  std::vector<std::string> record_doc_dirs = SplitPaths(FLAGS_record_doc_dir);
+  std::vector<std::string> attributes_paths = SplitPaths(FLAGS_attributes_path);
+  std::vector<std::string> write_snapshot_paths =
+      SplitPaths(FLAGS_write_snapshot_path);
+  std::vector<std::string> snapshot_paths = SplitPaths(FLAGS_snapshot_path);
+  std::vector<std::string> scanner_capabilities_paths =
+      SplitPaths(FLAGS_scanner_capabilities_path);
+  std::vector<std::string> scanner_doc_paths =
+      SplitPaths(FLAGS_scanner_doc_path);
 
-  if (FLAGS_descriptors_path.empty()) {
+  // Snapshots replace both the descriptors and the IPP attributes files.
+  bool use_snapshots = !snapshot_paths.empty();
+  size_t printer_count =
+      use_snapshots ? snapshot_paths.size() : descriptors_paths.size();
+  if (printer_count == 0 ||
+      (use_snapshots && (!descriptors_paths.empty() ||
+                         !attributes_paths.empty() ||
+                         !write_snapshot_paths.empty())) ||
+      (!write_snapshot_paths.empty() &&
+       write_snapshot_paths.size() != printer_count) ||
+      !IsValidPathList(record_doc_paths, printer_count) ||
+      !IsValidPathList(record_doc_dirs, printer_count) ||
+      !IsValidPathList(attributes_paths, printer_count) ||
+      !IsValidPathList(scanner_capabilities_paths, printer_count) ||
+      !IsValidPathList(scanner_doc_paths, printer_count)) {
     LOG(ERROR) << kUsage;
     return 1;
   }
-
-  base::Optional<std::string> descriptors_contents =
-      GetJSONContents(FLAGS_descriptors_path);
-  if (!descriptors_contents.has_value()) {
-    LOG(ERROR) << "Failed to load file contents for " << FLAGS_descriptors_path;
+  if (FLAGS_record_doc_keep_kb < 0 ||
+      (FLAGS_record_doc_keep_kb > 0 && !FLAGS_record_doc_checksum)) {
+    LOG(ERROR) << "--record_doc_keep_kb must not be negative, and requires "
+                  "--record_doc_checksum";
     return 1;
   }
-
-  base::Optional<base::Value> descriptors =
-      base::JSONReader::Read(*descriptors_contents);
-  if (!descriptors) {
-    LOG(ERROR) << "Failed to parse " << FLAGS_descriptors_path;
+  if (FLAGS_scan_job_limit < 1 || FLAGS_scan_job_max_age < 1) {
+    LOG(ERROR) << "--scan_job_limit and --scan_job_max_age must be positive";
     return 1;
   }
-
-  if (!descriptors->is_dict()) {
-    LOG(ERROR) << "Failed to extract printer configuration as dictionary";
+  if ((!FLAGS_listen_tcp && FLAGS_unix_socket_path.empty() &&
+       FLAGS_vsock_port < 0) ||
+      FLAGS_socket_buffer_size < 0) {
+    LOG(ERROR) << kUsage;
     return 1;
   }
+  ListenOptions listen_options;
+  listen_options.tcp = FLAGS_listen_tcp;
+  listen_options.socket_buffer_size = FLAGS_socket_buffer_size;
+  listen_options.unix_socket_path = FLAGS_unix_socket_path;
+  if (FLAGS_vsock_port >= 0) {
+    listen_options.vsock_port = FLAGS_vsock_port;
+  }
 
-  UsbDescriptors usb_descriptors = CreateUsbDescriptors(*descriptors);
+  JobRetention job_retention;
+  job_retention.max_jobs = FLAGS_scan_job_limit;
+  job_retention.max_age = base::TimeDelta::FromSeconds(FLAGS_scan_job_max_age);
 
-  base::FilePath document_output_path(FLAGS_record_doc_path);
+  // Holds the parsed IPP attributes files, which are only needed while the
+  // printers are being created and are released once they all exist.
+  std::map<std::string, base::Value> attribute_configs;
 
-  IppManager ipp_manager;
-  // Load ipp attributes if |FLAGS_attributes_path| is set.
-  base::Optional<base::Value> result;
-  if (!FLAGS_attributes_path.empty()) {
-    base::Optional<std::string> attributes_contents =
-        GetJSONContents(FLAGS_attributes_path);
-    if (!attributes_contents.has_value()) {
-      LOG(ERROR) << "Failed to load file contents for "
-                 << FLAGS_attributes_path;
-      return 1;
+  std::vector<UsbPrinter> printers;
+  printers.reserve(printer_count);
+  for (size_t i = 0; i < printer_count; ++i) {
+    base::Optional<UsbDescriptors> usb_descriptors;
+    base::Optional<IppManager> ipp_manager;
+    PerformanceProfile performance_profile;
+    if (use_snapshots) {
+      base::Optional<PrinterSnapshot> snapshot =
+          LoadConfigSnapshot(base::FilePath(snapshot_paths[i]));
+      if (!snapshot.has_value())
+        return 1;
+      usb_descriptors = std::move(snapshot->descriptors);
+      ipp_manager.emplace(std::move(snapshot->ipp_attributes));
+      performance_profile = std::move(snapshot->performance_profile);
+    } else {
+      usb_descriptors =
+          LoadUsbDescriptors(descriptors_paths[i], &performance_profile);
+      if (!usb_descriptors.has_value())
+        return 1;
+      base::Optional<SerializedIppAttributes> attributes = LoadIppAttributes(
+          GetPathForPrinter(attributes_paths, i), &attribute_configs);
+      if (!attributes.has_value())
+        return 1;
+      ipp_manager.emplace(std::move(attributes.value()));
     }
-    result = base::JSONReader::Read(*attributes_contents);
-    if (!result) {
-      LOG(ERROR) << "Failed to parse " << FLAGS_attributes_path;
-      return 1;
+
+    if (!write_snapshot_paths.empty()) {
+      if (!WriteConfigSnapshot(write_snapshot_paths[i],
+                               usb_descriptors.value(), ipp_manager.value(),
+                               performance_profile))
+        return 1;
+      LOG(INFO) << "Wrote a snapshot of " << descriptors_paths[i] << " to "
+                << write_snapshot_paths[i];
+      continue;
+    }
+
+    DocumentRecorder document_recorder(
+        base::FilePath(GetPathForPrinter(record_doc_paths, i)),
+        base::FilePath(GetPathForPrinter(record_doc_dirs, i)));
+    if (FLAGS_record_doc_checksum) {
+      document_recorder.set_checksum_mode(
+          static_cast<size_t>(FLAGS_record_doc_keep_kb) * 1024);
     }
 
-    std::vector<IppAttribute> operation_attributes =
-        GetAttributes(*result, kOperationAttributes);
-    std::vector<IppAttribute> printer_attributes =
-        GetAttributes(*result, kPrinterAttributes);
-    std::vector<IppAttribute> job_attributes =
-        GetAttributes(*result, kJobAttributes);
-    std::vector<IppAttribute> unsupported_attributes =
-        GetAttributes(*result, kUnsupportedAttributes);
+    base::Optional<EsclManager> escl_manager =
+        InitializeEsclManager(GetPathForPrinter(scanner_capabilities_paths, i),
+                              GetPathForPrinter(scanner_doc_paths, i));
+    if (!escl_manager.has_value())
+      return 1;
+    escl_manager->set_job_retention(job_retention);
 
-    ipp_manager =
-        IppManager(operation_attributes, printer_attributes, job_attributes,
-                   unsupported_attributes, document_output_path);
+    LOG(INFO) << "Exporting "
+              << (use_snapshots ? snapshot_paths[i] : descriptors_paths[i])
+              << " as bus ID "
+              << GetBusId(i);
+    printers.emplace_back(usb_descriptors.value(), std::move(document_recorder),
+                          std::move(ipp_manager.value()),
+                          std::move(escl_manager.value()), performance_profile);
   }
 
-  base::Optional<EsclManager> escl_manager = InitializeEsclManager(
-      FLAGS_scanner_capabilities_path, FLAGS_scanner_doc_path);
-  if (!escl_manager.has_value())
-    return 1;
+  attribute_configs.clear();
 
-  UsbPrinter printer(usb_descriptors, document_output_path,
-                     std::move(ipp_manager), std::move(escl_manager.value()));
+  if (!write_snapshot_paths.empty()) {
+    return 0;
+  }
 
-  Server server(std::move(printer));
+  Server server(std::move(printers), listen_options);
+  ReloadPaths reload_paths;
+  reload_paths.snapshot_paths = snapshot_paths;
+  reload_paths.attributes_paths = attributes_paths;
+  reload_paths.scanner_capabilities_paths = scanner_capabilities_paths;
+  // SIGHUP must be blocked before the reload thread is started, so that it is
+  // only ever received by the server.
+  base::Thread reload_thread("config-reload");
+  server.HandleSighup(base::BindRepeating(
+      &ScheduleReload, base::Unretained(&reload_thread),
+      base::Unretained(&server), reload_paths));
+  CHECK(reload_thread.Start()) << "Failed to start the config reload thread";
   server.Run();
 }
@@ -4,173 +4,214 @@
 
 #include "xml_util.h"
 
-#include <memory>
-#include <utility>
+#include <climits>
+#include <cstring>
+#include <map>
 #include <string>
+#include <utility>
 
-#include <libxml/tree.h>
+#include <libxml/parser.h>
 
-#include <base/containers/flat_map.h>
+#include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
-#include <base/strings/string_util.h>
-
-namespace {
 
-struct XmlNodeDeleter {
-  void operator()(xmlNode* p) { xmlFreeNode(p); }
-};
-using UniqueXmlNodePtr = std::unique_ptr<xmlNode, XmlNodeDeleter>;
-
-struct XmlDocDeleter {
-  void operator()(xmlDoc* p) { xmlFreeDoc(p); }
-};
-using UniqueXmlDocPtr = std::unique_ptr<xmlDoc, XmlDocDeleter>;
+#include "smart_buffer.h"
 
-constexpr char kPwgNs[] = "pwg";
-constexpr char kScanNs[] = "scan";
-using namespace_map = base::flat_map<std::string, xmlNs*>;
+namespace {
 
-inline const xmlChar* XmlCast(const char* p) {
-  return reinterpret_cast<const xmlChar*>(p);
-}
+constexpr char kXmlDeclaration[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+constexpr char kPwgNsDeclaration[] =
+    " xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\"";
+constexpr char kScanNsDeclaration[] =
+    " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\"";
+constexpr char kXsiNsDeclaration[] =
+    " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"";
+
+// Writes an XML document straight into a SmartBuffer, indenting each element
+// by two spaces per level in the same way as libxml2's formatted output.
+// Element names include their namespace prefix.
+class XmlWriter {
+ public:
+  explicit XmlWriter(SmartBuffer* out) : out_(out) {
+    out_->Add(kXmlDeclaration);
+  }
+  XmlWriter(const XmlWriter&) = delete;
+  XmlWriter& operator=(const XmlWriter&) = delete;
+
+  // Starts an element called |name|. |attributes| is written into the start
+  // tag as is, so it must already be escaped and begin with a space.
+  void StartElement(const char* name, const std::string& attributes = "") {
+    CloseStartTag();
+    Indent();
+    out_->Add("<");
+    out_->Add(name);
+    out_->Add(attributes);
+    open_elements_.push_back(name);
+    start_tag_open_ = true;
+  }
 
-bool StrEqual(const xmlChar* first, const char* second) {
-  return xmlStrEqual(first, XmlCast(second));
-}
+  // Ends the innermost element which has been started. An element without
+  // any children is written as an empty-element tag.
+  void EndElement() {
+    const char* name = open_elements_.back();
+    open_elements_.pop_back();
+    if (start_tag_open_) {
+      out_->Add("/>\n");
+      start_tag_open_ = false;
+      return;
+    }
+    Indent();
+    out_->Add("</");
+    out_->Add(name);
+    out_->Add(">\n");
+  }
 
-base::Optional<std::string> GetContent(const xmlNode* node) {
-  if (!node || !node->children) {
-    LOG(ERROR) << "node does not have content";
-    return base::nullopt;
+  // Adds an element called |name| containing the text |content|.
+  void AddElement(const char* name, const std::string& content) {
+    StartElement(name);
+    if (content.empty()) {
+      EndElement();
+      return;
+    }
+    out_->Add(">");
+    AddEscaped(content);
+    out_->Add("</");
+    out_->Add(name);
+    out_->Add(">\n");
+    open_elements_.pop_back();
+    start_tag_open_ = false;
   }
-  return reinterpret_cast<const char*>(node->children->content);
-}
 
-// Attempt to parse the contents of |node| as an integer.
-base::Optional<int> GetIntContent(const xmlNode* node) {
-  base::Optional<std::string> contents = GetContent(node);
-  if (!contents)
-    return base::nullopt;
-  int value;
-  if (!base::StringToInt(contents.value(), &value)) {
-    LOG(ERROR) << "Failed to convert " << contents.value() << " to int";
-    return base::nullopt;
+ private:
+  // Finishes the start tag of the innermost element once it is known to have
+  // children.
+  void CloseStartTag() {
+    if (start_tag_open_) {
+      out_->Add(">\n");
+      start_tag_open_ = false;
+    }
   }
-  return value;
-}
 
-// Serialize the xml tree in |root| into a vector. Consumes |root| and frees
-// its memory.
-std::vector<uint8_t> Serialize(UniqueXmlNodePtr root) {
-  UniqueXmlDocPtr doc(xmlNewDoc(XmlCast("1.0")));
-  // |doc| takes ownership of |root| here.
-  xmlDocSetRootElement(doc.get(), root.release());
+  void Indent() {
+    for (size_t i = 0; i < open_elements_.size(); i++) {
+      out_->Add("  ");
+    }
+  }
 
-  xmlChar* buf;
-  int length;
-  xmlDocDumpFormatMemoryEnc(doc.get(), &buf, &length, "UTF-8", true);
-  std::vector<uint8_t> xml(buf, buf + length);
-  xmlFree(buf);
+  // Adds |text| with the characters which can not appear in character data
+  // replaced by references.
+  void AddEscaped(const std::string& text) {
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+      const char* reference;
+      switch (text[i]) {
+        case '&':
+          reference = "&amp;";
+          break;
+        case '<':
+          reference = "&lt;";
+          break;
+        case '>':
+          reference = "&gt;";
+          break;
+        case '\r':
+          reference = "&#13;";
+          break;
+        default:
+          continue;
+      }
+      out_->Add(text.data() + start, i - start);
+      out_->Add(reference);
+      start = i + 1;
+    }
+    out_->Add(text.data() + start, text.size() - start);
+  }
 
-  return xml;
-}
+  SmartBuffer* out_;
+  // The names of the elements which have been started but not ended.
+  std::vector<const char*> open_elements_;
+  // Whether the start tag of the innermost element is still waiting for its
+  // closing '>' or '/>'.
+  bool start_tag_open_ = false;
+};
 
-// Adds a new node with namespace |ns| called |name| as a child of |node|.
-// Returns a non-owning pointer to the new node.
-xmlNode* AddNode(xmlNode* node, xmlNs* ns, const std::string& name) {
-  xmlNode* child = xmlNewNode(ns, XmlCast(name.c_str()));
-  xmlAddChild(node, child);
-  return child;
-}
+void AddSourceCapabilities(const SourceCapabilities& caps,
+                           const char* name,
+                           XmlWriter* writer) {
+  writer->StartElement(name);
 
-// Adds a new node with namespace |ns| called |name| and containing |content|
-// as a child of |node|.
-void AddNodeWithContent(xmlNode* node,
-                        xmlNs* ns,
-                        const std::string& name,
-                        const std::string& content) {
-  xmlNode* child = xmlNewNode(ns, XmlCast(name.c_str()));
-  xmlNodeSetContent(child, XmlCast(content.c_str()));
-  xmlAddChild(node, child);
-}
+  writer->AddElement("scan:MinWidth", "16");
+  writer->AddElement("scan:MaxWidth", "2550");
+  writer->AddElement("scan:MinHeight", "16");
+  writer->AddElement("scan:MaxHeight", "3507");
+  writer->AddElement("scan:MaxScanRegions", "1");
 
-UniqueXmlNodePtr SourceCapabilitiesAsXml(const SourceCapabilities& caps,
-                                         const std::string& name,
-                                         namespace_map* namespaces) {
-  xmlNs* pwg = (*namespaces)[kPwgNs];
-  xmlNs* scan = (*namespaces)[kScanNs];
-  UniqueXmlNodePtr root(xmlNewNode(scan, XmlCast(name.c_str())));
-
-  AddNodeWithContent(root.get(), scan, "MinWidth", "16");
-  AddNodeWithContent(root.get(), scan, "MaxWidth", "2550");
-  AddNodeWithContent(root.get(), scan, "MinHeight", "16");
-  AddNodeWithContent(root.get(), scan, "MaxHeight", "3507");
-  AddNodeWithContent(root.get(), scan, "MaxScanRegions", "1");
-
-  xmlNode* profiles = AddNode(root.get(), scan, "SettingProfiles");
-  xmlNode* profile = AddNode(profiles, scan, "SettingProfile");
-  xmlNode* color_modes = AddNode(profile, scan, "ColorModes");
+  writer->StartElement("scan:SettingProfiles");
+  writer->StartElement("scan:SettingProfile");
+  writer->StartElement("scan:ColorModes");
   for (const std::string& mode : caps.color_modes) {
-    AddNodeWithContent(color_modes, scan, "ColorMode", mode);
+    writer->AddElement("scan:ColorMode", mode);
   }
-  xmlNode* document_formats = AddNode(profile, scan, "DocumentFormats");
+  writer->EndElement();
+  writer->StartElement("scan:DocumentFormats");
   for (const std::string& format : caps.formats) {
-    AddNodeWithContent(document_formats, pwg, "DocumentFormat", format);
+    writer->AddElement("pwg:DocumentFormat", format);
   }
+  writer->EndElement();
 
-  xmlNode* resolutions = AddNode(profile, scan, "SupportedResolutions");
-  xmlNode* discrete_resolutions =
-      AddNode(resolutions, scan, "DiscreteResolutions");
+  writer->StartElement("scan:SupportedResolutions");
+  writer->StartElement("scan:DiscreteResolutions");
   for (int resolution : caps.resolutions) {
-    xmlNode* r = AddNode(discrete_resolutions, scan, "DiscreteResolution");
-    AddNodeWithContent(r, scan, "XResolution", std::to_string(resolution));
-    AddNodeWithContent(r, scan, "YResolution", std::to_string(resolution));
+    writer->StartElement("scan:DiscreteResolution");
+    writer->AddElement("scan:XResolution", std::to_string(resolution));
+    writer->AddElement("scan:YResolution", std::to_string(resolution));
+    writer->EndElement();
   }
-
-  xmlNode* intents = AddNode(root.get(), scan, "SupportedIntents");
-  AddNodeWithContent(intents, scan, "Intent", "Document");
-  AddNodeWithContent(intents, scan, "Intent", "TextAndGraphic");
-  AddNodeWithContent(intents, scan, "Intent", "Photo");
-  AddNodeWithContent(intents, scan, "Intent", "Preview");
-
-  AddNodeWithContent(root.get(), scan, "MaxOpticalXResolution", "2400");
-  AddNodeWithContent(root.get(), scan, "MaxOpticalYResolution", "2400");
-  AddNodeWithContent(root.get(), scan, "RiskyLeftMargin", "0");
-  AddNodeWithContent(root.get(), scan, "RiskyRightMargin", "0");
-  AddNodeWithContent(root.get(), scan, "RiskyTopMargin", "0");
-  AddNodeWithContent(root.get(), scan, "RiskyBottomMargin", "0");
-
-  return root;
+  writer->EndElement();
+  writer->EndElement();
+  writer->EndElement();
+  writer->EndElement();
+
+  writer->StartElement("scan:SupportedIntents");
+  writer->AddElement("scan:Intent", "Document");
+  writer->AddElement("scan:Intent", "TextAndGraphic");
+  writer->AddElement("scan:Intent", "Photo");
+  writer->AddElement("scan:Intent", "Preview");
+  writer->EndElement();
+
+  writer->AddElement("scan:MaxOpticalXResolution", "2400");
+  writer->AddElement("scan:MaxOpticalYResolution", "2400");
+  writer->AddElement("scan:RiskyLeftMargin", "0");
+  writer->AddElement("scan:RiskyRightMargin", "0");
+  writer->AddElement("scan:RiskyTopMargin", "0");
+  writer->AddElement("scan:RiskyBottomMargin", "0");
+
+  writer->EndElement();
 }
 
-// Serialize a map of UUIDs to JobInfo into the XML format expected for
-// eSCL ScannerStatus.
-// Returns a node which can be merged into the larger XML document.
-UniqueXmlNodePtr JobListAsXml(const base::flat_map<std::string, JobInfo>& jobs,
-                              namespace_map* namespaces) {
-  xmlNs* pwg = (*namespaces)[kPwgNs];
-  xmlNs* scan = (*namespaces)[kScanNs];
-
-  UniqueXmlNodePtr root(xmlNewNode(scan, XmlCast("Jobs")));
+// Writes a map of UUIDs to JobInfo in the XML format expected for the Jobs
+// element of eSCL ScannerStatus.
+void AddJobList(const std::map<std::string, JobInfo>& jobs, XmlWriter* writer) {
+  writer->StartElement("scan:Jobs");
   for (const auto& job : jobs) {
     const std::string& uuid = job.first;
     const JobInfo& info = job.second;
-    xmlNode* job_info = AddNode(root.get(), scan, "JobInfo");
-    AddNodeWithContent(job_info, pwg, "JobUri", "/eSCL/ScanJobs/" + uuid);
-    AddNodeWithContent(job_info, pwg, "JobUuid", "urn:uuid:" + uuid);
+    writer->StartElement("scan:JobInfo");
+    writer->AddElement("pwg:JobUri", "/eSCL/ScanJobs/" + uuid);
+    writer->AddElement("pwg:JobUuid", "urn:uuid:" + uuid);
 
     // Different scanners are not consistent with how they report scan job age.
     // Arbitrarily report age as elapsed seconds.
     base::TimeDelta elapsed = base::TimeTicks::Now() - info.created;
-    AddNodeWithContent(job_info, scan, "Age",
-                       std::to_string(elapsed.InSeconds()));
+    writer->AddElement("scan:Age", std::to_string(elapsed.InSeconds()));
 
     int images_completed = 0;
     int images_to_transfer = 0;
-    std::string job_state;
+    const char* job_state = "";
     // These reason strings are defined in the PWG standard. There are other
     // values possible, but for now, just use a typical value.
-    std::string reason;
+    const char* reason = "";
     switch (info.state) {
       case kPending:
         images_completed = 1;
@@ -192,67 +233,16 @@ UniqueXmlNodePtr JobListAsXml(const base::flat_map<std::string, JobInfo>& jobs,
         break;
     }
 
-    AddNodeWithContent(job_info, pwg, "ImagesCompleted",
-                       std::to_string(images_completed));
-    AddNodeWithContent(job_info, pwg, "ImagesToTransfer",
+    writer->AddElement("pwg:ImagesCompleted", std::to_string(images_completed));
+    writer->AddElement("pwg:ImagesToTransfer",
                        std::to_string(images_to_transfer));
-    AddNodeWithContent(job_info, pwg, "JobState", job_state);
-    xmlNode* job_state_reasons = AddNode(job_info, pwg, "JobStateReasons");
-    AddNodeWithContent(job_state_reasons, pwg, "JobStateReason", reason);
+    writer->AddElement("pwg:JobState", job_state);
+    writer->StartElement("pwg:JobStateReasons");
+    writer->AddElement("pwg:JobStateReason", reason);
+    writer->EndElement();
+    writer->EndElement();
   }
-
-  return root;
-}
-
-base::Optional<ScanRegion> ScanRegionFromNode(const xmlNode* node) {
-  if (!node) {
-    LOG(ERROR) << "ScanRegion node cannot be null";
-    return base::nullopt;
-  }
-
-  ScanRegion region;
-  // node->children is a null-terminated doubly-linked list of nodes. We
-  // iterate over the '->next' pointers, stopping once we get a null value.
-  for (xmlNode* child = node->children; child; child = child->next) {
-    if (StrEqual(child->name, "ContentRegionUnits")) {
-      base::Optional<std::string> content = GetContent(child);
-      if (!content) {
-        LOG(ERROR) << "ContentRegionUnits node is empty";
-        return base::nullopt;
-      }
-      region.units = content.value();
-    } else if (StrEqual(child->name, "Height")) {
-      base::Optional<int> content = GetIntContent(child);
-      if (!content) {
-        LOG(ERROR) << "Height node does not have valid contents";
-        return base::nullopt;
-      }
-      region.height = content.value();
-    } else if (StrEqual(child->name, "Width")) {
-      base::Optional<int> content = GetIntContent(child);
-      if (!content) {
-        LOG(ERROR) << "Width node does not have valid contents";
-        return base::nullopt;
-      }
-      region.width = content.value();
-    } else if (StrEqual(child->name, "XOffset")) {
-      base::Optional<int> content = GetIntContent(child);
-      if (!content) {
-        LOG(ERROR) << "XOffset node does not have valid contents";
-        return base::nullopt;
-      }
-      region.x_offset = content.value();
-    } else if (StrEqual(child->name, "YOffset")) {
-      base::Optional<int> content = GetIntContent(child);
-      if (!content) {
-        LOG(ERROR) << "YOffset node does not have valid contents";
-        return base::nullopt;
-      }
-      region.y_offset = content.value();
-    }
-  }
-
-  return region;
+  writer->EndElement();
 }
 
 base::Optional<ColorMode> ColorModeFromString(const std::string& color_mode) {
@@ -267,142 +257,283 @@ base::Optional<ColorMode> ColorModeFromString(const std::string& color_mode) {
   }
 }
 
-}  // namespace
+// The elements of a ScanSettings document which hold a value.
+enum class SettingField {
+  kNone,
+  // Children of the root ScanSettings element.
+  kDocumentFormat,
+  kColorMode,
+  kInputSource,
+  kXResolution,
+  kYResolution,
+  // Children of a ScanRegion element within ScanRegions.
+  kContentRegionUnits,
+  kHeight,
+  kWidth,
+  kXOffset,
+  kYOffset,
+};
 
-std::vector<uint8_t> ScannerCapabilitiesAsXml(const ScannerCapabilities& caps) {
-  UniqueXmlNodePtr root(xmlNewNode(nullptr, XmlCast("ScannerCapabilities")));
-
-  xmlNs* pwg =
-      xmlNewNs(root.get(), XmlCast("http://www.pwg.org/schemas/2010/12/sm"),
-               XmlCast("pwg"));
-  xmlNs* scan = xmlNewNs(
-      root.get(), XmlCast("http://schemas.hp.com/imaging/escl/2011/05/03"),
-      XmlCast("scan"));
-  xmlNewNs(root.get(), XmlCast("http://www.w3.org/2001/XMLSchema-instance"),
-           XmlCast("xsi"));
-  xmlSetNs(root.get(), scan);
-
-  namespace_map namespaces;
-  namespaces[kPwgNs] = pwg;
-  namespaces[kScanNs] = scan;
-
-  AddNodeWithContent(root.get(), pwg, "Version", "2.63");
-  AddNodeWithContent(root.get(), pwg, "MakeAndModel", caps.make_and_model);
-  AddNodeWithContent(root.get(), pwg, "SerialNumber", caps.serial_number);
-
-  xmlNode* platen = AddNode(root.get(), scan, "Platen");
-  UniqueXmlNodePtr platen_caps = SourceCapabilitiesAsXml(
-      caps.platen_capabilities, "PlatenInputCaps", &namespaces);
-  xmlAddChild(platen, platen_caps.release());
-
-  return Serialize(std::move(root));
+struct FieldName {
+  const char* name;
+  SettingField field;
+};
+
+constexpr FieldName kSettingFields[] = {
+    {"DocumentFormat", SettingField::kDocumentFormat},
+    {"ColorMode", SettingField::kColorMode},
+    {"InputSource", SettingField::kInputSource},
+    {"XResolution", SettingField::kXResolution},
+    {"YResolution", SettingField::kYResolution},
+};
+
+constexpr FieldName kScanRegionFields[] = {
+    {"ContentRegionUnits", SettingField::kContentRegionUnits},
+    {"Height", SettingField::kHeight},
+    {"Width", SettingField::kWidth},
+    {"XOffset", SettingField::kXOffset},
+    {"YOffset", SettingField::kYOffset},
+};
+
+bool StrEqual(const xmlChar* first, const char* second) {
+  return xmlStrEqual(first, reinterpret_cast<const xmlChar*>(second));
 }
 
-std::vector<uint8_t> ScannerStatusAsXml(const ScannerStatus& status) {
-  UniqueXmlNodePtr root(xmlNewNode(nullptr, XmlCast("ScannerStatus")));
+// Returns the field in |fields| called |name|, or kNone if there is none.
+template <size_t N>
+SettingField FindField(const FieldName (&fields)[N], const xmlChar* name) {
+  for (const FieldName& field : fields) {
+    if (StrEqual(name, field.name)) {
+      return field.field;
+    }
+  }
+  return SettingField::kNone;
+}
 
-  xmlNs* scan = xmlNewNs(
-      root.get(), XmlCast("http://schemas.hp.com/imaging/escl/2011/05/03"),
-      XmlCast("scan"));
-  xmlNs* pwg =
-      xmlNewNs(root.get(), XmlCast("http://www.pwg.org/schemas/2010/12/sm"),
-               XmlCast("pwg"));
-  xmlNewNs(root.get(), XmlCast("http://www.w3.org/2001/XMLSchema-instance"),
-           XmlCast("xsi"));
-  xmlSetNs(root.get(), scan);
+// Builds a ScanSettings from the SAX events of its XML document.
+//
+// As when the document was read into a tree, only the direct children of the
+// root element and of each ScanRegion are read, elements are matched by their
+// local names, and the value of an element is the text before its first child
+// element. An element without such text is invalid.
+class ScanSettingsParser {
+ public:
+  ScanSettingsParser() = default;
+  ScanSettingsParser(const ScanSettingsParser&) = delete;
+  ScanSettingsParser& operator=(const ScanSettingsParser&) = delete;
+
+  // Parses |xml|, returning the settings it describes if it is a well-formed
+  // document with valid settings.
+  base::Optional<ScanSettings> Parse(const SmartBufferView& xml) {
+    xmlSAXHandler handler;
+    memset(&handler, 0, sizeof(handler));
+    handler.initialized = XML_SAX2_MAGIC;
+    handler.startElementNs = &ScanSettingsParser::OnStartElement;
+    handler.endElementNs = &ScanSettingsParser::OnEndElement;
+    handler.characters = &ScanSettingsParser::OnCharacters;
+    handler.cdataBlock = &ScanSettingsParser::OnCharacters;
+    if (xml.size() > INT_MAX ||
+        xmlSAXUserParseMemory(&handler, this,
+                              reinterpret_cast<const char*>(xml.data()),
+                              xml.size()) != 0) {
+      if (valid_) {
+        LOG(ERROR) << "Could not parse data as XML document";
+      }
+      return base::nullopt;
+    }
+    if (!valid_) {
+      return base::nullopt;
+    }
+    if (!has_root_) {
+      LOG(ERROR) << "XML document does not have root node";
+      return base::nullopt;
+    }
+    return std::move(settings_);
+  }
 
-  AddNodeWithContent(root.get(), pwg, "Version", "2.6.3");
-  AddNodeWithContent(root.get(), pwg, "State", status.idle ? "Idle" : "Busy");
+ private:
+  static void OnStartElement(void* ctx,
+                             const xmlChar* localname,
+                             const xmlChar* prefix,
+                             const xmlChar* uri,
+                             int nb_namespaces,
+                             const xmlChar** namespaces,
+                             int nb_attributes,
+                             int nb_defaulted,
+                             const xmlChar** attributes) {
+    static_cast<ScanSettingsParser*>(ctx)->StartElement(localname);
+  }
 
-  // Add a list of all of the scan jobs
-  namespace_map namespaces;
-  namespaces[kPwgNs] = pwg;
-  namespaces[kScanNs] = scan;
-  UniqueXmlNodePtr jobs = JobListAsXml(status.jobs, &namespaces);
-  xmlAddChild(root.get(), jobs.release());
+  static void OnEndElement(void* ctx,
+                           const xmlChar* localname,
+                           const xmlChar* prefix,
+                           const xmlChar* uri) {
+    static_cast<ScanSettingsParser*>(ctx)->EndElement();
+  }
 
-  return Serialize(std::move(root));
-}
+  static void OnCharacters(void* ctx, const xmlChar* ch, int len) {
+    ScanSettingsParser* parser = static_cast<ScanSettingsParser*>(ctx);
+    // Only the text before the first child element of a field is its value.
+    if (parser->field_ != SettingField::kNone && !parser->field_has_child_) {
+      parser->content_.append(reinterpret_cast<const char*>(ch), len);
+    }
+  }
 
-base::Optional<ScanSettings> ScanSettingsFromXml(
-    const std::vector<uint8_t>& xml) {
-  // Since this document doesn't have a url, we use a filler value.
-  const char* url = "noname.xml";
-  // We don't know the encoding, so pass NULL to autodetect.
-  const char* encoding = NULL;
-  const UniqueXmlDocPtr doc(
-      xmlReadMemory(reinterpret_cast<const char*>(xml.data()), xml.size(), url,
-                    encoding, /*options=*/0));
-  if (!doc) {
-    LOG(ERROR) << "Could not parse data as XML document";
-    return base::nullopt;
+  void StartElement(const xmlChar* name) {
+    if (field_ != SettingField::kNone) {
+      field_has_child_ = true;
+    }
+    switch (depth_) {
+      case 0:
+        has_root_ = true;
+        break;
+      case 1:
+        in_scan_regions_ = StrEqual(name, "ScanRegions");
+        in_scan_region_ = false;
+        field_ = FindField(kSettingFields, name);
+        break;
+      case 2:
+        in_scan_region_ = in_scan_regions_ && StrEqual(name, "ScanRegion");
+        if (in_scan_region_) {
+          settings_.regions.emplace_back();
+        }
+        break;
+      case 3:
+        if (in_scan_region_) {
+          field_ = FindField(kScanRegionFields, name);
+        }
+        break;
+    }
+    if (field_ != SettingField::kNone && field_depth_ < 0) {
+      field_depth_ = depth_;
+    }
+    depth_++;
   }
 
-  const xmlNode* root = xmlDocGetRootElement(doc.get());
-  if (!root) {
-    LOG(ERROR) << "XML document does not have root node";
-    return base::nullopt;
+  void EndElement() {
+    depth_--;
+    if (depth_ != field_depth_) {
+      return;
+    }
+    if (valid_ && !SetField()) {
+      valid_ = false;
+    }
+    field_ = SettingField::kNone;
+    field_depth_ = -1;
+    field_has_child_ = false;
+    content_.clear();
   }
 
-  ScanSettings settings;
-  // Iterate over doubly-linked list of nodes in the document.
-  for (const xmlNode* node = root->children; node; node = node->next) {
-    if (StrEqual(node->name, "ScanRegions")) {
-      // Iterate over doubly-linked list of children of the ScanRegions node.
-      for (xmlNode* child = node->children; child; child = child->next) {
-        if (StrEqual(child->name, "ScanRegion")) {
-          base::Optional<ScanRegion> region = ScanRegionFromNode(child);
-          if (!region) {
-            LOG(ERROR) << "Failed to parse ScanRegion";
-            return base::nullopt;
-          }
-          settings.regions.push_back(region.value());
+  // Sets |field_| from |content_|, returning false if it is invalid.
+  bool SetField() {
+    if (content_.empty()) {
+      LOG(ERROR) << "node does not have content";
+      return false;
+    }
+    switch (field_) {
+      case SettingField::kNone:
+        return true;
+      case SettingField::kDocumentFormat:
+        settings_.document_format = content_;
+        return true;
+      case SettingField::kColorMode: {
+        base::Optional<ColorMode> color_mode = ColorModeFromString(content_);
+        if (!color_mode) {
+          LOG(ERROR) << "Invalid ColorMode value: " << content_;
+          return false;
         }
+        settings_.color_mode = color_mode.value();
+        return true;
       }
-    } else if (StrEqual(node->name, "DocumentFormat")) {
-      base::Optional<std::string> format = GetContent(node);
-      if (!format) {
-        LOG(ERROR) << "DocumentFormat node does not have valid contents.";
-        return base::nullopt;
-      }
-      settings.document_format = format.value();
-    } else if (StrEqual(node->name, "ColorMode")) {
-      base::Optional<std::string> color_mode_string = GetContent(node);
-      if (!color_mode_string) {
-        LOG(ERROR) << "ColorMode node does not have valid contents.";
-        return base::nullopt;
-      }
+      case SettingField::kInputSource:
+        settings_.input_source = content_;
+        return true;
+      case SettingField::kXResolution:
+        return SetIntField(&settings_.x_resolution);
+      case SettingField::kYResolution:
+        return SetIntField(&settings_.y_resolution);
+      case SettingField::kContentRegionUnits:
+        settings_.regions.back().units = content_;
+        return true;
+      case SettingField::kHeight:
+        return SetIntField(&settings_.regions.back().height);
+      case SettingField::kWidth:
+        return SetIntField(&settings_.regions.back().width);
+      case SettingField::kXOffset:
+        return SetIntField(&settings_.regions.back().x_offset);
+      case SettingField::kYOffset:
+        return SetIntField(&settings_.regions.back().y_offset);
+    }
+    return true;
+  }
 
-      base::Optional<ColorMode> color_mode =
-          ColorModeFromString(color_mode_string.value());
-      if (!color_mode) {
-        LOG(ERROR) << "Invalid ColorMode value: " << color_mode_string.value();
-        return base::nullopt;
-      }
-      settings.color_mode = color_mode.value();
-    } else if (StrEqual(node->name, "InputSource")) {
-      base::Optional<std::string> source = GetContent(node);
-      if (!source) {
-        LOG(ERROR) << "InputSource node does not have valid contents.";
-        return base::nullopt;
-      }
-      settings.input_source = source.value();
-    } else if (StrEqual(node->name, "XResolution")) {
-      base::Optional<int> resolution = GetIntContent(node);
-      if (!resolution) {
-        LOG(ERROR) << "XResolution node does not have valid contents.";
-        return base::nullopt;
-      }
-      settings.x_resolution = resolution.value();
-    } else if (StrEqual(node->name, "YResolution")) {
-      base::Optional<int> resolution = GetIntContent(node);
-      if (!resolution) {
-        LOG(ERROR) << "YResolution node does not have valid contents.";
-        return base::nullopt;
-      }
-      settings.y_resolution = resolution.value();
+  bool SetIntField(int* value) {
+    if (!base::StringToInt(content_, value)) {
+      LOG(ERROR) << "Failed to convert " << content_ << " to int";
+      return false;
     }
+    return true;
   }
 
-  return settings;
+  ScanSettings settings_;
+  bool valid_ = true;
+  bool has_root_ = false;
+  // The depth of the next element to start, where the root is at depth 0.
+  int depth_ = 0;
+  // Whether the parser is inside a ScanRegions child of the root, and inside
+  // a ScanRegion within that, whose fields are set in the last of
+  // |settings_.regions|.
+  bool in_scan_regions_ = false;
+  bool in_scan_region_ = false;
+  // The field whose value is being read, the depth of its element and whether
+  // a child element of it has started.
+  SettingField field_ = SettingField::kNone;
+  int field_depth_ = -1;
+  bool field_has_child_ = false;
+  // The text read so far for |field_|.
+  std::string content_;
+};
+
+}  // namespace
+
+std::vector<uint8_t> ScannerCapabilitiesAsXml(const ScannerCapabilities& caps) {
+  SmartBuffer xml;
+  XmlWriter writer(&xml);
+  writer.StartElement("scan:ScannerCapabilities",
+                      std::string(kPwgNsDeclaration) + kScanNsDeclaration +
+                          kXsiNsDeclaration);
+
+  writer.AddElement("pwg:Version", "2.63");
+  writer.AddElement("pwg:MakeAndModel", caps.make_and_model);
+  writer.AddElement("pwg:SerialNumber", caps.serial_number);
+
+  writer.StartElement("scan:Platen");
+  AddSourceCapabilities(caps.platen_capabilities, "scan:PlatenInputCaps",
+                        &writer);
+  writer.EndElement();
+
+  writer.EndElement();
+  return xml.TakeContents();
+}
+
+std::vector<uint8_t> ScannerStatusAsXml(const ScannerStatus& status) {
+  SmartBuffer xml;
+  XmlWriter writer(&xml);
+  writer.StartElement("scan:ScannerStatus",
+                      std::string(kScanNsDeclaration) + kPwgNsDeclaration +
+                          kXsiNsDeclaration);
+
+  writer.AddElement("pwg:Version", "2.6.3");
+  writer.AddElement("pwg:State", status.idle ? "Idle" : "Busy");
+
+  // Add a list of all of the scan jobs
+  AddJobList(status.jobs, &writer);
+
+  writer.EndElement();
+  return xml.TakeContents();
+}
+
+base::Optional<ScanSettings> ScanSettingsFromXml(const SmartBufferView& xml) {
+  ScanSettingsParser parser;
+  return parser.Parse(xml);
 }
@@ -12,8 +12,10 @@
 #include <base/optional.h>
 
 #include "escl_manager.h"
+#include "smart_buffer.h"
 
 // Returns a serialized eSCL ScannerCapabilities XML representation of |caps|.
+// The XML is written directly, without building a tree of it.
 // For fields that are not provided by |caps|, sensible default values are
 // chosen.
 std::vector<uint8_t> ScannerCapabilitiesAsXml(const ScannerCapabilities& caps);
@@ -22,7 +24,7 @@ std::vector<uint8_t> ScannerCapabilitiesAsXml(const ScannerCapabilities& caps);
 std::vector<uint8_t> ScannerStatusAsXml(const ScannerStatus& status);
 
 // Attempts to parse a ScanSettings object from its xml representation, |xml|.
-base::Optional<ScanSettings> ScanSettingsFromXml(
-    const std::vector<uint8_t>& xml);
+// The document is parsed as a stream, without building a tree of it.
+base::Optional<ScanSettings> ScanSettingsFromXml(const SmartBufferView& xml);
 
 #endif  // __XML_UTIL_H__